@@ -80,10 +80,13 @@ packet_handler(struct rte_mbuf *pkt, struct onvm_pkt_meta *meta, struct onvm_nf_
                         if (ret < 0) {
                                 printf("add entry fail, drop the pkt\n");
                                 onvm_pkt_set_action(pkt, ONVM_NF_ACTION_DROP, 0);
+                                return 0;
                         }
-                        memset(flow_entry, 0, sizeof(struct onvm_flow_entry));
-                        flow_entry->sc = onvm_sc_create();
-                        onvm_sc_set_entry(flow_entry->sc, 0, ONVM_NF_ACTION_DROP, 0);
+                        /* The chain is complete before other threads can see it */
+                        struct onvm_service_chain *sc = onvm_sc_create();
+                        onvm_sc_set_entry(sc, 0, ONVM_NF_ACTION_DROP, 0);
+                        if (onvm_flow_dir_set_sc(flow_entry, sc) < 0)
+                                rte_free(sc);
                         onvm_pkt_set_action(pkt, ONVM_NF_ACTION_DROP, 0);
                 }
                 return 0;
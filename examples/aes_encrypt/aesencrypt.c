@@ -67,8 +67,6 @@ static uint32_t print_delay = 1000000;
 
 static uint32_t destination;
 
-struct rte_mempool *pktmbuf_pool;
-
 /* AES encryption parameters */
 BYTE key[1][32] = {{0x60, 0x3d, 0xeb, 0x10, 0x15, 0xca, 0x71, 0xbe, 0x2b, 0x73, 0xae, 0xf0, 0x85, 0x7d, 0x77, 0x81,
                     0x1f, 0x35, 0x2c, 0x07, 0x3b, 0x61, 0x08, 0xd7, 0x2d, 0x98, 0x10, 0xa3, 0x09, 0x14, 0xdf, 0xf4}};
@@ -132,28 +130,24 @@ parse_app_args(int argc, char *argv[], const char *progname) {
 static int
 packet_handler(struct rte_mbuf *pkt, struct onvm_pkt_meta *meta,
                __attribute__((unused)) struct onvm_nf_local_ctx *nf_local_ctx) {
-        (void) meta;
-	
 	struct rte_udp_hdr *udp;
 
         static uint64_t counter = 0;
 	static uint64_t start, end, cost, latency;
 	
 	start = rte_get_timer_cycles();
-	
-	
-	struct rte_mbuf *clone_pkt = onvm_pkt_pktmbuf_copy(pkt, pktmbuf_pool);
-	if (clone_pkt == NULL) {
-		printf("alloc pktmbuf fail\n");
-		onvm_pkt_set_action(pkt, ONVM_NF_ACTION_TONF, destination);
-	}
-	/*
-	rte_memcpy(rte_pktmbuf_mtod(clone_pkt, char *), rte_pktmbuf_mtod(pkt, char *), pkt->data_len);
-	clone_pkt->pkt_len = pkt->pkt_len;
-	*/
 
-        /* Check if we have a valid UDP packet */
-        udp = onvm_pkt_udp_hdr(clone_pkt);
+        /*
+         * When run in parallel this NF has to be declared as a writer so it gets
+         * its own copy of the packet. A shared read-only packet is left untouched.
+         */
+        if (onvm_pkt_check_meta_bit(meta->flags, PKT_META_PAYLOAD_READ) &&
+            !onvm_pkt_check_meta_bit(meta->flags, PKT_META_CLONE))
+                udp = NULL;
+        else
+                udp = onvm_pkt_udp_hdr(pkt);
+
+        /* Encrypt the payload of UDP packets in place */
         if (udp != NULL) {
                 uint8_t *pkt_data;
                 uint8_t *eth;
@@ -163,9 +157,9 @@ packet_handler(struct rte_mbuf *pkt, struct onvm_pkt_meta *meta,
                 /* Get at the payload */
                 pkt_data = ((uint8_t *)udp) + sizeof(struct rte_udp_hdr);
                 /* Calculate length */
-                eth = rte_pktmbuf_mtod(clone_pkt, uint8_t *);
+                eth = rte_pktmbuf_mtod(pkt, uint8_t *);
                 hlen = pkt_data - eth;
-                plen = clone_pkt->pkt_len - hlen;
+                plen = pkt->pkt_len - hlen;
 
                 /* Encrypt. */
                 /* IV should change with every packet, but we don't have any
@@ -175,8 +169,6 @@ packet_handler(struct rte_mbuf *pkt, struct onvm_pkt_meta *meta,
 
 	onvm_pkt_set_action(pkt, ONVM_NF_ACTION_TONF, destination);
 
-	rte_pktmbuf_free(clone_pkt);
-
 	end = rte_get_timer_cycles();
 	cost += (end - start);
 	if (++counter == print_delay) {
@@ -224,12 +216,6 @@ main(int argc, char *argv[]) {
         /* Initialise encryption engine. Key should be configurable. */
         aes_key_setup(key[0], key_schedule, 256);
 
-	pktmbuf_pool = rte_mempool_lookup(PKTMBUF_CLONE_POOL_NAME);
-	if (pktmbuf_pool == NULL) {
-		onvm_nflib_stop(nf_local_ctx);
-		rte_exit(EXIT_FAILURE, "Cannot find mbuf pool!\n");
-	}
-
         onvm_nflib_run(nf_local_ctx);
 
         onvm_nflib_stop(nf_local_ctx);
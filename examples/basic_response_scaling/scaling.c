@@ -473,10 +473,8 @@ thread_main_loop(struct onvm_nf_local_ctx *nf_local_ctx) {
                 nb_pkts = rte_ring_dequeue_burst(rx_ring, pkts, PKT_READ_SIZE, NULL);
 
                 if (unlikely(nb_pkts == 0)) {
-                        if (ONVM_NF_SHARE_CORES) {
-                                rte_atomic16_set(nf->shared_core.sleep_state, 1);
-                                sem_wait(nf->shared_core.nf_mutex);
-                        }
+                        if (ONVM_NF_SHARE_CORES)
+                                onvm_nflib_wait_for_work(nf);
                         continue;
                 }
                 /* Process all the packets */
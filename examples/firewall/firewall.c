@@ -68,6 +68,8 @@
 
 #define MAX_RULES 256
 #define NUM_TBLS 8
+/* Next hop field of a bulk LPM lookup result, the upper bits are flags */
+#define LPM_NEXT_HOP_MASK 0x00FFFFFF
 
 static uint16_t destination;
 static int debug = 0;
@@ -195,56 +197,59 @@ do_stats_display(void) {
 }
 
 static int
-packet_handler(struct rte_mbuf *pkt, struct onvm_pkt_meta *meta,
-               __attribute__((unused)) struct onvm_nf_local_ctx *nf_local_ctx) {
+packet_batch_handler(struct rte_mbuf *pkts[], struct onvm_pkt_meta *meta[], uint16_t nb_pkts,
+                     __attribute__((unused)) struct onvm_nf_local_ctx *nf_local_ctx) {
         struct rte_ipv4_hdr *ipv4_hdr;
         static uint32_t counter = 0;
-        int ret;
-        uint32_t rule = 0;
-        uint32_t track_ip = 0;
+        uint32_t src_ips[PACKET_READ_SIZE];
+        uint32_t hops[PACKET_READ_SIZE];
+        uint16_t ipv4_idx[PACKET_READ_SIZE];
+        uint16_t i, nb_ipv4 = 0;
+        struct onvm_pkt_meta *pkt_meta;
         char ip_string[16];
 
-        if (++counter == print_delay) {
-                do_stats_display();
-                counter = 0;
-        }
+        for (i = 0; i < nb_pkts; i++) {
+                if (++counter == print_delay) {
+                        do_stats_display();
+                        counter = 0;
+                }
 
-        stats.pkt_total++;
+                stats.pkt_total++;
 
-        if (!onvm_pkt_is_ipv4(pkt)) {
-                if (debug) RTE_LOG(INFO, APP, "Packet received not ipv4\n");
-                stats.pkt_not_ipv4++;
-                meta->action = ONVM_NF_ACTION_DROP;
-                return 0;
+                if (!onvm_pkt_is_ipv4(pkts[i])) {
+                        if (debug) RTE_LOG(INFO, APP, "Packet received not ipv4\n");
+                        stats.pkt_not_ipv4++;
+                        meta[i]->action = ONVM_NF_ACTION_DROP;
+                        continue;
+                }
+
+                ipv4_hdr = onvm_pkt_ipv4_hdr(pkts[i]);
+                src_ips[nb_ipv4] = rte_be_to_cpu_32(ipv4_hdr->src_addr);
+                ipv4_idx[nb_ipv4++] = i;
         }
 
-        ipv4_hdr = onvm_pkt_ipv4_hdr(pkt);
-        ret = rte_lpm_lookup(lpm_tbl, rte_be_to_cpu_32(ipv4_hdr->src_addr), &rule);
+        /* Look up the whole burst in one pass over the LPM table */
+        if (nb_ipv4 > 0)
+                rte_lpm_lookup_bulk(lpm_tbl, src_ips, hops, nb_ipv4);
 
-        if (debug) onvm_pkt_parse_char_ip(ip_string, rte_be_to_cpu_32(ipv4_hdr->src_addr));
+        for (i = 0; i < nb_ipv4; i++) {
+                pkt_meta = meta[ipv4_idx[i]];
+                if (debug) onvm_pkt_parse_char_ip(ip_string, src_ips[i]);
 
-        if (ret < 0) {
-                meta->action = ONVM_NF_ACTION_DROP;
-                stats.pkt_drop++;
-                if (debug) RTE_LOG(INFO, APP, "Packet from source IP %s has been dropped\n", ip_string);
-                return 0;
-        }
-
-        switch (rule) {
-                case 0:
-                        meta->action = ONVM_NF_ACTION_TONF;
-                        meta->destination = destination;
+                /* Only a matching rule with action 0 lets the packet through */
+                if ((hops[i] & RTE_LPM_LOOKUP_SUCCESS) && (hops[i] & LPM_NEXT_HOP_MASK) == 0) {
+                        pkt_meta->action = ONVM_NF_ACTION_TONF;
+                        pkt_meta->destination = destination;
                         stats.pkt_accept++;
                         if (debug) RTE_LOG(INFO, APP, "Packet from source IP %s has been accepted\n", ip_string);
-                        break;
-                default:
-                        meta->action = ONVM_NF_ACTION_DROP;
+                } else {
+                        pkt_meta->action = ONVM_NF_ACTION_DROP;
                         stats.pkt_drop++;
                         if (debug) RTE_LOG(INFO, APP, "Packet from source IP %s has been dropped\n", ip_string);
-                        break;
+                }
         }
 
-        return 0;
+        return nb_pkts;
 }
 
 static int
@@ -366,7 +371,7 @@ int main(int argc, char *argv[]) {
         onvm_nflib_start_signal_handler(nf_local_ctx, NULL);
 
         nf_function_table = onvm_nflib_init_nf_function_table();
-        nf_function_table->pkt_handler = &packet_handler;
+        nf_function_table->pkt_batch_handler = &packet_batch_handler;
 
         if ((arg_offset = onvm_nflib_init(argc, argv, NF_TAG, nf_local_ctx, nf_function_table)) < 0) {
                 onvm_nflib_stop(nf_local_ctx);
@@ -221,19 +221,27 @@ datapath_handle_read(struct datapath *dp) {
                                 size_t actions_len = ntohs(fm->header.length) - sizeof(*fm);
                                 sc = flow_action_extract(&fm->actions[0], actions_len);
                                 ret = onvm_flow_dir_get_key(fk, &flow_entry);
-                                if (ret == -ENOENT) {
-                                        ret = onvm_flow_dir_add_key(fk, &flow_entry);
-                                } else if (ret >= 0) {
-                                        rte_free(flow_entry->key);
-                                        rte_free(flow_entry->sc);
-                                } else {
+                                if (ret >= 0) {
+                                        /* Packets may still be using the old rule, it is freed once they are done */
+                                        onvm_flow_dir_del_and_free_key(fk);
+                                } else if (ret != -ENOENT) {
                                         rte_exit(EXIT_FAILURE, "onvm_flow_dir_get parameters are invalid");
                                 }
-                                memset(flow_entry, 0, sizeof(struct onvm_flow_entry));
-                                flow_entry->key = fk;
-                                flow_entry->sc = sc;
+                                ret = onvm_flow_dir_add_key(fk, &flow_entry);
+                                if (ret < 0) {
+                                        debug_msg(dp, "flow table full, ignoring flow_mod");
+                                        rte_free(fk);
+                                        rte_free(sc);
+                                        break;
+                                }
                                 flow_entry->idle_timeout = OFP_FLOW_PERMANENT;
                                 flow_entry->hard_timeout = OFP_FLOW_PERMANENT;
+                                if (onvm_flow_dir_set_sc(flow_entry, sc) == 0) {
+                                        flow_entry->key = fk;
+                                } else {
+                                        rte_free(fk);
+                                        rte_free(sc);
+                                }
                                 sdn_list = (struct sdn_pkt_list *)onvm_ft_get_data(pkt_buf_ft, buffer_id);
                                 sdn_pkt_list_flush(nf, sdn_list);
                                 break;
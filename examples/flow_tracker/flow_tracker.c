@@ -62,6 +62,8 @@
 #define NF_TAG "flow_tracker"
 #define TBL_SIZE 100
 #define EXPIRE_TIME 5
+/* Most flows expired per main loop pass */
+#define EXPIRE_BATCH 32
 
 /*Struct that holds all NF state information */
 struct state_info {
@@ -153,35 +155,15 @@ update_status(uint64_t elapsed_cycles, struct flow_stats *data) {
 }
 
 /*
- * Clears expired entries from the flow table
+ * Called by the flow table for flows idle for EXPIRE_TIME seconds
  */
 static int
-clear_entries(struct state_info *state_info) {
-        if (unlikely(state_info == NULL)) {
-                return -1;
-        }
-
-        printf("Clearing expired entries\n");
-        struct flow_stats *data = NULL;
-        struct onvm_ft_ipv4_5tuple *key = NULL;
-        uint32_t next = 0;
-        int ret = 0;
-
-        while (onvm_ft_iterate(state_info->ft, (const void **)&key, (void **)&data, &next) > -1) {
-                if (update_status(state_info->elapsed_cycles, data) < 0) {
-                        return -1;
-                }
-
-                if (!data->is_active) {
-                        ret = onvm_ft_remove_key(state_info->ft, key);
-                        state_info->num_stored--;
-                        if (ret < 0) {
-                                printf("Key should have been removed, but was not\n");
-                                state_info->num_stored++;
-                        }
-                }
-        }
+flow_expired(__attribute__((unused)) struct onvm_ft *table, __attribute__((unused)) int32_t index,
+             __attribute__((unused)) const struct onvm_ft_ipv4_5tuple *key, __attribute__((unused)) char *data,
+             void *arg) {
+        struct state_info *state_info = (struct state_info *)arg;
 
+        state_info->num_stored--;
         return 0;
 }
 
@@ -215,8 +197,8 @@ do_stats_display(struct state_info *state_info) {
 }
 
 /*
- * Adds an entry to the flow table. It first checks if the table is full, and
- * if so, it calls clear_entries() to free up space.
+ * Adds an entry to the flow table. Idle flows are expired from the main
+ * loop, so a full table means the new flow is not tracked.
  */
 static int
 table_add_entry(struct onvm_ft_ipv4_5tuple *key, struct state_info *state_info) {
@@ -227,10 +209,7 @@ table_add_entry(struct onvm_ft_ipv4_5tuple *key, struct state_info *state_info)
         }
 
         if (TBL_SIZE - state_info->num_stored == 0) {
-                int ret = clear_entries(state_info);
-                if (ret < 0) {
-                        return -1;
-                }
+                return -1;
         }
 
         int tbl_index = onvm_ft_add_key(state_info->ft, key, (char **)&data);
@@ -285,6 +264,8 @@ callback_handler(__attribute__((unused)) struct onvm_nf_local_ctx *nf_local_ctx)
                 do_stats_display(state_info);
         }
 
+        onvm_ft_expire(state_info->ft, state_info->elapsed_cycles, EXPIRE_BATCH);
+
         return 0;
 }
 
@@ -354,6 +335,11 @@ main(int argc, char *argv[]) {
                 rte_exit(EXIT_FAILURE, "Unable to create flow table");
         }
 
+        if (onvm_ft_enable_expiry(state_info->ft, EXPIRE_TIME * 1000, &flow_expired, state_info) < 0) {
+                onvm_nflib_stop(nf_local_ctx);
+                rte_exit(EXIT_FAILURE, "Unable to enable flow expiry");
+        }
+
         /*Initialize NF timer */
         state_info->elapsed_cycles = rte_get_tsc_cycles();
 
@@ -18,7 +18,6 @@
 #include "onvm_nflib.h"
 #include "onvm_pkt_helper.h"
 
-#define PKTMBUF_CLONE_POOL_NAME "Mproc_pktmbuf_clone_pool"
 #define NF_TAG "parallel_fwd_1"
 
 static uint32_t print_delay = 10000000;
@@ -26,7 +25,6 @@ static uint64_t last_cycle;
 static uint64_t cur_cycles;
 static uint8_t destination = 0;
 
-struct rte_mempool *pktmbuf_pool;
 
 extern struct port_info *ports;
 
@@ -79,24 +77,10 @@ packet_handler(struct rte_mbuf *pkt, struct onvm_pkt_meta *meta,
 	static uint64_t start, end, cost, latency;
 	start = rte_get_timer_cycles();
 
-	struct rte_mbuf *clone_pkt = NULL;
-	if (onvm_pkt_check_meta_bit(meta->flags, PKT_META_PAYLOAD_WRITE)) {
-		clone_pkt = onvm_pkt_pktmbuf_copy(pkt, pktmbuf_pool);
-		meta->flags = onvm_pkt_clear_meta_bit(meta->flags, PKT_META_PAYLOAD_READ);
-		if (clone_pkt == NULL) {
-			printf("can not clone pkt\n");
-			return 0;
-		}
-	} else {
-		meta->flags = onvm_pkt_clear_meta_bit(meta->flags, PKT_META_PAYLOAD_READ);
-	}
-
+	/* A read-only branch works on the shared packet, writers get their own copy */
 	rte_delay_us_block(1);
 	onvm_pkt_set_action(pkt, ONVM_NF_ACTION_TONF, destination);
 
-	if (clone_pkt != NULL)
-		rte_pktmbuf_free(clone_pkt);
-
 	end = rte_get_timer_cycles();
 	cost += (end - start);
 	if ((++counter) == 10000000) {
@@ -143,12 +127,6 @@ main(int argc, char *argv[]) {
         cur_cycles = rte_get_tsc_cycles();
         last_cycle = rte_get_tsc_cycles();
 
-        pktmbuf_pool = rte_mempool_lookup(PKTMBUF_CLONE_POOL_NAME);	
-	if (pktmbuf_pool == NULL) {
-                onvm_nflib_stop(nf_local_ctx);
-                rte_exit(EXIT_FAILURE, "Cannot find mbuf pool!\n");
-        }
-
 	struct onvm_nf *parent_nf = nf_local_ctx->nf;
 	parent_nf->handle_rate = 750000;
 	onvm_flow_dir_nf_init();
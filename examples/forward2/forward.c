@@ -18,7 +18,6 @@
 #include "onvm_nflib.h"
 #include "onvm_pkt_helper.h"
 
-#define PKTMBUF_CLONE_POOL_NAME "Mproc_pktmbuf_clone_pool"
 #define NF_TAG "parallel_fwd_2"
 
 static uint32_t print_delay = 10000000;
@@ -26,7 +25,6 @@ static uint64_t last_cycle;
 static uint64_t cur_cycles;
 static uint8_t destination = 0;
 
-struct rte_mempool *pktmbuf_pool;
 
 extern struct port_info *ports;
 
@@ -79,9 +77,7 @@ packet_handler(struct rte_mbuf *pkt, struct onvm_pkt_meta *meta,
 	static uint64_t start, end, cost, latency;
 	start = rte_get_timer_cycles();
 
-	while (onvm_pkt_check_meta_bit(meta->flags, PKT_META_PAYLOAD_READ));
-	meta->flags = onvm_pkt_clear_meta_bit(meta->flags, PKT_META_PAYLOAD_WRITE);
-
+	/* As a declared writer this branch owns a private copy, no need to wait for readers */
 	rte_delay_us_block(2);
 	onvm_pkt_set_action(pkt, ONVM_NF_ACTION_TONF, destination);
 
@@ -131,12 +127,6 @@ main(int argc, char *argv[]) {
         cur_cycles = rte_get_tsc_cycles();
         last_cycle = rte_get_tsc_cycles();
 
-        pktmbuf_pool = rte_mempool_lookup(PKTMBUF_CLONE_POOL_NAME);	
-	if (pktmbuf_pool == NULL) {
-                onvm_nflib_stop(nf_local_ctx);
-                rte_exit(EXIT_FAILURE, "Cannot find mbuf pool!\n");
-        }
-
 	struct onvm_nf *parent_nf = nf_local_ctx->nf;
 	parent_nf->handle_rate = 350000;
 	onvm_flow_dir_nf_init();
@@ -160,52 +160,76 @@ print_stats(__attribute__((unused)) struct onvm_nf_local_ctx *nf_local_ctx) {
  * src and destination ethernet addresses of packets. It then performs a lookup
  * for the destination port. If the destination port value returned is not valid/not binded to dpdk,
  * the packet is forwarded back to the port of incoming traffic.
+ * LPM lookups are done for the whole burst at once.
  */
 static int
-packet_handler(struct rte_mbuf *pkt, struct onvm_pkt_meta *meta,
-               __attribute__((unused)) struct onvm_nf_local_ctx *nf_local_ctx) {
-        static uint32_t counter = 0;
-
+packet_batch_handler(struct rte_mbuf *pkts[], __attribute__((unused)) struct onvm_pkt_meta *meta[], uint16_t nb_pkts,
+                     struct onvm_nf_local_ctx *nf_local_ctx) {
         struct onvm_nf *nf = nf_local_ctx->nf;
         struct state_info *stats = (struct state_info *)nf->data;
-	
+        struct rte_ether_hdr *eth_hdr;
+        struct rte_ipv4_hdr *ipv4_hdrs[PACKET_READ_SIZE];
+        uint32_t dst_ips[PACKET_READ_SIZE];
+        uint16_t in_ports[PACKET_READ_SIZE];
+        uint16_t dst_ports[PACKET_READ_SIZE];
+        uint16_t ipv4_idx[PACKET_READ_SIZE];
+        uint16_t i, nb_ipv4 = 0;
+        uint16_t dst_port;
+        struct rte_mbuf *pkt;
+
 #ifdef print_stats
-	static uint32_t counter = 0;
-        if (counter++ == stats->print_delay) {
+        static uint32_t counter = 0;
+        counter += nb_pkts;
+        if (counter >= stats->print_delay) {
                 print_stats(nf_local_ctx);
                 counter = 0;
         }
 #endif
-        struct rte_ether_hdr *eth_hdr;
-        struct ipv4_hdr *ipv4_hdr;
-        uint16_t dst_port;
 
-        eth_hdr = rte_pktmbuf_mtod(pkt, struct rte_ether_hdr *);
-        if (onvm_pkt_is_ipv4(pkt)) {
+        for (i = 0; i < nb_pkts; i++) {
+                pkt = pkts[i];
+                if (!onvm_pkt_is_ipv4(pkt)) {
+                        onvm_pkt_set_action(pkt, ONVM_NF_ACTION_DROP, 0);
+                        stats->packets_dropped++;
+                        continue;
+                }
+
                 /* Handle IPv4 headers.*/
-                ipv4_hdr = rte_pktmbuf_mtod_offset(pkt, struct ipv4_hdr *, sizeof(struct rte_ether_hdr));
+                ipv4_hdrs[nb_ipv4] = rte_pktmbuf_mtod_offset(pkt, struct rte_ipv4_hdr *, sizeof(struct rte_ether_hdr));
 
 #ifdef DO_RFC_1812_CHECKS
                 /* Check to make sure the packet is valid (RFC1812) */
-                if (is_valid_ipv4_pkt(ipv4_hdr, pkt->pkt_len) < 0) {
+                if (is_valid_ipv4_pkt(ipv4_hdrs[nb_ipv4], pkt->pkt_len) < 0) {
                         onvm_pkt_set_action(pkt, ONVM_NF_ACTION_DROP, 0);
-                        packets_dropped++;
-                        return 0;
+                        stats->packets_dropped++;
+                        continue;
                 }
 #endif
-                if (stats->l3fwd_lpm_on) {
-                        dst_port = lpm_get_ipv4_dst_port(ipv4_hdr, pkt->port, stats);
-                } else {
-                        dst_port = em_get_ipv4_dst_port(pkt, stats);
-                }
+                dst_ips[nb_ipv4] = rte_be_to_cpu_32(ipv4_hdrs[nb_ipv4]->dst_addr);
+                in_ports[nb_ipv4] = pkt->port;
+                ipv4_idx[nb_ipv4++] = i;
+        }
+
+        if (stats->l3fwd_lpm_on) {
+                lpm_get_ipv4_dst_port_bulk(dst_ips, in_ports, dst_ports, nb_ipv4, stats);
+        } else {
+                for (i = 0; i < nb_ipv4; i++)
+                        dst_ports[i] = em_get_ipv4_dst_port(pkts[ipv4_idx[i]], stats);
+        }
+
+        for (i = 0; i < nb_ipv4; i++) {
+                pkt = pkts[ipv4_idx[i]];
+                dst_port = dst_ports[i];
                 if (dst_port >= RTE_MAX_ETHPORTS || get_initialized_ports(dst_port) == 0)
                         dst_port = pkt->port;
 
 #ifdef DO_RFC_1812_CHECKS
                 /* Update time to live and header checksum */
-                --(ipv4_hdr->time_to_live);
-                ++(ipv4_hdr->hdr_checksum);
+                --(ipv4_hdrs[i]->time_to_live);
+                ++(ipv4_hdrs[i]->hdr_checksum);
 #endif
+                eth_hdr = rte_pktmbuf_mtod(pkt, struct rte_ether_hdr *);
+
                 /* dst addr */
                 rte_ether_addr_copy(&ports->neighbor_mac[dst_port], &eth_hdr->d_addr);
 
@@ -214,12 +238,9 @@ packet_handler(struct rte_mbuf *pkt, struct onvm_pkt_meta *meta,
 
                 stats->port_statistics[dst_port]++;
                 onvm_pkt_set_action(pkt, ONVM_NF_ACTION_OUT, dst_port);
-        } else {
-                onvm_pkt_set_action(pkt, ONVM_NF_ACTION_DROP, 0);
-                stats->packets_dropped++;
         }
 
-        return 0;
+        return nb_pkts;
 }
 
 /*
@@ -309,7 +330,7 @@ main(int argc, char *argv[]) {
         onvm_nflib_start_signal_handler(nf_local_ctx, NULL);
 
         nf_function_table = onvm_nflib_init_nf_function_table();
-        nf_function_table->pkt_handler = &packet_handler;
+        nf_function_table->pkt_batch_handler = &packet_batch_handler;
         nf_function_table->setup = &nf_setup;
 
         if ((arg_offset = onvm_nflib_init(argc, argv, NF_TAG, nf_local_ctx, nf_function_table)) < 0) {
@@ -85,6 +85,10 @@ setup_hash(struct state_info *stats);
 uint16_t
 lpm_get_ipv4_dst_port(void *ipv4_hdr, uint16_t portid, struct state_info *stats);
 
+void
+lpm_get_ipv4_dst_port_bulk(const uint32_t *dst_ips, const uint16_t *portids, uint16_t *dst_ports, uint16_t nb_ips,
+                           struct state_info *stats);
+
 uint16_t
 em_get_ipv4_dst_port(struct rte_mbuf *pkt, struct state_info *stats);
 
@@ -158,6 +158,23 @@ lpm_get_ipv4_dst_port(void *ipv4_hdr, uint16_t portid, struct state_info *stats)
                               : portid);
 }
 
+/*
+ * Bulk version of lpm_get_ipv4_dst_port, dst_ips are in host byte order.
+ */
+void
+lpm_get_ipv4_dst_port_bulk(const uint32_t *dst_ips, const uint16_t *portids, uint16_t *dst_ports, uint16_t nb_ips,
+                           struct state_info *stats) {
+        uint32_t next_hops[nb_ips];
+        uint16_t i;
+
+        if (nb_ips == 0)
+                return;
+
+        rte_lpm_lookup_bulk(stats->lpm_tbl, dst_ips, next_hops, nb_ips);
+        for (i = 0; i < nb_ips; i++)
+                dst_ports[i] = (next_hops[i] & RTE_LPM_LOOKUP_SUCCESS) ? (uint16_t)next_hops[i] : portids[i];
+}
+
 /*
  * This helper function checks if the destination port
  * is a valid port number that is currently binded to dpdk.
@@ -65,6 +65,7 @@
 #include <rte_mbuf.h>
 #include <rte_memory.h>
 #include <rte_memzone.h>
+#include <rte_prefetch.h>
 
 #include "onvm_flow_table.h"
 #include "onvm_nflib.h"
@@ -72,6 +73,8 @@
 
 #define NF_TAG "load_balancer"
 #define TABLE_SIZE 65536
+/* Most flows expired per main loop pass */
+#define EXPIRE_BATCH 32
 
 /* Struct for load balancer information */
 struct loadbalance {
@@ -359,58 +362,19 @@ get_iface_inf(void) {
 }
 
 /*
- * Updates flow info to be "active" or "expired"
+ * Called by the flow table for flows idle for expire_time seconds
  */
 static int
-update_status(uint64_t elapsed_cycles, struct flow_info *data) {
-        if (unlikely(data == NULL)) {
-                return -1;
-        }
-        if ((elapsed_cycles - data->last_pkt_cycles) / rte_get_timer_hz() >= lb->expire_time) {
-                data->is_active = 0;
-        } else {
-                data->is_active = 1;
-        }
-
-        return 0;
-}
-
-/*
- * Clears expired entries from the flow table
- */
-static int
-clear_entries(void) {
-        if (unlikely(lb == NULL)) {
-                return -1;
-        }
-
-        printf("Clearing expired entries\n");
-        struct flow_info *data = NULL;
-        struct onvm_ft_ipv4_5tuple *key = NULL;
-        uint32_t next = 0;
-        int ret = 0;
-
-        while (onvm_ft_iterate(lb->ft, (const void **)&key, (void **)&data, &next) > -1) {
-                if (update_status(lb->elapsed_cycles, data) < 0) {
-                        return -1;
-                }
-
-                if (!data->is_active) {
-                        ret = onvm_ft_remove_key(lb->ft, key);
-                        lb->num_stored--;
-                        if (ret < 0) {
-                                printf("Key should have been removed, but was not\n");
-                                lb->num_stored++;
-                        }
-                }
-        }
-
+flow_expired(__attribute__((unused)) struct onvm_ft *table, __attribute__((unused)) int32_t index,
+             __attribute__((unused)) const struct onvm_ft_ipv4_5tuple *key, __attribute__((unused)) char *data,
+             __attribute__((unused)) void *arg) {
+        lb->num_stored--;
         return 0;
 }
 
 /*
- * Adds an entry to the flow table. It first checks if the table is full, and
- * if so, it calls clear_entries() to free up space.
+ * Adds an entry to the flow table. Idle flows are expired from the main
+ * loop, so a full table means the new flow is dropped.
  */
 static int
 table_add_entry(struct onvm_ft_ipv4_5tuple *key, struct flow_info **flow) {
@@ -421,10 +385,7 @@ table_add_entry(struct onvm_ft_ipv4_5tuple *key, struct flow_info **flow) {
         }
 
         if (TABLE_SIZE - 1 - lb->num_stored == 0) {
-                int ret = clear_entries();
-                if (ret < 0) {
-                        return -1;
-                }
+                return -1;
         }
 
         int tbl_index = onvm_ft_add_key(lb->ft, key, (char **)&data);
@@ -443,26 +404,23 @@ table_add_entry(struct onvm_ft_ipv4_5tuple *key, struct flow_info **flow) {
 }
 
 /*
- * Looks up a packet hash to see if there is a matching key in the table.
+ * Looks up a flow key to see if there is a matching key in the table.
  * If it finds one, it updates the metadata associated with the key entry,
  * and if it doesn't, it calls table_add_entry() to add it to the table.
+ * Used for keys the bulk lookup missed, an earlier packet of the same
+ * burst may have added them since.
  */
 static int
-table_lookup_entry(struct rte_mbuf *pkt, struct flow_info **flow) {
+table_lookup_entry(struct onvm_ft_ipv4_5tuple *key, struct flow_info **flow) {
         struct flow_info *data = NULL;
-        struct onvm_ft_ipv4_5tuple key;
 
-        if (unlikely(pkt == NULL || lb == NULL || flow == NULL)) {
+        if (unlikely(key == NULL || lb == NULL || flow == NULL)) {
                 return -1;
         }
 
-        int ret = onvm_ft_fill_key_symmetric(&key, pkt);
-        if (ret < 0)
-                return -1;
-
-        int tbl_index = onvm_ft_lookup_key(lb->ft, &key, (char **)&data);
+        int tbl_index = onvm_ft_lookup_key(lb->ft, key, (char **)&data);
         if (tbl_index == -ENOENT) {
-                return table_add_entry(&key, flow);
+                return table_add_entry(key, flow);
         } else if (tbl_index < 0) {
                 printf("Some other error occurred with the packet hashing\n");
                 return -1;
@@ -481,26 +439,24 @@ callback_handler(__attribute__((unused)) struct onvm_nf_local_ctx *nf_local_ctx)
                 lb->last_cycles = lb->elapsed_cycles;
         }
 
+        onvm_ft_expire(lb->ft, lb->elapsed_cycles, EXPIRE_BATCH);
+
         return 0;
 }
 
+/*
+ * Extracts the flow key of one packet. Returns -1 if the packet must be
+ * dropped.
+ */
 static int
-packet_handler(struct rte_mbuf *pkt, struct onvm_pkt_meta *meta,
-               __attribute__((unused)) struct onvm_nf_local_ctx *nf_local_ctx) {
-        static uint32_t counter = 0;
+lb_fill_key(struct rte_mbuf *pkt, struct onvm_ft_ipv4_5tuple *key) {
         struct rte_ipv4_hdr *ip;
-        struct rte_ether_hdr *ehdr;
-        struct flow_info *flow_info;
-        int i, ret;
 
-        ehdr = onvm_pkt_ether_hdr(pkt);
         ip = onvm_pkt_ipv4_hdr(pkt);
 
         /* Ignore packets without ip header, also ignore packets with invalid ip */
         if (ip == NULL || ip->src_addr == 0 || ip->dst_addr == 0) {
-                meta->action = ONVM_NF_ACTION_DROP;
-                meta->destination = 0;
-                return 0;
+                return -1;
         }
 
         /*
@@ -514,13 +470,23 @@ packet_handler(struct rte_mbuf *pkt, struct onvm_pkt_meta *meta,
                 ip->src_addr = 0;
         }
 
-        /* Get the packet flow entry */
-        ret = table_lookup_entry(pkt, &flow_info);
-        if (ret == -1) {
-                meta->action = ONVM_NF_ACTION_DROP;
-                meta->destination = 0;
-                return 0;
-        }
+        return onvm_ft_fill_key_symmetric(key, pkt) < 0 ? -1 : 0;
+}
+
+/*
+ * Rewrites one packet towards its client or server. The port MAC addresses
+ * are looked up once per burst by the caller.
+ */
+static void
+lb_process_pkt(struct rte_mbuf *pkt, struct onvm_pkt_meta *meta, struct flow_info *flow_info,
+               struct rte_ether_addr *client_mac, struct rte_ether_addr *server_mac) {
+        static uint32_t counter = 0;
+        struct rte_ipv4_hdr *ip;
+        struct rte_ether_hdr *ehdr;
+        int i;
+
+        ehdr = onvm_pkt_ether_hdr(pkt);
+        ip = onvm_pkt_ipv4_hdr(pkt);
 
         /* If the flow entry is new, save the client information */
         if (flow_info->is_active == 0) {
@@ -531,9 +497,7 @@ packet_handler(struct rte_mbuf *pkt, struct onvm_pkt_meta *meta,
         }
 
         if (pkt->port == lb->server_port) {
-                if (onvm_get_macaddr(lb->client_port, &ehdr->s_addr) == -1) {
-                        rte_exit(EXIT_FAILURE, "Failed to obtain MAC address\n");
-                }
+                rte_ether_addr_copy(client_mac, &ehdr->s_addr);
                 for (i = 0; i < RTE_ETHER_ADDR_LEN; i++) {
                         ehdr->d_addr.addr_bytes[i] = flow_info->s_addr_bytes[i];
                 }
@@ -541,9 +505,7 @@ packet_handler(struct rte_mbuf *pkt, struct onvm_pkt_meta *meta,
                 ip->src_addr = lb->ip_lb_client;
                 meta->destination = lb->client_port;
         } else {
-                if (onvm_get_macaddr(lb->server_port, &ehdr->s_addr) == -1) {
-                        rte_exit(EXIT_FAILURE, "Failed to obtain MAC address\n");
-                }
+                rte_ether_addr_copy(server_mac, &ehdr->s_addr);
                 for (i = 0; i < RTE_ETHER_ADDR_LEN; i++) {
                         ehdr->d_addr.addr_bytes[i] = lb->server[flow_info->dest].d_addr_bytes[i];
                 }
@@ -562,8 +524,63 @@ packet_handler(struct rte_mbuf *pkt, struct onvm_pkt_meta *meta,
                 print_flow_info(flow_info);
                 counter = 0;
         }
+}
 
-        return 0;
+static int
+packet_batch_handler(struct rte_mbuf *pkts[], struct onvm_pkt_meta *meta[], uint16_t nb_pkts,
+                     __attribute__((unused)) struct onvm_nf_local_ctx *nf_local_ctx) {
+        struct rte_ether_addr client_mac, server_mac;
+        struct onvm_ft_ipv4_5tuple keys[PACKET_READ_SIZE];
+        const struct onvm_ft_ipv4_5tuple *key_list[PACKET_READ_SIZE];
+        int32_t positions[PACKET_READ_SIZE];
+        char *data[PACKET_READ_SIZE];
+        struct flow_info *flows[PACKET_READ_SIZE];
+        uint16_t pkt_idx[PACKET_READ_SIZE];
+        uint16_t i, num_keys = 0;
+
+        if (onvm_get_macaddr(lb->client_port, &client_mac) == -1 ||
+            onvm_get_macaddr(lb->server_port, &server_mac) == -1) {
+                rte_exit(EXIT_FAILURE, "Failed to obtain MAC address\n");
+        }
+
+        /* Pull the headers of the whole burst in before touching any of them */
+        for (i = 0; i < nb_pkts; i++)
+                rte_prefetch0(rte_pktmbuf_mtod(pkts[i], void *));
+
+        for (i = 0; i < nb_pkts; i++) {
+                flows[i] = NULL;
+                if (lb_fill_key(pkts[i], &keys[num_keys]) < 0)
+                        continue;
+                key_list[num_keys] = &keys[num_keys];
+                pkt_idx[num_keys++] = i;
+        }
+
+        /* Known flows are found in one pass, new ones are added one by one */
+        if (onvm_ft_lookup_bulk(lb->ft, key_list, num_keys, positions, data) < 0) {
+                for (i = 0; i < num_keys; i++)
+                        data[i] = NULL;
+        }
+        for (i = 0; i < num_keys; i++) {
+                if (data[i] == NULL)
+                        continue;
+                flows[pkt_idx[i]] = (struct flow_info *)data[i];
+                flows[pkt_idx[i]]->last_pkt_cycles = lb->elapsed_cycles;
+        }
+        for (i = 0; i < num_keys; i++) {
+                if (data[i] == NULL && table_lookup_entry(&keys[i], &flows[pkt_idx[i]]) < 0)
+                        flows[pkt_idx[i]] = NULL;
+        }
+
+        for (i = 0; i < nb_pkts; i++) {
+                if (flows[i] == NULL) {
+                        meta[i]->action = ONVM_NF_ACTION_DROP;
+                        meta[i]->destination = 0;
+                        continue;
+                }
+                lb_process_pkt(pkts[i], meta[i], flows[i], &client_mac, &server_mac);
+        }
+
+        return nb_pkts;
 }
 
 int
@@ -577,7 +594,7 @@ main(int argc, char *argv[]) {
         onvm_nflib_start_signal_handler(nf_local_ctx, NULL);
 
         nf_function_table = onvm_nflib_init_nf_function_table();
-        nf_function_table->pkt_handler = &packet_handler;
+        nf_function_table->pkt_batch_handler = &packet_batch_handler;
         nf_function_table->user_actions = &callback_handler;
 
         if ((arg_offset = onvm_nflib_init(argc, argv, NF_TAG, nf_local_ctx, nf_function_table)) < 0) {
@@ -614,6 +631,11 @@ main(int argc, char *argv[]) {
         lb->expire_time = 32;
         lb->elapsed_cycles = rte_get_tsc_cycles();
 
+        if (onvm_ft_enable_expiry(lb->ft, lb->expire_time * 1000, &flow_expired, NULL) < 0) {
+                onvm_nflib_stop(nf_local_ctx);
+                rte_exit(EXIT_FAILURE, "Unable to enable flow expiry");
+        }
+
         onvm_nflib_run(nf_local_ctx);
 
         onvm_nflib_stop(nf_local_ctx);
@@ -30,7 +30,6 @@ static uint64_t cur_cycles;
 
 /* shared data structure containing host port info */
 extern struct port_info *ports;
-extern struct onvm_mutex *parallel_mutex ;
 /*
  * Print a usage message
  */
@@ -86,10 +85,12 @@ packet_handler(struct rte_mbuf *pkt, struct onvm_pkt_meta *meta,
         // When use parallel action, must initial dst to 0 before setting
         
 	uint8_t dst = 0;
-        meta->flags = onvm_pkt_set_meta_bit(meta->flags, PKT_META_PAYLOAD_READ);
+        /* Service 2 only reads the packet and shares it */
 	dst |= (1 << 2);
-	meta->flags = onvm_pkt_set_meta_bit(meta->flags, PKT_META_PAYLOAD_WRITE);
+        /* Service 3 modifies it and gets a private copy, merged back at the join */
         dst |= (1 << 3);
+	meta->writers = (1 << 3);
+	meta->flags = onvm_pkt_set_meta_bit(meta->flags, PKT_META_PAYLOAD_WRITE);
 	
         //dst |= (1 << 5);
         onvm_pkt_set_action(pkt, ONVM_NF_ACTION_PARA, dst);
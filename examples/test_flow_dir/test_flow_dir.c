@@ -156,6 +156,7 @@ packet_handler(struct rte_mbuf *pkt, struct onvm_pkt_meta *meta,
                __attribute__((unused)) struct onvm_nf_local_ctx *nf_local_ctx) {
         static uint32_t counter = 0;
         struct onvm_flow_entry *flow_entry = NULL;
+        struct onvm_service_chain *sc;
         int ret;
 
         if (++counter == print_delay) {
@@ -173,10 +174,12 @@ packet_handler(struct rte_mbuf *pkt, struct onvm_pkt_meta *meta,
                         meta->destination = 0;
                         return 0;
                 }
-                memset(flow_entry, 0, sizeof(struct onvm_flow_entry));
-                flow_entry->sc = onvm_sc_create();
-                onvm_sc_append_entry(flow_entry->sc, ONVM_NF_ACTION_TONF, destination);
-                // onvm_sc_print(flow_entry->sc);
+                sc = onvm_sc_create();
+                onvm_sc_append_entry(sc, ONVM_NF_ACTION_TONF, destination);
+                // onvm_sc_print(sc);
+                /* Another instance may have installed the flow meanwhile */
+                if (onvm_flow_dir_set_sc(flow_entry, sc) < 0)
+                        rte_free(sc);
         }
         return 0;
 }
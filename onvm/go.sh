@@ -1,7 +1,7 @@
 #!/bin/bash
 
 function usage {
-        echo "$0 -k PORTMASK -n NF-COREMASK [-m MANAGER CORES] [-r NUM-SERVICES] [-d DEFAULT-SERVICE] [-s STATS-OUTPUT] [-p WEB-PORT-NUMBER] [-z STATS-SLEEP-TIME]"
+        echo "$0 -k PORTMASK -n NF-COREMASK [-m MANAGER CORES] [-r NUM-SERVICES] [-d DEFAULT-SERVICE] [-s STATS-OUTPUT] [-p WEB-PORT-NUMBER] [-z STATS-SLEEP-TIME] [-g SERVICE-GRAPH-FILE] [-q SCHED-QUOTA] [-x DIRECT-RX-QUEUES] [-e AUTOSCALE-FILE] [-f CLASSIFIER-FILE]"
         # this works well on our 2x6-core nodes
         echo "$0 -k 3 -n 0xF0 --> cores 0,1,2, with ports 0 and 1, with NFs running on cores 4,5,6,7"
         echo -e "\tBy default, cores will be used as follows in numerical order:"
@@ -16,6 +16,8 @@ function usage {
         echo -e "\tRuns ONVM the same way as above, but prints statistics to stdout"
         echo -e "$0 -k 3 -n 0xF0 -m 2,3,4 -s stdout -c"
         echo -e "\tRuns ONVM the same way as above, but enables shared cpu support"
+        echo -e "$0 -k 3 -n 0xF0 -m 2,3,4 -s stdout -c -q 256"
+        echo -e "\tRuns ONVM the same way as above, but NFs sharing a core take turns of about 256 packets"
         echo -e "$0 -k 3 -n 0xF0 -m 2,3,4 -s stdout -t 42"
         echo -e "\tRuns ONVM the same way as above, but shuts down after 42 seconds"
         echo -e "$0 -k 3 -n 0xF0 -m 2,3,4 -s stdout -l 64"
@@ -28,6 +30,14 @@ function usage {
         echo -e "\tRuns ONVM the same way as above, but adds a --base-virtaddr dpdk parameter to overwrite default address"
         echo -e "$0 -k 3 -n 0xF0 -m 2,3,4 -r 10 -d 2"
         echo -e "\tRuns ONVM the same way as above, but limits max service IDs to 10 and uses service ID 2 as the default"
+        echo -e "$0 -k 3 -n 0xF0 -m 2,3,4 -g ../examples/example_service_graph.json"
+        echo -e "\tRuns ONVM the same way as above, but steers packets through the service graph in the given file"
+        echo -e "$0 -k 3 -n 0xF0 -m 2,3,4 -x 4"
+        echo -e "\tRuns ONVM the same way as above, but up to 4 NFs of the first service poll NIC RX queues themselves"
+        echo -e "$0 -k 3 -n 0xF0 -m 2,3,4 -e ../examples/example_autoscale.json"
+        echo -e "\tRuns ONVM the same way as above, but scales the services within the policies and limits in the given file"
+        echo -e "$0 -k 3 -n 0xF0 -m 2,3,4 -f ../examples/example_classifier.json"
+        echo -e "\tRuns ONVM the same way as above, but picks the service chain of each flow from the rules in the given file"
         exit 1
 }
 
@@ -110,7 +120,7 @@ then
     exit 1
 fi
 
-while getopts "a:r:d:s:t:l:p:z:cvm:k:n:" opt; do
+while getopts "a:r:d:s:t:l:p:z:cvm:k:n:g:q:x:e:f:" opt; do
     case $opt in
         a) virt_addr="--base-virtaddr=$OPTARG";;
         r) num_srvc="-r $OPTARG";;
@@ -121,6 +131,11 @@ while getopts "a:r:d:s:t:l:p:z:cvm:k:n:" opt; do
         p) web_port="$OPTARG";;
         z) stats_sleep_time="-z $OPTARG";;
         c) shared_cpu_flag="-c";;
+        q) sched_quota="-q $OPTARG";;
+        x) direct_rx="-x $OPTARG";;
+        g) service_graph="-g $(readlink -f "$OPTARG")";;
+        e) autoscale="-e $(readlink -f "$OPTARG")";;
+        f) classifier="-f $(readlink -f "$OPTARG")";;
         v) verbosity=$((verbosity+1));;
         m)
             # User is trying to set CPU cores but has already done so using legacy syntax
@@ -269,7 +284,7 @@ fi
 sudo rm -rf /mnt/huge/rtemap_*
 # watch out for variable expansion
 # shellcheck disable=SC2086
-sudo "$SCRIPTPATH"/onvm_mgr/"$RTE_TARGET"/onvm_mgr -l "$cpu" -n 4 --proc-type=primary ${virt_addr} -- -p ${ports} -n ${nf_cores} ${num_srvc} ${def_srvc} ${stats} ${stats_sleep_time} ${verbosity_level} ${ttl} ${packet_limit} ${shared_cpu_flag}
+sudo "$SCRIPTPATH"/onvm_mgr/"$RTE_TARGET"/onvm_mgr -l "$cpu" -n 4 --proc-type=primary ${virt_addr} -- -p ${ports} -n ${nf_cores} ${num_srvc} ${def_srvc} ${stats} ${stats_sleep_time} ${verbosity_level} ${ttl} ${packet_limit} ${shared_cpu_flag} ${sched_quota} ${direct_rx} ${service_graph} ${autoscale} ${classifier}
 
 if [ "${stats}" = "-s web" ]
 then
@@ -49,9 +49,11 @@
 
 #include <signal.h>
 
+#include "onvm_classifier.h"
 #include "onvm_mgr.h"
 #include "onvm_nf.h"
 #include "onvm_pkt.h"
+#include "onvm_scale.h"
 #include "onvm_stats.h"
 
 /****************************Internal Declarations****************************/
@@ -66,9 +68,43 @@ static uint8_t main_keep_running = 1;
 // race the stats display to be able to print, so keep this varable separate
 static uint8_t worker_keep_running = 1;
 
+/* A TX thread only takes an NF it is not home to once this many packets wait in its tx ring */
+#define ONVM_TX_STEAL_MIN PACKET_READ_SIZE
+/* TX threads are rebalanced once their loads differ by more than 1/ONVM_TX_REBALANCE_SLACK of the busiest */
+#define ONVM_TX_REBALANCE_SLACK 4
+
+/*
+ * Per NF TX ring claim. The tx rings are single consumer, so a TX thread
+ * owns the claim while it dequeues from the ring and until the packets it
+ * took are flushed, which keeps them in order when another thread steals.
+ */
+struct tx_claim {
+        volatile uint16_t owner;    // TX thread id + 1 holding the ring, 0 when free
+        volatile uint16_t home;     // TX thread id + 1 the NF is assigned to, 0 when unassigned
+        volatile uint64_t tx_pkts;  // packets dequeued from the ring, written under the claim
+} __rte_cache_aligned;
+
+static struct tx_claim tx_claims[MAX_NFS];
+
+// TX threads the master thread spreads the NFs over
+static struct queue_mgr **tx_threads;
+static unsigned num_tx_threads;
+
 static void
 handle_signal(int sig);
 
+static void
+tx_threads_rebalance(void);
+
+/*
+ * Blocks the master thread until a NF sends the manager a message, the
+ * deadline passes or a signal arrives.
+ *
+ * Input  : the TSC deadline
+ */
+static void
+master_thread_wait(uint64_t deadline);
+
 /*******************************Worker threads********************************/
 
 /*
@@ -83,6 +119,9 @@ master_thread_main(void) {
         const uint32_t time_to_live = global_time_to_live;
         const uint32_t pkt_limit = global_pkt_limit;
         const uint64_t start_time = rte_get_tsc_cycles();
+        const uint64_t stats_cycles = (uint64_t)sleeptime * rte_get_timer_hz();
+        const uint64_t tick_cycles = (uint64_t)ONVM_SCALE_TICK_MS * rte_get_timer_hz() / 1000;
+        uint64_t next_stats_time, next_tick_time, now;
         uint64_t total_rx_pkts;
 
         RTE_LOG(INFO, APP, "Core %d: Running master thread\n", rte_lcore_id());
@@ -101,9 +140,31 @@ master_thread_main(void) {
         sleep(5);
 
         onvm_stats_init(verbosity_level);
-        /* Loop forever: sleep always returns 0 or <= param */
-        while (main_keep_running && sleep(sleeptime) <= sleeptime) {
+        next_stats_time = rte_get_tsc_cycles() + stats_cycles;
+        next_tick_time = rte_get_tsc_cycles() + tick_cycles;
+        /*
+         * NF messages are handled as soon as they arrive, the autoscaler and the
+         * classifier reload tick every ONVM_SCALE_TICK_MS and everything else
+         * runs every stats interval
+         */
+        while (main_keep_running) {
+                master_thread_wait(RTE_MIN(next_tick_time, next_stats_time));
                 onvm_nf_check_status();
+
+                now = rte_get_tsc_cycles();
+                if (now >= next_tick_time) {
+                        next_tick_time = RTE_MAX(next_tick_time + tick_cycles, now);
+                        if (NF_SCALING)
+                                onvm_scale_tick();
+                        onvm_classifier_tick();
+                }
+
+                if (now < next_stats_time)
+                        continue;
+                next_stats_time += stats_cycles;
+
+                /* NFs that started since the last interval get a TX thread */
+                tx_threads_rebalance();
                 if (stats_destination != ONVM_STATS_NONE)
                         onvm_stats_display_all(sleeptime, verbosity_level);
 
@@ -117,16 +178,23 @@ master_thread_main(void) {
                 if (pkt_limit) {
                         total_rx_pkts = 0;
                         for (i = 0; i < ports->num_ports; i++)
-                                total_rx_pkts += ports->rx_stats.rx[ports->id[i]];
+                                total_rx_pkts += onvm_port_stats_rx(ports, ports->id[i]);
                         if (unlikely(total_rx_pkts >= (uint64_t)pkt_limit * PKT_TTL_MULTIPLIER)) {
                                 printf("Packet limit exceeded, shutting down\n");
                                 main_keep_running = 0;
                         }
                 }
 
-                if (NF_SCALING) {
-                        onvm_nf_scaling(sleeptime);
+                if (ONVM_NF_COOP_SCHED) {
+                        onvm_nf_sched_update();
                 }
+
+                if (ONVM_NF_LOAD_CORE_REASSIGNMENT)
+                        onvm_nf_rebalance_cores();
+
+                /* Off the packet path, every idle flow director entry can go at once */
+                onvm_flow_dir_expire(rte_get_tsc_cycles(), UINT32_MAX);
+                onvm_flow_dir_reclaim(UINT32_MAX);
         }
 
         /* Close out file references and things */
@@ -149,12 +217,6 @@ master_thread_main(void) {
                 RTE_LOG(INFO, APP, "Core %d: Notifying NF %" PRIu16 " to shut down\n", rte_lcore_id(), i);
                 onvm_nf_send_msg(i, MSG_STOP, NULL);
 
-                /* If in shared core mode NFs might be sleeping */
-                if (ONVM_NF_SHARE_CORES && rte_atomic16_read(nf_wakeup_infos[i].shm_server) == 1) {
-                        nf_wakeup_infos[i].num_wakeups++;
-                        rte_atomic16_set(nf_wakeup_infos[i].shm_server, 0);
-                        sem_post(nf_wakeup_infos[i].mutex);
-                }
         }
 
         /* Wait to process all exits */
@@ -169,105 +231,34 @@ master_thread_main(void) {
                         rte_lcore_id(), num_nfs);
         }
 
-        /* Clean up the shared memory */
-        if (ONVM_NF_SHARE_CORES) {
-                for (i = 0; i < MAX_NFS; i++) {
-                        sem_close(nf_wakeup_infos[i].mutex);
-                        sem_unlink(nf_wakeup_infos[i].sem_name);
-                }
-        }
-
         RTE_LOG(INFO, APP, "Core %d: Master thread done\n", rte_lcore_id());
 
-        char mutex_name[32][20];
-        strcpy(mutex_name[0], "pkt_mutex0");
-        strcpy(mutex_name[1], "pkt_mutex1");
-        strcpy(mutex_name[2], "pkt_mutex2");
-        strcpy(mutex_name[3], "pkt_mutex3");
-        strcpy(mutex_name[4], "pkt_mutex4");
-        strcpy(mutex_name[5], "pkt_mutex5");
-        strcpy(mutex_name[6], "pkt_mutex6");
-        strcpy(mutex_name[7], "pkt_mutex7");
-        strcpy(mutex_name[8], "pkt_mutex8");
-        strcpy(mutex_name[9], "pkt_mutex9");
-        strcpy(mutex_name[10], "pkt_mutex10");
-        strcpy(mutex_name[11], "pkt_mutex11");
-        strcpy(mutex_name[12], "pkt_mutex12");
-        strcpy(mutex_name[13], "pkt_mutex13");
-        strcpy(mutex_name[14], "pkt_mutex14");
-        strcpy(mutex_name[15], "pkt_mutex15");
-        strcpy(mutex_name[16], "pkt_mutex16");
-        strcpy(mutex_name[17], "pkt_mutex17");
-        strcpy(mutex_name[18], "pkt_mutex18");
-        strcpy(mutex_name[19], "pkt_mutex19");
-        strcpy(mutex_name[20], "pkt_mutex20");
-        strcpy(mutex_name[21], "pkt_mutex21");
-        strcpy(mutex_name[22], "pkt_mutex22");
-        strcpy(mutex_name[23], "pkt_mutex23");
-        strcpy(mutex_name[24], "pkt_mutex24");
-        strcpy(mutex_name[25], "pkt_mutex25");
-        strcpy(mutex_name[26], "pkt_mutex26");
-        strcpy(mutex_name[27], "pkt_mutex27");
-        strcpy(mutex_name[28], "pkt_mutex28");
-        strcpy(mutex_name[29], "pkt_mutex29");
-        strcpy(mutex_name[30], "pkt_mutex30");
-        strcpy(mutex_name[31], "pkt_mutex31");
-
-        for (i = 0; i < 32; i++) {
-                sem_t *mutex = sem_open(mutex_name[i], 0);
-                sem_close(mutex);
-                if (sem_unlink(mutex_name[i])) {
-                        RTE_LOG(INFO, APP, "Binary semaphore pkt_mutex destroy fail...\n");
-                }
-        }
-
-        strcpy(mutex_name[0], "set_action_mutex0");
-        strcpy(mutex_name[1], "set_action_mutex1");
-        strcpy(mutex_name[2], "set_action_mutex2");
-        strcpy(mutex_name[3], "set_action_mutex3");
-        strcpy(mutex_name[4], "set_action_mutex4");
-        strcpy(mutex_name[5], "set_action_mutex5");
-        strcpy(mutex_name[6], "set_action_mutex6");
-        strcpy(mutex_name[7], "set_action_mutex7");
-        strcpy(mutex_name[8], "set_action_mutex8");
-        strcpy(mutex_name[9], "set_action_mutex9");
-        strcpy(mutex_name[10], "set_action_mutex10");
-        strcpy(mutex_name[11], "set_action_mutex11");
-        strcpy(mutex_name[12], "set_action_mutex12");
-        strcpy(mutex_name[13], "set_action_mutex13");
-        strcpy(mutex_name[14], "set_action_mutex14");
-        strcpy(mutex_name[15], "set_action_mutex15");
-        strcpy(mutex_name[16], "set_action_mutex16");
-        strcpy(mutex_name[17], "set_action_mutex17");
-        strcpy(mutex_name[18], "set_action_mutex18");
-        strcpy(mutex_name[19], "set_action_mutex19");
-        strcpy(mutex_name[20], "set_action_mutex20");
-        strcpy(mutex_name[21], "set_action_mutex21");
-        strcpy(mutex_name[22], "set_action_mutex22");
-        strcpy(mutex_name[23], "set_action_mutex23");
-        strcpy(mutex_name[24], "set_action_mutex24");
-        strcpy(mutex_name[25], "set_action_mutex25");
-        strcpy(mutex_name[26], "set_action_mutex26");
-        strcpy(mutex_name[27], "set_action_mutex27");
-        strcpy(mutex_name[28], "set_action_mutex28");
-        strcpy(mutex_name[29], "set_action_mutex29");
-        strcpy(mutex_name[30], "set_action_mutex30");
-        strcpy(mutex_name[31], "set_action_mutex31");
-
-        for (i = 0; i < 32; i++) {
-                sem_t *mutex = sem_open(mutex_name[i], 0);
-                sem_close(mutex);
-                if (sem_unlink(mutex_name[i])) {
-                        RTE_LOG(INFO, APP, "Binary semaphore set_action_mutex destroy fail...\n");
-                }
-        }
-
         struct rte_mempool *pktmbuf_clone_pool = rte_mempool_lookup(PKTMBUF_CLONE_POOL_NAME);
         if (pktmbuf_clone_pool) {
                 rte_mempool_free(pktmbuf_clone_pool);
         }
 }
 
+static void
+master_thread_wait(uint64_t deadline) {
+        struct timespec timeout;
+        uint64_t now, ns;
+
+        now = rte_get_tsc_cycles();
+        if (now >= deadline)
+                return;
+        ns = (deadline - now) * NS_PER_S / rte_get_tsc_hz();
+        timeout.tv_sec = ns / NS_PER_S;
+        timeout.tv_nsec = ns % NS_PER_S;
+
+        /* Announce the sleep before the last look at the queue, see onvm_mgr_wakeup */
+        onvm_config->mgr.sleep_state = NF_SLEEPING;
+        rte_smp_mb();
+        if (rte_ring_empty(incoming_msg_queue))
+                syscall(SYS_futex, &onvm_config->mgr.sleep_state, FUTEX_WAIT, NF_SLEEPING, &timeout, NULL, 0);
+        onvm_config->mgr.sleep_state = NF_AWAKE;
+}
+
 /*
  * Function to receive packets from the NIC
  * and distribute them to the default service
@@ -281,8 +272,11 @@ rx_thread_main(void *arg) {
 
         onvm_stats_gen_event_info("Rx Start", ONVM_EVENT_WITH_CORE, &cur_lcore);
         RTE_LOG(INFO, APP, "Core %d: Running RX thread for RX queue %d\n", cur_lcore, rx_mgr->id);
+        if (onvm_flow_dir_reader_register(ONVM_FLOW_DIR_MGR_READER(cur_lcore)) < 0)
+                rte_exit(EXIT_FAILURE, "Core %d: Cannot read the flow director\n", cur_lcore);
 
         for (; worker_keep_running;) {
+                onvm_flow_dir_quiescent();
                 /* Read ports */
                 for (i = 0; i < ports->num_ports; i++) {
                         rx_count = rte_eth_rx_burst(ports->id[i], rx_mgr->id, pkts, PACKET_READ_SIZE);
@@ -300,50 +294,122 @@ rx_thread_main(void *arg) {
                 }
         }
 
+        onvm_flow_dir_reader_unregister();
         RTE_LOG(INFO, APP, "Core %d: RX thread done\n", rte_lcore_id());
         return 0;
 }
 
+/*
+ * Claims the tx ring of one NF for this TX thread and processes a burst from it.
+ * Returns the number of packets taken, the claim is only kept when that is not 0.
+ */
+static unsigned
+tx_thread_drain_nf(struct queue_mgr *tx_mgr, uint16_t nf_id) {
+        struct rte_mbuf *pkts[PACKET_READ_SIZE];
+        struct tx_claim *claim;
+        struct onvm_nf *nf;
+        uint16_t free_owner = 0;
+        unsigned tx_count;
+
+        nf = &nfs[nf_id];
+        if (!onvm_nf_is_valid(nf) || rte_ring_empty(nf->tx_q))
+                return 0;
+
+        claim = &tx_claims[nf_id];
+        if (!__atomic_compare_exchange_n(&claim->owner, &free_owner, tx_mgr->id + 1, 0, __ATOMIC_ACQUIRE,
+                                         __ATOMIC_RELAXED))
+                return 0;
+
+        /* Dequeue all packets in ring up to max possible. */
+        tx_count = rte_ring_dequeue_burst(nf->tx_q, (void **)pkts, PACKET_READ_SIZE, NULL);
+        if (unlikely(tx_count == 0)) {
+                __atomic_store_n(&claim->owner, 0, __ATOMIC_RELEASE);
+                return 0;
+        }
+
+        /* Now process the Client packets read */
+        onvm_pkt_process_tx_batch(tx_mgr, pkts, tx_count, nf);
+        claim->tx_pkts += tx_count;
+        return tx_count;
+}
+
+/*
+ * Finds the fullest tx ring of an NF this thread is not home to and drains it.
+ * NFs without a TX thread yet are taken with any backlog, the others only once
+ * their own thread has fallen behind. Returns the NF taken, 0 if none.
+ */
+static uint16_t
+tx_thread_steal(struct queue_mgr *tx_mgr) {
+        uint16_t i, home, best_id;
+        unsigned count, best_count;
+
+        best_id = 0;
+        best_count = 0;
+        for (i = 1; i < MAX_NFS; i++) {
+                if (!onvm_nf_is_valid(&nfs[i]))
+                        continue;
+                home = tx_claims[i].home;
+                if (home == tx_mgr->id + 1 || tx_claims[i].owner != 0)
+                        continue;
+                count = rte_ring_count(nfs[i].tx_q);
+                if (count > best_count && (home == 0 || count >= ONVM_TX_STEAL_MIN)) {
+                        best_id = i;
+                        best_count = count;
+                }
+        }
+
+        if (best_id == 0 || tx_thread_drain_nf(tx_mgr, best_id) == 0)
+                return 0;
+        return best_id;
+}
+
+/*
+ * Function to process packets from the NFs' tx rings. Every thread drains the
+ * NFs the master thread assigned to it and helps the others when it is idle.
+ */
 static int
 tx_thread_main(void *arg) {
-        struct onvm_nf *nf;
-        unsigned i, tx_count, cur_lcore;
-        struct rte_mbuf *pkts[PACKET_READ_SIZE];
+        struct tx_thread_info *info;
+        unsigned i, num_nfs, num_held, cur_lcore;
+        uint16_t held[MAX_NFS];
+        uint16_t nf_id;
         struct queue_mgr *tx_mgr = (struct queue_mgr *)arg;
         cur_lcore = rte_lcore_id();
+        info = tx_mgr->tx_thread_info;
 
         onvm_stats_gen_event_info("Tx Start", ONVM_EVENT_WITH_CORE, &cur_lcore);
-        if (tx_mgr->tx_thread_info->first_nf == tx_mgr->tx_thread_info->last_nf - 1) {
-                RTE_LOG(INFO, APP, "Core %d: Running TX thread for NF %d\n", cur_lcore,
-                        tx_mgr->tx_thread_info->first_nf);
-        } else if (tx_mgr->tx_thread_info->first_nf < tx_mgr->tx_thread_info->last_nf) {
-                RTE_LOG(INFO, APP, "Core %d: Running TX thread for NFs %d to %d\n", cur_lcore,
-                        tx_mgr->tx_thread_info->first_nf, tx_mgr->tx_thread_info->last_nf - 1);
-        }
+        RTE_LOG(INFO, APP, "Core %d: Running TX thread %u, NFs are assigned as they start\n", cur_lcore, tx_mgr->id);
+
+        if (onvm_flow_dir_reader_register(ONVM_FLOW_DIR_MGR_READER(cur_lcore)) < 0)
+                rte_exit(EXIT_FAILURE, "Core %d: Cannot read the flow director\n", cur_lcore);
 
         for (; worker_keep_running;) {
-                /* Read packets from the NF's tx queue and process them as needed */
-                for (i = tx_mgr->tx_thread_info->first_nf; i < tx_mgr->tx_thread_info->last_nf; i++) {
-                        nf = &nfs[i];
-                        if (!onvm_nf_is_valid(nf))
-                                continue;
-
-                        /* Dequeue all packets in ring up to max possible. */
-                        tx_count = rte_ring_dequeue_burst(nf->tx_q, (void **)pkts, PACKET_READ_SIZE, NULL);
-
-                        /* Now process the Client packets read */
-                        if (likely(tx_count > 0)) {
-                                onvm_pkt_process_tx_batch(tx_mgr, pkts, tx_count, nf);
-                        }
+                onvm_flow_dir_quiescent();
+                /* Read packets from the tx rings of the NFs assigned to this thread */
+                num_held = 0;
+                num_nfs = RTE_MIN(info->num_nfs, (unsigned)MAX_NFS);
+                for (i = 0; i < num_nfs; i++) {
+                        nf_id = info->nfs[i];
+                        if (tx_thread_drain_nf(tx_mgr, nf_id) > 0)
+                                held[num_held++] = nf_id;
                 }
 
+                /* Nothing to do here, take a ring from a thread that is behind */
+                if (num_held == 0 && (nf_id = tx_thread_steal(tx_mgr)) != 0)
+                        held[num_held++] = nf_id;
+
                 /* Send a burst to every port */
                 onvm_pkt_flush_all_ports(tx_mgr);
 
                 /* Send a burst to every NF */
                 onvm_pkt_flush_all_nfs(tx_mgr, NULL);
+
+                /* What was taken from these rings is sent, another thread may drain them now */
+                for (i = 0; i < num_held; i++)
+                        __atomic_store_n(&tx_claims[held[i]].owner, 0, __ATOMIC_RELEASE);
         }
 
+        onvm_flow_dir_reader_unregister();
         RTE_LOG(INFO, APP, "Core %d: TX thread done\n", rte_lcore_id());
         return 0;
 }
@@ -355,52 +421,94 @@ handle_signal(int sig) {
         }
 }
 
-static inline void
-wakeup_client(struct nf_wakeup_info *nf_wakeup_info) {
-        nf_wakeup_info->num_wakeups++;
-        rte_atomic16_set(nf_wakeup_info->shm_server, 0);
-        sem_post(nf_wakeup_info->mutex);
-}
-
-static int
-wakeup_thread_main(void *arg) {
-        unsigned i;
-        struct onvm_nf *nf;
-        struct nf_wakeup_info *nf_wakeup_info;
-        struct wakeup_thread_context *wakeup_ctx = (struct wakeup_thread_context *)arg;
-
-        if (wakeup_ctx->first_nf == wakeup_ctx->last_nf - 1) {
-                RTE_LOG(INFO, APP, "Core %d: Running Wakeup thread for NF %d\n", rte_lcore_id(), wakeup_ctx->first_nf);
-        } else if (wakeup_ctx->first_nf < wakeup_ctx->last_nf) {
-                RTE_LOG(INFO, APP, "Core %d: Running Wakeup thread for NFs %d to %d\n", rte_lcore_id(),
-                        wakeup_ctx->first_nf, wakeup_ctx->last_nf - 1);
+/*
+ * Spreads the running NFs over the TX threads by the packets each sent since
+ * the last call, heaviest first onto the least loaded thread. The lists are
+ * only rewritten when NFs came or went or the thread loads drifted apart, so
+ * threads keep their NFs while the load stays even.
+ */
+static void
+tx_threads_rebalance(void) {
+        static uint64_t tx_pkts_last[MAX_NFS];
+        uint64_t nf_load[MAX_NFS];
+        uint16_t order[MAX_NFS];
+        uint64_t thread_load[RTE_MAX_LCORE];
+        uint16_t thread_nfs[RTE_MAX_LCORE];
+        uint64_t pkts, max_load, min_load;
+        unsigned i, j, t, best, num_running;
+        uint16_t home;
+        uint8_t changed;
+
+        if (num_tx_threads == 0)
+                return;
+
+        memset(thread_load, 0, sizeof(thread_load));
+        changed = 0;
+        num_running = 0;
+        for (i = 1; i < MAX_NFS; i++) {
+                pkts = tx_claims[i].tx_pkts;
+                nf_load[i] = pkts - tx_pkts_last[i];
+                tx_pkts_last[i] = pkts;
+
+                home = tx_claims[i].home;
+                if (!onvm_nf_is_valid(&nfs[i])) {
+                        changed |= (home != 0);
+                        continue;
+                }
+                if (home == 0)
+                        changed = 1;
+                else
+                        thread_load[home - 1] += nf_load[i];
+
+                /* Keep the running NFs sorted by load, heaviest first */
+                for (j = num_running; j > 0 && nf_load[order[j - 1]] < nf_load[i]; j--)
+                        order[j] = order[j - 1];
+                order[j] = i;
+                num_running++;
         }
 
-        for (; worker_keep_running;) {
-                for (i = wakeup_ctx->first_nf; i < wakeup_ctx->last_nf; i++) {
-                        nf = &nfs[i];
-                        nf_wakeup_info = &nf_wakeup_infos[i];
-                        if (!onvm_nf_is_valid(nf))
-                                continue;
+        if (!changed) {
+                max_load = 0;
+                min_load = UINT64_MAX;
+                for (t = 0; t < num_tx_threads; t++) {
+                        max_load = RTE_MAX(max_load, thread_load[t]);
+                        min_load = RTE_MIN(min_load, thread_load[t]);
+                }
+                if (max_load - min_load <= max_load / ONVM_TX_REBALANCE_SLACK)
+                        return;
+        }
 
-                        /* Check if NF is sleeping and has pkts on the rx queue  */
-                        if (!whether_wakeup_client(nf, nf_wakeup_info))
-                                continue;
+        memset(thread_load, 0, sizeof(thread_load));
+        memset(thread_nfs, 0, sizeof(thread_nfs));
+        for (i = 1; i < MAX_NFS; i++) {
+                if (!onvm_nf_is_valid(&nfs[i]))
+                        tx_claims[i].home = 0;
+        }
 
-                        wakeup_client(nf_wakeup_info);
+        /* Ties go to the thread with fewer NFs, so idle NFs are spread out too */
+        for (i = 0; i < num_running; i++) {
+                best = 0;
+                for (t = 1; t < num_tx_threads; t++) {
+                        if (thread_load[t] < thread_load[best] ||
+                            (thread_load[t] == thread_load[best] && thread_nfs[t] < thread_nfs[best]))
+                                best = t;
                 }
+                thread_load[best] += nf_load[order[i]];
+                tx_threads[best]->tx_thread_info->nfs[thread_nfs[best]++] = order[i];
+                tx_claims[order[i]].home = best + 1;
         }
 
-        free(wakeup_ctx);
-        return 0;
+        /* A thread reading a list while it changes at worst skips or retries an NF, the claims keep it safe */
+        rte_smp_wmb();
+        for (t = 0; t < num_tx_threads; t++)
+                tx_threads[t]->tx_thread_info->num_nfs = thread_nfs[t];
 }
 
 /*
  * Function to free all allocated memory from main function.
  */
 static void
-onvm_main_free(unsigned tx_lcores, unsigned rx_lcores, struct queue_mgr *tx_mgr[], struct queue_mgr *rx_mgr[],
-               struct wakeup_thread_context *wakeup_ctx[]) {
+onvm_main_free(unsigned tx_lcores, unsigned rx_lcores, struct queue_mgr *tx_mgr[], struct queue_mgr *rx_mgr[]) {
         unsigned i;
         for (i = 0; i < tx_lcores; i++) {
                 if (tx_mgr[i] == NULL) {
@@ -409,8 +517,8 @@ onvm_main_free(unsigned tx_lcores, unsigned rx_lcores, struct queue_mgr *tx_mgr[
                 if (tx_mgr[i]->nf_rx_bufs != NULL) {
                         rte_free(tx_mgr[i]->nf_rx_bufs);
                 }
-                if (tx_mgr[i]->tx_thread_info->port_tx_bufs != NULL) {
-                        rte_free(tx_mgr[i]->tx_thread_info->port_tx_bufs);
+                if (tx_mgr[i]->port_tx_bufs != NULL) {
+                        rte_free(tx_mgr[i]->port_tx_bufs);
                 }
                 if (tx_mgr[i]->tx_thread_info != NULL) {
                         rte_free(tx_mgr[i]->tx_thread_info);
@@ -426,20 +534,11 @@ onvm_main_free(unsigned tx_lcores, unsigned rx_lcores, struct queue_mgr *tx_mgr[
                 }
                 rte_free(rx_mgr[i]);
         }
-        if (ONVM_NF_SHARE_CORES) {
-                for (i = 0; i < ONVM_NUM_WAKEUP_THREADS; i++) {
-                        if (wakeup_ctx[i] == NULL) {
-                                break;
-                        }
-                        rte_free(wakeup_ctx[i]);
-                }
-        }
 }
 /*******************************Main function*********************************/
 int
 main(int argc, char *argv[]) {
-        unsigned cur_lcore, rx_lcores, tx_lcores, wakeup_lcores;
-        unsigned nfs_per_tx, nfs_per_wakeup_thread;
+        unsigned cur_lcore, rx_lcores, tx_lcores;
         unsigned i;
 
         /* initialise the system */
@@ -448,25 +547,24 @@ main(int argc, char *argv[]) {
 
         RTE_LOG(INFO, APP, "Finished Process Init.\n");
 
+        /* Services scale within the limits of the autoscale file, or the default ones */
+        onvm_scale_init();
+
+        /* Flows without a flow director entry get the chain of the classifier rule they match */
+        onvm_classifier_init();
+
+        /* Until an NF polls a NIC RX queue of its own every flow goes to the RX threads */
+        onvm_nf_steer_direct_rx();
+
         /* clear statistics */
         onvm_stats_clear_all_nfs();
 
         /* Reserve n cores for: ONVM_NUM_MGR_AUX_THREADS for auxiliary(f.e. stats), ONVM_NUM_RX_THREADS for Rx, and all
-         * remaining for Tx (subtract wakeup cores if shared core mode is enabled) */
+         * remaining for Tx. Shared core NFs are woken by whoever hands them work, so no core is kept for wakeups */
         cur_lcore = rte_lcore_id();
         rx_lcores = ONVM_NUM_RX_THREADS;
         tx_lcores = rte_lcore_count() - rx_lcores - ONVM_NUM_MGR_AUX_THREADS;
 
-        /* If shared core mode enabled adjust core numbers */
-        if (ONVM_NF_SHARE_CORES) {
-                wakeup_lcores = ONVM_NUM_WAKEUP_THREADS;
-                tx_lcores -= wakeup_lcores;
-                if (tx_lcores < 1) {
-                        RTE_LOG(INFO, APP, "Not enough cores to enabled shared core support\n");
-                        return -1;
-                }
-        }
-
         onvm_stats_gen_event_info("MGR Start", ONVM_EVENT_WITH_CORE, &cur_lcore);
 
         /* Offset cur_lcore to start assigning TX cores */
@@ -475,20 +573,12 @@ main(int argc, char *argv[]) {
         RTE_LOG(INFO, APP, "%d cores available in total\n", rte_lcore_count());
         RTE_LOG(INFO, APP, "%d cores available for handling manager RX queues\n", rx_lcores);
         RTE_LOG(INFO, APP, "%d cores available for handling TX queues\n", tx_lcores);
-        if (ONVM_NF_SHARE_CORES)
-                RTE_LOG(INFO, APP, "%d cores available for handling wakeup\n", wakeup_lcores);
         RTE_LOG(INFO, APP, "%d cores available for handling stats\n", 1);
 
-        /* Evenly assign NFs to TX threads */
-
         /*
-         * If num NFs is zero, then we are running in dynamic NF mode.
-         * We do not have a way to tell the total number of NFs running so
-         * we have to calculate nfs_per_tx using MAX_NFS then.
-         * We want to distribute the number of running NFs across available
-         * TX threads
+         * NFs are spread over the TX threads by the master thread as they start and
+         * stop (see tx_threads_rebalance), idle TX threads steal from busy ones.
          */
-        nfs_per_tx = ceil((float)MAX_NFS / tx_lcores);
 
         // We start the system with 0 NFs active
         num_nfs = 0;
@@ -499,7 +589,6 @@ main(int argc, char *argv[]) {
 
         struct queue_mgr *tx_mgr[tx_lcores];
         struct queue_mgr *rx_mgr[rx_lcores];
-        struct wakeup_thread_context *wakeup_ctx[ONVM_NUM_WAKEUP_THREADS];
 
         for (i = 0; i < tx_lcores; i++) {
                 tx_mgr[i] = rte_calloc(NULL, 1, sizeof(struct queue_mgr), RTE_CACHE_LINE_SIZE);
@@ -512,22 +601,21 @@ main(int argc, char *argv[]) {
                 if (tx_mgr[i]->tx_thread_info == NULL) {
                         goto onvm_free;
                 }
-                tx_mgr[i]->tx_thread_info->port_tx_bufs =
+                /* TX thread i sends on NIC TX queue i of every port */
+                tx_mgr[i]->nic_txq = i;
+                tx_mgr[i]->port_tx_bufs =
                     rte_calloc(NULL, RTE_MAX_ETHPORTS, sizeof(struct packet_buf), RTE_CACHE_LINE_SIZE);
-                if (tx_mgr[i]->tx_thread_info->port_tx_bufs == NULL) {
+                if (tx_mgr[i]->port_tx_bufs == NULL) {
                         goto onvm_free;
                 }
                 tx_mgr[i]->nf_rx_bufs = rte_calloc(NULL, MAX_NFS, sizeof(struct packet_buf), RTE_CACHE_LINE_SIZE);
                 if (tx_mgr[i]->nf_rx_bufs == NULL) {
                         goto onvm_free;
                 }
-                tx_mgr[i]->tx_thread_info->first_nf = RTE_MIN(i * nfs_per_tx + 1, (unsigned)MAX_NFS);
-                tx_mgr[i]->tx_thread_info->last_nf = RTE_MIN((i + 1) * nfs_per_tx + 1, (unsigned)MAX_NFS);
                 cur_lcore = rte_get_next_lcore(cur_lcore, 1, 1);
                 if (rte_eal_remote_launch(tx_thread_main, (void *)tx_mgr[i], cur_lcore) == -EBUSY) {
-                        RTE_LOG(ERR, APP, "Core %d is already busy, can't use for nf %d TX\n", cur_lcore,
-                                tx_mgr[i]->tx_thread_info->first_nf);
-                        onvm_main_free(tx_lcores, rx_lcores, tx_mgr, rx_mgr, wakeup_ctx);
+                        RTE_LOG(ERR, APP, "Core %d is already busy, can't use for TX thread %u\n", cur_lcore, i);
+                        onvm_main_free(tx_lcores, rx_lcores, tx_mgr, rx_mgr);
                         return -1;
                 }
         }
@@ -541,6 +629,7 @@ main(int argc, char *argv[]) {
                 rx_mgr[i]->mgr_type_t = MGR;
                 rx_mgr[i]->id = i;
                 rx_mgr[i]->tx_thread_info = NULL;
+                rx_mgr[i]->nic_txq = ONVM_NF_NO_TXQ;
                 rx_mgr[i]->nf_rx_bufs = rte_calloc(NULL, MAX_NFS, sizeof(struct packet_buf), RTE_CACHE_LINE_SIZE);
                 if (rx_mgr[i]->nf_rx_bufs == NULL) {
                         goto onvm_free;
@@ -549,36 +638,20 @@ main(int argc, char *argv[]) {
                 if (rte_eal_remote_launch(rx_thread_main, (void *)rx_mgr[i], cur_lcore) == -EBUSY) {
                         RTE_LOG(ERR, APP, "Core %d is already busy, can't use for RX queue id %d\n", cur_lcore,
                                 rx_mgr[i]->id);
-                        onvm_main_free(tx_lcores, rx_lcores, tx_mgr, rx_mgr, wakeup_ctx);
+                        onvm_main_free(tx_lcores, rx_lcores, tx_mgr, rx_mgr);
                         return -1;
                 }
         }
 
-        if (ONVM_NF_SHARE_CORES) {
-                nfs_per_wakeup_thread = ceil((unsigned)MAX_NFS / wakeup_lcores);
-                for (i = 0; i < ONVM_NUM_WAKEUP_THREADS; i++) {
-                        wakeup_ctx[i] = rte_calloc(NULL, 1, sizeof(struct wakeup_thread_context), RTE_CACHE_LINE_SIZE);
-                        if (wakeup_ctx[i] == NULL) {
-                                goto onvm_free;
-                        }
-                        wakeup_ctx[i]->first_nf = RTE_MIN(i * nfs_per_wakeup_thread + 1, (unsigned)MAX_NFS);
-                        wakeup_ctx[i]->last_nf = RTE_MIN((i + 1) * nfs_per_wakeup_thread + 1, (unsigned)MAX_NFS);
-                        cur_lcore = rte_get_next_lcore(cur_lcore, 1, 1);
-                        if (rte_eal_remote_launch(wakeup_thread_main, (void *)wakeup_ctx[i], cur_lcore) == -EBUSY) {
-                                RTE_LOG(ERR, APP, "Core %d is already busy, can't use for nf %d wakeup thread\n",
-                                        cur_lcore, wakeup_ctx[i]->first_nf);
-                                onvm_main_free(tx_lcores, rx_lcores, tx_mgr, rx_mgr, wakeup_ctx);
-                                return -1;
-                        }
-                }
-        }
         /* Master thread handles statistics and NF management */
+        tx_threads = tx_mgr;
+        num_tx_threads = tx_lcores;
         master_thread_main();
-        onvm_main_free(tx_lcores, rx_lcores, tx_mgr, rx_mgr, wakeup_ctx);
+        onvm_main_free(tx_lcores, rx_lcores, tx_mgr, rx_mgr);
         return 0;
 
 onvm_free:
         RTE_LOG(ERR, APP, "Can't allocate required struct.\n");
-        onvm_main_free(tx_lcores, rx_lcores, tx_mgr, rx_mgr, wakeup_ctx);
+        onvm_main_free(tx_lcores, rx_lcores, tx_mgr, rx_mgr);
         return -1;
 }
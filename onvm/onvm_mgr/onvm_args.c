@@ -79,6 +79,22 @@ uint8_t global_verbosity_level = 1;
 /* global flag for enabling shared core logic - extern in init.h */
 uint8_t ONVM_NF_SHARE_CORES = 0;
 
+/* global flag for NFs taking turns on shared cores and their base quota - extern in init.h */
+uint8_t ONVM_NF_COOP_SCHED = 0;
+uint16_t global_sched_quota = ONVM_SCHED_DEFAULT_QUOTA;
+
+/* global var for the NIC RX queues per port polled directly by the first service, 0 if off - extern in init.h */
+uint16_t global_direct_rx_queues = 0;
+
+/* global var for the service graph config file, NULL to use the default chain - extern in init.h */
+const char *service_graph_file = NULL;
+
+/* global var for the autoscale config file, NULL to use the default limits - extern in init.h */
+const char *autoscale_file = NULL;
+
+/* global var for the classifier rules file, NULL to send every flow to the default chain - extern in init.h */
+const char *classifier_file = NULL;
+
 /* global var for program name */
 static const char *progname;
 
@@ -114,6 +130,12 @@ parse_stats_sleep_time(const char *sleeptime);
 static int
 parse_verbosity_level(const char *verbosity_level);
 
+static int
+parse_sched_quota(const char *sched_quota);
+
+static int
+parse_direct_rx_queues(const char *direct_rx_queues);
+
 /*********************************Interfaces**********************************/
 
 int
@@ -126,11 +148,14 @@ parse_app_args(uint8_t max_ports, int argc, char *argv[]) {
             {"nf-cores", required_argument, NULL, 'n'},  {"default-service", required_argument, NULL, 'd'},
             {"stats-out", no_argument, NULL, 's'},       {"stats-sleep-time", no_argument, NULL, 'z'},
             {"time_to_live", no_argument, NULL, 't'},    {"packet_limit", no_argument, NULL, 'l'},
-            {"verbocity-level", no_argument, NULL, 'v'}, {"enable_shared_cpu", no_argument, NULL, 'c'}};
+            {"verbocity-level", no_argument, NULL, 'v'}, {"enable_shared_cpu", no_argument, NULL, 'c'},
+            {"service-graph", required_argument, NULL, 'g'}, {"sched-quota", required_argument, NULL, 'q'},
+            {"direct-rx", required_argument, NULL, 'x'}, {"autoscale", required_argument, NULL, 'e'},
+            {"classifier", required_argument, NULL, 'f'}};
 
         progname = argv[0];
 
-        while ((opt = getopt_long(argc, argvopt, "p:r:n:d:s:t:l:z:v:c", lgopts, &option_index)) != EOF) {
+        while ((opt = getopt_long(argc, argvopt, "p:r:n:d:s:t:l:z:v:cg:q:x:e:f:", lgopts, &option_index)) != EOF) {
                 switch (opt) {
                         case 'p':
                                 if (parse_portmask(max_ports, optarg) != 0) {
@@ -192,6 +217,29 @@ parse_app_args(uint8_t max_ports, int argc, char *argv[]) {
                                 onvm_config->flags.ONVM_NF_SHARE_CORES = 1;
                                 ONVM_NF_SHARE_CORES = 1;
                                 break;
+                        case 'g':
+                                service_graph_file = optarg;
+                                break;
+                        case 'e':
+                                autoscale_file = optarg;
+                                break;
+                        case 'f':
+                                classifier_file = optarg;
+                                break;
+                        case 'q':
+                                if (parse_sched_quota(optarg) != 0) {
+                                        usage();
+                                        return -1;
+                                }
+                                onvm_config->flags.ONVM_NF_COOP_SCHED = 1;
+                                ONVM_NF_COOP_SCHED = 1;
+                                break;
+                        case 'x':
+                                if (parse_direct_rx_queues(optarg) != 0) {
+                                        usage();
+                                        return -1;
+                                }
+                                break;
                         default:
                                 printf("ERROR: Unknown option '%c'\n", opt);
                                 usage();
@@ -199,6 +247,25 @@ parse_app_args(uint8_t max_ports, int argc, char *argv[]) {
                 }
         }
 
+        if (ONVM_NF_COOP_SCHED && !ONVM_NF_SHARE_CORES) {
+                printf("ERROR: Cooperative scheduling (-q) needs shared core mode (-c)\n");
+                usage();
+                return -1;
+        }
+
+        if (global_direct_rx_queues && service_graph_file != NULL) {
+                printf("ERROR: Direct RX (-x) needs the default chain, it can't be used with a service graph (-g)\n");
+                usage();
+                return -1;
+        }
+
+        if (classifier_file != NULL && (service_graph_file != NULL || global_direct_rx_queues)) {
+                printf("ERROR: The classifier (-f) picks chains in the manager RX threads, it can't be used with a "
+                       "service graph (-g) or direct RX (-x)\n");
+                usage();
+                return -1;
+        }
+
         return 0;
 }
 
@@ -216,7 +283,13 @@ usage(void) {
             "\t-t TTL: time to live, how many seconds to wait until exiting (optional)\n"
             "\t-l PACKET_LIMIT: how many millions of packets to recieve before exiting (optional)\n"
             "\t-v VERBOCITY_LEVEL: verbocity level of the stats output (optional)\n"
-            "\t-c ENABLE_SHARED_CORE: allow the NFs to share a core based on mutex sleep/wakeups (optional)\n",
+            "\t-c ENABLE_SHARED_CORE: allow the NFs to share a core based on mutex sleep/wakeups (optional)\n"
+            "\t-g GRAPH_FILE: JSON service graph the manager steers packets through, replaces -d (optional)\n"
+            "\t-q SCHED_QUOTA: NFs sharing a core take turns of about SCHED_QUOTA packets, needs -c (optional)\n"
+            "\t-x DIRECT_RX_QUEUES: NIC RX queues per port the first service's NFs poll themselves (optional)\n"
+            "\t-e AUTOSCALE_FILE: JSON policies and limits the manager scales each service within (optional)\n"
+            "\t-f CLASSIFIER_FILE: JSON wildcard rules picking the service chain of each flow, reloaded on change "
+            "(optional)\n",
             progname);
 }
 
@@ -352,6 +425,32 @@ parse_stats_sleep_time(const char *sleeptime) {
         return 0;
 }
 
+static int
+parse_sched_quota(const char *sched_quota) {
+        char *end = NULL;
+        unsigned long temp;
+
+        temp = strtoul(sched_quota, &end, 10);
+        if (end == NULL || *end != '\0' || temp < PACKET_READ_SIZE || temp > UINT16_MAX / ONVM_SCHED_MAX_QUOTA_SCALE)
+                return -1;
+
+        global_sched_quota = (uint16_t)temp;
+        return 0;
+}
+
+static int
+parse_direct_rx_queues(const char *direct_rx_queues) {
+        char *end = NULL;
+        unsigned long temp;
+
+        temp = strtoul(direct_rx_queues, &end, 10);
+        if (end == NULL || *end != '\0' || temp == 0 || temp > ONVM_MAX_NF_RX_QUEUES)
+                return -1;
+
+        global_direct_rx_queues = (uint16_t)temp;
+        return 0;
+}
+
 static int
 parse_stats_output(const char *stats_output) {
         if (!strcmp(stats_output, ONVM_STR_STATS_STDOUT)) {
@@ -0,0 +1,664 @@
+/*********************************************************************
+ *                     openNetVM
+ *              https://sdnfv.github.io
+ *
+ *   BSD LICENSE
+ *
+ *   Copyright(c)
+ *            2015-2019 George Washington University
+ *            2015-2019 University of California Riverside
+ *            2010-2019 Intel Corporation. All rights reserved.
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * The name of the author may not be used to endorse or promote
+ *       products derived from this software without specific prior
+ *       written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ********************************************************************/
+
+/******************************************************************************
+
+                              onvm_classifier.c
+
+     This file contains the classifier. Its wildcard rules match the port
+     and VLAN a packet came from, its ether type, IPv4 prefixes, protocol
+     and port ranges, and give the flows without a flow director entry of
+     their own a service chain. The RX threads classify a whole burst at
+     once with rte_acl. The master thread reloads the rules when their file
+     changes, swapping in the new set at once and freeing the old one a
+     grace period later.
+
+******************************************************************************/
+
+#include <arpa/inet.h>
+#include <sys/stat.h>
+
+#include "onvm_classifier.h"
+#include "onvm_mgr.h"
+
+/* Fields the rules match on, in the order of the key */
+enum {
+        ONVM_CLASSIFIER_FIELD_PROTO,
+        ONVM_CLASSIFIER_FIELD_SRC_IP,
+        ONVM_CLASSIFIER_FIELD_DST_IP,
+        ONVM_CLASSIFIER_FIELD_SRC_PORT,
+        ONVM_CLASSIFIER_FIELD_DST_PORT,
+        ONVM_CLASSIFIER_FIELD_IN_PORT,
+        ONVM_CLASSIFIER_FIELD_VLAN,
+        ONVM_CLASSIFIER_FIELD_ETHER_TYPE,
+        ONVM_CLASSIFIER_NUM_FIELDS
+};
+
+/*
+ * What the rules see of a packet, in network byte order as rte_acl reads
+ * it. Fields are grouped in 4 bytes words, the protocol alone in the first.
+ */
+struct onvm_classifier_key {
+        uint8_t proto;
+        uint8_t pad[3];
+        uint32_t src_ip;
+        uint32_t dst_ip;
+        uint16_t src_port;
+        uint16_t dst_port;
+        uint16_t in_port;
+        uint16_t vlan;  // 0 if untagged
+        uint32_t ether_type;
+};
+
+static const struct rte_acl_field_def classifier_fields[ONVM_CLASSIFIER_NUM_FIELDS] = {
+    {.type = RTE_ACL_FIELD_TYPE_BITMASK,
+     .size = sizeof(uint8_t),
+     .field_index = ONVM_CLASSIFIER_FIELD_PROTO,
+     .input_index = 0,
+     .offset = offsetof(struct onvm_classifier_key, proto)},
+    {.type = RTE_ACL_FIELD_TYPE_MASK,
+     .size = sizeof(uint32_t),
+     .field_index = ONVM_CLASSIFIER_FIELD_SRC_IP,
+     .input_index = 1,
+     .offset = offsetof(struct onvm_classifier_key, src_ip)},
+    {.type = RTE_ACL_FIELD_TYPE_MASK,
+     .size = sizeof(uint32_t),
+     .field_index = ONVM_CLASSIFIER_FIELD_DST_IP,
+     .input_index = 2,
+     .offset = offsetof(struct onvm_classifier_key, dst_ip)},
+    {.type = RTE_ACL_FIELD_TYPE_RANGE,
+     .size = sizeof(uint16_t),
+     .field_index = ONVM_CLASSIFIER_FIELD_SRC_PORT,
+     .input_index = 3,
+     .offset = offsetof(struct onvm_classifier_key, src_port)},
+    {.type = RTE_ACL_FIELD_TYPE_RANGE,
+     .size = sizeof(uint16_t),
+     .field_index = ONVM_CLASSIFIER_FIELD_DST_PORT,
+     .input_index = 3,
+     .offset = offsetof(struct onvm_classifier_key, dst_port)},
+    {.type = RTE_ACL_FIELD_TYPE_RANGE,
+     .size = sizeof(uint16_t),
+     .field_index = ONVM_CLASSIFIER_FIELD_IN_PORT,
+     .input_index = 4,
+     .offset = offsetof(struct onvm_classifier_key, in_port)},
+    {.type = RTE_ACL_FIELD_TYPE_RANGE,
+     .size = sizeof(uint16_t),
+     .field_index = ONVM_CLASSIFIER_FIELD_VLAN,
+     .input_index = 4,
+     .offset = offsetof(struct onvm_classifier_key, vlan)},
+    {.type = RTE_ACL_FIELD_TYPE_BITMASK,
+     .size = sizeof(uint32_t),
+     .field_index = ONVM_CLASSIFIER_FIELD_ETHER_TYPE,
+     .input_index = 5,
+     .offset = offsetof(struct onvm_classifier_key, ether_type)},
+};
+
+RTE_ACL_RULE_DEF(onvm_classifier_rule, ONVM_CLASSIFIER_NUM_FIELDS);
+
+/* A set of rules, replaced as a whole when the file changes */
+struct onvm_classifier {
+        struct rte_acl_ctx *acl;
+        uint32_t num_rules;
+        /* Chain of each rule, the userdata of a rule is its index + 1 */
+        struct onvm_service_chain chains[];
+};
+
+/* Rules in use, read by the RX threads, NULL if there are none */
+static struct onvm_classifier *classifier;
+/* Rules replaced, freed once the grace period started at the swap is over */
+static struct onvm_classifier *classifier_retired;
+static uint64_t classifier_retired_token;
+/* Modification time of the file when it was last loaded */
+static struct timespec classifier_mtime;
+/* Every rule set gets an rte_acl context of its own name */
+static uint32_t classifier_generation;
+
+/************************Internal functions prototypes************************/
+
+/*
+ * Function loading a rule set from a file.
+ *
+ * Input  : the file name
+ *          a pointer to the rule set to fill, NULL if the file holds no rules
+ * Output : 0 on success, -1 on error
+ */
+static int
+onvm_classifier_load_file(const char *filename, struct onvm_classifier **rules);
+
+/*
+ * Function building the rte_acl context of a rule set.
+ *
+ * Input  : the rules and their count
+ * Output : the context, NULL on error
+ */
+static struct rte_acl_ctx *
+onvm_classifier_build(const struct onvm_classifier_rule *acl_rules, uint32_t num_rules);
+
+/*
+ * Function reading a rule and its chain from a JSON object.
+ *
+ * Input  : the JSON object and the index of the rule in the file
+ *          the rule and chain to fill
+ * Output : 0 on success, -1 if the rule is invalid
+ */
+static int
+onvm_classifier_parse_rule(cJSON *config, uint32_t index, struct onvm_classifier_rule *rule,
+                           struct onvm_service_chain *chain);
+
+/*
+ * Function reading a range of a JSON object, either a number or a "low-high"
+ * string. A missing key matches everything up to max.
+ *
+ * Input  : the JSON object, the key and the largest value allowed
+ *          the field of the rule to fill
+ * Output : 0 on success, -1 if the range is invalid
+ */
+static int
+onvm_classifier_parse_range(cJSON *config, const char *key, uint32_t max, struct rte_acl_field *field);
+
+/*
+ * Function reading an IPv4 prefix of a JSON object, "a.b.c.d/len". A
+ * missing key matches every address.
+ *
+ * Input  : the JSON object and the key
+ *          the field of the rule to fill
+ * Output : 0 on success, -1 if the prefix is invalid
+ */
+static int
+onvm_classifier_parse_prefix(cJSON *config, const char *key, struct rte_acl_field *field);
+
+/*
+ * Function reading the chain of a rule, a list of steps with an "action",
+ * "tonf", "out" or "drop", and a "destination".
+ *
+ * Input  : the JSON array
+ *          the chain to fill
+ * Output : 0 on success, -1 if the chain is invalid
+ */
+static int
+onvm_classifier_parse_chain(cJSON *config, struct onvm_service_chain *chain);
+
+/*
+ * Function freeing a rule set.
+ *
+ */
+static void
+onvm_classifier_free(struct onvm_classifier *rules);
+
+/*
+ * Function filling the key of a packet from its headers.
+ *
+ */
+static inline void
+onvm_classifier_fill_key(struct onvm_classifier_key *key, struct rte_mbuf *pkt);
+
+/*********************************Interfaces**********************************/
+
+void
+onvm_classifier_init(void) {
+        struct stat st;
+
+        if (classifier_file == NULL)
+                return;
+
+        if (stat(classifier_file, &st) < 0 || onvm_classifier_load_file(classifier_file, &classifier) < 0)
+                rte_exit(EXIT_FAILURE, "Invalid classifier file %s\n", classifier_file);
+        classifier_mtime = st.st_mtim;
+}
+
+void
+onvm_classifier_tick(void) {
+        struct onvm_classifier *rules;
+        struct stat st;
+
+        if (classifier_file == NULL)
+                return;
+
+        if (classifier_retired != NULL) {
+                /* The old rules go once no RX thread can still hold a chain of theirs */
+                if (!onvm_flow_dir_grace_done(classifier_retired_token))
+                        return;
+                onvm_classifier_free(classifier_retired);
+                classifier_retired = NULL;
+        }
+
+        if (stat(classifier_file, &st) < 0)
+                return;
+        if (st.st_mtim.tv_sec == classifier_mtime.tv_sec && st.st_mtim.tv_nsec == classifier_mtime.tv_nsec)
+                return;
+        classifier_mtime = st.st_mtim;
+
+        if (onvm_classifier_load_file(classifier_file, &rules) < 0) {
+                RTE_LOG(WARNING, APP, "Invalid classifier file %s, keeping the rules in use\n", classifier_file);
+                return;
+        }
+
+        classifier_retired = classifier;
+        __atomic_store_n(&classifier, rules, __ATOMIC_RELEASE);
+        if (classifier_retired != NULL)
+                classifier_retired_token = onvm_flow_dir_grace_start();
+}
+
+uint16_t
+onvm_classifier_classify_bulk(struct rte_mbuf *pkts[], uint16_t nb_pkts, struct onvm_service_chain *chains[]) {
+        struct onvm_classifier_key keys[PACKET_READ_SIZE];
+        const uint8_t *data[PACKET_READ_SIZE];
+        uint32_t results[PACKET_READ_SIZE];
+        struct onvm_classifier *rules;
+        uint16_t i, matched = 0;
+
+        rules = __atomic_load_n(&classifier, __ATOMIC_ACQUIRE);
+        if (rules == NULL || nb_pkts == 0 || nb_pkts > PACKET_READ_SIZE)
+                return 0;
+
+        for (i = 0; i < nb_pkts; i++) {
+                onvm_classifier_fill_key(&keys[i], pkts[i]);
+                data[i] = (const uint8_t *)&keys[i];
+        }
+
+        if (rte_acl_classify(rules->acl, data, results, nb_pkts, 1) != 0)
+                return 0;
+
+        for (i = 0; i < nb_pkts; i++) {
+                if (results[i] == 0) {
+                        chains[i] = NULL;
+                        continue;
+                }
+                chains[i] = &rules->chains[results[i] - 1];
+                matched++;
+        }
+
+        return matched;
+}
+
+/*****************************Internal functions******************************/
+
+static int
+onvm_classifier_load_file(const char *filename, struct onvm_classifier **rules) {
+        struct onvm_classifier_rule *acl_rules = NULL;
+        struct onvm_classifier *new_rules = NULL;
+        cJSON *config, *classifier_config, *rules_arr;
+        uint32_t i, num_rules;
+        int ret = -1;
+
+        config = onvm_config_parse_file(filename);
+        if (config == NULL)
+                return -1;
+
+        classifier_config = cJSON_GetObjectItem(config, "classifier");
+        if (classifier_config == NULL) {
+                printf("Unable to find the classifier config\n");
+                goto out;
+        }
+
+        rules_arr = cJSON_GetObjectItem(classifier_config, "rules");
+        num_rules = (rules_arr == NULL) ? 0 : cJSON_GetArraySize(rules_arr);
+        if (num_rules > ONVM_CLASSIFIER_MAX_RULES) {
+                printf("The classifier holds at most %d rules\n", ONVM_CLASSIFIER_MAX_RULES);
+                goto out;
+        }
+        if (num_rules == 0) {
+                /* Every flow goes to the default chain again */
+                *rules = NULL;
+                printf("Classifier: no rules in %s\n", filename);
+                ret = 0;
+                goto out;
+        }
+
+        acl_rules = rte_zmalloc("onvm_classifier_rules", sizeof(*acl_rules) * num_rules, 0);
+        new_rules = rte_zmalloc("onvm_classifier", sizeof(*new_rules) + sizeof(new_rules->chains[0]) * num_rules,
+                                RTE_CACHE_LINE_SIZE);
+        if (acl_rules == NULL || new_rules == NULL) {
+                printf("Cannot allocate memory for %u classifier rules\n", num_rules);
+                goto out;
+        }
+
+        for (i = 0; i < num_rules; i++) {
+                if (onvm_classifier_parse_rule(cJSON_GetArrayItem(rules_arr, i), i, &acl_rules[i],
+                                               &new_rules->chains[i]) < 0) {
+                        printf("Invalid classifier rule %u\n", i);
+                        goto out;
+                }
+        }
+
+        new_rules->acl = onvm_classifier_build(acl_rules, num_rules);
+        if (new_rules->acl == NULL)
+                goto out;
+        new_rules->num_rules = num_rules;
+
+        *rules = new_rules;
+        new_rules = NULL;
+        printf("Classifier: %u rules loaded from %s\n", num_rules, filename);
+        ret = 0;
+out:
+        onvm_classifier_free(new_rules);
+        rte_free(acl_rules);
+        cJSON_Delete(config);
+        return ret;
+}
+
+static struct rte_acl_ctx *
+onvm_classifier_build(const struct onvm_classifier_rule *acl_rules, uint32_t num_rules) {
+        char name[RTE_ACL_NAMESIZE];
+        struct rte_acl_config cfg;
+        struct rte_acl_ctx *acl;
+        struct rte_acl_param param = {
+            .name = name,
+            .socket_id = rte_socket_id(),
+            .rule_size = RTE_ACL_RULE_SZ(ONVM_CLASSIFIER_NUM_FIELDS),
+            .max_rule_num = num_rules,
+        };
+        int ret;
+
+        /* rte_acl hands back the existing context of a name in use */
+        snprintf(name, sizeof(name), "onvm_classifier_%u", classifier_generation++);
+        acl = rte_acl_create(&param);
+        if (acl == NULL) {
+                printf("Cannot create the classifier context\n");
+                return NULL;
+        }
+
+        ret = rte_acl_add_rules(acl, (const struct rte_acl_rule *)acl_rules, num_rules);
+        if (ret != 0) {
+                printf("Cannot add the classifier rules: %s\n", rte_strerror(-ret));
+                rte_acl_free(acl);
+                return NULL;
+        }
+
+        memset(&cfg, 0, sizeof(cfg));
+        cfg.num_categories = 1;
+        cfg.num_fields = ONVM_CLASSIFIER_NUM_FIELDS;
+        memcpy(cfg.defs, classifier_fields, sizeof(classifier_fields));
+        ret = rte_acl_build(acl, &cfg);
+        if (ret != 0) {
+                printf("Cannot build the classifier rules: %s\n", rte_strerror(-ret));
+                rte_acl_free(acl);
+                return NULL;
+        }
+
+        return acl;
+}
+
+static int
+onvm_classifier_parse_rule(cJSON *config, uint32_t index, struct onvm_classifier_rule *rule,
+                           struct onvm_service_chain *chain) {
+        struct rte_acl_field *field;
+        cJSON *item;
+        int priority = 0;
+        unsigned long value;
+        char *end;
+
+        item = cJSON_GetObjectItem(config, "priority");
+        if (item != NULL) {
+                if (!cJSON_IsNumber(item) || item->valueint < 0 || item->valueint > ONVM_CLASSIFIER_MAX_PRIORITY) {
+                        printf("Classifier priority must be between 0 and %d\n", ONVM_CLASSIFIER_MAX_PRIORITY);
+                        return -1;
+                }
+                priority = item->valueint;
+        }
+        /* Higher priorities win, then the rule listed first */
+        rule->data.priority = priority * ONVM_CLASSIFIER_MAX_RULES + ONVM_CLASSIFIER_MAX_RULES - index;
+        rule->data.category_mask = 1;
+        rule->data.userdata = index + 1;
+
+        field = &rule->field[ONVM_CLASSIFIER_FIELD_PROTO];
+        item = cJSON_GetObjectItem(config, "proto");
+        if (item == NULL) {
+                field->value.u8 = 0;
+                field->mask_range.u8 = 0;
+        } else if (cJSON_IsNumber(item) && item->valueint >= 0 && item->valueint <= UINT8_MAX) {
+                field->value.u8 = item->valueint;
+                field->mask_range.u8 = UINT8_MAX;
+        } else if (cJSON_IsString(item) && strcmp(item->valuestring, "tcp") == 0) {
+                field->value.u8 = IP_PROTOCOL_TCP;
+                field->mask_range.u8 = UINT8_MAX;
+        } else if (cJSON_IsString(item) && strcmp(item->valuestring, "udp") == 0) {
+                field->value.u8 = IP_PROTOCOL_UDP;
+                field->mask_range.u8 = UINT8_MAX;
+        } else {
+                printf("Classifier proto must be tcp, udp or a protocol number\n");
+                return -1;
+        }
+
+        field = &rule->field[ONVM_CLASSIFIER_FIELD_ETHER_TYPE];
+        item = cJSON_GetObjectItem(config, "ether_type");
+        value = 0;
+        if (cJSON_IsNumber(item)) {
+                value = item->valueint;
+        } else if (cJSON_IsString(item)) {
+                value = strtoul(item->valuestring, &end, 0);
+                if (*end != '\0')
+                        value = UINT32_MAX;
+        } else if (item != NULL) {
+                value = UINT32_MAX;
+        }
+        if (value > UINT16_MAX) {
+                printf("Classifier ether_type must be a 16 bits value such as \"0x0800\"\n");
+                return -1;
+        }
+        field->value.u32 = value;
+        field->mask_range.u32 = (item == NULL) ? 0 : UINT16_MAX;
+
+        field = rule->field;
+        if (onvm_classifier_parse_prefix(config, "src", &field[ONVM_CLASSIFIER_FIELD_SRC_IP]) < 0)
+                return -1;
+        if (onvm_classifier_parse_prefix(config, "dst", &field[ONVM_CLASSIFIER_FIELD_DST_IP]) < 0)
+                return -1;
+        if (onvm_classifier_parse_range(config, "src_port", UINT16_MAX, &field[ONVM_CLASSIFIER_FIELD_SRC_PORT]) < 0)
+                return -1;
+        if (onvm_classifier_parse_range(config, "dst_port", UINT16_MAX, &field[ONVM_CLASSIFIER_FIELD_DST_PORT]) < 0)
+                return -1;
+        if (onvm_classifier_parse_range(config, "in_port", RTE_MAX_ETHPORTS - 1,
+                                        &field[ONVM_CLASSIFIER_FIELD_IN_PORT]) < 0)
+                return -1;
+        if (onvm_classifier_parse_range(config, "vlan", RTE_ETHER_MAX_VLAN_ID, &field[ONVM_CLASSIFIER_FIELD_VLAN]) < 0)
+                return -1;
+
+        return onvm_classifier_parse_chain(cJSON_GetObjectItem(config, "chain"), chain);
+}
+
+static int
+onvm_classifier_parse_range(cJSON *config, const char *key, uint32_t max, struct rte_acl_field *field) {
+        cJSON *item = cJSON_GetObjectItem(config, key);
+        unsigned long low, high;
+        char *end;
+
+        if (item == NULL) {
+                low = 0;
+                high = max;
+        } else if (cJSON_IsNumber(item) && item->valueint >= 0) {
+                low = high = item->valueint;
+        } else if (cJSON_IsString(item)) {
+                low = strtoul(item->valuestring, &end, 10);
+                high = (*end == '-') ? strtoul(end + 1, &end, 10) : low;
+                if (*end != '\0')
+                        high = max + 1;
+        } else {
+                low = 0;
+                high = max + 1;
+        }
+
+        if (low > high || high > max) {
+                printf("Classifier %s must be a value or a \"low-high\" range up to %u\n", key, max);
+                return -1;
+        }
+        field->value.u16 = low;
+        field->mask_range.u16 = high;
+        return 0;
+}
+
+static int
+onvm_classifier_parse_prefix(cJSON *config, const char *key, struct rte_acl_field *field) {
+        cJSON *item = cJSON_GetObjectItem(config, key);
+        char addr[INET_ADDRSTRLEN];
+        struct in_addr in;
+        unsigned long depth = 32;
+        char *slash, *end;
+        size_t len;
+
+        field->value.u32 = 0;
+        field->mask_range.u32 = 0;
+        if (item == NULL)
+                return 0;
+
+        if (!cJSON_IsString(item))
+                goto invalid;
+        len = strlen(item->valuestring);
+        slash = strchr(item->valuestring, '/');
+        if (slash != NULL) {
+                depth = strtoul(slash + 1, &end, 10);
+                if (*end != '\0' || end == slash + 1 || depth > 32)
+                        goto invalid;
+                len = slash - item->valuestring;
+        }
+        if (len >= sizeof(addr))
+                goto invalid;
+        snprintf(addr, sizeof(addr), "%.*s", (int)len, item->valuestring);
+        if (inet_pton(AF_INET, addr, &in) != 1)
+                goto invalid;
+
+        /* Rules are in host byte order */
+        field->value.u32 = rte_be_to_cpu_32(in.s_addr);
+        field->mask_range.u32 = depth;
+        return 0;
+
+invalid:
+        printf("Classifier %s must be an IPv4 prefix such as \"10.0.0.0/8\"\n", key);
+        return -1;
+}
+
+static int
+onvm_classifier_parse_chain(cJSON *config, struct onvm_service_chain *chain) {
+        cJSON *step, *item;
+        const char *name;
+        uint8_t action;
+        int i, num_steps, destination;
+
+        num_steps = (config == NULL) ? 0 : cJSON_GetArraySize(config);
+        /* The first entry of a chain is reserved */
+        if (num_steps == 0 || num_steps >= ONVM_MAX_CHAIN_LENGTH) {
+                printf("Classifier chains need between 1 and %d steps\n", ONVM_MAX_CHAIN_LENGTH - 1);
+                return -1;
+        }
+
+        for (i = 0; i < num_steps; i++) {
+                step = cJSON_GetArrayItem(config, i);
+                item = cJSON_GetObjectItem(step, "action");
+                if (item == NULL || !cJSON_IsString(item)) {
+                        printf("Classifier chain steps need an action\n");
+                        return -1;
+                }
+                name = item->valuestring;
+                if (strcmp(name, "tonf") == 0) {
+                        action = ONVM_NF_ACTION_TONF;
+                } else if (strcmp(name, "out") == 0) {
+                        action = ONVM_NF_ACTION_OUT;
+                } else if (strcmp(name, "drop") == 0) {
+                        action = ONVM_NF_ACTION_DROP;
+                } else {
+                        printf("Unknown classifier action %s\n", name);
+                        return -1;
+                }
+
+                item = cJSON_GetObjectItem(step, "destination");
+                destination = (item == NULL || !cJSON_IsNumber(item)) ? -1 : item->valueint;
+                if (action == ONVM_NF_ACTION_DROP) {
+                        destination = 0;
+                } else if (destination < 0 || (action == ONVM_NF_ACTION_TONF && destination >= MAX_SERVICES) ||
+                           (action == ONVM_NF_ACTION_OUT && destination >= RTE_MIN(RTE_MAX_ETHPORTS, UINT8_MAX))) {
+                        printf("Invalid destination for classifier action %s\n", name);
+                        return -1;
+                }
+                onvm_sc_append_entry(chain, action, destination);
+        }
+
+        return 0;
+}
+
+static void
+onvm_classifier_free(struct onvm_classifier *rules) {
+        if (rules == NULL)
+                return;
+        rte_acl_free(rules->acl);
+        rte_free(rules);
+}
+
+static inline void
+onvm_classifier_fill_key(struct onvm_classifier_key *key, struct rte_mbuf *pkt) {
+        const struct rte_ether_hdr *eth;
+        const struct rte_vlan_hdr *vlan;
+        const struct rte_ipv4_hdr *ipv4;
+        const uint16_t *l4_ports;
+        uint16_t ether_type, offset;
+
+        memset(key, 0, sizeof(*key));
+        key->in_port = rte_cpu_to_be_16(pkt->port);
+
+        eth = rte_pktmbuf_mtod(pkt, const struct rte_ether_hdr *);
+        ether_type = eth->ether_type;
+        offset = sizeof(*eth);
+        if (pkt->ol_flags & PKT_RX_VLAN_STRIPPED) {
+                key->vlan = rte_cpu_to_be_16(pkt->vlan_tci & RTE_ETHER_MAX_VLAN_ID);
+        } else if (ether_type == rte_cpu_to_be_16(RTE_ETHER_TYPE_VLAN) && pkt->data_len >= offset + sizeof(*vlan)) {
+                vlan = rte_pktmbuf_mtod_offset(pkt, const struct rte_vlan_hdr *, offset);
+                key->vlan = vlan->vlan_tci & rte_cpu_to_be_16(RTE_ETHER_MAX_VLAN_ID);
+                ether_type = vlan->eth_proto;
+                offset += sizeof(*vlan);
+        }
+        key->ether_type = rte_cpu_to_be_32(rte_be_to_cpu_16(ether_type));
+
+        if (ether_type != rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4) || pkt->data_len < offset + sizeof(*ipv4))
+                return;
+        ipv4 = rte_pktmbuf_mtod_offset(pkt, const struct rte_ipv4_hdr *, offset);
+        key->proto = ipv4->next_proto_id;
+        key->src_ip = ipv4->src_addr;
+        key->dst_ip = ipv4->dst_addr;
+
+        /* Only the first fragment carries the ports */
+        if ((key->proto != IP_PROTOCOL_TCP && key->proto != IP_PROTOCOL_UDP) ||
+            (ipv4->fragment_offset & rte_cpu_to_be_16(RTE_IPV4_HDR_OFFSET_MASK)) != 0)
+                return;
+        offset += (ipv4->version_ihl & RTE_IPV4_HDR_IHL_MASK) * RTE_IPV4_IHL_MULTIPLIER;
+        if (pkt->data_len < offset + 2 * sizeof(uint16_t))
+                return;
+        l4_ports = rte_pktmbuf_mtod_offset(pkt, const uint16_t *, offset);
+        key->src_port = l4_ports[0];
+        key->dst_port = l4_ports[1];
+}
@@ -0,0 +1,96 @@
+/*********************************************************************
+ *                     openNetVM
+ *              https://sdnfv.github.io
+ *
+ *   BSD LICENSE
+ *
+ *   Copyright(c)
+ *            2015-2019 George Washington University
+ *            2015-2019 University of California Riverside
+ *            2010-2019 Intel Corporation. All rights reserved.
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * The name of the author may not be used to endorse or promote
+ *       products derived from this software without specific prior
+ *       written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ********************************************************************/
+
+/******************************************************************************
+
+                              onvm_classifier.h
+
+     This file contains the prototypes of the classifier, which picks the
+     service chain of the packets the manager receives from wildcard rules
+     on their ports, VLAN and headers.
+
+******************************************************************************/
+
+#ifndef _ONVM_CLASSIFIER_H_
+#define _ONVM_CLASSIFIER_H_
+
+#include <rte_acl.h>
+
+#include "onvm_common.h"
+
+/* Rules a classifier file can hold */
+#define ONVM_CLASSIFIER_MAX_RULES 1024
+
+/* Highest priority a rule can be given, rules of the same priority match in file order */
+#define ONVM_CLASSIFIER_MAX_PRIORITY (RTE_ACL_MAX_PRIORITY / ONVM_CLASSIFIER_MAX_RULES - 1)
+
+/********************************Interfaces***********************************/
+
+/*
+ * Interface loading the rules of classifier_file when one was given.
+ *
+ */
+void
+onvm_classifier_init(void);
+
+/*
+ * Interface reloading the rules when classifier_file changed, and freeing
+ * the rules it replaced once no RX thread can use them anymore. A file that
+ * fails to load leaves the rules in use untouched. Called by the master
+ * thread every tick.
+ *
+ */
+void
+onvm_classifier_tick(void);
+
+/*
+ * Interface picking the service chain of a burst of packets. Packets no rule
+ * matches get NULL, the array is left untouched when no rules are loaded.
+ * The chains stay valid until the calling RX thread reports a quiescent
+ * state to the flow director.
+ *
+ * Input  : the packets and their count, at most PACKET_READ_SIZE
+ *          the array to fill with their chain
+ * Output : the number of packets a rule matched
+ */
+uint16_t
+onvm_classifier_classify_bulk(struct rte_mbuf *pkts[], uint16_t nb_pkts, struct onvm_service_chain *chains[]);
+
+#endif  // _ONVM_CLASSIFIER_H_
@@ -55,7 +55,6 @@ struct onvm_nf *nfs = NULL;
 struct port_info *ports = NULL;
 struct core_status *cores = NULL;
 struct onvm_configuration *onvm_config = NULL;
-struct nf_wakeup_info *nf_wakeup_infos = NULL;
 
 struct rte_mempool *pktmbuf_clone_pool;
 struct rte_mempool *pktmbuf_pool;
@@ -64,18 +63,15 @@ struct rte_mempool *nf_msg_pool;
 struct rte_ring *incoming_msg_queue;
 uint16_t **services;
 uint16_t *nf_per_service_count;
+struct onvm_service_lb *service_lb;
+struct onvm_nf_rx_stats *nf_rx_stats;
+struct onvm_service_bp *service_bp;
 struct onvm_service_chain *default_chain;
 struct onvm_service_chain **default_sc_p;
+struct onvm_service_graph *service_graph;
 
-// sem_t *mutex;
 /*************************Internal Functions Prototypes***********************/
 
-static void
-init_set_action_mutex(void);
-
-static void
-init_pkt_mutex(void);
-
 static void
 set_default_config(struct onvm_configuration *config);
 
@@ -91,12 +87,12 @@ init_nf_msg_pool(void);
 static int
 init_port(uint8_t port_num);
 
-static void
-init_shared_sem(void);
-
 static int
 init_info_queue(void);
 
+static void
+init_service_graph(void);
+
 static void
 check_all_ports_link_status(uint8_t port_num, uint32_t port_mask);
 
@@ -152,8 +148,12 @@ init(int argc, char *argv[]) {
         const struct rte_memzone *mz_scp;
         const struct rte_memzone *mz_services;
         const struct rte_memzone *mz_nf_per_service;
+        const struct rte_memzone *mz_service_lb;
+        const struct rte_memzone *mz_nf_rx_stats;
+        const struct rte_memzone *mz_service_bp;
         const struct rte_memzone *mz_onvm_config;
         uint8_t i, total_ports, port_id;
+        int core;
 
         /* init EAL, parsing EAL args */
         retval = rte_eal_init(argc, argv);
@@ -168,10 +168,6 @@ init(int argc, char *argv[]) {
         /* get total number of ports */
         total_ports = rte_eth_dev_count_avail();
 
-        /* initial shared mutex */
-        init_set_action_mutex();
-        init_pkt_mutex();
-
         /* set up array for NF tx data */
         mz_nf = rte_memzone_reserve(MZ_NF_INFO, sizeof(*nfs) * MAX_NFS, rte_socket_id(), NO_FLAGS);
         if (mz_nf == NULL)
@@ -190,8 +186,14 @@ init(int argc, char *argv[]) {
                                        rte_socket_id(), NO_FLAGS);
         if (mz_cores == NULL)
                 rte_exit(EXIT_FAILURE, "Cannot reserve memory zone for core information\n");
-        memset(mz_cores->addr, 0, sizeof(*cores) * 64);
+        memset(mz_cores->addr, 0, sizeof(*cores) * onvm_threading_get_num_cores());
         cores = mz_cores->addr;
+        for (core = 0; core < onvm_threading_get_num_cores(); core++) {
+                cores[core].sched_deadline = rte_get_tsc_hz() * ONVM_SCHED_DEADLINE_US / US_PER_S;
+                if (core < RTE_MAX_LCORE)
+                        cores[core].socket_id = rte_lcore_to_socket_id(core);
+        }
+        onvm_threading_read_topology(cores);
 
         /* set up array for NF tx data */
         mz_services =
@@ -209,8 +211,37 @@ init(int argc, char *argv[]) {
         }
         nf_per_service_count = mz_nf_per_service->addr;
 
+        /* set up the consistent hash tables of the services */
+        mz_service_lb = rte_memzone_reserve(MZ_SERVICE_LB_INFO, sizeof(struct onvm_service_lb) * num_services,
+                                            rte_socket_id(), NO_FLAGS);
+        if (mz_service_lb == NULL) {
+                rte_exit(EXIT_FAILURE, "Cannot reserve memory zone for service instance tables.\n");
+        }
+        memset(mz_service_lb->addr, 0, sizeof(struct onvm_service_lb) * num_services);
+        service_lb = mz_service_lb->addr;
+
+        /* set up the rows of NF rx counters, one per writing thread */
+        mz_nf_rx_stats =
+            rte_memzone_reserve_aligned(MZ_NF_RX_STATS, sizeof(struct onvm_nf_rx_stats) * ONVM_MAX_THREAD_IDS,
+                                        rte_socket_id(), NO_FLAGS, RTE_CACHE_LINE_SIZE);
+        if (mz_nf_rx_stats == NULL) {
+                rte_exit(EXIT_FAILURE, "Cannot reserve memory zone for NF rx stats.\n");
+        }
+        memset(mz_nf_rx_stats->addr, 0, sizeof(struct onvm_nf_rx_stats) * ONVM_MAX_THREAD_IDS);
+        nf_rx_stats = mz_nf_rx_stats->addr;
+
+        /* set up the backpressure state of the services, nothing is overloaded yet */
+        mz_service_bp = rte_memzone_reserve(MZ_SERVICE_BP_INFO, sizeof(*service_bp), rte_socket_id(), NO_FLAGS);
+        if (mz_service_bp == NULL) {
+                rte_exit(EXIT_FAILURE, "Cannot reserve memory zone for service backpressure info.\n");
+        }
+        service_bp = mz_service_bp->addr;
+        service_bp->num_overloaded = 0;
+        for (i = 0; i < MAX_SERVICES; i++)
+                service_bp->admit[i] = ONVM_BP_ADMIT_ALL;
+
         /* set up custom flags */
-        mz_onvm_config = rte_memzone_reserve(MZ_ONVM_CONFIG, sizeof(uint16_t), rte_socket_id(), NO_FLAGS);
+        mz_onvm_config = rte_memzone_reserve(MZ_ONVM_CONFIG, sizeof(*onvm_config), rte_socket_id(), NO_FLAGS);
         if (mz_onvm_config == NULL) {
                 rte_exit(EXIT_FAILURE, "Cannot reserve memory zone for ONVM custom flags.\n");
         }
@@ -239,7 +270,11 @@ init(int argc, char *argv[]) {
                 rte_exit(EXIT_FAILURE, "Cannot create nf message pool: %s\n", rte_strerror(rte_errno));
         }
 
-        /* now initialise the ports we will use */
+        /* now initialise the ports we will use, init_port lowers num_nf_txqs to what every port supports */
+        ports->nf_txq_base = rte_lcore_count() - ONVM_NUM_RX_THREADS - ONVM_NUM_MGR_AUX_THREADS;
+        ports->num_nf_txqs = ONVM_NUM_NF_TX_QUEUES;
+        ports->nf_rxq_base = ONVM_NUM_RX_THREADS;
+        ports->num_nf_rxqs = global_direct_rx_queues;
         for (i = 0; i < ports->num_ports; i++) {
                 port_id = ports->id[i];
                 rte_eth_macaddr_get(port_id, &ports->mac[port_id]);
@@ -256,9 +291,6 @@ init(int argc, char *argv[]) {
         /* initialise a queue for newly created NFs */
         init_info_queue();
 
-        /* initialise the shared memory for shared core mode */
-        init_shared_sem();
-
         /*initialize a default service chain*/
         default_chain = onvm_sc_create();
         retval = onvm_sc_append_entry(default_chain, ONVM_NF_ACTION_TONF, 1);
@@ -277,6 +309,9 @@ init(int argc, char *argv[]) {
         *default_sc_p = default_chain;
         onvm_sc_print(default_chain);
 
+        /* set up the service graph shared to NFs, it replaces the default chain when loaded */
+        init_service_graph();
+
         onvm_flow_dir_init();
 
         return 0;
@@ -284,135 +319,62 @@ init(int argc, char *argv[]) {
 
 /*****************************Internal functions******************************/
 
-static inline void
-init_set_action_mutex(void) {
-        char mutex_name[32][20];
-        strcpy(mutex_name[0], "set_action_mutex0");
-        strcpy(mutex_name[1], "set_action_mutex1");
-        strcpy(mutex_name[2], "set_action_mutex2");
-        strcpy(mutex_name[3], "set_action_mutex3");
-        strcpy(mutex_name[4], "set_action_mutex4");
-        strcpy(mutex_name[5], "set_action_mutex5");
-        strcpy(mutex_name[6], "set_action_mutex6");
-        strcpy(mutex_name[7], "set_action_mutex7");
-        strcpy(mutex_name[8], "set_action_mutex8");
-        strcpy(mutex_name[9], "set_action_mutex9");
-        strcpy(mutex_name[10], "set_action_mutex10");
-        strcpy(mutex_name[11], "set_action_mutex11");
-        strcpy(mutex_name[12], "set_action_mutex12");
-        strcpy(mutex_name[13], "set_action_mutex13");
-        strcpy(mutex_name[14], "set_action_mutex14");
-        strcpy(mutex_name[15], "set_action_mutex15");
-        strcpy(mutex_name[16], "set_action_mutex16");
-        strcpy(mutex_name[17], "set_action_mutex17");
-        strcpy(mutex_name[18], "set_action_mutex18");
-        strcpy(mutex_name[19], "set_action_mutex19");
-        strcpy(mutex_name[20], "set_action_mutex20");
-        strcpy(mutex_name[21], "set_action_mutex21");
-        strcpy(mutex_name[22], "set_action_mutex22");
-        strcpy(mutex_name[23], "set_action_mutex23");
-        strcpy(mutex_name[24], "set_action_mutex24");
-        strcpy(mutex_name[25], "set_action_mutex25");
-        strcpy(mutex_name[26], "set_action_mutex26");
-        strcpy(mutex_name[27], "set_action_mutex27");
-        strcpy(mutex_name[28], "set_action_mutex28");
-        strcpy(mutex_name[29], "set_action_mutex29");
-        strcpy(mutex_name[30], "set_action_mutex30");
-        strcpy(mutex_name[31], "set_action_mutex31");
-
-        for (int i = 0; i < 32; i++) {
-                sem_t *mutex = sem_open(mutex_name[i], O_CREAT | O_EXCL, 0644, 1);
-                if (mutex == SEM_FAILED) {
-                        sem_unlink(mutex_name[i]);
-                        mutex = sem_open(mutex_name[i], O_CREAT | O_EXCL, 0644, 1);
-                        if (mutex == SEM_FAILED) {
-                                fprintf(stderr, "can not create semaphore for action set mutex");
-                                exit(1);
-                        }
-                }
-                sem_wait(mutex);
-                printf("%s create success\t- addr %p\n", mutex_name[i], mutex);
-                sem_post(mutex);
-        }
-}
-
-static inline void
-init_pkt_mutex(void) {
-        char mutex_name[32][20];
-        strcpy(mutex_name[0], "pkt_mutex0");
-        strcpy(mutex_name[1], "pkt_mutex1");
-        strcpy(mutex_name[2], "pkt_mutex2");
-        strcpy(mutex_name[3], "pkt_mutex3");
-        strcpy(mutex_name[4], "pkt_mutex4");
-        strcpy(mutex_name[5], "pkt_mutex5");
-        strcpy(mutex_name[6], "pkt_mutex6");
-        strcpy(mutex_name[7], "pkt_mutex7");
-        strcpy(mutex_name[8], "pkt_mutex8");
-        strcpy(mutex_name[9], "pkt_mutex9");
-        strcpy(mutex_name[10], "pkt_mutex10");
-        strcpy(mutex_name[11], "pkt_mutex11");
-        strcpy(mutex_name[12], "pkt_mutex12");
-        strcpy(mutex_name[13], "pkt_mutex13");
-        strcpy(mutex_name[14], "pkt_mutex14");
-        strcpy(mutex_name[15], "pkt_mutex15");
-        strcpy(mutex_name[16], "pkt_mutex16");
-        strcpy(mutex_name[17], "pkt_mutex17");
-        strcpy(mutex_name[18], "pkt_mutex18");
-        strcpy(mutex_name[19], "pkt_mutex19");
-        strcpy(mutex_name[20], "pkt_mutex20");
-        strcpy(mutex_name[21], "pkt_mutex21");
-        strcpy(mutex_name[22], "pkt_mutex22");
-        strcpy(mutex_name[23], "pkt_mutex23");
-        strcpy(mutex_name[24], "pkt_mutex24");
-        strcpy(mutex_name[25], "pkt_mutex25");
-        strcpy(mutex_name[26], "pkt_mutex26");
-        strcpy(mutex_name[27], "pkt_mutex27");
-        strcpy(mutex_name[28], "pkt_mutex28");
-        strcpy(mutex_name[29], "pkt_mutex29");
-        strcpy(mutex_name[30], "pkt_mutex30");
-        strcpy(mutex_name[31], "pkt_mutex31");
-
-        for (int i = 0; i < 32; i++) {
-                sem_t *mutex = sem_open(mutex_name[i], O_CREAT | O_EXCL, 0644, 1);
-                if (mutex == SEM_FAILED) {
-                        sem_unlink(mutex_name[i]);
-                        mutex = sem_open(mutex_name[i], O_CREAT | O_EXCL, 0644, 1);
-                        if (mutex == SEM_FAILED) {
-                                fprintf(stderr, "can not create semaphore\n");
-                                exit(1);
-                        }
-                }
-                sem_wait(mutex);
-                printf("%s create success\t- addr %p\n", mutex_name[i], mutex);
-                sem_post(mutex);
-        }
-}
-
 /**
  * Initialise the default onvm config structure
  */
 static void
 set_default_config(struct onvm_configuration *config) {
         config->flags.ONVM_NF_SHARE_CORES = ONVM_NF_SHARE_CORES_DEFAULT;
+        config->flags.ONVM_NF_COOP_SCHED = ONVM_NF_COOP_SCHED_DEFAULT;
 }
 
 /**
- * Initialise the mbuf pool for packet reception for the NIC, and any other
+ * Initialise the mbuf pools for packet reception for the NIC, one on the
+ * manager's socket and one on every other socket with a port, and any other
  * buffer pools needed by the app - currently none.
  */
 static int
 init_mbuf_pools(void) {
+        const char *pool_name;
+        int socket_id;
+        uint8_t i;
+
+        /* Every mbuf carries an onvm_pkt_priv area, used to track copies of parallel packets */
+        struct rte_pktmbuf_pool_private mbp_priv = {
+            .mbuf_data_room_size = RX_MBUF_DATA_SIZE + RTE_PKTMBUF_HEADROOM,
+            .mbuf_priv_size = ONVM_PKT_PRIV_SIZE,
+        };
+
         /* don't pass single-producer/single-consumer flags to mbuf create as it
          * seems faster to use a cache instead */
         printf("Creating mbuf pool '%s' [%u mbufs] ...\n", PKTMBUF_POOL_NAME, NUM_MBUFS);
-        pktmbuf_pool = rte_mempool_create(PKTMBUF_POOL_NAME, NUM_MBUFS, MBUF_SIZE, MBUF_CACHE_SIZE,
-                                          sizeof(struct rte_pktmbuf_pool_private), rte_pktmbuf_pool_init, NULL,
-                                          rte_pktmbuf_init, NULL, rte_socket_id(), NO_FLAGS);
+        pktmbuf_pool = rte_mempool_create(PKTMBUF_POOL_NAME, NUM_MBUFS, MBUF_SIZE + ONVM_PKT_PRIV_SIZE,
+                                          MBUF_CACHE_SIZE, sizeof(struct rte_pktmbuf_pool_private),
+                                          rte_pktmbuf_pool_init, &mbp_priv, rte_pktmbuf_init, NULL, rte_socket_id(),
+                                          NO_FLAGS);
+        if (pktmbuf_pool == NULL)
+                return -1;
+
+        /* Ports on other sockets receive into a pool of their own socket */
+        for (i = 0; i < ports->num_ports; i++) {
+                socket_id = rte_eth_dev_socket_id(ports->id[i]);
+                if (socket_id < 0 || (unsigned)socket_id == rte_socket_id())
+                        continue;
+                pool_name = get_pktmbuf_pool_name(socket_id);
+                if (rte_mempool_lookup(pool_name) != NULL)
+                        continue;
+                printf("Creating mbuf pool '%s' [%u mbufs] ...\n", pool_name, NUM_MBUFS);
+                if (rte_mempool_create(pool_name, NUM_MBUFS, MBUF_SIZE + ONVM_PKT_PRIV_SIZE, MBUF_CACHE_SIZE,
+                                       sizeof(struct rte_pktmbuf_pool_private), rte_pktmbuf_pool_init, &mbp_priv,
+                                       rte_pktmbuf_init, NULL, socket_id, NO_FLAGS) == NULL)
+                        return -1;
+        }
 
         const unsigned int CLONE_MBUF_SIZE = 300000;
         printf("Creating clone mbuf pool '%s' [%u mbufs] ...\n", PKTMBUF_CLONE_POOL_NAME, CLONE_MBUF_SIZE);
-        pktmbuf_clone_pool = rte_pktmbuf_pool_create(PKTMBUF_CLONE_POOL_NAME, CLONE_MBUF_SIZE, MBUF_CACHE_SIZE, 0,
-                                                     RTE_MBUF_DEFAULT_BUF_SIZE, rte_socket_id());
+        pktmbuf_clone_pool =
+            rte_pktmbuf_pool_create(PKTMBUF_CLONE_POOL_NAME, CLONE_MBUF_SIZE, MBUF_CACHE_SIZE, ONVM_PKT_PRIV_SIZE,
+                                    RTE_MBUF_DEFAULT_BUF_SIZE, rte_socket_id());
 
         return (pktmbuf_pool == NULL) | (pktmbuf_clone_pool == NULL); /* 0  on success */
 }
@@ -425,7 +387,7 @@ init_nf_msg_pool(void) {
         /* don't pass single-producer/single-consumer flags to mbuf
          * create as it seems faster to use a cache instead */
         printf("Creating mbuf pool '%s' ...\n", _NF_MSG_POOL_NAME);
-        nf_msg_pool = rte_mempool_create(_NF_MSG_POOL_NAME, MAX_NFS * NF_MSG_QUEUE_SIZE, NF_INFO_SIZE,
+        nf_msg_pool = rte_mempool_create(_NF_MSG_POOL_NAME, MAX_NFS * NF_MSG_QUEUE_SIZE, NF_MSG_SIZE,
                                          NF_MSG_CACHE_SIZE, 0, NULL, NULL, NULL, NULL, rte_socket_id(), NO_FLAGS);
 
         return (nf_msg_pool == NULL); /* 0 on success */
@@ -454,29 +416,47 @@ init_nf_init_cfg_pool(void) {
  */
 static int
 init_port(uint8_t port_num) {
-        const uint16_t rx_rings = ONVM_NUM_RX_THREADS;
+        uint16_t rx_rings;
         uint16_t rx_ring_size = RTE_MP_RX_DESC_DEFAULT;
         /* Set the number of tx_rings equal to the tx threads. This mimics the onvm_mgr tx thread calculation. */
-        const uint16_t tx_rings = rte_lcore_count() - rx_rings - ONVM_NUM_MGR_AUX_THREADS;
+        const uint16_t tx_thread_rings = rte_lcore_count() - ONVM_NUM_RX_THREADS - ONVM_NUM_MGR_AUX_THREADS;
+        uint16_t tx_rings;
         uint16_t tx_ring_size = RTE_MP_TX_DESC_DEFAULT;
 
         struct rte_eth_rxconf rxq_conf;
         struct rte_eth_txconf txq_conf;
         struct rte_eth_dev_info dev_info;
         struct rte_eth_conf local_port_conf = port_conf;
+        struct rte_mempool *rx_pool;
 
         uint16_t q;
         int retval;
 
-        printf("Port %u init ... \n", (unsigned)port_num);
-        printf("Port %u socket id %u ... \n", (unsigned)port_num, (unsigned)rte_eth_dev_socket_id(port_num));
-        printf("Port %u Rx rings %u ... \n", (unsigned)port_num, (unsigned)rx_rings);
-        printf("Port %u Tx rings %u ... \n", (unsigned)port_num, (unsigned)tx_rings);
-        fflush(stdout);
-
         /* Standard DPDK port initialisation - config port, then set up
          * rx and tx rings */
         rte_eth_dev_info_get(port_num, &dev_info);
+
+        /* The queues NFs can lease come after the TX threads' ones, as many as the port has left */
+        if (dev_info.max_tx_queues > tx_thread_rings)
+                ports->num_nf_txqs = RTE_MIN(ports->num_nf_txqs, dev_info.max_tx_queues - tx_thread_rings);
+        else
+                ports->num_nf_txqs = 0;
+        tx_rings = tx_thread_rings + ports->num_nf_txqs;
+
+        /* RX queues polled directly by NFs come after the RX threads' ones, they are only used once steered to */
+        if (dev_info.max_rx_queues > ONVM_NUM_RX_THREADS)
+                ports->num_nf_rxqs = RTE_MIN(ports->num_nf_rxqs, dev_info.max_rx_queues - ONVM_NUM_RX_THREADS);
+        else
+                ports->num_nf_rxqs = 0;
+        rx_rings = ONVM_NUM_RX_THREADS + ports->num_nf_rxqs;
+
+        printf("Port %u init ... \n", (unsigned)port_num);
+        printf("Port %u socket id %u ... \n", (unsigned)port_num, (unsigned)rte_eth_dev_socket_id(port_num));
+        printf("Port %u Rx rings %u (%u for NFs) ... \n", (unsigned)port_num, (unsigned)rx_rings,
+               (unsigned)ports->num_nf_rxqs);
+        printf("Port %u Tx rings %u (%u for NFs) ... \n", (unsigned)port_num, (unsigned)tx_rings,
+               (unsigned)ports->num_nf_txqs);
+        fflush(stdout);
         if (dev_info.tx_offload_capa & DEV_TX_OFFLOAD_MBUF_FAST_FREE)
                 local_port_conf.txmode.offloads |= DEV_TX_OFFLOAD_MBUF_FAST_FREE;
         local_port_conf.rx_adv_conf.rss_conf.rss_hf &= dev_info.flow_type_rss_offloads;
@@ -499,9 +479,10 @@ init_port(uint8_t port_num) {
 
         rxq_conf = dev_info.default_rxconf;
         rxq_conf.offloads = local_port_conf.rxmode.offloads;
+        rx_pool = onvm_get_pktmbuf_pool(rte_eth_dev_socket_id(port_num));
         for (q = 0; q < rx_rings; q++) {
                 retval = rte_eth_rx_queue_setup(port_num, q, rx_ring_size, rte_eth_dev_socket_id(port_num), &rxq_conf,
-                                                pktmbuf_pool);
+                                                rx_pool);
                 if (retval < 0)
                         return retval;
         }
@@ -526,50 +507,6 @@ init_port(uint8_t port_num) {
         return 0;
 }
 
-/**
- * Initialize shared core structs (mutex/semaphore)
- */
-static void
-init_shared_sem(void) {
-        uint16_t i;
-        key_t key;
-        int shmid;
-        char *shm;
-        sem_t *mutex;
-        const char *sem_name;
-
-        nf_wakeup_infos = rte_calloc("MGR_SHM_INFOS", sizeof(struct nf_wakeup_info), MAX_NFS, 0);
-
-        if (!ONVM_NF_SHARE_CORES)
-                return;
-
-        for (i = 0; i < MAX_NFS; i++) {
-                sem_name = get_sem_name(i);
-                nf_wakeup_infos[i].sem_name = sem_name;
-
-                mutex = sem_open(sem_name, O_CREAT, 06666, 0);
-                if (mutex == SEM_FAILED) {
-                        fprintf(stderr, "can not create semaphore for NF %d\n", i);
-                        sem_unlink(sem_name);
-                        exit(1);
-                }
-                nf_wakeup_infos[i].mutex = mutex;
-
-                key = get_rx_shmkey(i);
-                if ((shmid = shmget(key, SHMSZ, IPC_CREAT | 0666)) < 0) {
-                        fprintf(stderr, "can not create the shared memory segment for NF %d\n", i);
-                        exit(1);
-                }
-
-                if ((shm = shmat(shmid, NULL, 0)) == (char *)-1) {
-                        fprintf(stderr, "can not attach the shared segment to the server space for NF %d\n", i);
-                        exit(1);
-                }
-
-                nf_wakeup_infos[i].shm_server = (rte_atomic16_t *)shm;
-        }
-}
-
 /**
  * Allocate a rte_ring for newly created NFs
  */
@@ -584,6 +521,35 @@ init_info_queue(void) {
         return 0;
 }
 
+/**
+ * Reserve the shared service graph and load it from the graph file, if any
+ */
+static void
+init_service_graph(void) {
+        const struct rte_memzone *mz_sg;
+        cJSON *graph_config;
+        int retval;
+
+        mz_sg = rte_memzone_reserve(MZ_SERVICE_GRAPH, sizeof(struct onvm_service_graph), rte_socket_id(), NO_FLAGS);
+        if (mz_sg == NULL)
+                rte_exit(EXIT_FAILURE, "Cannot reserve memory zone for service graph\n");
+        memset(mz_sg->addr, 0, sizeof(struct onvm_service_graph));
+        service_graph = mz_sg->addr;
+
+        if (service_graph_file == NULL)
+                return;
+
+        graph_config = onvm_config_parse_file(service_graph_file);
+        if (graph_config == NULL)
+                rte_exit(EXIT_FAILURE, "Cannot parse service graph file %s\n", service_graph_file);
+        retval = onvm_config_extract_service_graph(graph_config, service_graph);
+        cJSON_Delete(graph_config);
+        if (retval < 0)
+                rte_exit(EXIT_FAILURE, "Invalid service graph in %s\n", service_graph_file);
+
+        printf("Service graph: %u nodes loaded from %s\n", service_graph->num_nodes - 1, service_graph_file);
+}
+
 /* Check the link status of all ports in up to 9s, and print them finally */
 static void
 check_all_ports_link_status(uint8_t port_num, uint32_t port_mask) {
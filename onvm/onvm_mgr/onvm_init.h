@@ -96,7 +96,8 @@
 #define ONVM_NUM_RX_THREADS 1
 /* Number of auxiliary threads in manager, 1 reserved for stats */
 #define ONVM_NUM_MGR_AUX_THREADS 1
-#define ONVM_NUM_WAKEUP_THREADS 1  // Enabled when using shared core mode
+/* NIC TX queues per port, after the TX threads' ones, that NFs can lease to send packets out themselves */
+#define ONVM_NUM_NF_TX_QUEUES 8
 
 /*************************External global variables***************************/
 
@@ -114,21 +115,28 @@ extern uint16_t num_services;
 extern uint16_t default_service;
 extern uint16_t **services;
 extern uint16_t *nf_per_service_count;
+extern struct onvm_service_lb *service_lb;
+extern struct onvm_nf_rx_stats *nf_rx_stats;
+extern struct onvm_service_bp *service_bp;
 extern unsigned num_sockets;
 extern struct onvm_service_chain *default_chain;
+extern struct onvm_service_graph *service_graph;
+extern const char *service_graph_file;
+extern const char *autoscale_file;
+extern const char *classifier_file;
 extern struct onvm_ft *sdn_ft;
 extern ONVM_STATS_OUTPUT stats_destination;
 extern uint16_t global_stats_sleep_time;
 extern uint32_t global_time_to_live;
 extern uint32_t global_pkt_limit;
 extern uint8_t global_verbosity_level;
+extern uint16_t global_direct_rx_queues;
 
 /* Custom flags for onvm */
 extern struct onvm_configuration *onvm_config;
 extern uint8_t ONVM_NF_SHARE_CORES;
-
-/* For handling shared core logic */
-extern struct nf_wakeup_info *nf_wakeup_infos;
+extern uint8_t ONVM_NF_COOP_SCHED;
+extern uint16_t global_sched_quota;
 
 /**********************************Functions**********************************/
 
@@ -47,31 +47,62 @@
 ******************************************************************************/
 
 #include "onvm_nf.h"
+#include <rte_jhash.h>
 #include <rte_lpm.h>
 #include "onvm_mgr.h"
+#include "onvm_scale.h"
 #include "onvm_stats.h"
 
-#define Max_Child 7
+/* Seeds of the preferred slot and step of an instance in the Maglev tables */
+#define SERVICE_LB_OFFSET_SEED 0x7a3b1c5d
+#define SERVICE_LB_SKIP_SEED 0x1f4e9a27
 
 /* ID 0 is reserved */
 uint16_t next_instance_id = 1;
 uint16_t starting_instance_id = 1;
 
-/************************Internal functions prototypes************************/
-static uint64_t
-onvm_nf_quick_multiplication(uint64_t handle_rate, uint32_t multiplier);
+/* Instance id of the NF holding each NIC TX queue leased to NFs, 0 if free */
+static uint16_t nf_txq_owner[ONVM_NUM_NF_TX_QUEUES];
+
+/* Instance id of the NF polling each NIC RX queue set aside for NFs, 0 if free */
+static uint16_t nf_rxq_owner[ONVM_MAX_NF_RX_QUEUES];
 
+/************************Internal functions prototypes************************/
+/*
+ * Function adding a NF to the NFs taking turns on a core. A NF that doesn't
+ * fit runs outside the turns.
+ *
+ * Input  : a pointer to the NF
+ *          the core it runs on
+ */
 static void
-onvm_nf_instance_stop(struct onvm_nf *parent_nf, struct onvm_nf *stop_instance);
+onvm_nf_sched_join(struct onvm_nf *nf, uint16_t core);
 
+/*
+ * Function leasing a free NIC TX queue to a NF. Without one the NF keeps
+ * sending through the TX threads.
+ *
+ * Input  : a pointer to the NF
+ */
 static void
-onvm_nf_instance_wakeup(struct onvm_nf *parent_nf);
+onvm_nf_lease_txq(struct onvm_nf *nf);
 
+/*
+ * Function giving back the NIC TX queue of a NF, if it holds one.
+ *
+ * Input  : a pointer to the NF
+ */
 static void
-onvm_nf_scaling_nf(struct onvm_nf *parent_nf);
+onvm_nf_release_txq(struct onvm_nf *nf);
 
+/*
+ * Function taking back the NIC RX queue of a stopped NF. The packets still
+ * in it are dropped.
+ *
+ * Input  : a pointer to the NF
+ */
 static void
-onvm_nf_sleep_instance(struct onvm_nf *parent_nf, struct onvm_nf *sleep_nf);
+onvm_nf_release_rxq(struct onvm_nf *nf);
 
 /*
  * Function starting a NF.
@@ -144,6 +175,81 @@ onvm_nf_init_ft(struct ft_request *ft);
 static void
 onvm_nf_init_rings(struct onvm_nf *nf);
 
+/*
+ * Function creating one of the rings of a NF on the given socket. Instance
+ * ids are reused, the ring left by the last NF with the id is kept when it
+ * is on the right socket and recreated otherwise.
+ *
+ * Input  : the ring name, its size and the socket
+ * Output : the ring, NULL on failure
+ */
+static struct rte_ring *
+onvm_nf_ring_create(const char *name, unsigned count, int socket_id);
+
+/*
+ * Function picking the socket a new NF of a service should run on: the one
+ * most of the running NFs and ports it exchanges packets with are on,
+ * following the service graph when loaded, otherwise the default chain.
+ *
+ * Input  : the service id of the NF
+ *          where to count the running peers on each core, or NULL
+ * Output : the socket id, SOCKET_ID_ANY if the service has no placed peers
+ */
+static int
+onvm_nf_peer_socket(uint16_t service_id, uint16_t *core_count);
+
+/*
+ * Helper functions for onvm_nf_peer_socket, counting the sockets and cores
+ * of the running NFs of a service and the socket of a port.
+ */
+static void
+onvm_nf_count_service_sockets(uint16_t service_id, unsigned *socket_count, uint16_t *core_count);
+
+static void
+onvm_nf_count_port_socket(uint16_t port_id, unsigned *socket_count);
+
+/*
+ * Function giving the load of a core for rebalancing, in per mille of a core:
+ * the load of its NFs and half of the load of its hyperthread siblings.
+ */
+static uint32_t
+onvm_nf_core_load(const uint32_t *core_load, int core, int max_cores);
+
+/*
+ * Function checking the manager may move a NF to another core: it runs on a
+ * shared core the manager picked for it.
+ */
+static int
+onvm_nf_can_move(struct onvm_nf *nf);
+
+/*
+ * Function gathering the flows a new load balancer table moves between two
+ * instances that both hand flows over, one handoff per pair of instances,
+ * and holding them at their new owner until it gets their state.
+ *
+ * Input  : the service id, its new table, room for MAX_NFS_PER_SERVICE handoffs
+ * Output : the number of handoffs to send to their source NFs
+ */
+static int
+onvm_nf_flow_handoff_prepare(uint16_t service_id, const uint16_t *table, struct onvm_flow_handoff **handoffs);
+
+/*
+ * Function checking a NF can hand flows over or take them: it is running
+ * and registered the flow_export and flow_import callbacks.
+ */
+static int
+onvm_nf_can_handoff(uint16_t instance_id);
+
+/*
+ * Function freeing a message left in the queue of a stopped NF along with
+ * what it carries: the reference on a typed payload, or the flow handoff
+ * with its state and packets.
+ *
+ * Input  : a pointer to the message
+ */
+static void
+onvm_nf_msg_release(struct onvm_nf_msg *msg);
+
 /********************************Interfaces***********************************/
 
 uint16_t
@@ -254,146 +360,342 @@ onvm_nf_send_msg(uint16_t dest, uint8_t msg_type, void *msg_data) {
         msg->msg_type = msg_type;
         msg->msg_data = msg_data;
 
-        return rte_ring_enqueue(nfs[dest].msg_q, (void *)msg);
+        ret = rte_ring_enqueue(nfs[dest].msg_q, (void *)msg);
+        if (ret == 0 && ONVM_NF_SHARE_CORES)
+                onvm_nf_wakeup(&nfs[dest]);
+
+        return ret;
+}
+
+static void
+onvm_nf_sched_join(struct onvm_nf *nf, uint16_t core) {
+        if (onvm_threading_sched_add(&cores[core], nf->instance_id, global_sched_quota) == 0)
+                return;
+
+        RTE_LOG(WARNING, APP, "NF %u runs outside the turns, core %u already has %d NFs taking turns\n",
+                nf->instance_id, core, ONVM_SCHED_MAX_NFS);
+        nf->flags.init_options &= ~(1 << COOP_SCHED_BIT);
+}
+
+static void
+onvm_nf_lease_txq(struct onvm_nf *nf) {
+        uint16_t i;
+
+        for (i = 0; i < ports->num_nf_txqs; i++) {
+                if (nf_txq_owner[i] == 0) {
+                        nf_txq_owner[i] = nf->instance_id;
+                        nf->nic_txq = ports->nf_txq_base + i;
+                        RTE_LOG(INFO, APP, "NF %u sends packets out on NIC TX queue %u\n", nf->instance_id,
+                                nf->nic_txq);
+                        return;
+                }
+        }
+
+        RTE_LOG(INFO, APP, "No NIC TX queue left for NF %u, its packets go through the TX threads\n",
+                nf->instance_id);
+}
+
+static void
+onvm_nf_release_txq(struct onvm_nf *nf) {
+        uint16_t i;
+
+        if (nf->nic_txq == ONVM_NF_NO_TXQ || nf->nic_txq < ports->nf_txq_base)
+                return;
+
+        i = nf->nic_txq - ports->nf_txq_base;
+        if (i < ports->num_nf_txqs && nf_txq_owner[i] == nf->instance_id)
+                nf_txq_owner[i] = 0;
+        nf->nic_txq = ONVM_NF_NO_TXQ;
 }
 
 void
-onvm_nf_scaling(unsigned difftime) {
-        static uint64_t nf_rx_last[MAX_NFS] = {0};
-        uint64_t nf_rx_pps;
-        uint64_t rx_pps_for_service[MAX_SERVICES] = {0};
+onvm_nf_lease_rxq(struct onvm_nf *nf) {
+        uint16_t i;
 
-        for (int i = 0; i < MAX_NFS; i++) {
-                if (!onvm_nf_is_valid(&nfs[i]))
-                        continue;
-                nf_rx_pps = (nfs[i].stats.rx - nf_rx_last[i]) / difftime;
-                nf_rx_last[i] = nfs[i].stats.rx;
+        if (ports->num_nf_rxqs == 0 || !ONVM_CHECK_BIT(nf->flags.init_options, DIRECT_RX_BIT))
+                return;
 
-                if (nfs[i].thread_info.parent) {
-                        if (nfs[i].idle_time >= 10) {
-                                struct onvm_nf *parent_nf = &nfs[nfs[i].thread_info.parent];
+        /* Only the first service sees every packet, the others get theirs from it */
+        if (default_chain->chain_length == 0 || default_chain->sc[1].action != ONVM_NF_ACTION_TONF ||
+            default_chain->sc[1].destination != nf->service_id)
+                return;
 
-                                if (nfs[i].instance_id == parent_nf->thread_info.sleep_instance[0]) {
-                                        onvm_nf_instance_stop(parent_nf, &nfs[i]);
-                                } else {
-                                        printf("error might happend...\n");
-                                }
-                        } else {
-                                if (nfs[i].thread_info.sleep_flag) {
-                                        nfs[i].idle_time++;
-                                        printf("instance %d idle for %d sec...\n", i, nfs[i].idle_time);
-                                } else
-                                        nfs[i].idle_time = 0;
-                        }
+        for (i = 0; i < ports->num_nf_rxqs; i++) {
+                if (nf_rxq_owner[i] == 0) {
+                        nf_rxq_owner[i] = nf->instance_id;
+                        nf->nic_rxq = ports->nf_rxq_base + i;
+                        RTE_LOG(INFO, APP, "NF %u polls NIC RX queue %u\n", nf->instance_id, nf->nic_rxq);
+                        onvm_nf_steer_direct_rx();
+                        return;
                 }
-                rx_pps_for_service[nfs[i].service_id] += nf_rx_pps;
-        }
-        printf(
-            "\n--------------------------------------------------------------------------------------------------------"
-            "--------------\n");
-        for (int i = 0; i < MAX_SERVICES; i++) {
-                uint16_t nfs_for_service = nf_per_service_count[i];
-                if (!nfs_for_service)
+        }
+}
+
+static void
+onvm_nf_release_rxq(struct onvm_nf *nf) {
+        struct rte_mbuf *pkts[PACKET_READ_SIZE];
+        uint16_t i, j, nb_pkts, queue;
+
+        queue = nf->nic_rxq;
+        if (queue == ONVM_NF_NO_RXQ || queue < ports->nf_rxq_base)
+                return;
+
+        i = queue - ports->nf_rxq_base;
+        nf->nic_rxq = ONVM_NF_NO_RXQ;
+        if (i >= ports->num_nf_rxqs || nf_rxq_owner[i] != nf->instance_id)
+                return;
+        nf_rxq_owner[i] = 0;
+        onvm_nf_steer_direct_rx();
+
+        for (i = 0; i < ports->num_ports; i++) {
+                while ((nb_pkts = rte_eth_rx_burst(ports->id[i], queue, pkts, PACKET_READ_SIZE)) > 0) {
+                        for (j = 0; j < nb_pkts; j++)
+                                rte_pktmbuf_free(pkts[j]);
+                }
+        }
+}
+
+void
+onvm_nf_sched_update(void) {
+        static uint64_t rx_last[MAX_NFS];
+        uint64_t rx[ONVM_SCHED_MAX_NFS];
+        uint64_t rx_total, rx_now, quota;
+        uint16_t i, id, num_nfs, owner;
+        struct core_status *core;
+        int core_id;
+
+        for (core_id = 0; core_id < onvm_threading_get_num_cores(); core_id++) {
+                core = &cores[core_id];
+                num_nfs = core->sched_num_nfs;
+                if (!core->enabled || num_nfs == 0)
                         continue;
 
-                uint32_t parent_instance_ID = services[i][0];
-                uint64_t service_handle_rate = nfs[parent_instance_ID].handle_rate;
-                uint64_t H_threshold = onvm_nf_quick_multiplication(service_handle_rate, nfs_for_service);
-                uint64_t L_threshold = onvm_nf_quick_multiplication(service_handle_rate, nfs_for_service - 1);
-
-                printf("Service : %d - child amount : %d - enable amount : %d\n", i,
-                       nfs[parent_instance_ID].thread_info.nums_child, nfs_for_service);
-                printf("H_threshold : %ld - L_threshold : %ld - rx_pps : %ld\n\n", H_threshold, L_threshold,
-                       rx_pps_for_service[i]);
-
-                if (rx_pps_for_service[i] >= H_threshold) {
-                        nfs[parent_instance_ID].thread_info.wait_counter = 10;
-
-                        if (nfs[parent_instance_ID].thread_info.sleep_count) {
-                                struct onvm_nf *parent_nf = &nfs[parent_instance_ID];
-                                onvm_nf_instance_wakeup(parent_nf);
-                        } else if (nfs[parent_instance_ID].thread_info.nums_child < Max_Child &&
-                                   nfs[parent_instance_ID].wait_flag == false) {
-                                onvm_nf_scaling_nf(&nfs[parent_instance_ID]);
-                        } else {
-                                printf("Do back pressure in the future\n");
-                                /* Drop the packet which will enter this overloading service */
+                /* Share the turns by how many packets each NF got since the last update */
+                rx_total = 0;
+                for (i = 0; i < num_nfs; i++) {
+                        id = core->sched_nfs[i];
+                        rx_now = onvm_nf_stats_rx(nf_rx_stats, id);
+                        rx[i] = rx_now > rx_last[id] ? rx_now - rx_last[id] : 0;
+                        rx_last[id] = rx_now;
+                        rx_total += rx[i];
+                }
+                for (i = 0; i < num_nfs; i++) {
+                        quota = rx_total ? global_sched_quota * num_nfs * rx[i] / rx_total : global_sched_quota;
+                        quota = RTE_MAX(quota, (uint64_t)PACKET_READ_SIZE);
+                        quota = RTE_MIN(quota, (uint64_t)global_sched_quota * ONVM_SCHED_MAX_QUOTA_SCALE);
+                        core->sched_quota[i] = (uint16_t)quota;
+                }
+
+                /* Pick up turns lost to an owner that died or raced with a membership change */
+                owner = core->sched_owner;
+                if (owner != 0 && !onvm_nf_is_valid(&nfs[owner]))
+                        onvm_threading_sched_handoff(core, owner, onvm_threading_sched_pick(core, owner));
+                else if (owner == 0)
+                        onvm_threading_sched_handoff(core, 0, 0);
+        }
+}
+
+void
+onvm_nf_rebalance_cores(void) {
+        static uint64_t busy_last[MAX_NFS];
+        static uint64_t tsc_last;
+        static unsigned cooldown;
+        uint32_t load[MAX_NFS];
+        uint32_t core_load[RTE_MAX_LCORE];
+        uint16_t peer_count[RTE_MAX_LCORE];
+        uint32_t src_load = 0, dst_load, after, score, best_score = 0;
+        uint64_t now, elapsed, busy;
+        uint16_t i, core, best_nf = 0;
+        int max_cores, c, llc_peers, src = -1, best_dst = -1;
+
+        now = rte_get_tsc_cycles();
+        elapsed = now - tsc_last;
+        tsc_last = now;
+        max_cores = RTE_MIN(onvm_threading_get_num_cores(), RTE_MAX_LCORE);
+
+        /* Share of the last interval each NF spent handling packets */
+        memset(core_load, 0, sizeof(core_load));
+        for (i = 1; i < MAX_NFS; i++) {
+                busy = nfs[i].nf_stats.busy_cycles;
+                load[i] = 0;
+                if (onvm_nf_is_valid(&nfs[i]) && busy >= busy_last[i] && elapsed > 0)
+                        load[i] = RTE_MIN((busy - busy_last[i]) * 1000 / elapsed, 1000);
+                busy_last[i] = busy;
+                core = nfs[i].thread_info.core;
+                if (load[i] > 0 && core < max_cores)
+                        core_load[core] += load[i];
+        }
+
+        /* The loads of the NFs that moved are only known after a full interval on their new core */
+        if (cooldown > 0) {
+                cooldown--;
+                return;
+        }
+
+        for (i = 1; i < MAX_NFS; i++) {
+                core = nfs[i].thread_info.core;
+                if (!onvm_nf_can_move(&nfs[i]) || core >= max_cores)
+                        continue;
+                if (src < 0 || onvm_nf_core_load(core_load, core, max_cores) > src_load) {
+                        src = core;
+                        src_load = onvm_nf_core_load(core_load, core, max_cores);
+                }
+        }
+        if (src < 0 || src_load < ONVM_NF_REBALANCE_THRESHOLD)
+                return;
+
+        /*
+         * Move the NF that best evens the busiest core with a core of the same
+         * socket at least ONVM_NF_REBALANCE_THRESHOLD below it, rather onto a
+         * core sharing its last level cache with the NF's peers.
+         */
+        for (i = 1; i < MAX_NFS; i++) {
+                if (nfs[i].thread_info.core != src || !onvm_nf_can_move(&nfs[i]) || load[i] == 0)
+                        continue;
+                memset(peer_count, 0, sizeof(peer_count));
+                onvm_nf_peer_socket(nfs[i].service_id, peer_count);
+                for (c = 0; c < max_cores; c++) {
+                        if (c == src || !cores[c].enabled || cores[c].is_dedicated_core ||
+                            cores[c].socket_id != cores[src].socket_id)
+                                continue;
+                        dst_load = onvm_nf_core_load(core_load, c, max_cores);
+                        if (dst_load + ONVM_NF_REBALANCE_THRESHOLD > src_load)
+                                continue;
+                        after = RTE_MAX(src_load - load[i], dst_load + load[i]);
+                        if (after >= src_load)
+                                continue;
+                        for (llc_peers = 0, core = 0; core < max_cores; core++) {
+                                if (cores[core].llc_group == cores[c].llc_group)
+                                        llc_peers += peer_count[core];
                         }
-                } else if (rx_pps_for_service[i] < L_threshold && nfs[parent_instance_ID].thread_info.nums_child !=
-                                                                      nfs[parent_instance_ID].thread_info.sleep_count) {
-                        if (nfs[parent_instance_ID].thread_info.wait_counter) {
-                                printf("Wating counter to terminate service %d\n", i);
-                                nfs[parent_instance_ID].thread_info.wait_counter--;
-                        } else if (!nfs[parent_instance_ID].wait_flag) {
-                                uint32_t sleep_instance = services[i][nfs_for_service - 1];
-                                struct onvm_nf *sleep_nf = &nfs[sleep_instance];
-                                struct onvm_nf *parent_nf = &nfs[parent_instance_ID];
-                                onvm_nf_sleep_instance(parent_nf, sleep_nf);
+                        score = after + (llc_peers > 0 ? 0 : ONVM_NF_REBALANCE_LLC_BONUS);
+                        if (best_dst < 0 || score < best_score) {
+                                best_score = score;
+                                best_dst = c;
+                                best_nf = i;
                         }
                 }
         }
+        if (best_dst < 0)
+                return;
+
+        printf("Moving NF %u (%u per mille busy) from core %d (%u) to core %d (%u)\n", best_nf, load[best_nf], src,
+               src_load, best_dst, onvm_nf_core_load(core_load, best_dst, max_cores));
+        onvm_nf_relocate_nf(best_nf, best_dst);
+        cooldown = ONVM_NF_REBALANCE_COOLDOWN;
 }
 
-/******************************Internal functions*****************************/
+void
+onvm_nf_steer_direct_rx(void) {
+        struct rte_eth_rss_reta_entry64 reta_conf[ETH_RSS_RETA_SIZE_512 / RTE_RETA_GROUP_SIZE];
+        struct rte_eth_dev_info dev_info;
+        uint16_t queues[ONVM_NUM_RX_THREADS + ONVM_MAX_NF_RX_QUEUES];
+        uint16_t i, num_queues, port_id;
+        uint8_t port;
+
+        if (ports->num_nf_rxqs == 0)
+                return;
 
-static inline uint64_t
-onvm_nf_quick_multiplication(uint64_t handle_rate, uint32_t multiplier) {
-        if (multiplier == 1) {
-                return handle_rate;
-        } else if (multiplier == 2) {
-                return handle_rate << 1;
-        } else if (multiplier == 3) {
-                return (handle_rate << 1) + handle_rate;
-        } else if (multiplier == 4) {
-                return handle_rate << 2;
-        } else if (multiplier == 5) {
-                return (handle_rate << 2) + handle_rate;
-        } else {
-                return handle_rate * multiplier;
+        /* Flows go to the NFs' queues as soon as one is polled, to the RX threads before */
+        num_queues = 0;
+        for (i = 0; i < ports->num_nf_rxqs; i++) {
+                if (nf_rxq_owner[i] != 0)
+                        queues[num_queues++] = ports->nf_rxq_base + i;
+        }
+        if (num_queues == 0) {
+                for (i = 0; i < ONVM_NUM_RX_THREADS; i++)
+                        queues[num_queues++] = i;
         }
-}
 
-static void
-onvm_nf_instance_stop(struct onvm_nf *parent_nf, struct onvm_nf *stop_instance) {
-        parent_nf->thread_info.sleep_count--;
-        for (int i = 1; i <= parent_nf->thread_info.sleep_count; i++) {
-                parent_nf->thread_info.sleep_instance[i - 1] = parent_nf->thread_info.sleep_instance[i];
+        for (port = 0; port < ports->num_ports; port++) {
+                port_id = ports->id[port];
+                rte_eth_dev_info_get(port_id, &dev_info);
+                /* Software PMDs have no RSS, packets stay on the queue they were put on */
+                if (dev_info.reta_size == 0 || dev_info.reta_size > ETH_RSS_RETA_SIZE_512)
+                        continue;
+
+                memset(reta_conf, 0, sizeof(reta_conf));
+                for (i = 0; i < dev_info.reta_size; i++) {
+                        reta_conf[i / RTE_RETA_GROUP_SIZE].mask |= 1ULL << (i % RTE_RETA_GROUP_SIZE);
+                        reta_conf[i / RTE_RETA_GROUP_SIZE].reta[i % RTE_RETA_GROUP_SIZE] = queues[i % num_queues];
+                }
+                if (rte_eth_dev_rss_reta_update(port_id, reta_conf, dev_info.reta_size) != 0)
+                        RTE_LOG(WARNING, APP, "Port %u: cannot update the RSS redirection table\n", port_id);
         }
-        parent_nf->wait_flag = true;
-        onvm_nf_send_msg(stop_instance->instance_id, MSG_STOP, NULL);
 }
 
-static void
-onvm_nf_instance_wakeup(struct onvm_nf *parent_nf) {
-        printf("Wake up sleep instance for service %d\n", parent_nf->service_id);
-        uint32_t wake_instance = parent_nf->thread_info.sleep_instance[--parent_nf->thread_info.sleep_count];
-        struct onvm_nf *wake_nf = &nfs[wake_instance];
-        wake_nf->thread_info.sleep_flag = false;
-        nf_per_service_count[parent_nf->service_id]++;
-}
+/*
+ * Maglev: every instance walks its own permutation of the slots, from a
+ * preferred slot with a fixed step both derived from its instance id, and
+ * the instances take turns claiming their next free slot. An instance
+ * joining or leaving only takes or gives back about its share of slots.
+ */
+void
+onvm_nf_update_service_lb(uint16_t service_id) {
+        struct onvm_service_lb *lb = &service_lb[service_id];
+        uint16_t table[ONVM_SERVICE_LB_SIZE];
+        uint32_t offset[MAX_NFS_PER_SERVICE];
+        uint32_t skip[MAX_NFS_PER_SERVICE];
+        uint32_t next[MAX_NFS_PER_SERVICE];
+        uint16_t *instances = services[service_id];
+        uint16_t count = RTE_MIN(nf_per_service_count[service_id], MAX_NFS_PER_SERVICE);
+        struct onvm_flow_handoff *handoffs[MAX_NFS_PER_SERVICE];
+        uint32_t i, slot, filled = 0;
+        int num_handoffs;
+
+        if (count == 0) {
+                lb->num_instances = 0;
+                return;
+        }
 
-static void
-onvm_nf_scaling_nf(struct onvm_nf *parent_nf) {
-        printf("Send scaling msg to service %d with instance %d\n", parent_nf->service_id, parent_nf->instance_id);
-        struct onvm_nf_scaling *scale_info = NULL;
-        parent_nf->wait_flag = true;
-        onvm_nf_send_msg(parent_nf->instance_id, MSG_SCALE, scale_info);
-}
+        for (i = 0; i < count; i++) {
+                offset[i] = rte_jhash_1word(instances[i], SERVICE_LB_OFFSET_SEED) % ONVM_SERVICE_LB_SIZE;
+                skip[i] = rte_jhash_1word(instances[i], SERVICE_LB_SKIP_SEED) % (ONVM_SERVICE_LB_SIZE - 1) + 1;
+                next[i] = 0;
+        }
 
-static void
-onvm_nf_sleep_instance(struct onvm_nf *parent_nf, struct onvm_nf *sleep_nf) {
-        uint32_t service_id = parent_nf->service_id;
-        uint32_t sleep_instance = sleep_nf->instance_id;
-        nf_per_service_count[service_id]--;
-        sleep_nf->thread_info.sleep_flag = true;
-        parent_nf->thread_info.sleep_instance[parent_nf->thread_info.sleep_count++] = sleep_instance;
-        printf("Sleep instance : %d\n", sleep_instance);
+        /* Instance id 0 is reserved, it marks the free slots */
+        memset(table, 0, sizeof(table));
+        while (filled < ONVM_SERVICE_LB_SIZE) {
+                for (i = 0; i < count && filled < ONVM_SERVICE_LB_SIZE; i++) {
+                        do {
+                                slot = (offset[i] + next[i] * skip[i]) % ONVM_SERVICE_LB_SIZE;
+                                next[i]++;
+                        } while (table[slot] != 0);
+                        table[slot] = instances[i];
+                        filled++;
+                }
+        }
+
+        /* The new owners hold the moved flows before the first packet can reach them */
+        num_handoffs = onvm_nf_flow_handoff_prepare(service_id, table, handoffs);
+
+        /* Readers see every slot either before or after the change */
+        for (slot = 0; slot < ONVM_SERVICE_LB_SIZE; slot++) {
+                if (lb->table[slot] != table[slot])
+                        lb->table[slot] = table[slot];
+        }
+        lb->num_instances = count;
+
+        /* Past the change the old owners' rings end with the last packets of the moved flows */
+        for (i = 0; i < (uint32_t)num_handoffs; i++) {
+                if (onvm_nf_send_msg(handoffs[i]->src, MSG_FLOW_EXPORT, handoffs[i]) != 0) {
+                        /* The new owner lets the flows go when waiting for them times out */
+                        RTE_LOG(INFO, APP, "Cannot hand flows over from NF %u to NF %u\n", handoffs[i]->src,
+                                handoffs[i]->dst);
+                        rte_free(handoffs[i]);
+                }
+        }
 }
 
+/******************************Internal functions*****************************/
+
 inline static int
 onvm_nf_start(struct onvm_nf_init_cfg *nf_init_cfg) {
         struct onvm_nf *spawned_nf;
+        uint16_t peer_count[RTE_MAX_LCORE];
         uint16_t nf_id;
+        int socket_id;
         int ret;
 
         if (nf_init_cfg == NULL || nf_init_cfg->status != NF_WAITING_FOR_ID)
@@ -432,7 +734,9 @@ onvm_nf_start(struct onvm_nf_init_cfg *nf_init_cfg) {
         nf_init_cfg->instance_id = nf_id;
 
         /* If not successful return will contain the error code */
-        ret = onvm_threading_get_core(&nf_init_cfg->core, nf_init_cfg->init_options, cores);
+        memset(peer_count, 0, sizeof(peer_count));
+        socket_id = onvm_nf_peer_socket(nf_init_cfg->service_id, peer_count);
+        ret = onvm_threading_get_core(&nf_init_cfg->core, nf_init_cfg->init_options, cores, socket_id, peer_count);
         if (ret != 0) {
                 nf_init_cfg->status = ret;
                 return 1;
@@ -445,6 +749,15 @@ onvm_nf_start(struct onvm_nf_init_cfg *nf_init_cfg) {
         spawned_nf->thread_info.core = nf_init_cfg->core;
         spawned_nf->flags.time_to_live = nf_init_cfg->time_to_live;
         spawned_nf->flags.pkt_limit = nf_init_cfg->pkt_limit;
+        spawned_nf->nic_txq = ONVM_NF_NO_TXQ;
+        spawned_nf->nic_rxq = ONVM_NF_NO_RXQ;
+        /* The instance id may be reused, nothing is left of the autoscaler's view of the last one */
+        spawned_nf->thread_info.sleep_flag = false;
+        spawned_nf->wait_flag = false;
+        spawned_nf->thread_info.attach_tsc = nf_init_cfg->request_tsc;
+        memset((void *)&spawned_nf->handoff, 0, sizeof(spawned_nf->handoff));
+        if (ONVM_CHECK_BIT(nf_init_cfg->init_options, NIC_TX_QUEUE_BIT))
+                onvm_nf_lease_txq(spawned_nf);
         onvm_nf_init_rings(spawned_nf);
 
         // Let the NF continue its init process
@@ -457,13 +770,23 @@ onvm_nf_ready(struct onvm_nf *nf) {
         // Ensure we've already called nf_start for this NF
         if (nf->status != NF_STARTING)
                 return -1;
-        /*
-        uint16_t service_count = nf_per_service_count[nf->service_id]++;
-        services[nf->service_id][service_count] = nf->instance_id;
-        */
+        /* Standby instances stay out of their service until the autoscaler wakes them up */
+        if (!onvm_scale_park(nf)) {
+                /* Only the manager changes the instances of a service, it keeps their tables in sync */
+                uint16_t service_count = nf_per_service_count[nf->service_id]++;
+                services[nf->service_id][service_count] = nf->instance_id;
+                onvm_nf_update_service_lb(nf->service_id);
+                /* Instances of the first service poll a NIC RX queue themselves when direct RX is on */
+                onvm_nf_lease_rxq(nf);
+        }
         num_nfs++;
+        /* Take turns with the other NFs on the core from now on */
+        if (ONVM_NF_COOP_SCHED && ONVM_CHECK_BIT(nf->flags.init_options, COOP_SCHED_BIT))
+                onvm_nf_sched_join(nf, nf->thread_info.core);
         // Register this NF running within its service
         nf->status = NF_RUNNING;
+        if (nf->thread_info.attach_tsc != 0)
+                onvm_stats_add_attach_latency(rte_get_tsc_cycles() - nf->thread_info.attach_tsc);
         return 0;
 }
 
@@ -478,6 +801,7 @@ onvm_nf_stop(struct onvm_nf *nf) {
         struct rte_mbuf *pkts[PACKET_READ_SIZE];
         uint16_t candidate_nf_id, candidate_core;
         int mapIndex;
+        bool nf_sleeping;
 
         if (nf == NULL)
                 return 1;
@@ -485,15 +809,9 @@ onvm_nf_stop(struct onvm_nf *nf) {
         nf_id = nf->instance_id;
         service_id = nf->service_id;
         nf_status = nf->status;
+        nf_sleeping = nf->thread_info.sleep_flag;
         candidate_core = nf->thread_info.core;
 
-        /* Remove this NF from ther service map.
-         * Need to shift all elements past it in the array left to avoid gaps
-         */
-        if (!nf->thread_info.sleep_flag) {
-                nf_per_service_count[service_id]--;
-        }
-
         /* Cleanup the allocated tag */
         if (nf->tag) {
                 rte_free(nf->tag);
@@ -511,9 +829,18 @@ onvm_nf_stop(struct onvm_nf *nf) {
         if (nfs[nf_id].thread_info.parent != 0)
                 rte_atomic16_dec(&nfs[nfs[nf_id].thread_info.parent].thread_info.children_cnt);
 
+        /* Its thread is gone, it must not hold back flow director frees */
+        onvm_flow_dir_reader_release(nf_id);
+
+        /* Nothing is sent on its NIC TX queue anymore nor received on its RX queue */
+        onvm_nf_release_txq(nf);
+        onvm_nf_release_rxq(nf);
+
         /* Remove the NF from the core it was running on */
         cores[nf->thread_info.core].nf_count--;
         cores[nf->thread_info.core].is_dedicated_core = 0;
+        if (ONVM_NF_COOP_SCHED)
+                onvm_threading_sched_remove(&cores[nf->thread_info.core], nf_id);
 
         /* Clean up possible left over objects in rings */
         while ((nb_pkts = rte_ring_dequeue_burst(nfs[nf_id].rx_q, (void **)pkts, PACKET_READ_SIZE, NULL)) > 0) {
@@ -525,9 +852,8 @@ onvm_nf_stop(struct onvm_nf *nf) {
                         rte_pktmbuf_free(pkts[i]);
         }
         nf_msg_pool = rte_mempool_lookup(_NF_MSG_POOL_NAME);
-        while (rte_ring_dequeue(nfs[nf_id].msg_q, (void **)(&msg)) == 0) {
-                rte_mempool_put(nf_msg_pool, (void *)msg);
-        }
+        while (rte_ring_dequeue(nfs[nf_id].msg_q, (void **)(&msg)) == 0)
+                onvm_nf_msg_release(msg);
 
         /* Free info struct */
         /* Lookup mempool for nf struct */
@@ -544,6 +870,13 @@ onvm_nf_stop(struct onvm_nf *nf) {
         /* Decrease the total number of RUNNING NFs */
         num_nfs--;
 
+        /* Remove this NF from ther service map.
+         * Need to shift all elements past it in the array left to avoid gaps
+         */
+        if (!nf_sleeping) {
+                nf_per_service_count[service_id]--;
+        }
+
         /* Reset stats */
         onvm_stats_clear_nf(nf_id);
 
@@ -565,6 +898,7 @@ onvm_nf_stop(struct onvm_nf *nf) {
                         services[service_id][mapIndex + 1] = 0;
                 }
         }
+        onvm_nf_update_service_lb(service_id);
 
         /* As this NF stopped we can reevaluate core mappings */
         if (ONVM_NF_SHUTDOWN_CORE_REASSIGNMENT) {
@@ -614,6 +948,12 @@ onvm_nf_relocate_nf(uint16_t dest, uint16_t new_core) {
         *msg_data = new_core;
 
         cores[nfs[dest].thread_info.core].nf_count--;
+        if (ONVM_NF_COOP_SCHED && ONVM_CHECK_BIT(nfs[dest].flags.init_options, COOP_SCHED_BIT)) {
+                onvm_threading_sched_remove(&cores[nfs[dest].thread_info.core], dest);
+                /* A NF that doesn't fit runs outside the turns of its new core */
+                if (onvm_threading_sched_add(&cores[new_core], dest, global_sched_quota) < 0)
+                        nfs[dest].flags.init_options &= ~(1 << COOP_SCHED_BIT);
+        }
 
         onvm_nf_send_msg(dest, MSG_CHANGE_CORE, msg_data);
 
@@ -637,13 +977,14 @@ onvm_nf_init_rings(struct onvm_nf *nf) {
         const unsigned msgringsize = NF_MSG_QUEUE_SIZE;
 
         instance_id = nf->instance_id;
-        socket_id = rte_socket_id();
+        /* The NF polls its rings all the time, put them on its own socket */
+        socket_id = cores[nf->thread_info.core].socket_id;
         rq_name = get_rx_queue_name(instance_id);
         tq_name = get_tx_queue_name(instance_id);
         msg_q_name = get_msg_queue_name(instance_id);
-        nf->rx_q = rte_ring_create(rq_name, ringsize, socket_id, RING_F_SC_DEQ);        /* multi prod, single cons */
-        nf->tx_q = rte_ring_create(tq_name, ringsize, socket_id, RING_F_SC_DEQ);        /* multi prod, single cons */
-        nf->msg_q = rte_ring_create(msg_q_name, msgringsize, socket_id, RING_F_SC_DEQ); /* multi prod, single cons */
+        nf->rx_q = onvm_nf_ring_create(rq_name, ringsize, socket_id);
+        nf->tx_q = onvm_nf_ring_create(tq_name, ringsize, socket_id);
+        nf->msg_q = onvm_nf_ring_create(msg_q_name, msgringsize, socket_id);
 
         if (nf->rx_q == NULL)
                 rte_exit(EXIT_FAILURE, "Cannot create rx ring queue for NF %u\n", instance_id);
@@ -654,3 +995,221 @@ onvm_nf_init_rings(struct onvm_nf *nf) {
         if (nf->msg_q == NULL)
                 rte_exit(EXIT_FAILURE, "Cannot create msg queue for NF %u\n", instance_id);
 }
+
+static struct rte_ring *
+onvm_nf_ring_create(const char *name, unsigned count, int socket_id) {
+        struct rte_ring *ring;
+
+        ring = rte_ring_lookup(name);
+        if (ring != NULL) {
+                if (ring->memzone == NULL || ring->memzone->socket_id == socket_id)
+                        return ring;
+                rte_ring_free(ring);
+        }
+
+        return rte_ring_create(name, count, socket_id, RING_F_SC_DEQ); /* multi prod, single cons */
+}
+
+static void
+onvm_nf_count_service_sockets(uint16_t service_id, unsigned *socket_count, uint16_t *core_count) {
+        uint16_t i, instance_id, core;
+
+        if (service_id >= num_services)
+                return;
+
+        for (i = 0; i < nf_per_service_count[service_id]; i++) {
+                instance_id = services[service_id][i];
+                if (!onvm_nf_is_valid(&nfs[instance_id]))
+                        continue;
+                core = nfs[instance_id].thread_info.core;
+                socket_count[cores[core].socket_id]++;
+                if (core_count != NULL && core < RTE_MAX_LCORE)
+                        core_count[core]++;
+        }
+}
+
+static void
+onvm_nf_count_port_socket(uint16_t port_id, unsigned *socket_count) {
+        int socket_id;
+
+        socket_id = rte_eth_dev_socket_id(port_id);
+        if (socket_id >= 0 && socket_id < RTE_MAX_NUMA_NODES)
+                socket_count[socket_id]++;
+}
+
+static int
+onvm_nf_peer_socket(uint16_t service_id, uint16_t *core_count) {
+        unsigned socket_count[RTE_MAX_NUMA_NODES] = {0};
+        struct onvm_sg_node *node;
+        unsigned best_count = 0;
+        int best_socket = SOCKET_ID_ANY;
+        int i, j, k, p;
+
+        if (service_graph != NULL && service_graph->num_nodes > 0) {
+                for (i = 1; i < service_graph->num_nodes; i++) {
+                        node = &service_graph->nodes[i];
+                        if (node->service_id != service_id)
+                                continue;
+                        /* Upstream nodes, node 0 hands over the packets from the ports */
+                        for (j = 0; j < service_graph->num_nodes; j++) {
+                                for (k = 0; k < service_graph->nodes[j].num_next; k++) {
+                                        if (service_graph->nodes[j].next[k] != i)
+                                                continue;
+                                        if (j == 0) {
+                                                for (p = 0; p < ports->num_ports; p++)
+                                                        onvm_nf_count_port_socket(ports->id[p], socket_count);
+                                        } else {
+                                                onvm_nf_count_service_sockets(service_graph->nodes[j].service_id,
+                                                                              socket_count, core_count);
+                                        }
+                                        break;
+                                }
+                        }
+                        /* Downstream nodes, or the port the graph ends on */
+                        for (k = 0; k < node->num_next; k++)
+                                onvm_nf_count_service_sockets(service_graph->nodes[node->next[k]].service_id,
+                                                              socket_count, core_count);
+                        if (node->num_next == 0 && node->port >= 0)
+                                onvm_nf_count_port_socket(node->port, socket_count);
+                }
+        } else if (default_chain != NULL) {
+                /* Chain entries start at 1, the packets of the first hop come from the ports */
+                for (i = 1; i <= default_chain->chain_length; i++) {
+                        if (default_chain->sc[i].action != ONVM_NF_ACTION_TONF ||
+                            default_chain->sc[i].destination != service_id)
+                                continue;
+                        if (i == 1) {
+                                for (p = 0; p < ports->num_ports; p++)
+                                        onvm_nf_count_port_socket(ports->id[p], socket_count);
+                        } else if (default_chain->sc[i - 1].action == ONVM_NF_ACTION_TONF) {
+                                onvm_nf_count_service_sockets(default_chain->sc[i - 1].destination, socket_count,
+                                                              core_count);
+                        }
+                        if (i == default_chain->chain_length)
+                                continue;
+                        if (default_chain->sc[i + 1].action == ONVM_NF_ACTION_TONF)
+                                onvm_nf_count_service_sockets(default_chain->sc[i + 1].destination, socket_count,
+                                                              core_count);
+                        else if (default_chain->sc[i + 1].action == ONVM_NF_ACTION_OUT)
+                                onvm_nf_count_port_socket(default_chain->sc[i + 1].destination, socket_count);
+                }
+        }
+
+        for (i = 0; i < RTE_MAX_NUMA_NODES; i++) {
+                if (socket_count[i] > best_count) {
+                        best_count = socket_count[i];
+                        best_socket = i;
+                }
+        }
+
+        return best_socket;
+}
+
+static int
+onvm_nf_can_handoff(uint16_t instance_id) {
+        struct onvm_nf *nf;
+
+        if (instance_id == 0 || instance_id >= MAX_NFS)
+                return 0;
+        nf = &nfs[instance_id];
+        return (nf->status == NF_RUNNING || nf->status == NF_STARTING) &&
+               ONVM_CHECK_BIT(nf->flags.init_options, FLOW_HANDOFF_BIT);
+}
+
+static void
+onvm_nf_msg_release(struct onvm_nf_msg *msg) {
+        struct onvm_nf_msg_payload *payload;
+        struct onvm_flow_handoff *handoff;
+        uint32_t i;
+
+        switch (msg->msg_type) {
+                case MSG_NF_TYPED:
+                        /* Typed messages from other NFs hold a reference on their payload */
+                        payload = (struct onvm_nf_msg_payload *)msg->msg_data;
+                        if (payload != NULL && __atomic_sub_fetch(&payload->refcnt, 1, __ATOMIC_ACQ_REL) == 0)
+                                rte_free(payload);
+                        break;
+                case MSG_FLOW_EXPORT:
+                case MSG_FLOW_IMPORT:
+                        handoff = (struct onvm_flow_handoff *)msg->msg_data;
+                        if (handoff == NULL)
+                                break;
+                        for (i = 0; i < handoff->num_pkts; i++)
+                                rte_pktmbuf_free(handoff->pkts[i]);
+                        rte_free(handoff->pkts);
+                        rte_free(handoff->state);
+                        rte_free(handoff);
+                        break;
+        }
+
+        rte_mempool_put(nf_msg_pool, (void *)msg);
+}
+
+static int
+onvm_nf_flow_handoff_prepare(uint16_t service_id, const uint16_t *table, struct onvm_flow_handoff **handoffs) {
+        struct onvm_service_lb *lb = &service_lb[service_id];
+        struct onvm_flow_handoff *handoff;
+        uint16_t src, dst;
+        uint32_t slot, w;
+        int i, num_handoffs = 0;
+
+        /* A table built for the first time moves no flow */
+        if (lb->num_instances == 0)
+                return 0;
+
+        for (slot = 0; slot < ONVM_SERVICE_LB_SIZE; slot++) {
+                src = lb->table[slot];
+                dst = table[slot];
+                if (src == dst || !onvm_nf_can_handoff(src) || !onvm_nf_can_handoff(dst))
+                        continue;
+
+                handoff = NULL;
+                for (i = 0; i < num_handoffs; i++) {
+                        if (handoffs[i]->src == src && handoffs[i]->dst == dst) {
+                                handoff = handoffs[i];
+                                break;
+                        }
+                }
+                if (handoff == NULL) {
+                        if (num_handoffs == MAX_NFS_PER_SERVICE)
+                                continue;
+                        handoff = rte_zmalloc(NULL, sizeof(struct onvm_flow_handoff), 0);
+                        if (handoff == NULL)
+                                continue;
+                        handoff->service_id = service_id;
+                        handoff->src = src;
+                        handoff->dst = dst;
+                        handoffs[num_handoffs++] = handoff;
+                }
+                handoff->slots[slot / 64] |= 1ULL << (slot % 64);
+        }
+
+        for (i = 0; i < num_handoffs; i++) {
+                handoff = handoffs[i];
+                for (w = 0; w < ONVM_FLOW_HANDOFF_WORDS; w++)
+                        __atomic_fetch_or(&nfs[handoff->dst].handoff.held[w], handoff->slots[w], __ATOMIC_RELEASE);
+                __atomic_fetch_add(&nfs[handoff->dst].handoff.num_pending, 1, __ATOMIC_RELEASE);
+                handoff->gen = __atomic_add_fetch(&nfs[handoff->dst].handoff.gen, 1, __ATOMIC_RELEASE);
+        }
+
+        return num_handoffs;
+}
+
+static uint32_t
+onvm_nf_core_load(const uint32_t *core_load, int core, int max_cores) {
+        uint32_t load = core_load[core];
+        int i;
+
+        for (i = 0; i < max_cores; i++) {
+                if (i != core && cores[i].sibling_group == cores[core].sibling_group)
+                        load += core_load[i] / 2;
+        }
+        return load;
+}
+
+static int
+onvm_nf_can_move(struct onvm_nf *nf) {
+        return nf->status == NF_RUNNING && ONVM_CHECK_BIT(nf->flags.init_options, SHARE_CORE_BIT) &&
+               !ONVM_CHECK_BIT(nf->flags.init_options, MANUAL_CORE_ASSIGNMENT_BIT) &&
+               !cores[nf->thread_info.core].is_dedicated_core;
+}
@@ -82,7 +82,52 @@ onvm_nf_check_status(void);
 int
 onvm_nf_send_msg(uint16_t dest, uint8_t msg_type, void *msg_data);
 
+/*
+ * Interface to update the cooperative scheduling of the shared cores.
+ * Gives each NF a quota by its share of the packets sent to its core and
+ * hands out cores whose turns got lost.
+ *
+ */
+void
+onvm_nf_sched_update(void);
+
+/*
+ * Interface moving a NF off the busiest shared core of a socket when it is
+ * well above the idlest one, by the cycles each NF spent handling packets
+ * since the last call. Moves at most one NF per call.
+ *
+ */
+void
+onvm_nf_rebalance_cores(void);
+
+/*
+ * Interface to point the RSS redirection table of every port at the NIC RX
+ * queues polled by NFs, or at the manager RX threads while no NF polls one.
+ * Does nothing unless direct RX is enabled.
+ *
+ */
+void
+onvm_nf_steer_direct_rx(void);
+
+/*
+ * Interface handing a free NIC RX queue to a running instance of the first
+ * service of the default chain, which polls it from then on. Does nothing
+ * unless direct RX is enabled and the NF asked for it.
+ *
+ * Input  : a pointer to the NF
+ *
+ */
+void
+onvm_nf_lease_rxq(struct onvm_nf *nf);
+
+/*
+ * Interface rebuilding the consistent hash table of a service from its
+ * running instances, services[service_id][0 .. nf_per_service_count - 1].
+ *
+ * Input  : the service id
+ *
+ */
 void
-onvm_nf_scaling(unsigned difftime);
+onvm_nf_update_service_lb(uint16_t service_id);
 
 #endif  // _ONVM_NF_H_
@@ -48,6 +48,7 @@
 
 #include "onvm_mgr.h"
 
+#include "onvm_classifier.h"
 #include "onvm_nf.h"
 #include "onvm_pkt.h"
 
@@ -57,32 +58,56 @@ void
 onvm_pkt_process_rx_batch(struct queue_mgr *rx_mgr, struct rte_mbuf *pkts[], uint16_t rx_count) {
         uint16_t i;
         struct onvm_pkt_meta *meta;
-#ifdef FLOW_LOOKUP
-        struct onvm_flow_entry *flow_entry;
         struct onvm_service_chain *sc;
-        int ret;
+        struct onvm_service_chain *classified[PACKET_READ_SIZE];
+        uint16_t num_classified = 0;
+        uint8_t policy;
+#ifdef FLOW_LOOKUP
+        struct onvm_flow_entry *flow_entries[PACKET_READ_SIZE];
 #endif
 
         if (rx_mgr == NULL || pkts == NULL)
                 return;
 
+#ifdef FLOW_LOOKUP
+        /* Keys of the whole burst are extracted and looked up at once */
+        if (service_graph->num_nodes == 0)
+                onvm_flow_dir_get_pkt_bulk(pkts, rx_count, flow_entries);
+#endif
+        /* Flows without an entry of their own get the chain of the classifier rule they match */
+        if (service_graph->num_nodes == 0)
+                num_classified = onvm_classifier_classify_bulk(pkts, rx_count, classified);
+
         for (i = 0; i < rx_count; i++) {
                 meta = (struct onvm_pkt_meta *)&(((struct rte_mbuf *)pkts[i])->udata64);
                 meta->src = 0;
                 meta->chain_index = 0;
+                meta->numNF = 0;
+                meta->flags = 0;
+                meta->writers = 0;
+                if (service_graph->num_nodes != 0) {
+                        /* The graph entry node hands the packet to its first services */
+                        onvm_pkt_enqueue_sg(rx_mgr, pkts[i], NULL);
+                        continue;
+                }
+                sc = NULL;
+                policy = ONVM_BP_POLICY_SHED;
 #ifdef FLOW_LOOKUP
-                ret = onvm_flow_dir_get_pkt(pkts[i], &flow_entry);
-                if (ret >= 0) {
-                        sc = flow_entry->sc;
-                        meta->action = onvm_sc_next_action(sc, pkts[i]);
-                        meta->destination = onvm_sc_next_destination(sc, pkts[i]);
-                } else {
+                if (flow_entries[i] != NULL && (sc = onvm_flow_dir_get_sc(flow_entries[i])) != NULL)
+                        policy = flow_entries[i]->bp_policy;
 #endif
-                        meta->action = onvm_sc_next_action(default_chain, pkts[i]);
-                        meta->destination = onvm_sc_next_destination(default_chain, pkts[i]);
-#ifdef FLOW_LOOKUP
+                if (sc == NULL && num_classified != 0 && (sc = classified[i]) != NULL && sc->chain_length > 1) {
+                        /* The rule may be replaced before the packet is done, it keeps its own copy */
+                        onvm_get_pkt_priv(pkts[i])->chain = *sc;
+                        meta->flags = onvm_pkt_set_meta_bit(meta->flags, PKT_META_CLASSIFIED);
                 }
-#endif
+                if (sc == NULL)
+                        sc = default_chain;
+                meta->action = onvm_sc_next_action(sc, pkts[i]);
+                meta->destination = onvm_sc_next_destination(sc, pkts[i]);
+                /* Flows bound for an overloaded service are shed before any NF works on them */
+                if (unlikely(onvm_pkt_bp_active()) && onvm_pkt_bp_shed(rx_mgr, pkts[i], sc, policy))
+                        continue;
                 /* PERF: this might hurt performance since it will cause cache
                  * invalidations. Ideally the data modified by the NF manager
                  * would be a different line than that modified/read by NFs.
@@ -96,17 +121,6 @@ onvm_pkt_process_rx_batch(struct queue_mgr *rx_mgr, struct rte_mbuf *pkts[], uin
         onvm_pkt_flush_all_nfs(rx_mgr, NULL);
 }
 
-void
-onvm_pkt_flush_all_ports(struct queue_mgr *tx_mgr) {
-        uint16_t i;
-
-        if (tx_mgr == NULL)
-                return;
-
-        for (i = 0; i < ports->num_ports; i++)
-                onvm_pkt_flush_port_queue(tx_mgr, ports->id[i]);
-}
-
 void
 onvm_pkt_drop_batch(struct rte_mbuf **pkts, uint16_t size) {
         uint16_t i;
@@ -0,0 +1,719 @@
+/*********************************************************************
+ *                     openNetVM
+ *              https://sdnfv.github.io
+ *
+ *   BSD LICENSE
+ *
+ *   Copyright(c)
+ *            2015-2019 George Washington University
+ *            2015-2019 University of California Riverside
+ *            2010-2019 Intel Corporation. All rights reserved.
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * The name of the author may not be used to endorse or promote
+ *       products derived from this software without specific prior
+ *       written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ********************************************************************/
+
+/******************************************************************************
+
+                                onvm_scale.c
+
+     This file contains the autoscaler. Every tick it samples the rx rings
+     and counters of each service, smooths them with an EWMA and lets the
+     service's policy decide whether it needs one instance more or less.
+     Instances removed are put to sleep first, so they can be woken up
+     again at once, and stopped once they slept long enough. A few sleeping
+     instances can be kept on standby, spawned ahead of time, so that
+     scaling up takes effect on the next burst. A service that can't get
+     any more instances sheds the flows bound for it.
+
+******************************************************************************/
+
+#include "onvm_scale.h"
+#include "onvm_mgr.h"
+#include "onvm_nf.h"
+
+/* Weight of a new sample in the EWMAs, 1 / 2^ONVM_SCALE_EWMA_SHIFT */
+#define ONVM_SCALE_EWMA_SHIFT 2
+
+/* Ticks the predictive policy looks ahead, about the time a new instance takes to start */
+#define ONVM_SCALE_LOOKAHEAD_TICKS 10
+
+/* A NF asked for a new instance that isn't ready after this long is asked again */
+#define ONVM_SCALE_PENDING_MS 5000
+
+/* Share of the offered load a shedding service takes back on every quiet tick */
+#define ONVM_SCALE_BP_STEP (ONVM_BP_ADMIT_ALL / 16)
+
+/* Autoscaling state of a service, only touched by the master thread */
+struct onvm_scale_service {
+        struct onvm_scale_stats stats;
+        uint16_t up_count;
+        uint16_t down_count;
+        uint16_t cooldown;
+        /* Instance asked for a new one and when, 0 if none is pending */
+        uint16_t pending_parent;
+        uint64_t pending_tsc;
+        /* The new instance goes on standby instead of joining the service */
+        bool pending_standby;
+        /* Instances put to sleep or on standby, oldest first, the last one is woken up first */
+        uint16_t sleeping[MAX_NFS_PER_SERVICE];
+        uint64_t sleep_tsc[MAX_NFS_PER_SERVICE];
+};
+
+/* Counters of a NF at the previous tick */
+struct onvm_scale_nf {
+        uint8_t seen;
+        uint64_t rx;
+        uint64_t rx_drop;
+        uint64_t rx_handled;
+};
+
+static struct onvm_scale_service scale_services[MAX_SERVICES];
+static struct onvm_scale_limits scale_limits[MAX_SERVICES];
+static struct onvm_scale_nf scale_nfs[MAX_NFS];
+static uint64_t scale_last_tsc;
+
+/************************Internal functions prototypes************************/
+
+/*
+ * Policy scaling on the rx ring occupancy and drops, and ahead of time on
+ * the arrival rate and its trend once the capacity of an instance is known.
+ */
+static int
+onvm_scale_decide_predictive(const struct onvm_scale_stats *stats, const struct onvm_scale_limits *limits);
+
+/*
+ * Policy scaling on the arrival rate alone, against the capacity of the
+ * running instances.
+ */
+static int
+onvm_scale_decide_rate(const struct onvm_scale_stats *stats, const struct onvm_scale_limits *limits);
+
+/*
+ * Function reading the limits and policy of a service from a JSON object,
+ * keys missing from it keep their value.
+ *
+ * Input  : the JSON object
+ *          the limits to fill
+ * Output : 0 on success, -1 if a value is invalid
+ */
+static int
+onvm_scale_parse_limits(cJSON *config, struct onvm_scale_limits *limits);
+
+/*
+ * Function reading an integer of a JSON object.
+ *
+ * Input  : the JSON object, the key and the range the value has to be in
+ *          the value kept if the key is missing or out of range
+ *          a flag set if it is out of range
+ * Output : the value
+ */
+static int
+onvm_scale_parse_value(cJSON *config, const char *key, int min, int max, int value, bool *invalid);
+
+/*
+ * Function loading the autoscale file.
+ *
+ * Input  : the file name
+ * Output : 0 on success, -1 on error
+ */
+static int
+onvm_scale_load_file(const char *filename);
+
+/*
+ * Function sampling the counters and rx rings of every NF and updating the
+ * stats of their services.
+ *
+ * Input  : the timer cycles since the last sample
+ */
+static void
+onvm_scale_sample(uint64_t cycles);
+
+/*
+ * Function giving a service one more instance, waking up a sleeping one or
+ * asking the first instance of the service to start a new one.
+ *
+ * Input  : the service id
+ * Output : 0 if an instance was added or is on its way, -1 if at the limit
+ */
+static int
+onvm_scale_up(uint16_t service_id, uint64_t now);
+
+/*
+ * Function asking the instance of a service started by hand to spawn a new
+ * one through MSG_SCALE.
+ *
+ * Input  : the service id
+ *          true if the new instance goes on standby
+ * Output : 0 if asked, -1 if the service has no instance to ask
+ */
+static int
+onvm_scale_spawn(uint16_t service_id, uint64_t now, bool standby);
+
+/*
+ * Function putting to sleep the last started instance of a service that
+ * can be stopped, it no longer gets new flows.
+ *
+ * Input  : the service id
+ * Output : 0 on success, -1 if no instance can sleep
+ */
+static int
+onvm_scale_down(uint16_t service_id, uint64_t now);
+
+/*
+ * Function stopping the instances of a service that slept long enough and
+ * forgetting those that stopped on their own.
+ *
+ * Input  : the service id
+ */
+static void
+onvm_scale_stop_sleeping(uint16_t service_id, uint64_t now);
+
+/*
+ * Function setting the share of its offered load a service takes, flows
+ * bound for it are shed upstream while below ONVM_BP_ADMIT_ALL.
+ *
+ * Input  : the service id
+ *          the share out of ONVM_BP_ADMIT_ALL, larger values admit everything
+ */
+static void
+onvm_scale_set_admit(uint16_t service_id, uint64_t admit);
+
+/*****************************Scaling policies********************************/
+
+static const struct onvm_scale_policy onvm_scale_policy_predictive = {
+    .name = "predictive",
+    .decide = onvm_scale_decide_predictive,
+};
+
+static const struct onvm_scale_policy onvm_scale_policy_rate = {
+    .name = "rate",
+    .decide = onvm_scale_decide_rate,
+};
+
+/* Policies a service can pick in the autoscale file, the first one is the default */
+static const struct onvm_scale_policy *scale_policies[] = {
+    &onvm_scale_policy_predictive,
+    &onvm_scale_policy_rate,
+};
+
+static const struct onvm_scale_limits scale_default_limits = {
+    .policy = &onvm_scale_policy_predictive,
+    .min_instances = 1,
+    .max_instances = 8,
+    .high_occupancy = 50,
+    .low_occupancy = 5,
+    .high_load = 90,
+    .up_ticks = 2,
+    .down_ticks = 20,
+    .cooldown_ticks = 10,
+    .sleep_stop_ms = 10000,
+    .standby_instances = 0,
+};
+
+/********************************Interfaces***********************************/
+
+void
+onvm_scale_init(void) {
+        uint16_t i;
+
+        for (i = 0; i < MAX_SERVICES; i++)
+                scale_limits[i] = scale_default_limits;
+
+        if (autoscale_file != NULL && onvm_scale_load_file(autoscale_file) < 0)
+                rte_exit(EXIT_FAILURE, "Invalid autoscale file %s\n", autoscale_file);
+
+        scale_last_tsc = rte_get_tsc_cycles();
+}
+
+void
+onvm_scale_tick(void) {
+        struct onvm_scale_service *state;
+        struct onvm_scale_limits *limits;
+        uint64_t now, cycles;
+        uint16_t i;
+        int decision;
+
+        now = rte_get_tsc_cycles();
+        cycles = now - scale_last_tsc;
+        if (cycles == 0)
+                return;
+        scale_last_tsc = now;
+
+        onvm_scale_sample(cycles);
+
+        for (i = 0; i < num_services; i++) {
+                state = &scale_services[i];
+                limits = &scale_limits[i];
+
+                onvm_scale_stop_sleeping(i, now);
+
+                /* The instance asked for a new one is done, or gave up */
+                if (state->pending_parent != 0 &&
+                    (!nfs[state->pending_parent].wait_flag ||
+                     (now - state->pending_tsc) * 1000 / rte_get_timer_hz() >= ONVM_SCALE_PENDING_MS)) {
+                        nfs[state->pending_parent].wait_flag = false;
+                        state->pending_parent = 0;
+                        state->pending_standby = false;
+                }
+
+                if (nf_per_service_count[i] == 0) {
+                        onvm_scale_set_admit(i, ONVM_BP_ADMIT_ALL);
+                        state->up_count = state->down_count = state->cooldown = 0;
+                        continue;
+                }
+
+                /* Keep the standby pool full, one instance at a time */
+                if (state->pending_parent == 0 && state->stats.num_sleeping < limits->standby_instances &&
+                    nf_per_service_count[i] + state->stats.num_sleeping < limits->max_instances)
+                        onvm_scale_spawn(i, now, true);
+
+                /* Hysteresis, a decision has to hold for a few ticks in a row before it is acted on */
+                decision = limits->policy->decide(&state->stats, limits);
+                state->up_count = decision == ONVM_SCALE_UP ? state->up_count + 1 : 0;
+                state->down_count = decision == ONVM_SCALE_DOWN ? state->down_count + 1 : 0;
+                if (state->cooldown > 0) {
+                        state->cooldown--;
+                        continue;
+                }
+
+                if (state->up_count >= limits->up_ticks) {
+                        state->up_count = 0;
+                        state->cooldown = limits->cooldown_ticks;
+                        if (onvm_scale_up(i, now) == 0 || state->stats.service_rate == 0 ||
+                            state->stats.arrival_rate == 0)
+                                continue;
+                        /* Can't scale any further, shed what the running instances can't take */
+                        onvm_scale_set_admit(i, (uint64_t)service_bp->admit[i] * state->stats.service_rate /
+                                                    state->stats.arrival_rate);
+                } else if (decision != ONVM_SCALE_UP && service_bp->admit[i] < ONVM_BP_ADMIT_ALL) {
+                        /* Take the shed flows back a step at a time, before giving up any instance */
+                        onvm_scale_set_admit(i, service_bp->admit[i] + ONVM_SCALE_BP_STEP);
+                        state->down_count = 0;
+                } else if (state->down_count >= limits->down_ticks) {
+                        state->down_count = 0;
+                        if (onvm_scale_down(i, now) == 0)
+                                state->cooldown = limits->cooldown_ticks;
+                }
+        }
+}
+
+int
+onvm_scale_park(struct onvm_nf *nf) {
+        struct onvm_scale_service *state;
+
+        if (nf->service_id >= num_services)
+                return 0;
+        state = &scale_services[nf->service_id];
+        if (!state->pending_standby || nf->thread_info.parent != state->pending_parent ||
+            state->stats.num_sleeping >= MAX_NFS_PER_SERVICE)
+                return 0;
+
+        state->pending_standby = false;
+        nf->thread_info.sleep_flag = true;
+        state->sleeping[state->stats.num_sleeping] = nf->instance_id;
+        state->sleep_tsc[state->stats.num_sleeping] = rte_get_tsc_cycles();
+        state->stats.num_sleeping++;
+        printf("Autoscale: instance %u of service %u is on standby\n", nf->instance_id, nf->service_id);
+        return 1;
+}
+
+/*****************************Internal functions******************************/
+
+static inline uint64_t
+onvm_scale_ewma(uint64_t avg, uint64_t sample) {
+        /* Rounded away from the average so it reaches the sample */
+        if (sample >= avg)
+                return avg + ((sample - avg + (1 << ONVM_SCALE_EWMA_SHIFT) - 1) >> ONVM_SCALE_EWMA_SHIFT);
+        return avg - ((avg - sample + (1 << ONVM_SCALE_EWMA_SHIFT) - 1) >> ONVM_SCALE_EWMA_SHIFT);
+}
+
+static int
+onvm_scale_decide_predictive(const struct onvm_scale_stats *stats, const struct onvm_scale_limits *limits) {
+        uint64_t predicted, capacity;
+
+        /* Where the arrival rate is heading by the time a new instance is up */
+        predicted = stats->arrival_rate;
+        if (stats->arrival_trend > 0)
+                predicted += (uint64_t)stats->arrival_trend * ONVM_SCALE_LOOKAHEAD_TICKS;
+        capacity = stats->instance_capacity * limits->high_load / 100;
+
+        if (stats->occupancy >= limits->high_occupancy || stats->drop_rate > 0)
+                return ONVM_SCALE_UP;
+        if (capacity && predicted >= capacity * stats->num_instances)
+                return ONVM_SCALE_UP;
+        if (stats->occupancy > limits->low_occupancy || stats->num_instances <= 1)
+                return ONVM_SCALE_HOLD;
+        /* One instance less still has to keep up, as far as can be told */
+        if (capacity == 0 || predicted < capacity * (stats->num_instances - 1))
+                return ONVM_SCALE_DOWN;
+        return ONVM_SCALE_HOLD;
+}
+
+static int
+onvm_scale_decide_rate(const struct onvm_scale_stats *stats, const struct onvm_scale_limits *limits) {
+        uint64_t capacity = stats->instance_capacity * limits->high_load / 100;
+
+        if (capacity == 0)
+                return ONVM_SCALE_HOLD;
+        if (stats->arrival_rate >= capacity * stats->num_instances)
+                return ONVM_SCALE_UP;
+        if (stats->num_instances > 1 && stats->arrival_rate < capacity * (stats->num_instances - 1))
+                return ONVM_SCALE_DOWN;
+        return ONVM_SCALE_HOLD;
+}
+
+static int
+onvm_scale_parse_value(cJSON *config, const char *key, int min, int max, int value, bool *invalid) {
+        cJSON *item = cJSON_GetObjectItem(config, key);
+
+        if (item == NULL)
+                return value;
+        if (!cJSON_IsNumber(item) || item->valueint < min || item->valueint > max) {
+                printf("Autoscale %s must be between %d and %d\n", key, min, max);
+                *invalid = true;
+                return value;
+        }
+        return item->valueint;
+}
+
+static int
+onvm_scale_parse_limits(cJSON *config, struct onvm_scale_limits *limits) {
+        cJSON *item;
+        unsigned i;
+        bool invalid = false;
+
+        item = cJSON_GetObjectItem(config, "policy");
+        if (item != NULL) {
+                if (!cJSON_IsString(item))
+                        return -1;
+                for (i = 0; i < RTE_DIM(scale_policies); i++) {
+                        if (strcmp(item->valuestring, scale_policies[i]->name) == 0)
+                                break;
+                }
+                if (i == RTE_DIM(scale_policies)) {
+                        printf("Unknown scaling policy %s\n", item->valuestring);
+                        return -1;
+                }
+                limits->policy = scale_policies[i];
+        }
+
+        limits->min_instances =
+            onvm_scale_parse_value(config, "min_instances", 1, MAX_NFS_PER_SERVICE, limits->min_instances, &invalid);
+        limits->max_instances =
+            onvm_scale_parse_value(config, "max_instances", 1, MAX_NFS_PER_SERVICE, limits->max_instances, &invalid);
+        limits->high_occupancy =
+            onvm_scale_parse_value(config, "high_occupancy", 1, 100, limits->high_occupancy, &invalid);
+        limits->low_occupancy = onvm_scale_parse_value(config, "low_occupancy", 0, 99, limits->low_occupancy, &invalid);
+        limits->high_load = onvm_scale_parse_value(config, "high_load", 1, 100, limits->high_load, &invalid);
+        limits->up_ticks = onvm_scale_parse_value(config, "up_ticks", 1, UINT16_MAX, limits->up_ticks, &invalid);
+        limits->down_ticks = onvm_scale_parse_value(config, "down_ticks", 1, UINT16_MAX, limits->down_ticks, &invalid);
+        limits->cooldown_ticks =
+            onvm_scale_parse_value(config, "cooldown_ticks", 0, UINT16_MAX, limits->cooldown_ticks, &invalid);
+        limits->sleep_stop_ms =
+            onvm_scale_parse_value(config, "sleep_stop_ms", 0, INT32_MAX, limits->sleep_stop_ms, &invalid);
+        limits->standby_instances = onvm_scale_parse_value(config, "standby_instances", 0, MAX_NFS_PER_SERVICE,
+                                                           limits->standby_instances, &invalid);
+        if (invalid)
+                return -1;
+
+        if (limits->min_instances > limits->max_instances) {
+                printf("Autoscale min_instances is above max_instances\n");
+                return -1;
+        }
+        if (limits->low_occupancy >= limits->high_occupancy) {
+                printf("Autoscale low_occupancy has to be below high_occupancy\n");
+                return -1;
+        }
+        return 0;
+}
+
+static int
+onvm_scale_load_file(const char *filename) {
+        struct onvm_scale_limits defaults = scale_default_limits;
+        cJSON *config, *scale_config, *services_arr, *service_obj, *item;
+        int i, num_configured = 0, service_id, ret = -1;
+
+        config = onvm_config_parse_file(filename);
+        if (config == NULL)
+                return -1;
+
+        scale_config = cJSON_GetObjectItem(config, "autoscale");
+        if (scale_config == NULL) {
+                printf("Unable to find the autoscale config\n");
+                goto out;
+        }
+
+        item = cJSON_GetObjectItem(scale_config, "default");
+        if (item != NULL && onvm_scale_parse_limits(item, &defaults) < 0)
+                goto out;
+        for (i = 0; i < MAX_SERVICES; i++)
+                scale_limits[i] = defaults;
+
+        services_arr = cJSON_GetObjectItem(scale_config, "services");
+        if (services_arr != NULL)
+                num_configured = cJSON_GetArraySize(services_arr);
+        for (i = 0; i < num_configured; i++) {
+                service_obj = cJSON_GetArrayItem(services_arr, i);
+                item = cJSON_GetObjectItem(service_obj, "service");
+                service_id = (item == NULL) ? -1 : item->valueint;
+                if (service_id < 0 || service_id >= MAX_SERVICES) {
+                        printf("Autoscale services need a service id between 0 and %d\n", MAX_SERVICES - 1);
+                        goto out;
+                }
+                if (onvm_scale_parse_limits(service_obj, &scale_limits[service_id]) < 0) {
+                        printf("Invalid autoscale limits for service %d\n", service_id);
+                        goto out;
+                }
+        }
+
+        printf("Autoscale: %s policy by default, %d services configured from %s\n", defaults.policy->name,
+               num_configured, filename);
+        ret = 0;
+out:
+        cJSON_Delete(config);
+        return ret;
+}
+
+static void
+onvm_scale_sample(uint64_t cycles) {
+        uint64_t arrival[MAX_SERVICES] = {0};
+        uint64_t handled[MAX_SERVICES] = {0};
+        uint64_t worst_drop[MAX_SERVICES] = {0};
+        uint64_t saturated[MAX_SERVICES] = {0};
+        uint32_t fill[MAX_SERVICES] = {0};
+        uint32_t declared[MAX_SERVICES] = {0};
+        const uint64_t hz = rte_get_timer_hz();
+        struct onvm_scale_stats *stats;
+        struct onvm_scale_nf *sample;
+        struct onvm_nf *nf;
+        uint64_t rx, rx_drop, rx_handled, drop_pps, handled_pps;
+        uint64_t old_arrival;
+        uint32_t nf_fill;
+        uint16_t i, service_id;
+
+        for (i = 1; i < MAX_NFS; i++) {
+                nf = &nfs[i];
+                sample = &scale_nfs[i];
+                if (!onvm_nf_is_valid(nf) || nf->service_id >= num_services) {
+                        sample->seen = 0;
+                        continue;
+                }
+
+                rx = onvm_nf_stats_rx(nf_rx_stats, i);
+                rx_drop = onvm_nf_stats_rx_drop(nf_rx_stats, i);
+                rx_handled = nf->nf_stats.rx_handled;
+                if (!sample->seen || rx < sample->rx || rx_drop < sample->rx_drop || rx_handled < sample->rx_handled) {
+                        /* First tick of this instance, nothing to compare with yet */
+                        sample->seen = 1;
+                        sample->rx = rx;
+                        sample->rx_drop = rx_drop;
+                        sample->rx_handled = rx_handled;
+                        continue;
+                }
+
+                service_id = nf->service_id;
+                drop_pps = (rx_drop - sample->rx_drop) * hz / cycles;
+                handled_pps = (rx_handled - sample->rx_handled) * hz / cycles;
+                arrival[service_id] += (rx - sample->rx) * hz / cycles + drop_pps;
+                handled[service_id] += handled_pps;
+                worst_drop[service_id] = RTE_MAX(worst_drop[service_id], drop_pps);
+                nf_fill = rte_ring_count(nf->rx_q) * 100 / rte_ring_get_capacity(nf->rx_q);
+                fill[service_id] = RTE_MAX(fill[service_id], nf_fill);
+                /* A saturated instance handles as much as it can */
+                if (nf_fill >= scale_limits[service_id].high_occupancy || drop_pps > 0)
+                        saturated[service_id] = RTE_MAX(saturated[service_id], handled_pps);
+                declared[service_id] = RTE_MAX(declared[service_id], nf->handle_rate);
+                sample->rx = rx;
+                sample->rx_drop = rx_drop;
+                sample->rx_handled = rx_handled;
+        }
+
+        for (i = 0; i < num_services; i++) {
+                stats = &scale_services[i].stats;
+                old_arrival = stats->arrival_rate;
+                stats->num_instances = nf_per_service_count[i];
+                stats->arrival_rate = onvm_scale_ewma(stats->arrival_rate, arrival[i]);
+                stats->arrival_trend += ((int64_t)stats->arrival_rate - (int64_t)old_arrival - stats->arrival_trend) /
+                                        (1 << ONVM_SCALE_EWMA_SHIFT);
+                stats->service_rate = onvm_scale_ewma(stats->service_rate, handled[i]);
+                stats->drop_rate = onvm_scale_ewma(stats->drop_rate, worst_drop[i]);
+                stats->occupancy = onvm_scale_ewma(stats->occupancy, fill[i]);
+                /* What the NFs declare they handle wins over what was seen */
+                if (declared[i])
+                        stats->instance_capacity = declared[i];
+                else if (saturated[i])
+                        stats->instance_capacity = onvm_scale_ewma(stats->instance_capacity, saturated[i]);
+        }
+}
+
+static int
+onvm_scale_up(uint16_t service_id, uint64_t now) {
+        struct onvm_scale_service *state = &scale_services[service_id];
+        uint16_t count = nf_per_service_count[service_id];
+        uint16_t instance_id;
+        struct onvm_nf *nf;
+
+        if (count >= MAX_NFS_PER_SERVICE)
+                return -1;
+
+        while (state->stats.num_sleeping > 0) {
+                instance_id = state->sleeping[--state->stats.num_sleeping];
+                nf = &nfs[instance_id];
+                if (!onvm_nf_is_valid(nf) || !nf->thread_info.sleep_flag)
+                        continue;
+                nf->thread_info.sleep_flag = false;
+                services[service_id][count] = instance_id;
+                nf_per_service_count[service_id]++;
+                onvm_nf_update_service_lb(service_id);
+                /* Parked instances skipped the lease when they became ready */
+                onvm_nf_lease_rxq(nf);
+                printf("Autoscale: woke up instance %u of service %u\n", instance_id, service_id);
+                return 0;
+        }
+
+        if (state->pending_parent != 0) {
+                /* The instance on its way joins the service rather than the standby pool */
+                state->pending_standby = false;
+                return 0;
+        }
+        if (count >= scale_limits[service_id].max_instances)
+                return -1;
+
+        return onvm_scale_spawn(service_id, now, false);
+}
+
+static int
+onvm_scale_spawn(uint16_t service_id, uint64_t now, bool standby) {
+        struct onvm_scale_service *state = &scale_services[service_id];
+        uint16_t count = nf_per_service_count[service_id];
+        struct onvm_nf *nf = NULL;
+        uint16_t i;
+
+        /* The instance started by hand spawns the new ones */
+        for (i = 0; i < count; i++) {
+                nf = &nfs[services[service_id][i]];
+                if (nf->thread_info.parent == 0)
+                        break;
+        }
+        if (i == count)
+                return -1;
+        if (nf->wait_flag)
+                return 0;
+
+        nf->wait_flag = true;
+        state->pending_parent = nf->instance_id;
+        state->pending_tsc = now;
+        state->pending_standby = standby;
+        printf("Autoscale: instance %u of service %u starts a new one%s\n", nf->instance_id, service_id,
+               standby ? " on standby" : "");
+        onvm_nf_send_msg(nf->instance_id, MSG_SCALE, NULL);
+        return 0;
+}
+
+static int
+onvm_scale_down(uint16_t service_id, uint64_t now) {
+        struct onvm_scale_service *state = &scale_services[service_id];
+        uint16_t count = nf_per_service_count[service_id];
+        uint16_t *instances = services[service_id];
+        struct onvm_nf *nf = NULL;
+        int i;
+
+        if (count <= scale_limits[service_id].min_instances)
+                return -1;
+
+        /* Only spawned instances stop, an instance polling a NIC RX queue would still get packets */
+        for (i = count - 1; i >= 0; i--) {
+                nf = &nfs[instances[i]];
+                if (nf->thread_info.parent != 0 && nf->nic_rxq == ONVM_NF_NO_RXQ)
+                        break;
+        }
+        if (i < 0)
+                return -1;
+
+        for (; i < count - 1; i++)
+                instances[i] = instances[i + 1];
+        instances[count - 1] = 0;
+        nf->thread_info.sleep_flag = true;
+        nf_per_service_count[service_id]--;
+        onvm_nf_update_service_lb(service_id);
+
+        state->sleeping[state->stats.num_sleeping] = nf->instance_id;
+        state->sleep_tsc[state->stats.num_sleeping] = now;
+        state->stats.num_sleeping++;
+        printf("Autoscale: put instance %u of service %u to sleep\n", nf->instance_id, service_id);
+        return 0;
+}
+
+static void
+onvm_scale_stop_sleeping(uint16_t service_id, uint64_t now) {
+        struct onvm_scale_service *state = &scale_services[service_id];
+        uint64_t stop_cycles = (uint64_t)scale_limits[service_id].sleep_stop_ms * rte_get_timer_hz() / 1000;
+        uint16_t i, kept = 0, num_alive = 0;
+        struct onvm_nf *nf;
+
+        for (i = 0; i < state->stats.num_sleeping; i++) {
+                nf = &nfs[state->sleeping[i]];
+                if (onvm_nf_is_valid(nf) && nf->thread_info.sleep_flag)
+                        num_alive++;
+        }
+
+        for (i = 0; i < state->stats.num_sleeping; i++) {
+                nf = &nfs[state->sleeping[i]];
+                if (!onvm_nf_is_valid(nf) || !nf->thread_info.sleep_flag)
+                        continue;
+                /* The most recent ones stay on standby whatever their age */
+                if (num_alive > scale_limits[service_id].standby_instances &&
+                    now - state->sleep_tsc[i] >= stop_cycles) {
+                        num_alive--;
+                        printf("Autoscale: stopping instance %u of service %u\n", nf->instance_id, service_id);
+                        onvm_nf_send_msg(nf->instance_id, MSG_STOP, NULL);
+                        continue;
+                }
+                state->sleeping[kept] = state->sleeping[i];
+                state->sleep_tsc[kept] = state->sleep_tsc[i];
+                kept++;
+        }
+        state->stats.num_sleeping = kept;
+}
+
+static void
+onvm_scale_set_admit(uint16_t service_id, uint64_t admit) {
+        uint16_t old_admit = service_bp->admit[service_id];
+
+        admit = RTE_MAX(RTE_MIN(admit, (uint64_t)ONVM_BP_ADMIT_ALL), 1ULL);
+        if (admit == old_admit)
+                return;
+
+        if (old_admit == ONVM_BP_ADMIT_ALL)
+                service_bp->num_overloaded++;
+        else if (admit == ONVM_BP_ADMIT_ALL)
+                service_bp->num_overloaded--;
+        service_bp->admit[service_id] = admit;
+        printf("Service %u admits %" PRIu64 "/%u of its load\n", service_id, admit, ONVM_BP_ADMIT_ALL);
+}
@@ -0,0 +1,134 @@
+/*********************************************************************
+ *                     openNetVM
+ *              https://sdnfv.github.io
+ *
+ *   BSD LICENSE
+ *
+ *   Copyright(c)
+ *            2015-2019 George Washington University
+ *            2015-2019 University of California Riverside
+ *            2010-2019 Intel Corporation. All rights reserved.
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * The name of the author may not be used to endorse or promote
+ *       products derived from this software without specific prior
+ *       written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ********************************************************************/
+
+/******************************************************************************
+
+                                onvm_scale.h
+
+     This file contains the prototypes and structures of the autoscaler,
+     which adds and removes instances of each service as its load changes.
+
+******************************************************************************/
+
+#ifndef _ONVM_SCALE_H_
+#define _ONVM_SCALE_H_
+
+#include "onvm_common.h"
+
+/* Period the master thread ticks the autoscaler at, in milliseconds */
+#define ONVM_SCALE_TICK_MS 100
+
+/* Decisions a scaling policy takes for a service on every tick */
+#define ONVM_SCALE_HOLD 0
+#define ONVM_SCALE_UP 1
+#define ONVM_SCALE_DOWN 2
+
+/*
+ * Limits a service scales within, the defaults apply to every service not
+ * listed in the autoscale file.
+ */
+struct onvm_scale_limits {
+        const struct onvm_scale_policy *policy;
+        uint16_t min_instances;   // running instances never put to sleep
+        uint16_t max_instances;   // running and sleeping instances
+        uint8_t high_occupancy;   // rx ring fill in percent asking for one more instance
+        uint8_t low_occupancy;    // rx ring fill in percent below which one instance less may do
+        uint8_t high_load;        // share in percent of the instances capacity asking for one more
+        uint16_t up_ticks;        // ticks in a row asking for one more instance before it starts
+        uint16_t down_ticks;      // ticks in a row asking for one instance less before it sleeps
+        uint16_t cooldown_ticks;  // ticks after a change before the next one
+        uint32_t sleep_stop_ms;   // time a sleeping instance is kept to be woken up before it stops
+        uint16_t standby_instances;  // sleeping instances kept ready, spawned ahead of time if need be
+};
+
+/*
+ * What a policy sees of a service, smoothed by an EWMA over the ticks.
+ * Rates are in packets per second.
+ */
+struct onvm_scale_stats {
+        uint16_t num_instances;      // running instances
+        uint16_t num_sleeping;       // instances put to sleep, woken up first when scaling up
+        uint64_t arrival_rate;       // packets offered to the rx rings, dropped ones included
+        int64_t arrival_trend;       // change of the arrival rate per tick
+        uint64_t service_rate;       // packets the instances handled
+        uint64_t drop_rate;          // packets dropped at the rx ring of the worst instance
+        uint32_t occupancy;          // fill of the fullest rx ring in percent
+        uint64_t instance_capacity;  // packets one instance handles, declared or seen while saturated, 0 if unknown
+};
+
+/*
+ * A scaling policy, picked by name for each service. The autoscaler applies
+ * the hysteresis, the limits and the cooldown to the decisions it takes.
+ */
+struct onvm_scale_policy {
+        const char *name;
+        int (*decide)(const struct onvm_scale_stats *stats, const struct onvm_scale_limits *limits);
+};
+
+/********************************Interfaces***********************************/
+
+/*
+ * Interface setting up the autoscaler, with the policies and limits of
+ * autoscale_file when one was given.
+ *
+ */
+void
+onvm_scale_init(void);
+
+/*
+ * Interface sampling the rings and counters of every service and scaling
+ * them up or down. Called by the master thread every ONVM_SCALE_TICK_MS.
+ *
+ */
+void
+onvm_scale_tick(void);
+
+/*
+ * Interface parking a NF that just became ready if it is the standby
+ * instance the autoscaler asked for. It runs its setup and polls its rings
+ * but gets no flows until the autoscaler wakes it up.
+ *
+ * Input  : a pointer to the NF
+ * Output : 1 if the NF was parked, 0 if it joins its service
+ */
+int
+onvm_scale_park(struct onvm_nf *nf);
+
+#endif  // _ONVM_SCALE_H_
@@ -79,6 +79,21 @@ onvm_stats_display_ports(unsigned difftime, uint8_t verbosity_level);
 static void
 onvm_stats_display_nfs(unsigned difftime, uint8_t verbosity_level);
 
+/*
+ * Function displaying the services under backpressure and the packets shed for them
+ *
+ * Input : time passed since last display (to compute shed rate)
+ *
+ */
+static void
+onvm_stats_display_bp(unsigned difftime);
+
+/*
+ * Function displaying how long NFs took to attach to the manager.
+ */
+static void
+onvm_stats_display_attach(void);
+
 /*
  * Function clearing the terminal and moving back the cursor to the top left.
  *
@@ -122,6 +137,15 @@ static FILE *json_events_out;
 
 /****************************Global variables***************************************/
 
+/* Time from a NF's request for an id to it running, in TSC cycles */
+static struct {
+        uint64_t count;
+        uint64_t last;
+        uint64_t total;
+        uint64_t max;
+} attach_latency;
+
+
 /* Holds current timestamp, might want to make this not global */
 char buffer[20];
 
@@ -218,11 +242,17 @@ onvm_stats_clear_all_nfs(void) {
 
 void
 onvm_stats_clear_nf(uint16_t id) {
-        nfs[id].stats.rx = nfs[id].stats.rx_drop = 0;
+        unsigned i;
+
+        for (i = 0; i < ONVM_MAX_THREAD_IDS; i++)
+                nf_rx_stats[i].rx[id] = nf_rx_stats[i].rx_drop[id] = 0;
         nfs[id].stats.tx = nfs[id].stats.tx_drop = 0;
         nfs[id].stats.act_drop = nfs[id].stats.act_tonf = 0;
         nfs[id].stats.act_next = nfs[id].stats.act_out = 0;
-        nfs[id].stats.tx_returned = nfs[id].stats.tx_buffer = 0;
+        nfs[id].nf_stats.rx_handled = nfs[id].nf_stats.tx_returned_drop = 0;
+        nfs[id].nf_stats.tx_returned = nfs[id].nf_stats.tx_buffer = 0;
+        nfs[id].nf_stats.busy_cycles = 0;
+        nfs[id].shared_core.num_wakeups = 0;
 }
 
 void
@@ -333,7 +363,7 @@ onvm_stats_display_ports(unsigned difftime, uint8_t verbosity_level) {
                 fprintf(stats_out, "\n\n");
         }
         for (i = 0; i < ports->num_ports; i++) {
-                nic_rx_pkts = ports->rx_stats.rx[ports->id[i]];
+                nic_rx_pkts = onvm_port_stats_rx(ports, ports->id[i]);
                 nic_tx_pkts = ports->tx_stats.tx[ports->id[i]];
 
                 nic_rx_pps = (nic_rx_pkts - rx_last[i]) / difftime;
@@ -368,24 +398,67 @@ onvm_stats_display_ports(unsigned difftime, uint8_t verbosity_level) {
 }
 
 static void
-onvm_stats_display_client_wakeup_thread_context(int difftime) {
+onvm_stats_display_nf_wakeups(int difftime) {
+        static uint64_t prev_num_wakeups = 0;
         uint64_t num_wakeups = 0;
-        uint64_t prev_num_wakeups = 0;
         uint64_t wakeup_rate;
         unsigned i = 0;
 
         for (i = 0; i < MAX_NFS; i++) {
                 if (!onvm_nf_is_valid(&nfs[i]))
                         continue;
-                num_wakeups += nf_wakeup_infos[i].num_wakeups;
-                prev_num_wakeups += nf_wakeup_infos[i].prev_num_wakeups;
-                nf_wakeup_infos[i].prev_num_wakeups = nf_wakeup_infos[i].num_wakeups;
+                num_wakeups += nfs[i].shared_core.num_wakeups;
         }
 
-        wakeup_rate = (num_wakeups - prev_num_wakeups) / difftime;
+        /* The total shrinks when NFs exit */
+        wakeup_rate = num_wakeups > prev_num_wakeups ? (num_wakeups - prev_num_wakeups) / difftime : 0;
+        prev_num_wakeups = num_wakeups;
         fprintf(stats_out, "Total wakeups = %" PRIu64 ", Wakeup rate = %" PRIu64 "\n", num_wakeups, wakeup_rate);
 }
 
+void
+onvm_stats_add_attach_latency(uint64_t cycles) {
+        attach_latency.count++;
+        attach_latency.last = cycles;
+        attach_latency.total += cycles;
+        attach_latency.max = RTE_MAX(attach_latency.max, cycles);
+}
+
+static void
+onvm_stats_display_attach(void) {
+        const uint64_t cycles_per_us = RTE_MAX(rte_get_tsc_hz() / US_PER_S, (uint64_t)1);
+
+        if (attach_latency.count == 0)
+                return;
+        fprintf(stats_out, "\n\nNF attach latency: last %" PRIu64 " us, avg %" PRIu64 " us, max %" PRIu64
+                " us over %" PRIu64 " NFs\n", attach_latency.last / cycles_per_us,
+                attach_latency.total / attach_latency.count / cycles_per_us, attach_latency.max / cycles_per_us,
+                attach_latency.count);
+}
+
+static void
+onvm_stats_display_bp(unsigned difftime) {
+        static uint64_t bp_drop_last[MAX_SERVICES];
+        uint64_t bp_drop, bp_drop_rate;
+        uint8_t header = 0;
+        unsigned i;
+
+        for (i = 0; i < MAX_SERVICES; i++) {
+                bp_drop = onvm_service_stats_bp_drop(nf_rx_stats, i);
+                bp_drop_rate = (bp_drop - bp_drop_last[i]) / difftime;
+                bp_drop_last[i] = bp_drop;
+                if (service_bp->admit[i] == ONVM_BP_ADMIT_ALL && bp_drop_rate == 0)
+                        continue;
+                if (!header) {
+                        fprintf(stats_out, "\n\nBackpressure\n");
+                        fprintf(stats_out, "------------\n");
+                        header = 1;
+                }
+                fprintf(stats_out, "Service %2u: admit %3u/%u, shed %9" PRIu64 " (%9" PRIu64 " pps)\n", i,
+                        service_bp->admit[i], ONVM_BP_ADMIT_ALL, bp_drop, bp_drop_rate);
+        }
+}
+
 static void
 onvm_stats_display_nfs(unsigned difftime, uint8_t verbosity_level) {
         char *nf_label = NULL;
@@ -396,6 +469,8 @@ onvm_stats_display_nfs(unsigned difftime, uint8_t verbosity_level) {
         /* Arrays to store last TX/RX pkts dropped for NFs to calculate drop rate */
         static uint64_t nf_tx_drop_last[MAX_NFS];
         static uint64_t nf_rx_drop_last[MAX_NFS];
+        /* Array to store last wakeup count for NFs to calculate wakeup rate */
+        static uint64_t nf_wakeups_last[MAX_NFS];
         static const char *NF_MSG[3];
 
         NF_MSG[0] = ONVM_STATS_MSG;
@@ -445,28 +520,28 @@ onvm_stats_display_nfs(unsigned difftime, uint8_t verbosity_level) {
         for (i = 0; i < MAX_NFS; i++) {
                 if (!onvm_nf_is_valid(&nfs[i]))
                         continue;
-                const uint64_t rx = nfs[i].stats.rx;
-                const uint64_t rx_drop = nfs[i].stats.rx_drop;
+                /* The rx counters are spread over one row per writer */
+                const uint64_t rx = onvm_nf_stats_rx(nf_rx_stats, i);
+                const uint64_t rx_drop = onvm_nf_stats_rx_drop(nf_rx_stats, i);
                 const uint64_t tx = nfs[i].stats.tx;
-                const uint64_t tx_drop = nfs[i].stats.tx_drop;
+                const uint64_t tx_drop = nfs[i].stats.tx_drop + nfs[i].nf_stats.tx_returned_drop;
                 const uint64_t act_out = nfs[i].stats.act_out;
                 const uint64_t act_tonf = nfs[i].stats.act_tonf;
                 const uint64_t act_drop = nfs[i].stats.act_drop;
                 const uint64_t act_next = nfs[i].stats.act_next;
-                const uint64_t act_buffer = nfs[i].stats.tx_buffer;
-                const uint64_t act_returned = nfs[i].stats.tx_returned;
+                const uint64_t act_buffer = nfs[i].nf_stats.tx_buffer;
+                const uint64_t act_returned = nfs[i].nf_stats.tx_returned;
                 const uint64_t rx_pps = (rx - nf_rx_last[i]) / difftime;
                 const uint64_t tx_pps = (tx - nf_tx_last[i]) / difftime;
                 const uint64_t tx_drop_rate = (tx_drop - nf_tx_drop_last[i]) / difftime;
                 const uint64_t rx_drop_rate = (rx_drop - nf_rx_drop_last[i]) / difftime;
-                const uint64_t num_wakeups = nf_wakeup_infos[i].num_wakeups;
-                const uint64_t prev_num_wakeups = nf_wakeup_infos[i].prev_num_wakeups;
-                const uint64_t wakeup_rate = (num_wakeups - prev_num_wakeups) / difftime;
+                const uint64_t num_wakeups = nfs[i].shared_core.num_wakeups;
+                const uint64_t wakeup_rate = (num_wakeups - nf_wakeups_last[i]) / difftime;
                 char state;
 
                 uint8_t active = 0;
                 if (ONVM_NF_SHARE_CORES)
-                        active = rte_atomic16_read(nf_wakeup_infos[i].shm_server);
+                        active = nfs[i].shared_core.sleep_state;
                 if (!active) {
                         state = 'W';
                 } else {
@@ -529,10 +604,11 @@ onvm_stats_display_nfs(unsigned difftime, uint8_t verbosity_level) {
                         nf_label = NULL;
                 }
 
-                nf_rx_last[i] = nfs[i].stats.rx;
-                nf_tx_last[i] = nfs[i].stats.tx;
+                nf_rx_last[i] = rx;
+                nf_tx_last[i] = tx;
                 nf_rx_drop_last[i] = rx_drop;
                 nf_tx_drop_last[i] = tx_drop;
+                nf_wakeups_last[i] = num_wakeups;
         }
 
         if (verbosity_level == ONVM_RAW_STATS_DUMP)
@@ -563,10 +639,13 @@ onvm_stats_display_nfs(unsigned difftime, uint8_t verbosity_level) {
                 }
         }
 
+        onvm_stats_display_bp(difftime);
+        onvm_stats_display_attach();
+
         if (ONVM_NF_SHARE_CORES) {
                 fprintf(stats_out, "\n\nShared core stats\n");
                 fprintf(stats_out, "-----------------\n");
-                onvm_stats_display_client_wakeup_thread_context(difftime);
+                onvm_stats_display_nf_wakeups(difftime);
         }
 }
 
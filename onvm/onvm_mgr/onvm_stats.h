@@ -222,4 +222,11 @@ onvm_stats_gen_event_info(const char *msg, uint8_t type, void *data);
 void
 onvm_stats_gen_event_nf_info(const char *msg, struct onvm_nf *nf);
 
+/*
+ * Interface called by the manager when a NF starts running, with the TSC
+ * cycles from its request for an id to the end of its handshake.
+ */
+void
+onvm_stats_add_attach_latency(uint64_t cycles);
+
 #endif  // _ONVM_STATS_H_
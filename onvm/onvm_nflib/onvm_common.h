@@ -46,27 +46,89 @@
 
 /* Std C library includes for shared core */
 #include <fcntl.h>
+#include <linux/futex.h>
 #include <rte_ethdev.h>
 #include <rte_ether.h>
 #include <rte_hash.h>
 #include <rte_mbuf.h>
-#include <semaphore.h>
 #include <signal.h>
-#include <sys/ipc.h>
-#include <sys/shm.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #include "onvm_config_common.h"
 #include "onvm_msg_common.h"
 
 #define ONVM_NF_HANDLE_TX 1                   // should be true if NFs primarily pass packets to each other
 #define ONVM_NF_SHUTDOWN_CORE_REASSIGNMENT 0  // should be true if on NF shutdown onvm_mgr tries to reallocate cores
+#define ONVM_NF_LOAD_CORE_REASSIGNMENT 1      // should be true if onvm_mgr moves shared core NFs off the busiest cores
+
+/*
+ * Live rebalancing of the NFs sharing cores, by the share of the TSC cycles
+ * each NF spends handling packets, in per mille of a core. A NF moves when
+ * the busiest core of a socket is that much above the idlest one, half of
+ * the load of a hyperthread sibling counts toward a core's load.
+ */
+#define ONVM_NF_REBALANCE_THRESHOLD 300  // per mille of a core between the busiest and idlest core
+#define ONVM_NF_REBALANCE_LLC_BONUS 50   // per mille a core sharing its LLC with the NF's peers is worth
+#define ONVM_NF_REBALANCE_COOLDOWN 2     // stats intervals without moves after a NF moved
 
 #define ONVM_MAX_CHAIN_LENGTH 4  // the maximum chain length
 #define MAX_NFS 128              // total number of concurrent NFs allowed (-1 because ID 0 is reserved)
 #define MAX_SERVICES 32          // total number of unique services allowed
 #define MAX_NFS_PER_SERVICE 32   // max number of NFs per service.
 
+/*
+ * Flows are spread over the running instances of a service with a Maglev
+ * consistent hash table, indexed by the RSS hash of the packet. The manager
+ * rebuilds the table of a service whenever an instance joins, sleeps, wakes
+ * up or stops, so only about 1/N of the flows change instance.
+ */
+#define ONVM_SERVICE_LB_SIZE 1021  // prime, well above MAX_NFS_PER_SERVICE
+
+struct onvm_service_lb {
+        uint16_t num_instances;
+        uint16_t table[ONVM_SERVICE_LB_SIZE];
+};
+
+/*
+ * When slots of a service's table change instance and both instances hand
+ * their flows over (flow_export and flow_import), the manager marks the
+ * slots held at the new instance and sends the old one MSG_FLOW_EXPORT.
+ * The old instance exports the state of the flows of these slots, adds the
+ * packets its rx ring still had for them and sends it all on with
+ * MSG_FLOW_IMPORT. The new instance holds the packets of these flows until
+ * then, so no packet is handled without its state or out of order.
+ */
+#define ONVM_FLOW_HANDOFF_WORDS ((ONVM_SERVICE_LB_SIZE + 63) / 64)
+
+struct onvm_flow_handoff {
+        uint16_t service_id;
+        uint16_t src;  // instance giving the flows up
+        uint16_t dst;  // instance taking them over
+        uint32_t gen;  // generation of the handoff at dst, see the handoff state of struct onvm_nf
+        uint64_t slots[ONVM_FLOW_HANDOFF_WORDS];
+        /* State of the flows exported by src, allocated with rte_malloc and freed with the handoff */
+        void *state;
+        uint32_t state_len;
+        /* Packets of the flows src still had, dst handles them before any newer one */
+        struct rte_mbuf **pkts;
+        uint32_t num_pkts;
+};
+
+/* Whether the flow with this RSS hash is one of those handed over */
+static inline int
+onvm_flow_handoff_has(const struct onvm_flow_handoff *handoff, uint32_t rss) {
+        uint32_t slot = rss % ONVM_SERVICE_LB_SIZE;
+
+        return (handoff->slots[slot / 64] >> (slot % 64)) & 1;
+}
+
+/* Ids of the threads writing shared per thread state: NFs use their instance
+ * id, manager threads their lcore after the NF ids */
+#define ONVM_MGR_THREAD_ID(lcore) (MAX_NFS + (lcore))
+#define ONVM_MAX_THREAD_IDS (MAX_NFS + RTE_MAX_LCORE)
+
 #define NUM_MBUFS 32767          // total number of mbufs (2^15 - 1)
 #define NF_QUEUE_RINGSIZE 32768  // size of queue for NFs
 
@@ -75,9 +137,19 @@
 #define ONVM_NF_SHARE_CORES_DEFAULT \
         0  // default value for shared core logic, if true NFs sleep while waiting for packets
 
-#define PKT_WAKEUP_THRESHOLD 1  // for shared core mode, how many packets are required to wake up the NF
-#define MSG_WAKEUP_THRESHOLD \
-        1  // for shared core mode, how many messages on an NF's ring are required to wake up the NF
+#define ONVM_NF_SPIN_MIN 16    // for shared core mode, fewest empty polls of an idle NF before it blocks
+#define ONVM_NF_SPIN_MAX 1024  // for shared core mode, most empty polls of an idle NF before it blocks
+
+#define ONVM_NF_COOP_SCHED_DEFAULT 0      // default value for cooperative scheduling of the NFs sharing a core
+#define ONVM_SCHED_MAX_NFS 32             // most NFs taking turns on one core
+#define ONVM_SCHED_DEFAULT_QUOTA 256      // packets a NF handles per turn, unless the manager is told otherwise
+#define ONVM_SCHED_MAX_QUOTA_SCALE 4      // a busy NF gets at most this many times the base quota
+#define ONVM_SCHED_DEADLINE_US 1000       // a NF with work waiting longer than this goes first
+
+/* Shared core sleep states of a NF */
+#define NF_AWAKE 0
+#define NF_SLEEPING 1      // No work, woken by whoever hands it some
+#define NF_WAITING_TURN 2  // Cooperative scheduling only, woken when its core is handed to it
 
 /* Default action */
 #define ONVM_NF_ACTION_NEXT 0
@@ -90,6 +162,17 @@
 /* Used in setting bit flags for core options */
 #define MANUAL_CORE_ASSIGNMENT_BIT 0
 #define SHARE_CORE_BIT 1
+#define COOP_SCHED_BIT 2  // Set by onvm_nflib_run, the NF can take turns with the other NFs on its core
+#define NIC_TX_QUEUE_BIT 3  // The NF asks for its own NIC TX queue and sends packets out without a TX thread
+#define DIRECT_RX_BIT 4     // Set by onvm_nflib_run, the NF can poll a NIC RX queue of its own
+#define FLOW_HANDOFF_BIT 5  // Set by onvm_nflib_run, the NF hands its flows over with flow_export/flow_import
+
+/* No NIC TX queue leased, packets go out through the manager TX threads */
+#define ONVM_NF_NO_TXQ UINT16_MAX
+/* No NIC RX queue leased, packets come through the manager RX threads */
+#define ONVM_NF_NO_RXQ UINT16_MAX
+/* Most NIC RX queues per port polled directly by instances of the first service */
+#define ONVM_MAX_NF_RX_QUEUES 16
 
 #define ONVM_SIGNAL_TERMINATION -999
 
@@ -106,32 +189,100 @@
 /* Measured in seconds */
 #define TIME_TTL_MULTIPLIER 1
 
+/* Microseconds a NF waits between looks at the manager's answer to its startup messages */
+#define NF_HANDSHAKE_POLL_US 1000
+
 /* For NF termination handling */
 #define NF_TERM_WAIT_TIME 1
 #define NF_TERM_INIT_ITER_TIMES 3
 /* If a lot of children spawned this might need to be increased */
 #define NF_TERM_STOP_ITER_TIMES 10
 
+/*
+ * Parallel payload flags. A dispatcher sets PKT_META_PAYLOAD_WRITE and lists in
+ * meta->writers the service of the fan-out that modifies the packet. It gets a
+ * private copy (PKT_META_CLONE, PKT_META_PAYLOAD_WRITE), the others share the
+ * original read-only (PKT_META_PAYLOAD_READ). With PKT_META_HDR_WRITE only the
+ * first ONVM_PKT_HDR_COPY_LEN bytes are copied and the payload stays shared.
+ * Only one copy can replace the original at the join, so a fan-out with more
+ * than one writer is dropped.
+ */
 #define PKT_META_PAYLOAD_READ 0
 #define PKT_META_PAYLOAD_WRITE 1
 #define PKT_META_GO_PARALLEL 2
 #define PKT_META_CLONE 3
+#define PKT_META_HDR_WRITE 4
+/* Set while the branches of a service graph fork are processing the packet */
+#define PKT_META_SG_FORK 5
+/* Set when the manager classifier gave the packet a chain of several steps, kept in its private area */
+#define PKT_META_CLASSIFIED 6
+
+#define ONVM_PKT_HDR_COPY_LEN 128
+
+/*
+ * Action and destination of a packet, packed together so parallel NFs can
+ * merge their verdicts with a single compare-and-swap.
+ */
+union onvm_pkt_verdict {
+        struct {
+                uint8_t action;
+                uint8_t destination;
+        };
+        uint16_t value;
+};
 
 struct onvm_pkt_meta {
-        volatile uint8_t action; /* Action to be performed */
-        uint8_t destination;     /* where to go next */
-        uint8_t src;             /* who processed the packet last */
-        uint8_t chain_index;     /*index of the current step in the service chain*/
-        volatile uint8_t mutex_id;
-        volatile uint8_t numNF; /* Number of parallel NFs */
+        union {
+                struct {
+                        volatile uint8_t action; /* Action to be performed */
+                        uint8_t destination;     /* where to go next */
+                };
+                volatile uint16_t verdict; /* action and destination, updated atomically by parallel NFs */
+        };
+        uint8_t src;            /* who processed the packet last */
+        uint8_t chain_index;    /*index of the current step in the service chain*/
+        volatile uint8_t numNF; /* Number of parallel NFs still processing the packet */
         volatile uint8_t flags;
+        /* Service of a parallel fan-out that modifies the packet, bit i for service i as in the fan-out
+         * destination, which only reaches services 0 to 7 */
+        uint8_t writers;
+};
+
+/*
+ * Define a structure to describe a service chain entry
+ */
+struct onvm_service_chain_entry {
+        uint16_t destination;
+        uint8_t action;
 };
 
+struct onvm_service_chain {
+        struct onvm_service_chain_entry sc[ONVM_MAX_CHAIN_LENGTH];
+        uint8_t chain_length;
+        int ref_cnt;
+};
+
+/* Private area appended to the mbufs of the onvm packet and clone pools */
+struct onvm_pkt_priv {
+        /* A writer copy points to its parent, a parent to the writer copy kept for the join */
+        struct rte_mbuf *parallel_link;
+        uint8_t parallel_service; /* service a writer copy was made for */
+        /* Chain picked by the manager classifier, only valid while PKT_META_CLASSIFIED is set */
+        struct onvm_service_chain chain;
+};
+
+#define ONVM_PKT_PRIV_SIZE RTE_ALIGN(sizeof(struct onvm_pkt_priv), RTE_MBUF_PRIV_ALIGN)
+
 static inline struct onvm_pkt_meta *
 onvm_get_pkt_meta(struct rte_mbuf *pkt) {
         return (struct onvm_pkt_meta *)&pkt->udata64;
 }
 
+static inline struct onvm_pkt_priv *
+onvm_get_pkt_priv(struct rte_mbuf *pkt) {
+        return (struct onvm_pkt_priv *)rte_mbuf_to_priv(pkt);
+}
+
 static inline uint8_t
 onvm_get_pkt_chain_index(struct rte_mbuf *pkt) {
         struct onvm_pkt_meta *pkt_meta = (struct onvm_pkt_meta *)&pkt->udata64;
@@ -157,9 +308,9 @@ onvm_get_pkt_chain_index(struct rte_mbuf *pkt) {
  * tx threads.
  */
 struct tx_thread_info {
-        unsigned first_nf;
-        unsigned last_nf;
-        struct packet_buf *port_tx_bufs;
+        /* NFs this thread drains first, rewritten by the manager as NFs start, stop and change load */
+        volatile uint16_t num_nfs;
+        volatile uint16_t nfs[MAX_NFS];
 };
 
 /*
@@ -171,6 +322,9 @@ struct packet_buf {
         unsigned int count;
 };
 
+/* Number of 64 bit words needed for one bit per NF instance */
+#define NF_RX_BUFS_PENDING_WORDS ((MAX_NFS + 63) / 64)
+
 /*
  * Generic data struct that tx threads and nfs both use.
  * Allows pkt functions to be shared
@@ -182,22 +336,13 @@ struct queue_mgr {
                 struct tx_thread_info *tx_thread_info;
                 struct packet_buf *to_tx_buf;
         };
+        /* NIC TX queue used on every port, ONVM_NF_NO_TXQ for NFs going through the TX threads */
+        uint16_t nic_txq;
+        /* Per port buffers for packets sent out on nic_txq, NULL without a queue */
+        struct packet_buf *port_tx_bufs;
         struct packet_buf *nf_rx_bufs;
-};
-
-/* NFs wakeup Info: used by manager to update NFs pool and wakeup stats */
-struct wakeup_thread_context {
-        unsigned first_nf;
-        unsigned last_nf;
-};
-
-struct nf_wakeup_info {
-        const char *sem_name;
-        sem_t *mutex;
-        key_t shm_key;
-        rte_atomic16_t *shm_server;
-        uint64_t num_wakeups;
-        uint64_t prev_num_wakeups;
+        /* One bit per instance with packets waiting in nf_rx_bufs, so flushes skip empty buffers */
+        uint64_t nf_rx_bufs_pending[NF_RX_BUFS_PENDING_WORDS];
 };
 
 struct rx_stats {
@@ -217,40 +362,96 @@ struct port_info {
         struct rte_ether_addr neighbor_mac[RTE_MAX_ETHPORTS];
         volatile struct rx_stats rx_stats;
         volatile struct tx_stats tx_stats;
+        /* NIC TX queues nf_txq_base to nf_txq_base + num_nf_txqs - 1 of every port are leased to NFs */
+        uint16_t nf_txq_base;
+        uint16_t num_nf_txqs;
+        /* Same for the NIC RX queues polled by NFs, each with the rx stats of the NF holding it */
+        uint16_t nf_rxq_base;
+        uint16_t num_nf_rxqs;
+        volatile struct rx_stats nf_rxq_stats[ONVM_MAX_NF_RX_QUEUES];
 };
 
+/* Packets received on a port, by the manager RX threads and the NFs polling it directly */
+static inline uint64_t
+onvm_port_stats_rx(const struct port_info *port_info, uint16_t port) {
+        uint64_t rx = port_info->rx_stats.rx[port];
+        unsigned i;
+
+        for (i = 0; i < port_info->num_nf_rxqs; i++)
+                rx += port_info->nf_rxq_stats[i].rx[port];
+        return rx;
+}
+
 struct onvm_configuration {
         struct {
                 uint8_t ONVM_NF_SHARE_CORES;
+                uint8_t ONVM_NF_COOP_SCHED;
         } flags;
+        /*
+         * The manager blocks on this futex until a NF sends it a message or
+         * its next timer is due, NF_SLEEPING while blocked, NF_AWAKE otherwise.
+         */
+        struct {
+                volatile uint32_t sleep_state;
+        } mgr;
 };
 
 struct core_status {
         uint8_t enabled;
         uint8_t is_dedicated_core;
         uint16_t nf_count;
-};
+        /* NUMA node of the core, NF rings live there and peers of a NF are placed on it first */
+        uint16_t socket_id;
+        /* Lowest core id of the hyperthread siblings and of the cores sharing the last level cache */
+        uint16_t sibling_group;
+        uint16_t llc_group;
+        /*
+         * Cooperative scheduling of the NFs on this core. The manager fills in
+         * the members, their quotas and the deadline. Only sched_owner runs,
+         * it hands the core on when it has used up its quota or run out of work.
+         */
+        volatile uint16_t sched_owner;
+        volatile uint16_t sched_num_nfs;
+        volatile uint16_t sched_nfs[ONVM_SCHED_MAX_NFS];
+        volatile uint16_t sched_quota[ONVM_SCHED_MAX_NFS];
+        /* TSC cycles a NF with work may wait before it is picked first */
+        uint64_t sched_deadline;
+} __rte_cache_aligned;
 
 struct onvm_nf_local_ctx;
 struct onvm_nf;
 /* Function prototype for NF packet handlers */
 typedef int (*nf_pkt_handler_fn)(struct rte_mbuf *pkt, struct onvm_pkt_meta *meta,
                                  __attribute__((unused)) struct onvm_nf_local_ctx *nf_local_ctx);
+/* Function prototype for NF batch packet handlers, returns how many packets are left in pkts */
+typedef int (*nf_pkt_batch_handler_fn)(struct rte_mbuf *pkts[], struct onvm_pkt_meta *meta[], uint16_t nb_pkts,
+                                       struct onvm_nf_local_ctx *nf_local_ctx);
 /* Function prototype for NF the callback */
 typedef int (*nf_user_actions_fn)(__attribute__((unused)) struct onvm_nf_local_ctx *nf_local_ctx);
 /* Function prototype for NFs that want extra initalization/setup before running */
 typedef void (*nf_setup_fn)(struct onvm_nf_local_ctx *nf_local_ctx);
 /* Function prototype for NFs to handle custom messages */
 typedef void (*nf_msg_handler_fn)(void *msg_data, struct onvm_nf_local_ctx *nf_local_ctx);
+/* Function prototype for NFs to handle a burst of typed messages, freed when it returns */
+typedef void (*nf_typed_msg_handler_fn)(struct onvm_nf_msg *msgs[], uint16_t nb_msgs,
+                                        struct onvm_nf_local_ctx *nf_local_ctx);
 /* Function prototype for NFs to signal handling */
 typedef void (*handle_signal_func)(int);
+/* Function prototype for NFs adding the state of the flows handed over, see onvm_nflib_flow_handoff_set_state */
+typedef int (*nf_flow_export_fn)(struct onvm_flow_handoff *handoff, struct onvm_nf_local_ctx *nf_local_ctx);
+/* Function prototype for NFs taking over the state of the flows handed over */
+typedef int (*nf_flow_import_fn)(const struct onvm_flow_handoff *handoff, struct onvm_nf_local_ctx *nf_local_ctx);
 
 /* Contains all functions the NF might use */
 struct onvm_nf_function_table {
         nf_setup_fn setup;
         nf_msg_handler_fn msg_handler;
+        nf_typed_msg_handler_fn typed_msg_handler; /* optional, gets the messages sent with onvm_nflib_send_msgs */
         nf_user_actions_fn user_actions;
         nf_pkt_handler_fn pkt_handler;
+        nf_pkt_batch_handler_fn pkt_batch_handler; /* optional, used instead of pkt_handler when set */
+        nf_flow_export_fn flow_export;             /* optional, with flow_import flows keep their state on scaling */
+        nf_flow_import_fn flow_import;
 };
 
 /* Information needed to initialize a new NF child thread */
@@ -261,11 +462,18 @@ struct onvm_nf_scale_info {
         struct onvm_nf_function_table *function_table;
 };
 
+struct onvm_flow_hold;
+
 struct onvm_nf_local_ctx {
         struct onvm_nf *nf;
         rte_atomic16_t nf_init_finished;
         rte_atomic16_t keep_running;
         rte_atomic16_t nf_stopped;
+        /* Packets of flows whose state is on its way to this NF, NULL until the first one */
+        struct onvm_flow_hold *flow_hold;
+        /* The NF looks for messages every msg_poll_interval bursts */
+        uint16_t msg_poll_interval;
+        uint16_t msg_poll_countdown;
 };
 
 /*
@@ -282,14 +490,30 @@ struct onvm_nf {
         struct queue_mgr *nf_tx_mgr;
         uint16_t instance_id;
         uint16_t service_id;
-        uint16_t idle_time;
+        /* Packets per second one instance handles, 0 if unknown, the manager scales the service on it */
         uint32_t handle_rate;
         uint8_t status;
         char *tag;
         /* Pointer to NF defined state data */
         void *data;
+        /* Set by the manager while it waits for the new instance it asked this NF to start */
         volatile bool wait_flag;
         volatile bool overloading_flag;
+        /* NIC TX queue leased by the manager, ONVM_NF_NO_TXQ if none */
+        uint16_t nic_txq;
+        /* NIC RX queue polled on every port, set by the manager once the NF runs, ONVM_NF_NO_RXQ if none */
+        volatile uint16_t nic_rxq;
+        /* Table slots whose flows wait for their state, set by the manager, cleared by the NF on import */
+        struct {
+                volatile uint64_t held[ONVM_FLOW_HANDOFF_WORDS];
+                volatile uint16_t num_pending;
+                /* Last generation prepared by the manager, bumped once its slots and count are set */
+                volatile uint32_t gen;
+                /* Written by the NF only: handoffs up to this generation were given up on, and
+                 * the number of later ones imported since */
+                uint32_t given_up_gen;
+                uint16_t num_imported;
+        } handoff;
 
         struct {
                 uint16_t core;
@@ -297,10 +521,10 @@ struct onvm_nf {
                 uint16_t parent;
                 /* Child control variable */
                 uint16_t nums_child;
-                uint16_t sleep_instance[10];
-                uint16_t sleep_count;
-                uint16_t wait_counter;
+                /* Put to sleep by the manager, the instance gets no new flows and is stopped later */
                 bool sleep_flag;
+                /* TSC when the NF asked for its id */
+                uint64_t attach_tsc;
 
                 rte_atomic16_t children_cnt;
         } thread_info;
@@ -323,33 +547,108 @@ struct onvm_nf {
          * and how many packets were dropped because the NF's queue was full.
          * The port-info stats, in contrast, record how many packets were received
          * or transmitted on an actual NIC port.
+         *
+         * Every block has a single writer and its own cache lines: stats is
+         * written by the thread sending the NF's packets (the NF itself with
+         * ONVM_NF_HANDLE_TX, a manager TX thread otherwise), nf_stats by the NF
+         * thread. The rx counters are written by every thread handing packets to
+         * the NF, they live in a row per writer, see struct onvm_nf_rx_stats.
          */
         struct {
-                volatile uint64_t rx;
-                volatile uint64_t rx_drop;
-                volatile uint64_t rx_buffer;
                 volatile uint64_t tx;
                 volatile uint64_t tx_drop;
-                volatile uint64_t tx_buffer;
-                volatile uint64_t tx_returned;
                 volatile uint64_t act_out;
                 volatile uint64_t act_tonf;
                 volatile uint64_t act_drop;
                 volatile uint64_t act_next;
                 volatile uint64_t act_buffer;
                 volatile uint64_t act_cont;
-        } stats;
+        } stats __rte_cache_aligned;
 
         struct {
-                /*
-                 * Sleep state (shared mem variable) to track state of NF and trigger wakeups
-                 *     sleep_state = 1 => NF sleeping (waiting on semaphore)
-                 *     sleep_state = 0 => NF running (not waiting on semaphore)
-                 */
-                rte_atomic16_t *sleep_state;
-                /* Mutex for NF sem_wait */
-                sem_t *nf_mutex;
-        } shared_core;
+                volatile uint64_t rx_handled;
+                volatile uint64_t tx_buffer;
+                volatile uint64_t tx_returned;
+                volatile uint64_t tx_returned_drop;
+                /* TSC cycles spent handling packets, the manager places NFs by it */
+                volatile uint64_t busy_cycles;
+        } nf_stats __rte_cache_aligned;
+
+        /*
+         * Shared core mode idle state, next to the rings the NF waits on.
+         * An idle NF spins for spin_budget empty polls, then blocks on the
+         * sleep_state futex. Whoever enqueues to a blocked NF wakes it.
+         *     sleep_state = NF_SLEEPING     => NF blocked (or about to block) waiting for work
+         *     sleep_state = NF_WAITING_TURN => NF blocked waiting for its core
+         *     sleep_state = NF_AWAKE        => NF running
+         */
+        struct {
+                volatile uint32_t sleep_state;
+                /* Only touched by the NF, adapted to how often spinning finds work */
+                uint32_t spin_budget;
+                volatile uint64_t num_wakeups;
+                /* Cooperative scheduling, packets left in this turn and when it started */
+                int32_t sched_credit;
+                volatile uint64_t sched_last_run;
+        } shared_core __rte_cache_aligned;
+};
+
+/*
+ * Packets handed to each NF, one row per writer so that the manager threads
+ * and NFs delivering packets never write the same cache line. NFs write the
+ * row of their instance id, manager threads ONVM_MGR_THREAD_ID of their lcore.
+ * Only the stats code sums the rows.
+ */
+struct onvm_nf_rx_stats {
+        volatile uint64_t rx[MAX_NFS];
+        volatile uint64_t rx_drop[MAX_NFS];
+        /* Packets shed before entering their chain, by the overloaded service they were bound for */
+        volatile uint64_t bp_drop[MAX_SERVICES];
+} __rte_cache_aligned;
+
+static inline uint64_t
+onvm_nf_stats_rx(const struct onvm_nf_rx_stats *rx_stats, uint16_t instance_id) {
+        uint64_t rx = 0;
+        unsigned i;
+
+        for (i = 0; i < ONVM_MAX_THREAD_IDS; i++)
+                rx += rx_stats[i].rx[instance_id];
+        return rx;
+}
+
+static inline uint64_t
+onvm_nf_stats_rx_drop(const struct onvm_nf_rx_stats *rx_stats, uint16_t instance_id) {
+        uint64_t rx_drop = 0;
+        unsigned i;
+
+        for (i = 0; i < ONVM_MAX_THREAD_IDS; i++)
+                rx_drop += rx_stats[i].rx_drop[instance_id];
+        return rx_drop;
+}
+
+static inline uint64_t
+onvm_service_stats_bp_drop(const struct onvm_nf_rx_stats *rx_stats, uint16_t service_id) {
+        uint64_t bp_drop = 0;
+        unsigned i;
+
+        for (i = 0; i < ONVM_MAX_THREAD_IDS; i++)
+                bp_drop += rx_stats[i].bp_drop[service_id];
+        return bp_drop;
+}
+
+/*
+ * Chain-aware backpressure. When a service is overloaded and can't be scaled
+ * any further the manager sets the share of its offered load it can take,
+ * out of ONVM_BP_ADMIT_ALL. The manager RX threads and the NFs shed flows
+ * bound for the service where they enter the rest of their chain, instead of
+ * having upstream NFs process packets that are dropped at its full ring.
+ * num_overloaded lets the packet path skip the check while nothing is overloaded.
+ */
+#define ONVM_BP_ADMIT_ALL 256
+
+struct onvm_service_bp {
+        volatile uint16_t num_overloaded;
+        volatile uint16_t admit[MAX_SERVICES];
 };
 
 /*
@@ -366,20 +665,37 @@ struct onvm_nf_init_cfg {
         uint16_t time_to_live;
         /* If set NF will stop after pkts TX reach pkt_limit */
         uint16_t pkt_limit;
+        /* TSC when the NF asked for an id, the manager reports how long attaching took */
+        uint64_t request_tsc;
 };
 
 /*
- * Define a structure to describe a service chain entry
+ * Service graph run by the manager. Node 0 is the entry point, its next
+ * nodes receive the packets coming from the ports. A node with several next
+ * nodes forks: the branches process the packet in parallel and must all
+ * lead to the same join node. A node without next nodes ends the graph,
+ * sending the packet out of port or dropping it when port is negative.
+ * While the graph is in use meta->chain_index holds the current node.
  */
-struct onvm_service_chain_entry {
-        uint16_t destination;
-        uint8_t action;
+#define ONVM_MAX_SG_NODES 64
+#define ONVM_MAX_SG_BRANCHES 8
+
+#define ONVM_SG_READ 0
+#define ONVM_SG_WRITE 1
+#define ONVM_SG_HDR_WRITE 2
+
+struct onvm_sg_node {
+        uint16_t service_id;
+        int16_t port;
+        uint8_t write;
+        uint8_t num_next;
+        uint8_t next[ONVM_MAX_SG_BRANCHES];
 };
 
-struct onvm_service_chain {
-        struct onvm_service_chain_entry sc[ONVM_MAX_CHAIN_LENGTH];
-        uint8_t chain_length;
-        int ref_cnt;
+struct onvm_service_graph {
+        /* 0 when no graph is loaded, the default service chain is used */
+        uint8_t num_nodes;
+        struct onvm_sg_node nodes[ONVM_MAX_SG_NODES];
 };
 
 struct lpm_request {
@@ -402,9 +718,9 @@ struct ft_request {
 /* define common names for structures shared between server and NF */
 #define MP_NF_RXQ_NAME "MProc_Client_%u_RX"
 #define MP_NF_TXQ_NAME "MProc_Client_%u_TX"
-#define MP_CLIENT_SEM_NAME "MProc_Client_%u_SEM"
 #define PKTMBUF_CLONE_POOL_NAME "Mproc_pktmbuf_clone_pool"
 #define PKTMBUF_POOL_NAME "MProc_pktmbuf_pool"
+#define PKTMBUF_SOCKET_POOL_NAME "MProc_pktmbuf_pool_%u"
 #define MZ_PORT_INFO "MProc_port_info"
 #define MZ_CORES_STATUS "MProc_cores_info"
 #define MZ_NF_INFO "MProc_nf_init_cfg"
@@ -413,16 +729,16 @@ struct ft_request {
 #define MZ_ONVM_CONFIG "MProc_onvm_config"
 #define MZ_SCP_INFO "MProc_scp_info"
 #define MZ_FTP_INFO "MProc_ftp_info"
+#define MZ_SERVICE_GRAPH "MProc_service_graph"
+#define MZ_SERVICE_LB_INFO "MProc_service_lb_info"
+#define MZ_NF_RX_STATS "MProc_nf_rx_stats"
+#define MZ_SERVICE_BP_INFO "MProc_service_bp_info"
 
 #define _MGR_MSG_QUEUE_NAME "MSG_MSG_QUEUE"
 #define _NF_MSG_QUEUE_NAME "NF_%u_MSG_QUEUE"
 #define _NF_MEMPOOL_NAME "NF_INFO_MEMPOOL"
 #define _NF_MSG_POOL_NAME "NF_MSG_MEMPOOL"
 
-/* interrupt semaphore specific updates */
-#define SHMSZ 4         // size of shared memory segement (page_size)
-#define KEY_PREFIX 123  // prefix len for key
-
 /* common names for NF states */
 #define NF_WAITING_FOR_ID 0       // First step in startup process, doesn't have ID confirmed by manager yet
 #define NF_STARTING 1             // When a NF is in the startup process and already has an id
@@ -482,46 +798,89 @@ get_msg_queue_name(unsigned id) {
 }
 
 /*
- * Interface checking if a given NF is "valid", meaning if it's running.
+ * Given the mbuf pool name template above, get the name of the pool of a socket
  */
-static inline int
-onvm_nf_is_valid(struct onvm_nf *nf) {
-        return nf && nf->status == NF_RUNNING;
+static inline const char *
+get_pktmbuf_pool_name(unsigned socket_id) {
+        /* buffer for return value. Size calculated by %u being replaced
+         * by maximum 3 digits (plus an extra byte for safety) */
+        static char buffer[sizeof(PKTMBUF_SOCKET_POOL_NAME) + 2];
+
+        snprintf(buffer, sizeof(buffer) - 1, PKTMBUF_SOCKET_POOL_NAME, socket_id);
+        return buffer;
 }
 
 /*
- * Given the rx queue name template above, get the key of the shared memory
+ * Get the mbuf pool on the given socket. Only sockets with a port but without
+ * the manager have their own pool, the others use the PKTMBUF_POOL_NAME one.
  */
-static inline key_t
-get_rx_shmkey(unsigned id) {
-        return KEY_PREFIX * 10 + id;
+static inline struct rte_mempool *
+onvm_get_pktmbuf_pool(int socket_id) {
+        struct rte_mempool *mp = NULL;
+
+        if (socket_id >= 0)
+                mp = rte_mempool_lookup(get_pktmbuf_pool_name(socket_id));
+        return mp != NULL ? mp : rte_mempool_lookup(PKTMBUF_POOL_NAME);
 }
 
 /*
- * Given the sem name template above, get the sem name
+ * Interface checking if a given NF is "valid", meaning if it's running.
  */
-static inline const char *
-get_sem_name(unsigned id) {
-        /* buffer for return value. Size calculated by %u being replaced
-         * by maximum 3 digits (plus an extra byte for safety) */
-        static char buffer[sizeof(MP_CLIENT_SEM_NAME) + 2];
-
-        snprintf(buffer, sizeof(buffer) - 1, MP_CLIENT_SEM_NAME, id);
-        return buffer;
+static inline int
+onvm_nf_is_valid(struct onvm_nf *nf) {
+        return nf && nf->status == NF_RUNNING;
 }
 
+/*
+ * Wakes a shared core NF blocked on its futex in the given sleep state.
+ * Returns 1 if the NF was in that state.
+ * The futex is not process private, nfs live in memory shared with the manager.
+ */
 static inline int
-whether_wakeup_client(struct onvm_nf *nf, struct nf_wakeup_info *nf_wakeup_info) {
-        if (rte_ring_count(nf->rx_q) < PKT_WAKEUP_THRESHOLD && rte_ring_count(nf->msg_q) < MSG_WAKEUP_THRESHOLD)
-                return 0;
+onvm_nf_wake(struct onvm_nf *nf, uint32_t state) {
+        uint32_t expected = state;
 
-        /* Check if its already woken up */
-        if (rte_atomic16_read(nf_wakeup_info->shm_server) == 0)
+        if (!__atomic_compare_exchange_n(&nf->shared_core.sleep_state, &expected, NF_AWAKE, 0, __ATOMIC_ACQ_REL,
+                                         __ATOMIC_RELAXED))
                 return 0;
 
+        __atomic_fetch_add(&nf->shared_core.num_wakeups, 1, __ATOMIC_RELAXED);
+        syscall(SYS_futex, &nf->shared_core.sleep_state, FUTEX_WAKE, 1, NULL, NULL, 0);
         return 1;
 }
 
+/*
+ * Wakes a shared core NF waiting for work. Call after enqueueing to one of
+ * its rings, the full barrier pairs with the one the NF takes between
+ * setting sleep_state and checking its rings, so either the NF sees the new
+ * entries or the caller sees it sleeping.
+ * A NF waiting for its core is left alone, the NF running there hands it over.
+ */
+static inline void
+onvm_nf_wakeup(struct onvm_nf *nf) {
+        rte_smp_mb();
+        if (likely(nf->shared_core.sleep_state != NF_SLEEPING))
+                return;
+        onvm_nf_wake(nf, NF_SLEEPING);
+}
+
+/*
+ * Wakes the manager waiting for messages. Call after enqueueing to its
+ * message queue, the barrier pairs with the one the manager takes between
+ * announcing its sleep and checking the queue, like onvm_nf_wakeup.
+ */
+static inline void
+onvm_mgr_wakeup(struct onvm_configuration *config) {
+        uint32_t expected = NF_SLEEPING;
+
+        rte_smp_mb();
+        if (likely(config->mgr.sleep_state != NF_SLEEPING))
+                return;
+        if (__atomic_compare_exchange_n(&config->mgr.sleep_state, &expected, NF_AWAKE, 0, __ATOMIC_ACQ_REL,
+                                        __ATOMIC_RELAXED))
+                syscall(SYS_futex, &config->mgr.sleep_state, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
 #define RTE_LOGTYPE_APP RTE_LOGTYPE_USER1
 
 /*
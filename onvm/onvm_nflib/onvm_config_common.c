@@ -45,10 +45,22 @@
 #include <string.h>
 
 #include "cJSON.h"
+#include "onvm_common.h"
 #include "onvm_config_common.h"
 
 #define IS_NULL_OR_EMPTY_STRING(s) ((s) == NULL || strncmp(s, "", 1) == 0 ? 1 : 0)
 
+/* Depth first search state of the service graph cycle check */
+#define SG_NODE_NEW 0
+#define SG_NODE_VISITING 1
+#define SG_NODE_DONE 2
+
+static int
+onvm_config_extract_sg_next(cJSON* next_arr, const char* names[], int num_nodes, struct onvm_sg_node* node);
+
+static int
+onvm_config_check_sg_acyclic(struct onvm_service_graph* graph, uint8_t* state, uint8_t cur);
+
 cJSON*
 onvm_config_parse_file(const char* filename) {
         if (IS_NULL_OR_EMPTY_STRING(filename)) {
@@ -560,3 +572,191 @@ onvm_config_create_dpdk_args(cJSON* dpdk_config, int* dpdk_argc, char** dpdk_arg
 
         return 0;
 }
+
+int
+onvm_config_extract_service_graph(cJSON* config, struct onvm_service_graph* graph) {
+        cJSON* sg_config = NULL;
+        cJSON* nodes_arr = NULL;
+        cJSON* node_obj = NULL;
+        cJSON* item = NULL;
+        const char* names[ONVM_MAX_SG_NODES];
+        uint8_t state[ONVM_MAX_SG_NODES];
+        struct onvm_sg_node* node = NULL;
+        struct onvm_sg_node* branch = NULL;
+        int num_nodes = 0;
+        int num_writers = 0;
+        int i = 0;
+        int j = 0;
+
+        if (config == NULL || graph == NULL) {
+                return -1;
+        }
+
+        sg_config = cJSON_GetObjectItem(config, "service_graph");
+        if (sg_config == NULL) {
+                printf("Unable to find the service graph config\n");
+                return -1;
+        }
+
+        nodes_arr = cJSON_GetObjectItem(sg_config, "nodes");
+        if (nodes_arr == NULL || cJSON_GetArraySize(nodes_arr) == 0) {
+                printf("Service graph has no nodes\n");
+                return -1;
+        }
+
+        /* Node 0 is the entry point, the configured nodes follow it */
+        num_nodes = cJSON_GetArraySize(nodes_arr) + 1;
+        if (num_nodes > ONVM_MAX_SG_NODES) {
+                printf("Service graph has more than %d nodes\n", ONVM_MAX_SG_NODES - 1);
+                return -1;
+        }
+
+        memset(graph, 0, sizeof(struct onvm_service_graph));
+        names[0] = NULL;
+        for (i = 1; i < num_nodes; ++i) {
+                node_obj = cJSON_GetArrayItem(nodes_arr, i - 1);
+                item = cJSON_GetObjectItem(node_obj, "name");
+                if (item == NULL || !cJSON_IsString(item) || IS_NULL_OR_EMPTY_STRING(item->valuestring)) {
+                        printf("Service graph node %d has no name\n", i);
+                        return -1;
+                }
+                names[i] = item->valuestring;
+                for (j = 1; j < i; ++j) {
+                        if (strcmp(names[i], names[j]) == 0) {
+                                printf("Service graph node %s is defined twice\n", names[i]);
+                                return -1;
+                        }
+                }
+        }
+
+        for (i = 1; i < num_nodes; ++i) {
+                node_obj = cJSON_GetArrayItem(nodes_arr, i - 1);
+                node = &graph->nodes[i];
+
+                item = cJSON_GetObjectItem(node_obj, "service");
+                if (item == NULL || item->valueint <= 0 || item->valueint >= MAX_SERVICES) {
+                        printf("Service graph node %s needs a service id between 1 and %d\n", names[i],
+                               MAX_SERVICES - 1);
+                        return -1;
+                }
+                node->service_id = item->valueint;
+
+                item = cJSON_GetObjectItem(node_obj, "port");
+                node->port = (item == NULL) ? -1 : item->valueint;
+
+                item = cJSON_GetObjectItem(node_obj, "write");
+                if (item == NULL) {
+                        node->write = ONVM_SG_READ;
+                } else if (cJSON_IsString(item) && strcmp(item->valuestring, "header") == 0) {
+                        node->write = ONVM_SG_HDR_WRITE;
+                } else {
+                        node->write = cJSON_IsTrue(item) ? ONVM_SG_WRITE : ONVM_SG_READ;
+                }
+
+                if (onvm_config_extract_sg_next(cJSON_GetObjectItem(node_obj, "next"), names, num_nodes, node) < 0) {
+                        printf("Service graph node %s has an invalid next list\n", names[i]);
+                        return -1;
+                }
+        }
+
+        node = &graph->nodes[0];
+        node->port = -1;
+        if (onvm_config_extract_sg_next(cJSON_GetObjectItem(sg_config, "entry"), names, num_nodes, node) < 0 ||
+            node->num_next == 0) {
+                printf("Service graph has an invalid entry list\n");
+                return -1;
+        }
+
+        /* Branches of a fork are joined by the manager before moving on, so each
+         * branch must be a single node and all of them must share one next node.
+         * Only one private copy survives the join, so at most one branch writes */
+        for (i = 0; i < num_nodes; ++i) {
+                node = &graph->nodes[i];
+                if (node->num_next < 2)
+                        continue;
+                num_writers = 0;
+                for (j = 0; j < node->num_next; ++j) {
+                        branch = &graph->nodes[node->next[j]];
+                        if (branch->num_next != 1 || branch->next[0] != graph->nodes[node->next[0]].next[0]) {
+                                printf("Service graph branch %s must lead to the same join node as its siblings\n",
+                                       names[node->next[j]]);
+                                return -1;
+                        }
+                        if (branch->write != ONVM_SG_READ)
+                                num_writers++;
+                }
+                if (num_writers > 1) {
+                        printf("Service graph fork after %s has %d writing branches, at most one can write\n",
+                               i == 0 ? "the entry" : names[i], num_writers);
+                        return -1;
+                }
+        }
+
+        memset(state, SG_NODE_NEW, sizeof(state));
+        if (onvm_config_check_sg_acyclic(graph, state, 0) < 0) {
+                printf("Service graph has a cycle\n");
+                return -1;
+        }
+
+        graph->num_nodes = num_nodes;
+        return 0;
+}
+
+static int
+onvm_config_extract_sg_next(cJSON* next_arr, const char* names[], int num_nodes, struct onvm_sg_node* node) {
+        cJSON* item = NULL;
+        int next_count = 0;
+        int i = 0;
+        int j = 0;
+
+        node->num_next = 0;
+        if (next_arr == NULL) {
+                return 0;
+        }
+
+        next_count = cJSON_GetArraySize(next_arr);
+        if (next_count > ONVM_MAX_SG_BRANCHES) {
+                return -1;
+        }
+
+        for (i = 0; i < next_count; ++i) {
+                item = cJSON_GetArrayItem(next_arr, i);
+                if (item == NULL || !cJSON_IsString(item)) {
+                        return -1;
+                }
+                for (j = 1; j < num_nodes; ++j) {
+                        if (strcmp(item->valuestring, names[j]) == 0)
+                                break;
+                }
+                if (j == num_nodes) {
+                        printf("Service graph node %s is not defined\n", item->valuestring);
+                        return -1;
+                }
+                node->next[node->num_next++] = j;
+        }
+
+        return 0;
+}
+
+static int
+onvm_config_check_sg_acyclic(struct onvm_service_graph* graph, uint8_t* state, uint8_t cur) {
+        struct onvm_sg_node* node = &graph->nodes[cur];
+        int i = 0;
+
+        if (state[cur] == SG_NODE_VISITING) {
+                return -1;
+        }
+        if (state[cur] == SG_NODE_DONE) {
+                return 0;
+        }
+
+        state[cur] = SG_NODE_VISITING;
+        for (i = 0; i < node->num_next; ++i) {
+                if (onvm_config_check_sg_acyclic(graph, state, node->next[i]) < 0) {
+                        return -1;
+                }
+        }
+        state[cur] = SG_NODE_DONE;
+
+        return 0;
+}
@@ -45,6 +45,8 @@
 
 #define MAX_SERVICE_ID_SIZE 5
 
+struct onvm_service_graph;
+
 /***********************Command Line Arg Strings**********************/
 
 #define PROC_TYPE_SECONDARY "--proc-type=secondary"
@@ -205,4 +207,21 @@ onvm_config_create_onvm_args(cJSON* onvm_config, int* onvm_argc, char** onvm_arg
 int
 onvm_config_create_dpdk_args(cJSON* dpdk_config, int* dpdk_argc, char** dpdk_argv[]);
 
+/*
+ * Extracts the service graph run by the manager. The graph lists its nodes,
+ * each with a unique name, a service id, the names of its next nodes and
+ * optionally a "write" mode (true or "header") and an out "port". The
+ * "entry" list names the nodes that receive the packets from the ports.
+ * Every fork must be made of single nodes leading to the same join node.
+ *
+ * @param config
+ *   Pointer to a cJSON struct with the parsed service graph file
+ * @param graph
+ *   Pointer to the graph to fill, node 0 is the entry point
+ * @return
+ *   0 on success, -1 if the graph is missing or invalid
+ */
+int
+onvm_config_extract_service_graph(cJSON* config, struct onvm_service_graph* graph);
+
 #endif  // _ONVM_CONFIG_COMMON_H_
@@ -43,6 +43,8 @@
 #include <rte_mbuf.h>
 #include <rte_memory.h>
 #include <rte_memzone.h>
+#include <rte_per_lcore.h>
+#include <rte_rcu_qsbr.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -51,18 +53,40 @@
 
 #define NO_FLAGS 0
 #define SDN_FT_ENTRIES 1024
+/* Idle time after which an entry's own timeouts are first checked */
+#define SDN_FT_CHECK_MS 1000
+#define NO_READER UINT32_MAX
+
+static int
+onvm_flow_dir_expired(struct onvm_ft *table, int32_t index, const struct onvm_ft_ipv4_5tuple *key, char *data,
+                      void *arg);
+
+/* Frees the service chain and key of an entry once no reader can use them */
+static void
+onvm_flow_dir_reclaimed(struct onvm_ft *table, int32_t index, char *data);
 
 struct onvm_ft *sdn_ft;
 struct onvm_ft **sdn_ft_p;
 
+/* Reader id of the calling thread */
+static RTE_DEFINE_PER_LCORE(unsigned int, flow_dir_reader) = NO_READER;
+
 int
 onvm_flow_dir_init(void) {
         const struct rte_memzone *mz_ftp;
+        struct rte_rcu_qsbr *rcu;
 
-        sdn_ft = onvm_ft_create(SDN_FT_ENTRIES, sizeof(struct onvm_flow_entry));
+        rcu = rte_zmalloc("flow_dir_rcu", rte_rcu_qsbr_get_memsize(ONVM_FLOW_DIR_MAX_READERS), RTE_CACHE_LINE_SIZE);
+        if (rcu == NULL || rte_rcu_qsbr_init(rcu, ONVM_FLOW_DIR_MAX_READERS) != 0) {
+                rte_exit(EXIT_FAILURE, "Unable to create flow table RCU\n");
+        }
+        sdn_ft = onvm_ft_create_lf(SDN_FT_ENTRIES, sizeof(struct onvm_flow_entry), rcu, onvm_flow_dir_reclaimed);
         if (sdn_ft == NULL) {
                 rte_exit(EXIT_FAILURE, "Unable to create flow table\n");
         }
+        if (onvm_ft_enable_expiry(sdn_ft, SDN_FT_CHECK_MS, onvm_flow_dir_expired, NULL) < 0) {
+                rte_exit(EXIT_FAILURE, "Unable to enable flow table expiry\n");
+        }
         mz_ftp = rte_memzone_reserve(MZ_FTP_INFO, sizeof(struct onvm_ft *), rte_socket_id(), NO_FLAGS);
         if (mz_ftp == NULL) {
                 rte_exit(EXIT_FAILURE, "Canot reserve memory zone for flow table pointer\n");
@@ -96,6 +120,47 @@ onvm_flow_dir_get_pkt(struct rte_mbuf *pkt, struct onvm_flow_entry **flow_entry)
         return ret;
 }
 
+/* Lookup the flow entries of a burst, flow_entries[i] is NULL for packets
+ * without one. Only valid in the manager, which created the table. */
+int
+onvm_flow_dir_get_pkt_bulk(struct rte_mbuf *pkts[], uint16_t nb_pkts, struct onvm_flow_entry *flow_entries[]) {
+        struct onvm_ft_ipv4_5tuple keys[RTE_HASH_LOOKUP_BULK_MAX];
+        const struct onvm_ft_ipv4_5tuple *key_list[RTE_HASH_LOOKUP_BULK_MAX];
+        int32_t positions[RTE_HASH_LOOKUP_BULK_MAX];
+        char *data[RTE_HASH_LOOKUP_BULK_MAX];
+        int key_ret[RTE_HASH_LOOKUP_BULK_MAX];
+        uint16_t pkt_idx[RTE_HASH_LOOKUP_BULK_MAX];
+        uint16_t i, j, n, num_keys;
+        int ret, found = 0;
+
+        for (i = 0; i < nb_pkts; i++)
+                flow_entries[i] = NULL;
+
+        for (i = 0; i < nb_pkts; i += n) {
+                n = RTE_MIN(nb_pkts - i, RTE_HASH_LOOKUP_BULK_MAX);
+                onvm_ft_fill_key_bulk(keys, &pkts[i], n, key_ret);
+
+                num_keys = 0;
+                for (j = 0; j < n; j++) {
+                        if (key_ret[j] < 0)
+                                continue;
+                        key_list[num_keys] = &keys[j];
+                        pkt_idx[num_keys++] = i + j;
+                }
+                if (num_keys == 0)
+                        continue;
+
+                ret = onvm_ft_lookup_bulk(sdn_ft, key_list, num_keys, positions, data);
+                if (ret < 0)
+                        return ret;
+                for (j = 0; j < num_keys; j++)
+                        flow_entries[pkt_idx[j]] = (struct onvm_flow_entry *)data[j];
+                found += ret;
+        }
+
+        return found;
+}
+
 int
 onvm_flow_dir_add_pkt(struct rte_mbuf *pkt, struct onvm_flow_entry **flow_entry) {
         int ret;
@@ -108,11 +173,14 @@ int
 onvm_flow_dir_del_pkt(struct rte_mbuf *pkt) {
         int ret;
         struct onvm_flow_entry *flow_entry;
+        struct onvm_service_chain *sc;
         int ref_cnt;
 
         ret = onvm_flow_dir_get_pkt(pkt, &flow_entry);
         if (ret >= 0) {
-                ref_cnt = flow_entry->sc->ref_cnt--;
+                /* An entry whose chain is not published yet holds no reference */
+                sc = onvm_flow_dir_get_sc(flow_entry);
+                ref_cnt = sc == NULL ? 0 : __atomic_fetch_sub(&sc->ref_cnt, 1, __ATOMIC_ACQ_REL);
                 if (ref_cnt <= 0) {
                         ret = onvm_flow_dir_del_and_free_pkt(pkt);
                 }
@@ -124,14 +192,9 @@ onvm_flow_dir_del_pkt(struct rte_mbuf *pkt) {
 int
 onvm_flow_dir_del_and_free_pkt(struct rte_mbuf *pkt) {
         int ret;
-        struct onvm_flow_entry *flow_entry;
 
-        ret = onvm_flow_dir_get_pkt(pkt, &flow_entry);
-        if (ret >= 0) {
-                rte_free(flow_entry->sc);
-                rte_free(flow_entry->key);
-                ret = onvm_ft_remove_pkt(sdn_ft, pkt);
-        }
+        /* The service chain and key are freed after readers are done with the entry */
+        ret = onvm_ft_remove_pkt(sdn_ft, pkt);
 
         return ret;
 }
@@ -156,11 +219,14 @@ int
 onvm_flow_dir_del_key(struct onvm_ft_ipv4_5tuple *key) {
         int ret;
         struct onvm_flow_entry *flow_entry;
+        struct onvm_service_chain *sc;
         int ref_cnt;
 
         ret = onvm_flow_dir_get_key(key, &flow_entry);
         if (ret >= 0) {
-                ref_cnt = flow_entry->sc->ref_cnt--;
+                /* An entry whose chain is not published yet holds no reference */
+                sc = onvm_flow_dir_get_sc(flow_entry);
+                ref_cnt = sc == NULL ? 0 : __atomic_fetch_sub(&sc->ref_cnt, 1, __ATOMIC_ACQ_REL);
                 if (ref_cnt <= 0) {
                         ret = onvm_flow_dir_del_and_free_key(key);
                 }
@@ -172,14 +238,123 @@ onvm_flow_dir_del_key(struct onvm_ft_ipv4_5tuple *key) {
 int
 onvm_flow_dir_del_and_free_key(struct onvm_ft_ipv4_5tuple *key) {
         int ret;
-        struct onvm_flow_entry *flow_entry;
 
-        ret = onvm_flow_dir_get_key(key, &flow_entry);
-        if (ret >= 0) {
-                rte_free(flow_entry->sc);
-                rte_free(flow_entry->key);
-                ret = onvm_ft_remove_key(sdn_ft, key);
-        }
+        /* The service chain and key are freed after readers are done with the entry */
+        ret = onvm_ft_remove_key(sdn_ft, key);
 
         return ret;
 }
+
+int
+onvm_flow_dir_expire(uint64_t now, uint32_t budget) {
+        return onvm_ft_expire(sdn_ft, now, budget);
+}
+
+int
+onvm_flow_dir_reclaim(uint32_t budget) {
+        return onvm_ft_reclaim(sdn_ft, budget);
+}
+
+int
+onvm_flow_dir_reader_register(unsigned int reader_id) {
+        int ret;
+
+        if (sdn_ft == NULL || RTE_PER_LCORE(flow_dir_reader) != NO_READER) {
+                return 0;
+        }
+        if (reader_id >= ONVM_FLOW_DIR_MAX_READERS) {
+                return -EINVAL;
+        }
+
+        ret = rte_rcu_qsbr_thread_register(sdn_ft->rcu, reader_id);
+        if (ret != 0) {
+                return ret;
+        }
+        rte_rcu_qsbr_thread_online(sdn_ft->rcu, reader_id);
+        RTE_PER_LCORE(flow_dir_reader) = reader_id;
+
+        return 0;
+}
+
+void
+onvm_flow_dir_reader_unregister(void) {
+        unsigned int reader_id = RTE_PER_LCORE(flow_dir_reader);
+
+        if (reader_id == NO_READER) {
+                return;
+        }
+        rte_rcu_qsbr_thread_offline(sdn_ft->rcu, reader_id);
+        rte_rcu_qsbr_thread_unregister(sdn_ft->rcu, reader_id);
+        RTE_PER_LCORE(flow_dir_reader) = NO_READER;
+}
+
+void
+onvm_flow_dir_reader_release(unsigned int reader_id) {
+        if (sdn_ft == NULL || reader_id >= ONVM_FLOW_DIR_MAX_READERS) {
+                return;
+        }
+        rte_rcu_qsbr_thread_offline(sdn_ft->rcu, reader_id);
+        rte_rcu_qsbr_thread_unregister(sdn_ft->rcu, reader_id);
+}
+
+void
+onvm_flow_dir_quiescent(void) {
+        if (RTE_PER_LCORE(flow_dir_reader) != NO_READER) {
+                rte_rcu_qsbr_quiescent(sdn_ft->rcu, RTE_PER_LCORE(flow_dir_reader));
+        }
+}
+
+void
+onvm_flow_dir_reader_offline(void) {
+        if (RTE_PER_LCORE(flow_dir_reader) != NO_READER) {
+                rte_rcu_qsbr_thread_offline(sdn_ft->rcu, RTE_PER_LCORE(flow_dir_reader));
+        }
+}
+
+void
+onvm_flow_dir_reader_online(void) {
+        if (RTE_PER_LCORE(flow_dir_reader) != NO_READER) {
+                rte_rcu_qsbr_thread_online(sdn_ft->rcu, RTE_PER_LCORE(flow_dir_reader));
+        }
+}
+
+uint64_t
+onvm_flow_dir_grace_start(void) {
+        return rte_rcu_qsbr_start(sdn_ft->rcu);
+}
+
+int
+onvm_flow_dir_grace_done(uint64_t token) {
+        return rte_rcu_qsbr_check(sdn_ft->rcu, token, false);
+}
+
+/* Entries without an idle timeout never expire, the others get their own
+ * timeout the first time they are checked and are removed once idle for it */
+static int
+onvm_flow_dir_expired(struct onvm_ft *table, int32_t index, __rte_unused const struct onvm_ft_ipv4_5tuple *key,
+                      char *data, __rte_unused void *arg) {
+        struct onvm_flow_entry *flow_entry = (struct onvm_flow_entry *)data;
+        uint32_t timeout_ms;
+
+        /* Checked again after the default timeout but never removed */
+        if (flow_entry->idle_timeout == 0) {
+                return 1;
+        }
+
+        timeout_ms = flow_entry->idle_timeout * 1000U;
+        if (table->expiry->timers[index].timeout_ticks != (uint64_t)timeout_ms * ONVM_FT_TICKS_PER_SEC / 1000) {
+                onvm_ft_set_timeout(table, index, timeout_ms);
+                return 1;
+        }
+
+        onvm_ft_set_timeout(table, index, 0);
+        return 0;
+}
+
+static void
+onvm_flow_dir_reclaimed(__rte_unused struct onvm_ft *table, __rte_unused int32_t index, char *data) {
+        struct onvm_flow_entry *flow_entry = (struct onvm_flow_entry *)data;
+
+        rte_free(flow_entry->sc);
+        rte_free(flow_entry->key);
+}
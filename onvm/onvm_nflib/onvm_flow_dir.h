@@ -47,16 +47,50 @@
 extern struct onvm_ft* sdn_ft;
 extern struct onvm_ft** sdn_ft_p;
 
+/*
+ * The flow director is read without locks by the manager RX/TX threads and
+ * the NFs. Every reader registers once and reports a quiescent state between
+ * two bursts, removed entries and their service chains are freed only once
+ * all online readers did so. NFs use their instance id, manager threads
+ * ONVM_FLOW_DIR_MGR_READER of their lcore.
+ */
+#define ONVM_FLOW_DIR_MAX_READERS ONVM_MAX_THREAD_IDS
+#define ONVM_FLOW_DIR_MGR_READER(lcore) ONVM_MGR_THREAD_ID(lcore)
+
+/* What happens to a flow bound for an overloaded service, see struct onvm_service_bp */
+#define ONVM_BP_POLICY_SHED 0    // Default, the flow is shed or not depending on its hash
+#define ONVM_BP_POLICY_DROP 1    // Every packet is dropped while the service is overloaded
+#define ONVM_BP_POLICY_EXEMPT 2  // Never shed, e.g. for control traffic
+
 struct onvm_flow_entry {
         struct onvm_ft_ipv4_5tuple* key;
         struct onvm_service_chain* sc;
         uint64_t ref_cnt;
         uint16_t idle_timeout;
         uint16_t hard_timeout;
+        uint8_t bp_policy;
         uint64_t packet_count;
         uint64_t byte_count;
 };
 
+/* Install the service chain of a new entry, making it visible to readers,
+ * once the chain and the other fields are filled. Returns -EEXIST if another
+ * writer installed the same flow first, the caller keeps its chain then. */
+static inline int
+onvm_flow_dir_set_sc(struct onvm_flow_entry* flow_entry, struct onvm_service_chain* sc) {
+        struct onvm_service_chain* none = NULL;
+
+        if (!__atomic_compare_exchange_n(&flow_entry->sc, &none, sc, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+                return -EEXIST;
+        return 0;
+}
+
+/* Service chain of an entry, NULL while the entry is still being installed */
+static inline struct onvm_service_chain*
+onvm_flow_dir_get_sc(struct onvm_flow_entry* flow_entry) {
+        return __atomic_load_n(&flow_entry->sc, __ATOMIC_ACQUIRE);
+}
+
 /* Get a pointer to the flow entry entry for this packet.
  * Returns:
  *  0        on success. *flow_entry points to this packet flow's flow entry
@@ -69,6 +103,8 @@ onvm_flow_dir_nf_init(void);
 int
 onvm_flow_dir_get_pkt(struct rte_mbuf* pkt, struct onvm_flow_entry** flow_entry);
 int
+onvm_flow_dir_get_pkt_bulk(struct rte_mbuf* pkts[], uint16_t nb_pkts, struct onvm_flow_entry* flow_entries[]);
+int
 onvm_flow_dir_add_pkt(struct rte_mbuf* pkt, struct onvm_flow_entry** flow_entry);
 /* delete the flow dir entry, but do not free the service chain (useful if a service chain is pointed to by several
  * different flows */
@@ -85,4 +121,32 @@ int
 onvm_flow_dir_del_key(struct onvm_ft_ipv4_5tuple* key);
 int
 onvm_flow_dir_del_and_free_key(struct onvm_ft_ipv4_5tuple* key);
+/* Remove entries idle for longer than their idle_timeout, from the manager only */
+int
+onvm_flow_dir_expire(uint64_t now, uint32_t budget);
+/* Free the entries removed one grace period ago, from the manager only */
+int
+onvm_flow_dir_reclaim(uint32_t budget);
+/* Start reading the flow director from this thread, a no-op if the table is not mapped */
+int
+onvm_flow_dir_reader_register(unsigned int reader_id);
+void
+onvm_flow_dir_reader_unregister(void);
+/* Forget a reader that stopped without unregistering, from the manager only */
+void
+onvm_flow_dir_reader_release(unsigned int reader_id);
+/* The thread holds no flow entry, called between bursts */
+void
+onvm_flow_dir_quiescent(void);
+/* Stop or resume reporting around a blocking wait, so the thread does not hold back frees */
+void
+onvm_flow_dir_reader_offline(void);
+void
+onvm_flow_dir_reader_online(void);
+/* Start a grace period for other memory the readers use between two quiescent states, from the manager only */
+uint64_t
+onvm_flow_dir_grace_start(void);
+/* Whether every online reader went through a quiescent state since the grace period started */
+int
+onvm_flow_dir_grace_done(uint64_t token);
 #endif  // _ONVM_FLOW_DIR_H_
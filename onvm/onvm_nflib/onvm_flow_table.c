@@ -43,6 +43,8 @@
 #include <rte_hash.h>
 #include <rte_lcore.h>
 #include <rte_malloc.h>
+#include <rte_prefetch.h>
+#include <rte_vect.h>
 
 #include "onvm_flow_table.h"
 #include "onvm_nflib.h"
@@ -53,16 +55,105 @@ uint8_t rss_symmetric_key[40] = {
     0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a, 0x6d, 0x5a,
 };
 
+uint32_t onvm_ft_rss_table[ONVM_FT_RSS_TUPLE_LEN][256];
+
+/* Number of packets ahead to prefetch when filling keys for a burst */
+#define ONVM_FT_PREFETCH_OFFSET 4
+
+/* Precompute the Toeplitz hash of each byte value at each tuple position,
+ * the RSS of a tuple is then the XOR of the entries of its bytes. */
+RTE_INIT(onvm_ft_rss_table_init) {
+        uint64_t window;
+        uint32_t hash;
+        int i, bit, value, pos;
+
+        for (i = 0; i < ONVM_FT_RSS_TUPLE_LEN; i++) {
+                for (value = 0; value < 256; value++) {
+                        hash = 0;
+                        for (bit = 0; bit < 8; bit++) {
+                                if (!(value & (0x80 >> bit)))
+                                        continue;
+                                /* 32 bits of the key starting at the input bit position */
+                                window = 0;
+                                for (pos = 0; pos < 5; pos++)
+                                        window = (window << 8) | rss_symmetric_key[i + pos];
+                                hash ^= (uint32_t)(window >> (8 - bit));
+                        }
+                        onvm_ft_rss_table[i][value] = hash;
+                }
+        }
+}
+
+/* Link an entry in the wheel slot of its deadline */
+static void
+onvm_ft_timer_link(struct onvm_ft_expiry *expiry, uint32_t index, uint64_t deadline);
+
+/* Deadline tick of an entry from its last activity */
+static inline uint64_t
+onvm_ft_timer_deadline(struct onvm_ft_expiry *expiry, struct onvm_ft_timer *timer);
+
+/* Create the hash table and data array of a flow table */
+static struct onvm_ft *
+onvm_ft_create_table(int cnt, int entry_size, uint8_t extra_flag);
+
+/* Add or remove a key, serialized with the other writers of a lock free table */
+static inline int32_t
+onvm_ft_insert(struct onvm_ft *table, const struct onvm_ft_ipv4_5tuple *key, uint32_t sig);
+
+static int32_t
+onvm_ft_delete(struct onvm_ft *table, const struct onvm_ft_ipv4_5tuple *key, uint32_t sig);
+
+uint32_t
+onvm_ft_hash(const void *key, __rte_unused uint32_t key_len, __rte_unused uint32_t init_val) {
+        return onvm_softrss((const struct onvm_ft_ipv4_5tuple *)key);
+}
+
 /* Create a new flow table made of an rte_hash table and a fixed size
  * data array for storing values. Only supports IPv4 5-tuple lookups. */
 struct onvm_ft *
 onvm_ft_create(int cnt, int entry_size) {
+        return onvm_ft_create_table(cnt, entry_size, 0);
+}
+
+struct onvm_ft *
+onvm_ft_create_lf(int cnt, int entry_size, struct rte_rcu_qsbr *rcu, onvm_ft_reclaim_cb reclaim) {
+        struct onvm_ft *ft;
+        char name[RTE_RING_NAMESIZE];
+
+        if (rcu == NULL) {
+                return NULL;
+        }
+
+        /* Removing a key only unlinks it, its position is freed after the grace period */
+        ft = onvm_ft_create_table(cnt, entry_size, RTE_HASH_EXTRA_FLAGS_RW_CONCURRENCY_LF);
+        if (ft == NULL) {
+                return NULL;
+        }
+
+        /* A position is retired at most once until it is freed, the ring holds all of them */
+        snprintf(name, sizeof(name), "ft_retired_%d-%" PRIu64, rte_lcore_id(), rte_get_tsc_cycles() & 0xFFFFFF);
+        ft->retired = rte_ring_create(name, rte_align32pow2(cnt + 1), rte_socket_id(), RING_F_SC_DEQ);
+        ft->retire_token = rte_calloc("ft_retire_token", cnt, sizeof(uint64_t), 0);
+        if (ft->retired == NULL || ft->retire_token == NULL) {
+                onvm_ft_free(ft);
+                return NULL;
+        }
+        rte_spinlock_init(&ft->write_lock);
+        ft->rcu = rcu;
+        ft->reclaim = reclaim;
+        ft->retire_pending = -1;
+
+        return ft;
+}
+
+static struct onvm_ft *
+onvm_ft_create_table(int cnt, int entry_size, uint8_t extra_flag) {
         struct rte_hash *hash;
         struct rte_hash_parameters *ipv4_hash_params;
         struct onvm_ft *ft;
         int status;
 
-        ipv4_hash_params = (struct rte_hash_parameters *)rte_malloc(NULL, sizeof(struct rte_hash_parameters), 0);
+        ipv4_hash_params = (struct rte_hash_parameters *)rte_zmalloc(NULL, sizeof(struct rte_hash_parameters), 0);
         if (!ipv4_hash_params) {
                 return NULL;
         }
@@ -71,8 +162,10 @@ onvm_ft_create(int cnt, int entry_size) {
         /* create ipv4 hash table. use core number and cycle counter to get a unique name. */
         ipv4_hash_params->entries = cnt;
         ipv4_hash_params->key_len = sizeof(struct onvm_ft_ipv4_5tuple);
-        ipv4_hash_params->hash_func = NULL;
+        /* Bulk lookups hash keys themselves, make them agree with the software RSS */
+        ipv4_hash_params->hash_func = onvm_ft_hash;
         ipv4_hash_params->hash_func_init_val = 0;
+        ipv4_hash_params->extra_flag = extra_flag;
         ipv4_hash_params->name = name;
         ipv4_hash_params->socket_id = rte_socket_id();
         snprintf(name, 64, "onvm_ft_%d-%" PRIu64, rte_lcore_id(), rte_get_tsc_cycles());
@@ -126,9 +219,10 @@ onvm_ft_add_pkt(struct onvm_ft *table, struct rte_mbuf *pkt, char **data) {
         if (err < 0) {
                 return err;
         }
-        tbl_index = rte_hash_add_key_with_hash(table->hash, (const void *)&key, pkt->hash.rss);
+        tbl_index = onvm_ft_insert(table, &key, pkt->hash.rss);
         if (tbl_index >= 0) {
                 *data = &table->data[tbl_index * table->entry_size];
+                onvm_ft_touch(table, tbl_index, rte_get_tsc_cycles());
         }
         return tbl_index;
 }
@@ -152,6 +246,7 @@ onvm_ft_lookup_pkt(struct onvm_ft *table, struct rte_mbuf *pkt, char **data) {
         tbl_index = rte_hash_lookup_with_hash(table->hash, (const void *)&key, pkt->hash.rss);
         if (tbl_index >= 0) {
                 *data = onvm_ft_get_data(table, tbl_index);
+                onvm_ft_touch(table, tbl_index, rte_get_tsc_cycles());
         }
         return tbl_index;
 }
@@ -172,7 +267,7 @@ onvm_ft_remove_pkt(struct onvm_ft *table, struct rte_mbuf *pkt) {
         if (ret < 0) {
                 return ret;
         }
-        return rte_hash_del_key_with_hash(table->hash, (const void *)&key, pkt->hash.rss);
+        return onvm_ft_delete(table, &key, pkt->hash.rss);
 }
 
 int
@@ -182,9 +277,10 @@ onvm_ft_add_key(struct onvm_ft *table, struct onvm_ft_ipv4_5tuple *key, char **d
 
         softrss = onvm_softrss(key);
 
-        tbl_index = rte_hash_add_key_with_hash(table->hash, (const void *)key, softrss);
+        tbl_index = onvm_ft_insert(table, key, softrss);
         if (tbl_index >= 0) {
                 *data = onvm_ft_get_data(table, tbl_index);
+                onvm_ft_touch(table, tbl_index, rte_get_tsc_cycles());
         }
 
         return tbl_index;
@@ -200,6 +296,7 @@ onvm_ft_lookup_key(struct onvm_ft *table, struct onvm_ft_ipv4_5tuple *key, char
         tbl_index = rte_hash_lookup_with_hash(table->hash, (const void *)key, softrss);
         if (tbl_index >= 0) {
                 *data = onvm_ft_get_data(table, tbl_index);
+                onvm_ft_touch(table, tbl_index, rte_get_tsc_cycles());
         }
 
         return tbl_index;
@@ -210,7 +307,105 @@ onvm_ft_remove_key(struct onvm_ft *table, struct onvm_ft_ipv4_5tuple *key) {
         uint32_t softrss;
 
         softrss = onvm_softrss(key);
-        return rte_hash_del_key_with_hash(table->hash, (const void *)key, softrss);
+        return onvm_ft_delete(table, key, softrss);
+}
+
+/* Lookup a burst of keys, at most RTE_HASH_LOOKUP_BULK_MAX at a time.
+   Returns:
+    the number of keys found
+    -EINVAL if the parameters are invalid.
+*/
+int
+onvm_ft_lookup_bulk(struct onvm_ft *table, const struct onvm_ft_ipv4_5tuple *keys[], uint32_t num_keys,
+                    int32_t positions[], char *data[]) {
+        uint64_t now = rte_get_tsc_cycles();
+        uint32_t i, n;
+        int found = 0;
+        int ret;
+
+        for (i = 0; i < num_keys; i += n) {
+                n = RTE_MIN(num_keys - i, (uint32_t)RTE_HASH_LOOKUP_BULK_MAX);
+                ret = rte_hash_lookup_bulk(table->hash, (const void **)&keys[i], n, &positions[i]);
+                if (ret < 0) {
+                        return ret;
+                }
+        }
+
+        for (i = 0; i < num_keys; i++) {
+                if (positions[i] >= 0) {
+                        data[i] = onvm_ft_get_data(table, positions[i]);
+                        onvm_ft_touch(table, positions[i], now);
+                        found++;
+                } else {
+                        data[i] = NULL;
+                }
+        }
+
+        return found;
+}
+
+/* Add a burst of keys, the hash of each key is computed from the precomputed tables.
+   Returns:
+    the number of keys added, positions[i] holds the error code of the others.
+*/
+int
+onvm_ft_add_bulk(struct onvm_ft *table, const struct onvm_ft_ipv4_5tuple *keys[], uint32_t num_keys,
+                 int32_t positions[], char *data[]) {
+        uint64_t now = rte_get_tsc_cycles();
+        uint32_t i;
+        int added = 0;
+
+        for (i = 0; i < num_keys; i++) {
+                positions[i] = onvm_ft_insert(table, keys[i], onvm_softrss(keys[i]));
+                if (positions[i] >= 0) {
+                        data[i] = onvm_ft_get_data(table, positions[i]);
+                        onvm_ft_touch(table, positions[i], now);
+                        added++;
+                } else {
+                        data[i] = NULL;
+                }
+        }
+
+        return added;
+}
+
+uint16_t
+onvm_ft_fill_key_bulk(struct onvm_ft_ipv4_5tuple keys[], struct rte_mbuf *pkts[], uint16_t nb_pkts, int ret[]) {
+        struct rte_ipv4_hdr *ipv4_hdr;
+        uint16_t i, filled = 0;
+#ifdef RTE_MACHINE_CPUFLAG_SSE2
+        /* Addresses and ports are contiguous in the headers, keep those 12 bytes */
+        const __m128i tuple_mask = _mm_set_epi32(0, -1, -1, -1);
+        __m128i tuple;
+#endif
+
+        for (i = 0; i < nb_pkts && i < ONVM_FT_PREFETCH_OFFSET; i++)
+                rte_prefetch0(rte_pktmbuf_mtod(pkts[i], void *));
+
+        for (i = 0; i < nb_pkts; i++) {
+                if (i + ONVM_FT_PREFETCH_OFFSET < nb_pkts)
+                        rte_prefetch0(rte_pktmbuf_mtod(pkts[i + ONVM_FT_PREFETCH_OFFSET], void *));
+
+                if (unlikely(!onvm_pkt_is_ipv4(pkts[i]))) {
+                        ret[i] = -EPROTONOSUPPORT;
+                        continue;
+                }
+                ret[i] = 0;
+                filled++;
+
+                ipv4_hdr = onvm_pkt_ipv4_hdr(pkts[i]);
+#ifdef RTE_MACHINE_CPUFLAG_SSE2
+                if (ipv4_hdr->next_proto_id == IP_PROTOCOL_TCP || ipv4_hdr->next_proto_id == IP_PROTOCOL_UDP) {
+                        tuple = _mm_loadu_si128((const __m128i *)&ipv4_hdr->src_addr);
+                        _mm_storeu_si128((__m128i *)&keys[i], _mm_and_si128(tuple, tuple_mask));
+                        keys[i].proto = ipv4_hdr->next_proto_id;
+                        continue;
+                }
+#endif
+                onvm_ft_fill_key(&keys[i], pkts[i]);
+        }
+
+        return filled;
 }
 
 /* Iterate through the hash table, returning key-value pairs.
@@ -234,11 +429,245 @@ onvm_ft_iterate(struct onvm_ft *table, const void **key, void **data, uint32_t *
         return tbl_index;
 }
 
+int
+onvm_ft_enable_expiry(struct onvm_ft *table, uint32_t timeout_ms, onvm_ft_expire_cb cb, void *arg) {
+        struct onvm_ft_expiry *expiry;
+        int i;
+
+        if (table == NULL || table->expiry != NULL) {
+                return -EINVAL;
+        }
+
+        expiry = rte_calloc("ft_expiry", 1, sizeof(struct onvm_ft_expiry), 0);
+        if (expiry == NULL) {
+                return -ENOMEM;
+        }
+        expiry->timers = rte_calloc("ft_timers", table->cnt, sizeof(struct onvm_ft_timer), 0);
+        expiry->arm_mask = rte_align32pow2(table->cnt) - 1;
+        expiry->arm_queue = rte_malloc("ft_arm_queue", (expiry->arm_mask + 1) * sizeof(uint32_t), 0);
+        if (expiry->timers == NULL || expiry->arm_queue == NULL) {
+                rte_free(expiry->timers);
+                rte_free(expiry->arm_queue);
+                rte_free(expiry);
+                return -ENOMEM;
+        }
+
+        for (i = 0; i <= (int)expiry->arm_mask; i++) {
+                expiry->arm_queue[i] = ONVM_FT_TIMER_NONE;
+        }
+        for (i = 0; i < ONVM_FT_WHEEL_L0_SLOTS + ONVM_FT_WHEEL_L1_SLOTS; i++) {
+                expiry->wheel[i] = ONVM_FT_TIMER_NONE;
+        }
+
+        expiry->cb = cb;
+        expiry->cb_arg = arg;
+        expiry->tick_cycles = RTE_MAX(rte_get_timer_hz() / ONVM_FT_TICKS_PER_SEC, (uint64_t)1);
+        expiry->timeout_ticks = RTE_MAX((uint64_t)timeout_ms * ONVM_FT_TICKS_PER_SEC / 1000, (uint64_t)1);
+        expiry->cur_tick = rte_get_tsc_cycles() / expiry->tick_cycles;
+        expiry->cascaded = 1;
+
+        table->expiry = expiry;
+        return 0;
+}
+
+void
+onvm_ft_set_timeout(struct onvm_ft *table, int32_t index, uint32_t timeout_ms) {
+        if (table->expiry == NULL || index < 0 || index >= table->cnt) {
+                return;
+        }
+
+        table->expiry->timers[index].timeout_ticks = (uint64_t)timeout_ms * ONVM_FT_TICKS_PER_SEC / 1000;
+}
+
+int
+onvm_ft_expire(struct onvm_ft *table, uint64_t now, uint32_t budget) {
+        struct onvm_ft_expiry *expiry = table->expiry;
+        struct onvm_ft_timer *timer;
+        const struct onvm_ft_ipv4_5tuple *key;
+        uint64_t now_tick, deadline;
+        uint32_t index, slot;
+        int expired = 0;
+
+        if (expiry == NULL) {
+                return 0;
+        }
+
+        /* Link the entries seen for the first time since the last call */
+        while ((index = __atomic_load_n(&expiry->arm_queue[expiry->arm_head & expiry->arm_mask], __ATOMIC_ACQUIRE)) !=
+               ONVM_FT_TIMER_NONE) {
+                expiry->arm_queue[expiry->arm_head & expiry->arm_mask] = ONVM_FT_TIMER_NONE;
+                expiry->arm_head++;
+                onvm_ft_timer_link(expiry, index, onvm_ft_timer_deadline(expiry, &expiry->timers[index]));
+        }
+
+        now_tick = now / expiry->tick_cycles;
+        while (expiry->cur_tick <= now_tick && budget > 0) {
+                /* Entering a new level 0 round, spread the matching level 1 slot over it */
+                if (!expiry->cascaded && (expiry->cur_tick & (ONVM_FT_WHEEL_L0_SLOTS - 1)) == 0) {
+                        slot = ONVM_FT_WHEEL_L0_SLOTS +
+                               ((expiry->cur_tick >> ONVM_FT_WHEEL_L0_BITS) & (ONVM_FT_WHEEL_L1_SLOTS - 1));
+                        while ((index = expiry->wheel[slot]) != ONVM_FT_TIMER_NONE) {
+                                expiry->wheel[slot] = expiry->timers[index].next;
+                                onvm_ft_timer_link(expiry, index,
+                                                   onvm_ft_timer_deadline(expiry, &expiry->timers[index]));
+                        }
+                }
+                expiry->cascaded = 1;
+
+                slot = expiry->cur_tick & (ONVM_FT_WHEEL_L0_SLOTS - 1);
+                index = expiry->wheel[slot];
+                if (index == ONVM_FT_TIMER_NONE) {
+                        expiry->cur_tick++;
+                        expiry->cascaded = 0;
+                        continue;
+                }
+
+                timer = &expiry->timers[index];
+                expiry->wheel[slot] = timer->next;
+                budget--;
+
+                /* Entries seen since they were linked move further */
+                deadline = onvm_ft_timer_deadline(expiry, timer);
+                if (deadline > expiry->cur_tick) {
+                        onvm_ft_timer_link(expiry, index, deadline);
+                        continue;
+                }
+
+                /* The key was removed by its user already */
+                if (rte_hash_get_key_with_position(table->hash, index, (void **)&key) < 0) {
+                        __atomic_store_n(&timer->state, ONVM_FT_TIMER_IDLE, __ATOMIC_RELEASE);
+                        continue;
+                }
+
+                if (expiry->cb != NULL &&
+                    expiry->cb(table, index, key, onvm_ft_get_data(table, index), expiry->cb_arg)) {
+                        __atomic_store_n(&timer->last_cycles, now, __ATOMIC_RELAXED);
+                        onvm_ft_timer_link(expiry, index, onvm_ft_timer_deadline(expiry, timer));
+                        continue;
+                }
+
+                /* Back to idle first so a new key at this position is queued again */
+                __atomic_store_n(&timer->state, ONVM_FT_TIMER_IDLE, __ATOMIC_RELEASE);
+                onvm_ft_delete(table, key, onvm_softrss(key));
+                expired++;
+        }
+
+        return expired;
+}
+
+int
+onvm_ft_reclaim(struct onvm_ft *table, uint32_t budget) {
+        void *position;
+        int32_t index;
+        int reclaimed = 0;
+
+        if (table->rcu == NULL) {
+                return 0;
+        }
+
+        while (budget-- > 0) {
+                /* Positions were retired in order, stop at the first one still in use */
+                if (table->retire_pending < 0) {
+                        if (rte_ring_sc_dequeue(table->retired, &position) != 0)
+                                break;
+                        table->retire_pending = (int32_t)(uintptr_t)position;
+                }
+                index = table->retire_pending;
+                if (rte_rcu_qsbr_check(table->rcu, table->retire_token[index], false) != 1)
+                        break;
+
+                if (table->reclaim != NULL)
+                        table->reclaim(table, index, onvm_ft_get_data(table, index));
+                memset(onvm_ft_get_data(table, index), 0, table->entry_size);
+                /* Freed positions share the free slot ring with the writers' adds */
+                rte_spinlock_lock(&table->write_lock);
+                rte_hash_free_key_with_position(table->hash, index);
+                rte_spinlock_unlock(&table->write_lock);
+                table->retire_pending = -1;
+                reclaimed++;
+        }
+
+        return reclaimed;
+}
+
 /* Clears a flow table and frees associated memory */
 void
 onvm_ft_free(struct onvm_ft *table) {
+        rte_ring_free(table->retired);
+        rte_free(table->retire_token);
         rte_hash_reset(table->hash);
         rte_hash_free(table->hash);
+        if (table->expiry != NULL) {
+                rte_free(table->expiry->timers);
+                rte_free(table->expiry->arm_queue);
+                rte_free(table->expiry);
+        }
         rte_free(table->data);
         rte_free(table);
 }
+
+static inline uint64_t
+onvm_ft_timer_deadline(struct onvm_ft_expiry *expiry, struct onvm_ft_timer *timer) {
+        uint32_t timeout = timer->timeout_ticks != 0 ? timer->timeout_ticks : expiry->timeout_ticks;
+
+        return __atomic_load_n(&timer->last_cycles, __ATOMIC_RELAXED) / expiry->tick_cycles + timeout;
+}
+
+static inline int32_t
+onvm_ft_insert(struct onvm_ft *table, const struct onvm_ft_ipv4_5tuple *key, uint32_t sig) {
+        int32_t tbl_index;
+
+        if (table->rcu == NULL) {
+                return rte_hash_add_key_with_hash(table->hash, (const void *)key, sig);
+        }
+
+        rte_spinlock_lock(&table->write_lock);
+        tbl_index = rte_hash_add_key_with_hash(table->hash, (const void *)key, sig);
+        rte_spinlock_unlock(&table->write_lock);
+        return tbl_index;
+}
+
+static int32_t
+onvm_ft_delete(struct onvm_ft *table, const struct onvm_ft_ipv4_5tuple *key, uint32_t sig) {
+        int32_t tbl_index;
+
+        if (table->rcu == NULL) {
+                return rte_hash_del_key_with_hash(table->hash, (const void *)key, sig);
+        }
+
+        rte_spinlock_lock(&table->write_lock);
+        tbl_index = rte_hash_del_key_with_hash(table->hash, (const void *)key, sig);
+        rte_spinlock_unlock(&table->write_lock);
+        if (tbl_index < 0) {
+                return tbl_index;
+        }
+
+        /* Readers that found the key before this point may still use its data */
+        table->retire_token[tbl_index] = rte_rcu_qsbr_start(table->rcu);
+        rte_ring_mp_enqueue(table->retired, (void *)(uintptr_t)tbl_index);
+        return tbl_index;
+}
+
+static void
+onvm_ft_timer_link(struct onvm_ft_expiry *expiry, uint32_t index, uint64_t deadline) {
+        struct onvm_ft_timer *timer = &expiry->timers[index];
+        uint64_t cur_round = expiry->cur_tick >> ONVM_FT_WHEEL_L0_BITS;
+        uint32_t slot;
+
+        if (deadline < expiry->cur_tick)
+                deadline = expiry->cur_tick;
+
+        if (deadline - expiry->cur_tick < ONVM_FT_WHEEL_L0_SLOTS) {
+                slot = deadline & (ONVM_FT_WHEEL_L0_SLOTS - 1);
+        } else if ((deadline >> ONVM_FT_WHEEL_L0_BITS) - cur_round < ONVM_FT_WHEEL_L1_SLOTS) {
+                slot = ONVM_FT_WHEEL_L0_SLOTS + ((deadline >> ONVM_FT_WHEEL_L0_BITS) & (ONVM_FT_WHEEL_L1_SLOTS - 1));
+        } else {
+                /* Beyond the wheel, park in the farthest slot and look again when it comes */
+                slot = ONVM_FT_WHEEL_L0_SLOTS +
+                       ((cur_round + ONVM_FT_WHEEL_L1_SLOTS - 1) & (ONVM_FT_WHEEL_L1_SLOTS - 1));
+        }
+
+        timer->next = expiry->wheel[slot];
+        expiry->wheel[slot] = index;
+        timer->state = ONVM_FT_TIMER_LINKED;
+}
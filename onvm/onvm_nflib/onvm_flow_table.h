@@ -44,6 +44,9 @@
 #include <rte_common.h>
 #include <rte_ip.h>
 #include <rte_mbuf.h>
+#include <rte_rcu_qsbr.h>
+#include <rte_ring.h>
+#include <rte_spinlock.h>
 #include <rte_tcp.h>
 #include <rte_thash.h>
 #include <rte_udp.h>
@@ -53,6 +56,12 @@
 
 extern uint8_t rss_symmetric_key[40];
 
+/* Bytes of the 5 tuple hashed by RSS: source/destination addresses and ports */
+#define ONVM_FT_RSS_TUPLE_LEN 12
+
+/* Toeplitz hash of every byte value at every tuple position, built once from rss_symmetric_key */
+extern uint32_t onvm_ft_rss_table[ONVM_FT_RSS_TUPLE_LEN][256];
+
 #ifdef RTE_MACHINE_CPUFLAG_SSE4_2
 #include <rte_hash_crc.h>
 #define DEFAULT_HASH_FUNC rte_hash_crc
@@ -61,11 +70,73 @@ extern uint8_t rss_symmetric_key[40];
 #define DEFAULT_HASH_FUNC rte_jhash
 #endif
 
+/*
+ * Idle expiry of flow table entries, a two level timer wheel of 1ms ticks.
+ * Lookups and adds only record the time of the entry (and queue it the
+ * first time), the owner of the table moves entries through the wheel and
+ * removes the idle ones in onvm_ft_expire.
+ */
+#define ONVM_FT_WHEEL_L0_BITS 8
+#define ONVM_FT_WHEEL_L1_BITS 8
+#define ONVM_FT_WHEEL_L0_SLOTS (1 << ONVM_FT_WHEEL_L0_BITS)
+#define ONVM_FT_WHEEL_L1_SLOTS (1 << ONVM_FT_WHEEL_L1_BITS)
+#define ONVM_FT_TICKS_PER_SEC 1000
+
+#define ONVM_FT_TIMER_NONE UINT32_MAX
+
+#define ONVM_FT_TIMER_IDLE 0
+#define ONVM_FT_TIMER_QUEUED 1
+#define ONVM_FT_TIMER_LINKED 2
+
+struct onvm_ft;
+struct onvm_ft_ipv4_5tuple;
+
+/* Called before an idle entry is removed, returning non zero keeps it for another timeout */
+typedef int (*onvm_ft_expire_cb)(struct onvm_ft *table, int32_t index, const struct onvm_ft_ipv4_5tuple *key,
+                                 char *data, void *arg);
+
+/* Called once no reader can hold a removed entry anymore, before its position is reused */
+typedef void (*onvm_ft_reclaim_cb)(struct onvm_ft *table, int32_t index, char *data);
+
+struct onvm_ft_timer {
+        uint64_t last_cycles;
+        uint32_t timeout_ticks;
+        uint32_t next;
+        uint8_t state;
+};
+
+struct onvm_ft_expiry {
+        onvm_ft_expire_cb cb;
+        void *cb_arg;
+        uint64_t tick_cycles;
+        uint32_t timeout_ticks;
+        /* Next level 0 slot to reap and whether its level 1 slot was cascaded */
+        uint64_t cur_tick;
+        uint8_t cascaded;
+        /* Entries touched for the first time, written by any thread and drained by the owner. The queue
+         * size is a power of two so the free running head and tail keep their slot when they wrap */
+        uint32_t arm_head;
+        uint32_t arm_tail;
+        uint32_t arm_mask;
+        uint32_t *arm_queue;
+        struct onvm_ft_timer *timers;
+        uint32_t wheel[ONVM_FT_WHEEL_L0_SLOTS + ONVM_FT_WHEEL_L1_SLOTS];
+};
+
 struct onvm_ft {
         struct rte_hash *hash;
         char *data;
         int cnt;
         int entry_size;
+        struct onvm_ft_expiry *expiry;
+        /* Lock free tables only: writers serialize on write_lock, readers
+         * never lock and removed positions wait in retired for a grace period */
+        rte_spinlock_t write_lock;
+        struct rte_rcu_qsbr *rcu;
+        struct rte_ring *retired;
+        uint64_t *retire_token;
+        int32_t retire_pending;
+        onvm_ft_reclaim_cb reclaim;
 };
 
 struct onvm_ft_ipv4_5tuple {
@@ -95,6 +166,13 @@ union ipv4_5tuple_host {
 struct onvm_ft *
 onvm_ft_create(int cnt, int entry_size);
 
+/* Create a flow table that many threads and processes can read without
+ * locks while others add and remove entries. Readers must report quiescent
+ * states on rcu, removed entries are handed to reclaim and their positions
+ * reused only once every reader went through one, see onvm_ft_reclaim. */
+struct onvm_ft *
+onvm_ft_create_lf(int cnt, int entry_size, struct rte_rcu_qsbr *rcu, onvm_ft_reclaim_cb reclaim);
+
 int
 onvm_ft_add_pkt(struct onvm_ft *table, struct rte_mbuf *pkt, char **data);
 
@@ -119,10 +197,48 @@ onvm_ft_iterate(struct onvm_ft *table, const void **key, void **data, uint32_t *
 void
 onvm_ft_free(struct onvm_ft *table);
 
-/* TODO(@sdnfv): Add function to calculate hash and then make lookup/get
- * have versions with precomputed hash values */
-// hash_sig_t
-// onvm_ft_hash(struct rte_mbuf *buf);
+/* Bulk versions of the key functions for a burst of keys. They set
+ * positions[i] and data[i] for each key, data[i] is NULL if the lookup
+ * or add failed. Bulk lookups hash keys with the table's hash function,
+ * so they must run in the process that called onvm_ft_create.
+ * Returns the number of keys found or added, or a negative error code. */
+int
+onvm_ft_lookup_bulk(struct onvm_ft *table, const struct onvm_ft_ipv4_5tuple *keys[], uint32_t num_keys,
+                    int32_t positions[], char *data[]);
+
+int
+onvm_ft_add_bulk(struct onvm_ft *table, const struct onvm_ft_ipv4_5tuple *keys[], uint32_t num_keys,
+                 int32_t positions[], char *data[]);
+
+/* Fill the keys of a burst of packets. ret[i] is 0 or -EPROTONOSUPPORT
+ * if the packet is not ipv4. Returns the number of keys filled. */
+uint16_t
+onvm_ft_fill_key_bulk(struct onvm_ft_ipv4_5tuple keys[], struct rte_mbuf *pkts[], uint16_t nb_pkts, int ret[]);
+
+/* Enable idle expiry of the entries, timeout_ms is the default idle timeout.
+ * Returns 0 on success, -ENOMEM if the wheel could not be allocated. */
+int
+onvm_ft_enable_expiry(struct onvm_ft *table, uint32_t timeout_ms, onvm_ft_expire_cb cb, void *arg);
+
+/* Override the idle timeout of one entry, 0 restores the default */
+void
+onvm_ft_set_timeout(struct onvm_ft *table, int32_t index, uint32_t timeout_ms);
+
+/* Remove entries idle for longer than their timeout, handling at most budget
+ * entries so it can run from a packet loop. Must be called by the owner of
+ * the table only. Returns the number of entries removed. */
+int
+onvm_ft_expire(struct onvm_ft *table, uint64_t now, uint32_t budget);
+
+/* Release the entries of a lock free table removed at least one grace
+ * period ago, at most budget of them. Must be called by a single thread,
+ * which is not a reader of the table. Returns the number of entries released. */
+int
+onvm_ft_reclaim(struct onvm_ft *table, uint32_t budget);
+
+/* Hash function of the flow tables, the software RSS of the key */
+uint32_t
+onvm_ft_hash(const void *key, uint32_t key_len, uint32_t init_val);
 
 static inline void
 _onvm_ft_print_key(struct onvm_ft_ipv4_5tuple *key) {
@@ -138,6 +254,29 @@ onvm_ft_get_data(struct onvm_ft *table, int32_t index) {
         return &table->data[index * table->entry_size];
 }
 
+/* Record activity on an entry, safe from any thread or process */
+static inline void
+onvm_ft_touch(struct onvm_ft *table, int32_t index, uint64_t now) {
+        struct onvm_ft_expiry *expiry = table->expiry;
+        struct onvm_ft_timer *timer;
+        uint8_t idle = ONVM_FT_TIMER_IDLE;
+        uint32_t pos;
+
+        if (expiry == NULL || index < 0 || index >= table->cnt)
+                return;
+
+        timer = &expiry->timers[index];
+        __atomic_store_n(&timer->last_cycles, now, __ATOMIC_RELAXED);
+        if (likely(timer->state != ONVM_FT_TIMER_IDLE))
+                return;
+        if (!__atomic_compare_exchange_n(&timer->state, &idle, ONVM_FT_TIMER_QUEUED, 0, __ATOMIC_ACQ_REL,
+                                         __ATOMIC_RELAXED))
+                return;
+        /* Each entry is queued at most once, the queue can hold all of them */
+        pos = __atomic_fetch_add(&expiry->arm_tail, 1, __ATOMIC_RELAXED) & expiry->arm_mask;
+        __atomic_store_n(&expiry->arm_queue[pos], (uint32_t)index, __ATOMIC_RELEASE);
+}
+
 static inline int
 onvm_ft_fill_key(struct onvm_ft_ipv4_5tuple *key, struct rte_mbuf *pkt) {
         struct rte_ipv4_hdr *ipv4_hdr;
@@ -195,25 +334,24 @@ onvm_ft_fill_key_symmetric(struct onvm_ft_ipv4_5tuple *key, struct rte_mbuf *pkt
 /* Hash a flow key to get an int. From L3 fwd example */
 static inline uint32_t
 onvm_ft_ipv4_hash_crc(const void *data, __rte_unused uint32_t data_len, uint32_t init_val) {
-        union ipv4_5tuple_host *k;
+        union ipv4_5tuple_host k;
         uint32_t t;
         const uint32_t *p;
 
-        k = (union ipv4_5tuple_host *)malloc(sizeof(union ipv4_5tuple_host));
-        rte_memcpy(k, data, sizeof(union ipv4_5tuple_host));
+        rte_memcpy(&k, data, sizeof(union ipv4_5tuple_host));
 
-        t = k->proto;
-        p = (const uint32_t *)&k->port_src;
+        t = k.proto;
+        p = (const uint32_t *)&k.port_src;
 
 #ifdef RTE_MACHINE_CPUFLAG_SSE4_2
         init_val = rte_hash_crc_4byte(t, init_val);
-        init_val = rte_hash_crc_4byte(k->ip_src, init_val);
-        init_val = rte_hash_crc_4byte(k->ip_dst, init_val);
+        init_val = rte_hash_crc_4byte(k.ip_src, init_val);
+        init_val = rte_hash_crc_4byte(k.ip_dst, init_val);
         init_val = rte_hash_crc_4byte(*p, init_val);
 #else  /* RTE_MACHINE_CPUFLAG_SSE4_2 */
         init_val = rte_jhash_1word(t, init_val);
-        init_val = rte_jhash_1word(k->ip_src, init_val);
-        init_val = rte_jhash_1word(k->ip_dst, init_val);
+        init_val = rte_jhash_1word(k.ip_src, init_val);
+        init_val = rte_jhash_1word(k.ip_dst, init_val);
         init_val = rte_jhash_1word(*p, init_val);
 #endif /* RTE_MACHINE_CPUFLAG_SSE4_2 */
         return (init_val);
@@ -221,19 +359,14 @@ onvm_ft_ipv4_hash_crc(const void *data, __rte_unused uint32_t data_len, uint32_t
 
 /*software caculate RSS*/
 static inline uint32_t
-onvm_softrss(struct onvm_ft_ipv4_5tuple *key) {
-        union rte_thash_tuple tuple;
-        uint8_t rss_key_be[RTE_DIM(rss_symmetric_key)];
-        uint32_t rss_l3l4;
-
-        rte_convert_rss_key((uint32_t *)rss_symmetric_key, (uint32_t *)rss_key_be, RTE_DIM(rss_symmetric_key));
-
-        tuple.v4.src_addr = rte_be_to_cpu_32(key->src_addr);
-        tuple.v4.dst_addr = rte_be_to_cpu_32(key->dst_addr);
-        tuple.v4.sport = rte_be_to_cpu_16(key->src_port);
-        tuple.v4.dport = rte_be_to_cpu_16(key->dst_port);
-
-        rss_l3l4 = rte_softrss_be((uint32_t *)&tuple, RTE_THASH_V4_L4_LEN, rss_key_be);
+onvm_softrss(const struct onvm_ft_ipv4_5tuple *key) {
+        /* The key starts with the tuple in network order, the same bytes the NIC hashes */
+        const uint8_t *tuple = (const uint8_t *)key;
+        uint32_t rss_l3l4 = 0;
+        int i;
+
+        for (i = 0; i < ONVM_FT_RSS_TUPLE_LEN; i++)
+                rss_l3l4 ^= onvm_ft_rss_table[i][tuple[i]];
 
         return rss_l3l4;
 }
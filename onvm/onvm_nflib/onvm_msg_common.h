@@ -55,10 +55,35 @@
 #define MSG_REQUEST_LPM_REGION 7
 #define MSG_CHANGE_CORE 8
 #define MSG_REQUEST_FT 9
+#define MSG_FLOW_EXPORT 10
+#define MSG_FLOW_IMPORT 11
+#define MSG_NF_TYPED 12
+
+/* Payloads of MSG_NF_TYPED messages up to this size travel in the message itself */
+#define ONVM_NF_MSG_INLINE_SIZE 48
+
+/*
+ * Payload of a MSG_NF_TYPED message too large to travel inline. It is
+ * refcounted so it can go to several NFs without being copied, the last
+ * one to release it frees it. Allocated in hugepages by the sender.
+ */
+struct onvm_nf_msg_payload {
+        uint32_t refcnt;
+        uint32_t len;
+        uint8_t data[];
+};
 
 struct onvm_nf_msg {
         uint8_t msg_type; /* Constant saying what type of message is */
         void *msg_data;   /* These should be rte_malloc'd so they're stored in hugepages */
+        /*
+         * Header of MSG_NF_TYPED messages between NFs. The payload is inline
+         * when msg_data is NULL, otherwise msg_data is a onvm_nf_msg_payload.
+         */
+        uint16_t src;  /* instance id of the sending NF */
+        uint16_t type; /* chosen by the NFs */
+        uint16_t len;  /* length of the inline payload */
+        uint8_t data[ONVM_NF_MSG_INLINE_SIZE];
 };
 
 #endif  // _ONVM_MSG_COMMON_H_
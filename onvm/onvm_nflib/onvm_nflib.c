@@ -71,6 +71,20 @@
 
 #define ONVM_NO_CALLBACK NULL
 
+/* Packets a NF holds at most for flows whose state is on its way, the next ones are dropped */
+#define ONVM_FLOW_HOLD_SIZE 4096
+/* A NF gives up waiting for the state of the flows it holds after this long */
+#define ONVM_FLOW_HANDOFF_TIMEOUT_MS 500
+
+/* Messages a NF takes from its message queue at once */
+#define NF_MSG_BURST_SIZE 32
+
+struct onvm_flow_hold {
+        struct rte_mbuf *pkts[ONVM_FLOW_HOLD_SIZE];
+        uint32_t count;
+        uint64_t since;  // when the oldest packet held was held
+};
+
 /******************************Global Variables*******************************/
 
 // Shared data for host port information
@@ -88,6 +102,13 @@ struct onvm_nf *nfs;
 // Shared data from manager, has information used for nf_side tx
 uint16_t **services;
 uint16_t *nf_per_service_count;
+struct onvm_service_lb *service_lb;
+
+// Shared rows of packets handed to each NF, one per writer
+struct onvm_nf_rx_stats *nf_rx_stats;
+
+// Shared backpressure state of the services
+struct onvm_service_bp *service_bp;
 
 // Shared pool for all NFs info
 static struct rte_mempool *nf_init_cfg_mp;
@@ -104,19 +125,22 @@ static handle_signal_func global_nf_signal_handler = NULL;
 // Shared data for default service chain
 struct onvm_service_chain *default_chain;
 
+// Shared service graph, packets follow it when the manager loaded one
+struct onvm_service_graph *service_graph;
+
 /* Shared data for onvm config */
 struct onvm_configuration *onvm_config;
 
 /* Flag to check if shared core mutex sleep/wakeup is enabled */
 uint8_t ONVM_NF_SHARE_CORES;
 
-/***********************Internal Functions Prototypes*************************/
+/* Flag to check if the NFs sharing a core take turns on it */
+uint8_t ONVM_NF_COOP_SCHED;
 
-static void
-onvm_nf_ready_receive(struct onvm_nf *nf) {
-        uint16_t service_count = nf_per_service_count[nf->service_id]++;
-        services[nf->service_id][service_count] = nf->instance_id;
-}
+/* The manager clears the bit of NFs it could not fit into the turns of their core */
+#define ONVM_NF_TAKES_TURNS(nf) (ONVM_NF_COOP_SCHED && ONVM_CHECK_BIT((nf)->flags.init_options, COOP_SCHED_BIT))
+
+/***********************Internal Functions Prototypes*************************/
 
 /*
  * Function that initialize a nf tx info data structure.
@@ -149,11 +173,94 @@ static int
 onvm_nflib_parse_args(int argc, char *argv[], struct onvm_nf_init_cfg *nf_init_cfg);
 
 /*
- * Check if there are packets in this NF's RX Queue and process them
+ * Check if there are packets in this NF's RX Queue and process them,
+ * through the batch handler if the NF registered one
  */
 static inline uint16_t
-onvm_nflib_dequeue_packets(void **pkts, struct onvm_nf_local_ctx *nf_local_ctx, nf_pkt_handler_fn handler)
-    __attribute__((always_inline));
+onvm_nflib_dequeue_packets(void **pkts, struct onvm_nf_local_ctx *nf_local_ctx,
+                           struct onvm_nf_function_table *function_table) __attribute__((always_inline));
+
+/*
+ * Give a burst of up to PACKET_READ_SIZE packets to the NF's handler.
+ *
+ * Output : with ONVM_NF_HANDLE_TX the number of packets left in pkts to be
+ *          sent, 0 otherwise as they went to the TX thread
+ */
+static inline uint16_t
+onvm_nflib_handle_packets(void **pkts, uint16_t nb_pkts, struct onvm_nf_local_ctx *nf_local_ctx,
+                          struct onvm_nf_function_table *function_table) __attribute__((always_inline));
+
+/*
+ * Give any number of packets to the NF's handler and send them on, for the
+ * packets handled outside of the main loop's bursts.
+ */
+static void
+onvm_nflib_handle_burst(struct onvm_nf_local_ctx *nf_local_ctx, struct rte_mbuf *pkts[], uint32_t nb_pkts);
+
+/*
+ * Move the packets of held flows from a burst to the NF's hold, and let all
+ * held flows go on without their state if it took too long to arrive.
+ *
+ * Input  : the context of the NF
+ *          the burst and its size
+ * Output : the number of packets left in the burst
+ */
+static uint16_t
+onvm_nflib_flow_hold(struct onvm_nf_local_ctx *nf_local_ctx, struct rte_mbuf *pkts[], uint16_t nb_pkts);
+
+/*
+ * Handle the held packets of the flows no longer held.
+ */
+static void
+onvm_nflib_flow_release(struct onvm_nf_local_ctx *nf_local_ctx);
+
+/*
+ * Hand flows over on MSG_FLOW_EXPORT: take the packets the flows left in the
+ * rx ring and the hold, let the NF export their state and send it all on to
+ * the new instance.
+ */
+static void
+onvm_nflib_flow_export(struct onvm_flow_handoff *handoff, struct onvm_nf_local_ctx *nf_local_ctx);
+
+/*
+ * Take flows over on MSG_FLOW_IMPORT: let the NF import their state, handle
+ * the packets handed over, then the ones held for them.
+ */
+static void
+onvm_nflib_flow_import(struct onvm_flow_handoff *handoff, struct onvm_nf_local_ctx *nf_local_ctx);
+
+/*
+ * Free a handoff with the state and packets it still has.
+ */
+static void
+onvm_nflib_flow_handoff_free(struct onvm_flow_handoff *handoff);
+
+/*
+ * Send a message to the manager and wake it up.
+ *
+ * Output : 0 on success, an error code if its queue is full
+ */
+static int
+onvm_nflib_send_mgr_msg(struct onvm_nf_msg *msg);
+
+/*
+ * Send a message of the given type to another NF.
+ *
+ * Output : 0 on success, an error code otherwise
+ */
+static int
+onvm_nflib_send_msg(uint16_t dest, uint8_t msg_type, void *msg_data);
+
+/*
+ * Receive packets from the NIC RX queue this NF polls directly, on every
+ * port. Packets whose chain starts at another service are passed on.
+ *
+ * Input  : a pointer to the NF
+ *          the array to fill and its free space
+ * Output : the number of packets put in the array for this NF
+ */
+static inline uint16_t
+onvm_nflib_receive_direct(struct onvm_nf *nf, struct rte_mbuf *pkts[], uint16_t max_pkts);
 
 /*
  * Check if there is a message available for this NF and process it
@@ -161,6 +268,12 @@ onvm_nflib_dequeue_packets(void **pkts, struct onvm_nf_local_ctx *nf_local_ctx,
 static inline void
 onvm_nflib_dequeue_messages(struct onvm_nf_local_ctx *nf_local_ctx) __attribute__((always_inline));
 
+/*
+ * Give a run of typed messages to the NF's typed message handler, then free them.
+ */
+static void
+onvm_nflib_deliver_typed_msgs(struct onvm_nf_local_ctx *nf_local_ctx, struct onvm_nf_msg *msgs[], uint16_t nb_msgs);
+
 /*
  * Terminate the children spawned by the NF
  *
@@ -220,12 +333,65 @@ void *
 onvm_nflib_thread_main_loop(void *arg);
 
 /*
- * Function to initalize the shared core support
+ * Check if a NF has neither packets nor messages waiting.
+ *
+ * Input  : a pointer to the NF
+ */
+static inline int
+onvm_nflib_nf_is_idle(struct onvm_nf *nf);
+
+/*
+ * Cooperative scheduling: checks that the NF owns its core, otherwise waits
+ * until the core is handed to it.
+ *
+ * Input  : a pointer to the NF
+ * Output : 1 if the NF may run, 0 if it was woken without the core
+ */
+static int
+onvm_nflib_sched_acquire(struct onvm_nf *nf);
+
+/*
+ * Cooperative scheduling: charges a burst to the NF's turn, once the quota
+ * is used up the core goes to the NF picked by onvm_threading_sched_pick.
+ *
+ * Input  : a pointer to the NF
+ *          the number of packets handled
+ */
+static inline void
+onvm_nflib_sched_account(struct onvm_nf *nf, uint16_t nb_pkts);
+
+/*
+ * Cooperative scheduling: gives up the NF's core, to the next NF with work if any.
+ *
+ * Input  : a pointer to the NF
+ */
+static void
+onvm_nflib_sched_release(struct onvm_nf *nf);
+
+/*
+ * Makes the NF thread the DPDK lcore of its core when it has the core to
+ * itself, giving it the mempool caches of that lcore. Threads on shared
+ * cores drop their lcore id, they would otherwise share one cache.
+ *
+ * Input  : a pointer to the NF
+ */
+static void
+onvm_nflib_lcore_register(struct onvm_nf *nf);
+
+/*
+ * Gives the objects cached for this thread's lcore back to the mempools
+ * before the thread exits.
+ */
+static void
+onvm_nflib_lcore_unregister(void);
+
+/*
+ * Wakes a shared core NF whether it waits for work or for its core.
  *
- * Input  : Number of NF instances
+ * Input  : a pointer to the NF
  */
 static void
-init_shared_core_mode_info(uint16_t instance_id);
+onvm_nflib_wake_nf(struct onvm_nf *nf);
 
 /*
  * Signal handler to catch SIGINT/SIGTERM.
@@ -252,6 +418,8 @@ onvm_nflib_init_nf_local_ctx(void) {
         rte_atomic16_set(&nf_local_ctx->nf_init_finished, 0);
         rte_atomic16_init(&nf_local_ctx->nf_stopped);
         rte_atomic16_set(&nf_local_ctx->nf_stopped, 0);
+        nf_local_ctx->msg_poll_interval = 1;
+        nf_local_ctx->msg_poll_countdown = 1;
 
         return nf_local_ctx;
 }
@@ -279,18 +447,18 @@ onvm_nflib_request_lpm(struct lpm_request *lpm_req) {
         request_message->msg_type = MSG_REQUEST_LPM_REGION;
         request_message->msg_data = lpm_req;
 
-        ret = rte_ring_enqueue(mgr_msg_queue, request_message);
+        ret = onvm_nflib_send_mgr_msg(request_message);
         if (ret < 0) {
                 rte_mempool_put(nf_msg_pool, request_message);
                 return ret;
         }
 
+        /* The manager gives the message back to the pool once it handled it */
         lpm_req->status = NF_WAITING_FOR_LPM;
         for (; lpm_req->status == (uint16_t)NF_WAITING_FOR_LPM;) {
-                sleep(1);
+                usleep(NF_HANDSHAKE_POLL_US);
         }
 
-        rte_mempool_put(nf_msg_pool, request_message);
         return lpm_req->status;
 }
 
@@ -316,18 +484,18 @@ onvm_nflib_request_ft(struct rte_hash_parameters *ipv4_hash_params) {
         request_message->msg_type = MSG_REQUEST_FT;
         request_message->msg_data = ft_req;
 
-        ret = rte_ring_enqueue(mgr_msg_queue, request_message);
+        ret = onvm_nflib_send_mgr_msg(request_message);
         if (ret < 0) {
                 rte_mempool_put(nf_msg_pool, request_message);
                 return ret;
         }
 
+        /* The manager gives the message back to the pool once it handled it */
         ft_req->status = NF_WAITING_FOR_FT;
         for (; ft_req->status == (uint16_t)NF_WAITING_FOR_FT;) {
-                sleep(1);
+                usleep(NF_HANDSHAKE_POLL_US);
         }
 
-        rte_mempool_put(nf_msg_pool, request_message);
         return ft_req->status;
 }
 
@@ -447,7 +615,8 @@ onvm_nflib_start_nf(struct onvm_nf_local_ctx *nf_local_ctx, struct onvm_nf_init_
         /* Tell the manager we're ready to recieve packets */
         startup_msg->msg_type = MSG_NF_STARTING;
         startup_msg->msg_data = nf_init_cfg;
-        if (rte_ring_enqueue(mgr_msg_queue, startup_msg) < 0) {
+        nf_init_cfg->request_tsc = rte_get_tsc_cycles();
+        if (onvm_nflib_send_mgr_msg(startup_msg) < 0) {
                 rte_mempool_put(nf_init_cfg_mp, nf_init_cfg);  // give back mermory
                 rte_mempool_put(nf_msg_pool, startup_msg);
                 rte_exit(EXIT_FAILURE, "Cannot send nf_init_cfg to manager");
@@ -456,7 +625,7 @@ onvm_nflib_start_nf(struct onvm_nf_local_ctx *nf_local_ctx, struct onvm_nf_init_
         /* Wait for a NF id to be assigned by the manager */
         RTE_LOG(INFO, APP, "Waiting for manager to assign an ID...\n");
         for (; nf_init_cfg->status == (uint16_t)NF_WAITING_FOR_ID;) {
-                sleep(1);
+                usleep(NF_HANDSHAKE_POLL_US);
                 if (!rte_atomic16_read(&nf_local_ctx->keep_running)) {
                         /* Wait because we sent a message to the onvm_mgr */
                         for (i = 0; i < NF_TERM_INIT_ITER_TIMES && nf_init_cfg->status != NF_STARTING; i++) {
@@ -535,7 +704,9 @@ onvm_nflib_start_nf(struct onvm_nf_local_ctx *nf_local_ctx, struct onvm_nf_init_
 
         if (ONVM_NF_SHARE_CORES) {
                 RTE_LOG(INFO, APP, "Shared CPU support enabled\n");
-                init_shared_core_mode_info(nf->instance_id);
+                nf->shared_core.sleep_state = NF_AWAKE;
+                nf->shared_core.spin_budget = ONVM_NF_SPIN_MIN;
+                nf->shared_core.sched_credit = 0;
         }
 
         RTE_LOG(INFO, APP, "Using Instance ID %d\n", nf->instance_id);
@@ -588,8 +759,17 @@ onvm_nflib_thread_main_loop(void *arg) {
         nf_local_ctx = (struct onvm_nf_local_ctx *)arg;
         nf = nf_local_ctx->nf;
         onvm_threading_core_affinitize(nf->thread_info.core);
-        onvm_init_pkt_mutex();
-        onvm_init_set_action_mutex();
+        onvm_nflib_lcore_register(nf);
+
+        /* Only NFs running this loop give their core back, NFs with their own loop keep out of the turns */
+        if (ONVM_NF_COOP_SCHED)
+                nf->flags.init_options = ONVM_SET_BIT(nf->flags.init_options, COOP_SCHED_BIT);
+        /* A NIC RX queue has to be polled, NFs that sleep or run their own loop only get packets from rings */
+        if (!ONVM_NF_SHARE_CORES)
+                nf->flags.init_options = ONVM_SET_BIT(nf->flags.init_options, DIRECT_RX_BIT);
+        /* The manager only hands flows over between NFs that export and import their state */
+        if (nf->function_table->flow_export != NULL && nf->function_table->flow_import != NULL)
+                nf->flags.init_options = ONVM_SET_BIT(nf->flags.init_options, FLOW_HANDOFF_BIT);
 
         printf("Sending NF_READY message to manager...\n");
         ret = onvm_nflib_nf_ready(nf);
@@ -603,33 +783,45 @@ onvm_nflib_thread_main_loop(void *arg) {
         if (nf->function_table->setup != NULL)
                 nf->function_table->setup(nf_local_ctx);
 
+        /* Flow entries seen while handling a burst are not kept past it */
+        if (onvm_flow_dir_reader_register(nf->instance_id) < 0)
+                rte_exit(EXIT_FAILURE, "Unable to read the flow director\n");
+
         start_time = rte_get_tsc_cycles();
-        onvm_nf_ready_receive(nf);
         for (; rte_atomic16_read(&nf_local_ctx->keep_running) && rte_atomic16_read(&main_nf_local_ctx->keep_running);) {
+                onvm_flow_dir_quiescent();
                 /* Possibly sleep if in shared core mode, otherwise continue */
-                if (ONVM_NF_SHARE_CORES) {
-                        if (unlikely(rte_ring_count(nf->rx_q) == 0) && likely(rte_ring_count(nf->msg_q) == 0)) {
-                                rte_atomic16_set(nf->shared_core.sleep_state, 1);
-                                sem_wait(nf->shared_core.nf_mutex);
-                        }
+                if (ONVM_NF_SHARE_CORES && onvm_nflib_nf_is_idle(nf)) {
+                        onvm_flow_dir_reader_offline();
+                        onvm_nflib_wait_for_work(nf);
+                        onvm_flow_dir_reader_online();
+                        continue;
+                }
+                if (ONVM_NF_TAKES_TURNS(nf) && !onvm_nflib_sched_acquire(nf)) {
+                        continue;
                 }
 
-                nb_pkts_added =
-                    onvm_nflib_dequeue_packets((void **)pkts, nf_local_ctx, nf->function_table->pkt_handler);
+                nb_pkts_added = onvm_nflib_dequeue_packets((void **)pkts, nf_local_ctx, nf->function_table);
 
                 if (likely(nb_pkts_added > 0)) {
                         onvm_pkt_process_tx_batch(nf->nf_tx_mgr, pkts, nb_pkts_added, nf);
                 }
                 /* Flush the packet buffers */
                 onvm_pkt_enqueue_tx_thread(nf->nf_tx_mgr->to_tx_buf, nf);
+                onvm_pkt_flush_all_ports(nf->nf_tx_mgr);
                 onvm_pkt_flush_all_nfs(nf->nf_tx_mgr, nf);
 
-                onvm_nflib_dequeue_messages(nf_local_ctx);
+                if (--nf_local_ctx->msg_poll_countdown == 0) {
+                        nf_local_ctx->msg_poll_countdown = nf_local_ctx->msg_poll_interval;
+                        onvm_nflib_dequeue_messages(nf_local_ctx);
+                }
                 if (nf->function_table->user_actions != ONVM_NO_CALLBACK) {
                         rte_atomic16_set(&nf_local_ctx->keep_running,
                                          !(*nf->function_table->user_actions)(nf_local_ctx) &&
                                              rte_atomic16_read(&nf_local_ctx->keep_running));
                 }
+                if (ONVM_NF_TAKES_TURNS(nf))
+                        onvm_nflib_sched_account(nf, nb_pkts_added);
 
                 if (nf->flags.time_to_live &&
                     unlikely((rte_get_tsc_cycles() - start_time) * TIME_TTL_MULTIPLIER / rte_get_timer_hz() >=
@@ -638,7 +830,7 @@ onvm_nflib_thread_main_loop(void *arg) {
                         rte_atomic16_set(&nf_local_ctx->keep_running, 0);
                 }
                 if (nf->flags.pkt_limit &&
-                    unlikely(nf->stats.rx >= (uint64_t)nf->flags.pkt_limit * PKT_TTL_MULTIPLIER)) {
+                    unlikely(nf->nf_stats.rx_handled >= (uint64_t)nf->flags.pkt_limit * PKT_TTL_MULTIPLIER)) {
                         printf("Packet limit exceeded, shutting down\n");
                         rte_atomic16_set(&nf_local_ctx->keep_running, 0);
                 }
@@ -651,6 +843,10 @@ onvm_nflib_thread_main_loop(void *arg) {
                         break;
                 }
         }
+        if (ONVM_NF_TAKES_TURNS(nf))
+                onvm_nflib_sched_release(nf);
+        onvm_flow_dir_reader_unregister();
+        onvm_nflib_lcore_unregister();
         return NULL;
 }
 
@@ -665,13 +861,13 @@ onvm_nflib_return_pkt_bulk(struct onvm_nf *nf, struct rte_mbuf **pkts, uint16_t
         if (pkts == NULL || count == 0)
                 return -1;
         if (unlikely(rte_ring_mp_enqueue_bulk(nf->tx_q, (void **)pkts, count, NULL) == 0)) {
-                nf->stats.tx_drop += count;
+                nf->nf_stats.tx_returned_drop += count;
                 for (i = 0; i < count; i++) {
                         rte_pktmbuf_free(pkts[i]);
                 }
                 return -ENOBUFS;
         } else {
-                nf->stats.tx_returned += count;
+                nf->nf_stats.tx_returned += count;
         }
 
         return 0;
@@ -689,7 +885,7 @@ onvm_nflib_nf_ready(struct onvm_nf *nf) {
 
         startup_msg->msg_type = MSG_NF_READY;
         startup_msg->msg_data = nf;
-        ret = rte_ring_enqueue(mgr_msg_queue, startup_msg);
+        ret = onvm_nflib_send_mgr_msg(startup_msg);
         if (ret < 0) {
                 rte_mempool_put(nf_msg_pool, startup_msg);
                 return ret;
@@ -697,7 +893,7 @@ onvm_nflib_nf_ready(struct onvm_nf *nf) {
 
         /* Don't start running before the onvm_mgr handshake is finished */
         while (nf->status != NF_RUNNING) {
-                sleep(1);
+                usleep(NF_HANDSHAKE_POLL_US);
         }
 
         return 0;
@@ -708,9 +904,7 @@ onvm_nflib_handle_msg(struct onvm_nf_msg *msg, struct onvm_nf_local_ctx *nf_loca
         switch (msg->msg_type) {
                 case MSG_STOP:
                         RTE_LOG(INFO, APP, "Shutting down...\n");
-                        struct onvm_nf *parent_nf = &nfs[services[nf_local_ctx->nf->service_id][0]];
                         rte_atomic16_set(&nf_local_ctx->keep_running, 0);
-                        parent_nf->wait_flag = false;
                         break;
                 case MSG_SCALE:
                         RTE_LOG(INFO, APP, "Received scale message...\n");
@@ -733,10 +927,21 @@ onvm_nflib_handle_msg(struct onvm_nf_msg *msg, struct onvm_nf_local_ctx *nf_loca
                 case MSG_CHANGE_CORE:
                         RTE_LOG(INFO, APP, "Received relocation message...\n");
                         RTE_LOG(INFO, APP, "Moving NF to core %d\n", *(uint16_t *)msg->msg_data);
+                        /* The turns on the old core go on without this NF */
+                        if (ONVM_NF_TAKES_TURNS(nf_local_ctx->nf))
+                                onvm_nflib_sched_release(nf_local_ctx->nf);
                         nf_local_ctx->nf->thread_info.core = *(uint16_t *)msg->msg_data;
+                        onvm_nflib_lcore_unregister();
                         onvm_threading_core_affinitize(nf_local_ctx->nf->thread_info.core);
+                        onvm_nflib_lcore_register(nf_local_ctx->nf);
                         rte_free(msg->msg_data);
                         break;
+                case MSG_FLOW_EXPORT:
+                        onvm_nflib_flow_export((struct onvm_flow_handoff *)msg->msg_data, nf_local_ctx);
+                        break;
+                case MSG_FLOW_IMPORT:
+                        onvm_nflib_flow_import((struct onvm_flow_handoff *)msg->msg_data, nf_local_ctx);
+                        break;
                 case MSG_NOOP:
                 default:
                         break;
@@ -747,19 +952,185 @@ onvm_nflib_handle_msg(struct onvm_nf_msg *msg, struct onvm_nf_local_ctx *nf_loca
 
 int
 onvm_nflib_send_msg_to_nf(uint16_t dest, void *msg_data) {
+        return onvm_nflib_send_msg(dest, MSG_FROM_NF, msg_data);
+}
+
+void
+onvm_nflib_set_msg_poll_interval(struct onvm_nf_local_ctx *nf_local_ctx, uint16_t interval) {
+        nf_local_ctx->msg_poll_interval = RTE_MAX(interval, 1);
+        nf_local_ctx->msg_poll_countdown = RTE_MIN(nf_local_ctx->msg_poll_countdown, nf_local_ctx->msg_poll_interval);
+}
+
+int
+onvm_nflib_msg_alloc_bulk(struct onvm_nf_msg **msgs, unsigned count) {
+        unsigned i;
         int ret;
-        struct onvm_nf_msg *msg;
 
-        ret = rte_mempool_get(nf_msg_pool, (void **)(&msg));
-        if (ret != 0) {
-                RTE_LOG(INFO, APP, "Oh the huge manatee! Unable to allocate msg from pool :(\n");
+        ret = rte_mempool_get_bulk(nf_msg_pool, (void **)msgs, count);
+        if (ret != 0)
                 return ret;
+
+        for (i = 0; i < count; i++) {
+                msgs[i]->msg_type = MSG_NF_TYPED;
+                msgs[i]->msg_data = NULL;
+                msgs[i]->src = 0;
+                msgs[i]->type = 0;
+                msgs[i]->len = 0;
         }
+        return 0;
+}
 
-        msg->msg_type = MSG_FROM_NF;
-        msg->msg_data = msg_data;
+void
+onvm_nflib_msg_free_bulk(struct onvm_nf_msg **msgs, unsigned count) {
+        unsigned i;
 
-        return rte_ring_enqueue(nfs[dest].msg_q, (void *)msg);
+        for (i = 0; i < count; i++) {
+                if (msgs[i]->msg_type == MSG_NF_TYPED && msgs[i]->msg_data != NULL)
+                        onvm_nflib_msg_payload_put((struct onvm_nf_msg_payload *)msgs[i]->msg_data);
+        }
+        rte_mempool_put_bulk(nf_msg_pool, (void **)msgs, count);
+}
+
+int
+onvm_nflib_msg_set_data(struct onvm_nf_msg *msg, uint16_t type, const void *data, uint32_t len) {
+        struct onvm_nf_msg_payload *payload;
+
+        if (len <= ONVM_NF_MSG_INLINE_SIZE) {
+                rte_memcpy(msg->data, data, len);
+                msg->type = type;
+                msg->len = len;
+                return 0;
+        }
+
+        payload = onvm_nflib_msg_payload_alloc(len);
+        if (payload == NULL)
+                return -ENOMEM;
+        rte_memcpy(payload->data, data, len);
+        onvm_nflib_msg_set_payload(msg, type, payload);
+        onvm_nflib_msg_payload_put(payload);
+        return 0;
+}
+
+void
+onvm_nflib_msg_set_payload(struct onvm_nf_msg *msg, uint16_t type, struct onvm_nf_msg_payload *payload) {
+        onvm_nflib_msg_payload_get(payload);
+        msg->msg_data = payload;
+        msg->type = type;
+        msg->len = 0;
+}
+
+const void *
+onvm_nflib_msg_data(const struct onvm_nf_msg *msg) {
+        if (msg->msg_data != NULL)
+                return ((const struct onvm_nf_msg_payload *)msg->msg_data)->data;
+        return msg->data;
+}
+
+uint32_t
+onvm_nflib_msg_len(const struct onvm_nf_msg *msg) {
+        if (msg->msg_data != NULL)
+                return ((const struct onvm_nf_msg_payload *)msg->msg_data)->len;
+        return msg->len;
+}
+
+struct onvm_nf_msg_payload *
+onvm_nflib_msg_payload_alloc(uint32_t len) {
+        struct onvm_nf_msg_payload *payload;
+
+        payload = rte_malloc(NULL, sizeof(struct onvm_nf_msg_payload) + len, 0);
+        if (payload == NULL)
+                return NULL;
+        payload->refcnt = 1;
+        payload->len = len;
+        return payload;
+}
+
+void
+onvm_nflib_msg_payload_get(struct onvm_nf_msg_payload *payload) {
+        __atomic_fetch_add(&payload->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+void
+onvm_nflib_msg_payload_put(struct onvm_nf_msg_payload *payload) {
+        if (__atomic_sub_fetch(&payload->refcnt, 1, __ATOMIC_ACQ_REL) == 0)
+                rte_free(payload);
+}
+
+unsigned
+onvm_nflib_send_msgs(struct onvm_nf_local_ctx *nf_local_ctx, uint16_t dest, struct onvm_nf_msg **msgs,
+                     unsigned count) {
+        unsigned i, sent;
+
+        if (dest >= MAX_NFS || nfs[dest].msg_q == NULL)
+                return 0;
+
+        for (i = 0; i < count; i++)
+                msgs[i]->src = nf_local_ctx->nf->instance_id;
+
+        sent = rte_ring_enqueue_burst(nfs[dest].msg_q, (void **)msgs, count, NULL);
+        if (sent > 0 && ONVM_NF_SHARE_CORES)
+                onvm_nf_wakeup(&nfs[dest]);
+        return sent;
+}
+
+int
+onvm_nflib_flow_handoff_set_state(struct onvm_flow_handoff *handoff, const void *state, uint32_t state_len) {
+        void *copy;
+
+        copy = rte_malloc(NULL, state_len, 0);
+        if (copy == NULL)
+                return -ENOMEM;
+        rte_memcpy(copy, state, state_len);
+
+        rte_free(handoff->state);
+        handoff->state = copy;
+        handoff->state_len = state_len;
+        return 0;
+}
+
+void
+onvm_nflib_wait_for_work(struct onvm_nf *nf) {
+        struct core_status *core = &cores[nf->thread_info.core];
+        uint32_t spins;
+        uint16_t next;
+
+        if (ONVM_NF_TAKES_TURNS(nf)) {
+                /* Only the owner may spin, and only when no other NF has work */
+                if (core->sched_owner != nf->instance_id)
+                        goto block;
+                next = onvm_threading_sched_pick(core, nf->instance_id);
+                if (next != 0) {
+                        nf->shared_core.sched_credit = 0;
+                        onvm_threading_sched_handoff(core, nf->instance_id, next);
+                        goto block;
+                }
+        }
+
+        for (spins = 0; spins < nf->shared_core.spin_budget; spins++) {
+                if (!onvm_nflib_nf_is_idle(nf)) {
+                        /* Spinning paid off, allow a longer spin next time */
+                        nf->shared_core.spin_budget = RTE_MIN(nf->shared_core.spin_budget * 2, ONVM_NF_SPIN_MAX);
+                        return;
+                }
+                rte_pause();
+        }
+        nf->shared_core.spin_budget = RTE_MAX(nf->shared_core.spin_budget / 2, ONVM_NF_SPIN_MIN);
+
+        /* Free the core while blocked, a NF already waiting for it gets it */
+        if (ONVM_NF_TAKES_TURNS(nf)) {
+                nf->shared_core.sched_credit = 0;
+                onvm_threading_sched_handoff(core, nf->instance_id, 0);
+        }
+
+block:
+        /* Announce the sleep before the last look at the rings, see onvm_nf_wakeup */
+        nf->shared_core.sleep_state = NF_SLEEPING;
+        rte_smp_mb();
+        if (onvm_nflib_nf_is_idle(nf)) {
+                /* Returns at once if a producer already cleared sleep_state */
+                syscall(SYS_futex, &nf->shared_core.sleep_state, FUTEX_WAIT, NF_SLEEPING, NULL, NULL, 0);
+        }
+        nf->shared_core.sleep_state = NF_AWAKE;
 }
 
 void
@@ -919,7 +1290,11 @@ onvm_nflib_lookup_shared_structs(void) {
         const struct rte_memzone *mz_scp;
         const struct rte_memzone *mz_services;
         const struct rte_memzone *mz_nf_per_service;
+        const struct rte_memzone *mz_service_lb;
+        const struct rte_memzone *mz_nf_rx_stats;
+        const struct rte_memzone *mz_service_bp;
         const struct rte_memzone *mz_onvm_config;
+        const struct rte_memzone *mz_sg;
         struct rte_mempool *mp;
         struct onvm_service_chain **scp;
 
@@ -955,6 +1330,24 @@ onvm_nflib_lookup_shared_structs(void) {
         }
         nf_per_service_count = mz_nf_per_service->addr;
 
+        mz_service_lb = rte_memzone_lookup(MZ_SERVICE_LB_INFO);
+        if (mz_service_lb == NULL) {
+                rte_exit(EXIT_FAILURE, "Cannot get service instance tables\n");
+        }
+        service_lb = mz_service_lb->addr;
+
+        mz_nf_rx_stats = rte_memzone_lookup(MZ_NF_RX_STATS);
+        if (mz_nf_rx_stats == NULL) {
+                rte_exit(EXIT_FAILURE, "Cannot get NF rx stats\n");
+        }
+        nf_rx_stats = mz_nf_rx_stats->addr;
+
+        mz_service_bp = rte_memzone_lookup(MZ_SERVICE_BP_INFO);
+        if (mz_service_bp == NULL) {
+                rte_exit(EXIT_FAILURE, "Cannot get service backpressure info\n");
+        }
+        service_bp = mz_service_bp->addr;
+
         mz_port = rte_memzone_lookup(MZ_PORT_INFO);
         if (mz_port == NULL)
                 rte_exit(EXIT_FAILURE, "Cannot get port info structure\n");
@@ -978,6 +1371,11 @@ onvm_nflib_lookup_shared_structs(void) {
         default_chain = *scp;
         onvm_sc_print(default_chain);
 
+        mz_sg = rte_memzone_lookup(MZ_SERVICE_GRAPH);
+        if (mz_sg == NULL)
+                rte_exit(EXIT_FAILURE, "Cannot get service graph structure\n");
+        service_graph = mz_sg->addr;
+
         mgr_msg_queue = rte_ring_lookup(_MGR_MSG_QUEUE_NAME);
         if (mgr_msg_queue == NULL)
                 rte_exit(EXIT_FAILURE, "Cannot get mgr message ring");
@@ -988,15 +1386,14 @@ onvm_nflib_lookup_shared_structs(void) {
 static void
 onvm_nflib_parse_config(struct onvm_configuration *config) {
         ONVM_NF_SHARE_CORES = config->flags.ONVM_NF_SHARE_CORES;
+        ONVM_NF_COOP_SCHED = config->flags.ONVM_NF_SHARE_CORES && config->flags.ONVM_NF_COOP_SCHED;
 }
 
 static inline uint16_t
-onvm_nflib_dequeue_packets(void **pkts, struct onvm_nf_local_ctx *nf_local_ctx, nf_pkt_handler_fn handler) {
+onvm_nflib_dequeue_packets(void **pkts, struct onvm_nf_local_ctx *nf_local_ctx,
+                           struct onvm_nf_function_table *function_table) {
         struct onvm_nf *nf;
-        struct onvm_pkt_meta *meta;
-        uint16_t i, nb_pkts;
-        struct packet_buf tx_buf;
-        int ret_act;
+        uint16_t nb_pkts;
 
         nf = nf_local_ctx->nf;
 
@@ -1004,46 +1401,374 @@ onvm_nflib_dequeue_packets(void **pkts, struct onvm_nf_local_ctx *nf_local_ctx,
         //nb_pkts = rte_ring_mc_dequeue_burst(nf->rx_q, pkts, PACKET_READ_SIZE, NULL);
 	nb_pkts = rte_ring_dequeue_burst(nf->rx_q, pkts, PACKET_READ_SIZE, NULL);
 
+        /* Flows handed over to this NF wait for their state */
+        if (unlikely(nf->handoff.num_pending > 0))
+                nb_pkts = onvm_nflib_flow_hold(nf_local_ctx, (struct rte_mbuf **)pkts, nb_pkts);
+
+        /* Fill the rest of the burst from the NIC RX queue the manager gave this NF, if any */
+        if (nf->nic_rxq != ONVM_NF_NO_RXQ && nb_pkts < PACKET_READ_SIZE)
+                nb_pkts += onvm_nflib_receive_direct(nf, (struct rte_mbuf **)pkts + nb_pkts,
+                                                     PACKET_READ_SIZE - nb_pkts);
+
         if (unlikely(nb_pkts == 0)) {
                 return 0;
         }
 
-        tx_buf.count = 0;
+        return onvm_nflib_handle_packets(pkts, nb_pkts, nf_local_ctx, function_table);
+}
 
-        /* Give each packet to the user proccessing function */
-        for (i = 0; i < nb_pkts; i++) {
-                meta = onvm_get_pkt_meta((struct rte_mbuf *)pkts[i]);
-                ret_act = (*handler)((struct rte_mbuf *)pkts[i], meta, nf_local_ctx);
-                /* NF returns 0 to return packets or 1 to buffer */
-                if (likely(ret_act == 0)) {
+static inline uint16_t
+onvm_nflib_handle_packets(void **pkts, uint16_t nb_pkts, struct onvm_nf_local_ctx *nf_local_ctx,
+                          struct onvm_nf_function_table *function_table) {
+        struct onvm_nf *nf;
+        struct onvm_pkt_meta *meta[PACKET_READ_SIZE];
+        uint16_t i, nb_ret;
+        struct packet_buf tx_buf;
+        uint64_t start;
+        int ret_act;
+
+        start = rte_get_tsc_cycles();
+        nf = nf_local_ctx->nf;
+        tx_buf.count = 0;
+        nf->nf_stats.rx_handled += nb_pkts;
+
+        for (i = 0; i < nb_pkts; i++)
+                meta[i] = onvm_get_pkt_meta((struct rte_mbuf *)pkts[i]);
+
+        if (function_table->pkt_batch_handler != NULL) {
+                /* The batch handler compacts the packets it returns to the front of pkts */
+                ret_act = (*function_table->pkt_batch_handler)((struct rte_mbuf **)pkts, meta, nb_pkts,
+                                                               nf_local_ctx);
+                /* A negative return hands nothing back, never hand back more than was given */
+                nb_ret = ret_act < 0 ? 0 : (uint16_t)RTE_MIN(ret_act, (int)nb_pkts);
+                nf->nf_stats.tx_buffer += nb_pkts - nb_ret;
+                for (i = 0; i < nb_ret; i++)
                         tx_buf.buffer[tx_buf.count++] = pkts[i];
-                } else {
-                        nf->stats.tx_buffer++;
+        } else {
+                /* Give each packet to the user proccessing function */
+                for (i = 0; i < nb_pkts; i++) {
+                        ret_act = (*function_table->pkt_handler)((struct rte_mbuf *)pkts[i], meta[i], nf_local_ctx);
+                        /* NF returns 0 to return packets or 1 to buffer */
+                        if (likely(ret_act == 0)) {
+                                tx_buf.buffer[tx_buf.count++] = pkts[i];
+                        } else {
+                                nf->nf_stats.tx_buffer++;
+                        }
                 }
         }
         if (ONVM_NF_HANDLE_TX) {
-                return nb_pkts;
+                /* Only the packets handed back by the NF go through the tx path */
+                for (i = 0; i < tx_buf.count; i++)
+                        pkts[i] = tx_buf.buffer[i];
+                nf->nf_stats.busy_cycles += rte_get_tsc_cycles() - start;
+                return tx_buf.count;
         }
 
         onvm_pkt_enqueue_tx_thread(&tx_buf, nf);
+        nf->nf_stats.busy_cycles += rte_get_tsc_cycles() - start;
         return 0;
 }
 
-static inline void
-onvm_nflib_dequeue_messages(struct onvm_nf_local_ctx *nf_local_ctx) {
+static inline uint16_t
+onvm_nflib_receive_direct(struct onvm_nf *nf, struct rte_mbuf *pkts[], uint16_t max_pkts) {
+        volatile struct rx_stats *rx_stats;
+        uint16_t i, queue, rx_count, nb_pkts;
+
+        queue = nf->nic_rxq;
+        if (unlikely(queue < ports->nf_rxq_base || queue - ports->nf_rxq_base >= ports->num_nf_rxqs))
+                return 0;
+        rx_stats = &ports->nf_rxq_stats[queue - ports->nf_rxq_base];
+
+        nb_pkts = 0;
+        for (i = 0; i < ports->num_ports && nb_pkts < max_pkts; i++) {
+                rx_count = rte_eth_rx_burst(ports->id[i], queue, pkts + nb_pkts, max_pkts - nb_pkts);
+                if (rx_count == 0)
+                        continue;
+                rx_stats->rx[ports->id[i]] += rx_count;
+                nb_pkts += onvm_pkt_process_direct_rx_batch(nf->nf_tx_mgr, pkts + nb_pkts, rx_count, nf);
+        }
+
+        nf_rx_stats[nf->instance_id].rx[nf->instance_id] += nb_pkts;
+        return nb_pkts;
+}
+
+static void
+onvm_nflib_handle_burst(struct onvm_nf_local_ctx *nf_local_ctx, struct rte_mbuf *pkts[], uint32_t nb_pkts) {
+        struct onvm_nf *nf;
+        uint32_t i;
+        uint16_t burst, nb_tx;
+
+        nf = nf_local_ctx->nf;
+        for (i = 0; i < nb_pkts; i += burst) {
+                burst = RTE_MIN(nb_pkts - i, (uint32_t)PACKET_READ_SIZE);
+                nb_tx = onvm_nflib_handle_packets((void **)&pkts[i], burst, nf_local_ctx, nf->function_table);
+                /* The main loop flushes what this leaves buffered */
+                if (ONVM_NF_HANDLE_TX && nb_tx > 0)
+                        onvm_pkt_process_tx_batch(nf->nf_tx_mgr, &pkts[i], nb_tx, nf);
+        }
+}
+
+static uint16_t
+onvm_nflib_flow_hold(struct onvm_nf_local_ctx *nf_local_ctx, struct rte_mbuf *pkts[], uint16_t nb_pkts) {
+        struct onvm_nf *nf;
+        struct onvm_flow_hold *hold;
+        uint16_t i, nb_left, num_given_up;
+        uint32_t slot, w, gen;
+        uint64_t given_up;
+
+        nf = nf_local_ctx->nf;
+        hold = nf_local_ctx->flow_hold;
+        if (hold == NULL) {
+                hold = calloc(1, sizeof(struct onvm_flow_hold));
+                if (hold == NULL)
+                        return nb_pkts;
+                nf_local_ctx->flow_hold = hold;
+        }
+
+        /* The state never came, the flows go on from scratch rather than stall */
+        if (hold->count > 0 &&
+            rte_get_tsc_cycles() - hold->since > rte_get_tsc_hz() * ONVM_FLOW_HANDOFF_TIMEOUT_MS / 1000) {
+                RTE_LOG(INFO, APP, "NF %u gave up waiting for the state of %u held packets\n", nf->instance_id,
+                        hold->count);
+                /* Only give up on the handoffs prepared so far, the manager may prepare another meanwhile.
+                 * The generation is read first, the slots and count of every handoff up to it are set by then.
+                 * Imports of these handoffs arriving later are ignored */
+                gen = __atomic_load_n(&nf->handoff.gen, __ATOMIC_ACQUIRE);
+                for (w = 0; w < ONVM_FLOW_HANDOFF_WORDS; w++) {
+                        given_up = __atomic_load_n(&nf->handoff.held[w], __ATOMIC_RELAXED);
+                        __atomic_fetch_and(&nf->handoff.held[w], ~given_up, __ATOMIC_RELEASE);
+                }
+                num_given_up = (uint16_t)(gen - nf->handoff.given_up_gen) - nf->handoff.num_imported;
+                __atomic_fetch_sub(&nf->handoff.num_pending, num_given_up, __ATOMIC_RELEASE);
+                nf->handoff.given_up_gen = gen;
+                nf->handoff.num_imported = 0;
+                onvm_nflib_flow_release(nf_local_ctx);
+                return nb_pkts;
+        }
+
+        nb_left = 0;
+        for (i = 0; i < nb_pkts; i++) {
+                slot = pkts[i]->hash.rss % ONVM_SERVICE_LB_SIZE;
+                if (likely(!(nf->handoff.held[slot / 64] & (1ULL << (slot % 64))))) {
+                        pkts[nb_left++] = pkts[i];
+                        continue;
+                }
+                if (unlikely(hold->count == ONVM_FLOW_HOLD_SIZE)) {
+                        rte_pktmbuf_free(pkts[i]);
+                        nf_rx_stats[nf->instance_id].rx_drop[nf->instance_id]++;
+                        continue;
+                }
+                if (hold->count == 0)
+                        hold->since = rte_get_tsc_cycles();
+                hold->pkts[hold->count++] = pkts[i];
+        }
+
+        return nb_left;
+}
+
+static void
+onvm_nflib_flow_release(struct onvm_nf_local_ctx *nf_local_ctx) {
+        struct onvm_nf *nf;
+        struct onvm_flow_hold *hold;
+        struct rte_mbuf *ready[ONVM_FLOW_HOLD_SIZE];
+        uint32_t i, nb_ready, nb_held, slot;
+
+        nf = nf_local_ctx->nf;
+        hold = nf_local_ctx->flow_hold;
+        if (hold == NULL || hold->count == 0)
+                return;
+
+        /* Keep the order of each flow, the packets still held stay in front */
+        nb_ready = nb_held = 0;
+        for (i = 0; i < hold->count; i++) {
+                slot = hold->pkts[i]->hash.rss % ONVM_SERVICE_LB_SIZE;
+                if (nf->handoff.held[slot / 64] & (1ULL << (slot % 64)))
+                        hold->pkts[nb_held++] = hold->pkts[i];
+                else
+                        ready[nb_ready++] = hold->pkts[i];
+        }
+        hold->count = nb_held;
+        hold->since = rte_get_tsc_cycles();
+
+        onvm_nflib_handle_burst(nf_local_ctx, ready, nb_ready);
+}
+
+static void
+onvm_nflib_flow_export(struct onvm_flow_handoff *handoff, struct onvm_nf_local_ctx *nf_local_ctx) {
+        struct onvm_nf *nf;
+        struct onvm_flow_hold *hold;
+        struct rte_mbuf **pkts;
+        struct rte_mbuf *local[PACKET_READ_SIZE];
+        uint32_t i, nb_max, nb_ring, nb_local, nb_held;
+        uint16_t n;
+        int ret;
+
+        nf = nf_local_ctx->nf;
+        hold = nf_local_ctx->flow_hold;
+
+        /* The manager changed the table first, so the ring holds all the packets these flows will leave here */
+        nb_ring = rte_ring_count(nf->rx_q);
+        nb_max = nb_ring + (hold != NULL ? hold->count : 0);
+        pkts = nb_max > 0 ? rte_malloc(NULL, nb_max * sizeof(struct rte_mbuf *), 0) : NULL;
+
+        while (nb_ring > 0) {
+                n = rte_ring_dequeue_burst(nf->rx_q, (void **)local, RTE_MIN(nb_ring, PACKET_READ_SIZE), NULL);
+                if (n == 0)
+                        break;
+                nb_ring -= n;
+                nb_local = 0;
+                for (i = 0; i < n; i++) {
+                        if (pkts != NULL && onvm_flow_handoff_has(handoff, local[i]->hash.rss))
+                                pkts[handoff->num_pkts++] = local[i];
+                        else
+                                local[nb_local++] = local[i];
+                }
+                onvm_nflib_handle_burst(nf_local_ctx, local, nb_local);
+        }
+
+        /* Flows handed to this NF a moment ago may leave again before their state came */
+        if (hold != NULL && pkts != NULL) {
+                nb_held = 0;
+                for (i = 0; i < hold->count; i++) {
+                        if (onvm_flow_handoff_has(handoff, hold->pkts[i]->hash.rss))
+                                pkts[handoff->num_pkts++] = hold->pkts[i];
+                        else
+                                hold->pkts[nb_held++] = hold->pkts[i];
+                }
+                hold->count = nb_held;
+        }
+        handoff->pkts = pkts;
+
+        ret = (*nf->function_table->flow_export)(handoff, nf_local_ctx);
+        if (ret < 0)
+                RTE_LOG(INFO, APP, "NF %u could not export flow state for NF %u\n", nf->instance_id,
+                        handoff->dst);
+
+        if (onvm_nflib_send_msg(handoff->dst, MSG_FLOW_IMPORT, handoff) != 0) {
+                RTE_LOG(INFO, APP, "NF %u could not hand flows over to NF %u\n", nf->instance_id, handoff->dst);
+                onvm_nflib_flow_handoff_free(handoff);
+        }
+}
+
+static void
+onvm_nflib_flow_import(struct onvm_flow_handoff *handoff, struct onvm_nf_local_ctx *nf_local_ctx) {
+        struct onvm_nf *nf;
+        uint32_t w;
+        int ret;
+
+        nf = nf_local_ctx->nf;
+
+        /* Given up on already, its flows went on from scratch and its slots and count are gone */
+        if ((int32_t)(handoff->gen - nf->handoff.given_up_gen) <= 0) {
+                RTE_LOG(INFO, APP, "NF %u ignored the late flow state from NF %u\n", nf->instance_id,
+                        handoff->src);
+                onvm_nflib_handle_burst(nf_local_ctx, handoff->pkts, handoff->num_pkts);
+                handoff->num_pkts = 0;
+                onvm_nflib_flow_handoff_free(handoff);
+                return;
+        }
+
+        ret = (*nf->function_table->flow_import)(handoff, nf_local_ctx);
+        if (ret < 0)
+                RTE_LOG(INFO, APP, "NF %u could not import flow state from NF %u\n", nf->instance_id,
+                        handoff->src);
+
+        /* The packets the old instance had come before the ones held here */
+        onvm_nflib_handle_burst(nf_local_ctx, handoff->pkts, handoff->num_pkts);
+
+        for (w = 0; w < ONVM_FLOW_HANDOFF_WORDS; w++)
+                __atomic_fetch_and(&nf->handoff.held[w], ~handoff->slots[w], __ATOMIC_RELEASE);
+        __atomic_fetch_sub(&nf->handoff.num_pending, 1, __ATOMIC_RELEASE);
+        nf->handoff.num_imported++;
+        onvm_nflib_flow_release(nf_local_ctx);
+
+        handoff->num_pkts = 0;
+        onvm_nflib_flow_handoff_free(handoff);
+}
+
+static void
+onvm_nflib_flow_handoff_free(struct onvm_flow_handoff *handoff) {
+        uint32_t i;
+
+        for (i = 0; i < handoff->num_pkts; i++)
+                rte_pktmbuf_free(handoff->pkts[i]);
+        rte_free(handoff->pkts);
+        rte_free(handoff->state);
+        rte_free(handoff);
+}
+
+static int
+onvm_nflib_send_mgr_msg(struct onvm_nf_msg *msg) {
+        int ret;
+
+        ret = rte_ring_enqueue(mgr_msg_queue, msg);
+        if (ret == 0)
+                onvm_mgr_wakeup(onvm_config);
+        return ret;
+}
+
+static int
+onvm_nflib_send_msg(uint16_t dest, uint8_t msg_type, void *msg_data) {
+        int ret;
         struct onvm_nf_msg *msg;
-        struct rte_ring *msg_q;
 
-        msg_q = nf_local_ctx->nf->msg_q;
+        ret = rte_mempool_get(nf_msg_pool, (void **)(&msg));
+        if (ret != 0) {
+                RTE_LOG(INFO, APP, "Oh the huge manatee! Unable to allocate msg from pool :(\n");
+                return ret;
+        }
+
+        msg->msg_type = msg_type;
+        msg->msg_data = msg_data;
 
-        // Check and see if this NF has any messages from the manager
-        if (likely(rte_ring_count(msg_q) == 0)) {
+        ret = rte_ring_enqueue(nfs[dest].msg_q, (void *)msg);
+        if (ret != 0) {
+                rte_mempool_put(nf_msg_pool, (void *)msg);
+                return ret;
+        }
+        if (ONVM_NF_SHARE_CORES)
+                onvm_nf_wakeup(&nfs[dest]);
+
+        return 0;
+}
+
+static inline void
+onvm_nflib_dequeue_messages(struct onvm_nf_local_ctx *nf_local_ctx) {
+        struct onvm_nf_msg *msgs[NF_MSG_BURST_SIZE];
+        struct onvm_nf_msg *typed_msgs[NF_MSG_BURST_SIZE];
+        uint16_t i, nb_msgs, nb_typed;
+
+        // Check and see if this NF has any messages from the manager or other NFs
+        nb_msgs = rte_ring_dequeue_burst(nf_local_ctx->nf->msg_q, (void **)msgs, NF_MSG_BURST_SIZE, NULL);
+        if (likely(nb_msgs == 0))
                 return;
+
+        nb_typed = 0;
+        for (i = 0; i < nb_msgs; i++) {
+                if (msgs[i]->msg_type == MSG_NF_TYPED) {
+                        typed_msgs[nb_typed++] = msgs[i];
+                        continue;
+                }
+                /* The typed messages sent before this one are handled first */
+                onvm_nflib_deliver_typed_msgs(nf_local_ctx, typed_msgs, nb_typed);
+                nb_typed = 0;
+                onvm_nflib_handle_msg(msgs[i], nf_local_ctx);
+                rte_mempool_put(nf_msg_pool, (void *)msgs[i]);
         }
-        msg = NULL;
-        rte_ring_dequeue(msg_q, (void **)(&msg));
-        onvm_nflib_handle_msg(msg, nf_local_ctx);
-        rte_mempool_put(nf_msg_pool, (void *)msg);
+        onvm_nflib_deliver_typed_msgs(nf_local_ctx, typed_msgs, nb_typed);
+}
+
+static void
+onvm_nflib_deliver_typed_msgs(struct onvm_nf_local_ctx *nf_local_ctx, struct onvm_nf_msg *msgs[], uint16_t nb_msgs) {
+        nf_typed_msg_handler_fn handler;
+
+        if (nb_msgs == 0)
+                return;
+
+        handler = nf_local_ctx->nf->function_table->typed_msg_handler;
+        if (handler != NULL)
+                (*handler)(msgs, nb_msgs, nf_local_ctx);
+        onvm_nflib_msg_free_bulk(msgs, nb_msgs);
 }
 
 static void *
@@ -1109,10 +1834,8 @@ onvm_nflib_handle_signal(int sig) {
 
         /* If NF is asleep, wake it up */
         nf = main_nf_local_ctx->nf;
-        if (ONVM_NF_SHARE_CORES && rte_atomic16_read(nf->shared_core.sleep_state) == 1) {
-                rte_atomic16_set(nf->shared_core.sleep_state, 0);
-                sem_post(nf->shared_core.nf_mutex);
-        }
+        if (ONVM_NF_SHARE_CORES)
+                onvm_nflib_wake_nf(nf);
 
         if (global_nf_signal_handler != NULL)
                 global_nf_signal_handler(sig);
@@ -1123,7 +1846,8 @@ onvm_nflib_handle_signal(int sig) {
 static int
 onvm_nflib_is_scale_info_valid(struct onvm_nf_scale_info *scale_info) {
         return scale_info->nf_init_cfg->service_id != 0 && scale_info->function_table != NULL &&
-               scale_info->function_table->pkt_handler != NULL;
+               (scale_info->function_table->pkt_handler != NULL ||
+                scale_info->function_table->pkt_batch_handler != NULL);
 }
 
 static void
@@ -1148,6 +1872,16 @@ onvm_nflib_nf_tx_mgr_init(struct onvm_nf *nf) {
                 RTE_LOG(ERR, APP, "Can't allocate packet_buf struct\n");
                 return;
         }
+        /* With a NIC TX queue leased by the manager packets going out skip the TX threads */
+        nf->nf_tx_mgr->nic_txq = ONVM_NF_NO_TXQ;
+        if (nf->nic_txq != ONVM_NF_NO_TXQ) {
+                nf->nf_tx_mgr->port_tx_bufs =
+                    rte_zmalloc(NULL, RTE_MAX_ETHPORTS * sizeof(struct packet_buf), RTE_CACHE_LINE_SIZE);
+                if (nf->nf_tx_mgr->port_tx_bufs != NULL)
+                        nf->nf_tx_mgr->nic_txq = nf->nic_txq;
+                else
+                        RTE_LOG(WARNING, APP, "Can't allocate port buffers, sending through the TX threads\n");
+        }
 }
 
 static void
@@ -1159,7 +1893,8 @@ onvm_nflib_usage(const char *progname) {
             "[-t <time_to_live>] "
             "[-l <pkt_limit>] "
             "[-m (manual core assignment flag)] "
-            "[-s (share core flag)]\n\n",
+            "[-s (share core flag)] "
+            "[-o (own NIC TX queue flag)]\n\n",
             progname);
 }
 
@@ -1170,7 +1905,7 @@ onvm_nflib_parse_args(int argc, char *argv[], struct onvm_nf_init_cfg *nf_init_c
         int service_id = -1;
 
         opterr = 0;
-        while ((c = getopt(argc, argv, "n:r:t:l:ms")) != -1)
+        while ((c = getopt(argc, argv, "n:r:t:l:mso")) != -1)
                 switch (c) {
                         case 'n':
                                 initial_instance_id = (uint16_t)strtoul(optarg, NULL, 10);
@@ -1203,6 +1938,9 @@ onvm_nflib_parse_args(int argc, char *argv[], struct onvm_nf_init_cfg *nf_init_c
                         case 's':
                                 nf_init_cfg->init_options = ONVM_SET_BIT(nf_init_cfg->init_options, SHARE_CORE_BIT);
                                 break;
+                        case 'o':
+                                nf_init_cfg->init_options = ONVM_SET_BIT(nf_init_cfg->init_options, NIC_TX_QUEUE_BIT);
+                                break;
                         case '?':
                                 onvm_nflib_usage(progname);
                                 if (optopt == 'n')
@@ -1241,10 +1979,8 @@ onvm_nflib_terminate_children(struct onvm_nf *nf) {
                                 continue;
 
                         /* Wake up the child if its sleeping */
-                        if (ONVM_NF_SHARE_CORES && rte_atomic16_read(nfs[i].shared_core.sleep_state) == 1) {
-                                rte_atomic16_set(nfs[i].shared_core.sleep_state, 0);
-                                sem_post(nfs[i].shared_core.nf_mutex);
-                        }
+                        if (ONVM_NF_SHARE_CORES)
+                                onvm_nflib_wake_nf(&nfs[i]);
                 }
                 RTE_LOG(INFO, APP, "NF %d: Waiting for %d children to exit\n", nf->instance_id,
                         rte_atomic16_read(&nf->thread_info.children_cnt));
@@ -1262,6 +1998,7 @@ static void
 onvm_nflib_cleanup(struct onvm_nf_local_ctx *nf_local_ctx) {
         struct onvm_nf_msg *shutdown_msg;
         struct onvm_nf *nf;
+        uint32_t i;
 
         if (nf_local_ctx == NULL) {
                 return;
@@ -1297,6 +2034,10 @@ onvm_nflib_cleanup(struct onvm_nf_local_ctx *nf_local_ctx) {
                         rte_free(nf->nf_tx_mgr->nf_rx_bufs);
                         nf->nf_tx_mgr->nf_rx_bufs = NULL;
                 }
+                if (nf->nf_tx_mgr->port_tx_bufs != NULL) {
+                        rte_free(nf->nf_tx_mgr->port_tx_bufs);
+                        nf->nf_tx_mgr->port_tx_bufs = NULL;
+                }
                 rte_free(nf->nf_tx_mgr);
                 nf->nf_tx_mgr = NULL;
         }
@@ -1314,40 +2055,131 @@ onvm_nflib_cleanup(struct onvm_nf_local_ctx *nf_local_ctx) {
         shutdown_msg->msg_type = MSG_NF_STOPPING;
         shutdown_msg->msg_data = nf;
 
-        if (rte_ring_enqueue(mgr_msg_queue, shutdown_msg) < 0) {
+        if (onvm_nflib_send_mgr_msg(shutdown_msg) < 0) {
                 rte_mempool_put(nf_msg_pool, shutdown_msg);
                 rte_exit(EXIT_FAILURE, "Cannot send mgr message to manager for shutdown");
         }
 
+        /* Packets still held for flows in transit are lost with the NF */
+        if (nf_local_ctx->flow_hold != NULL) {
+                for (i = 0; i < nf_local_ctx->flow_hold->count; i++)
+                        rte_pktmbuf_free(nf_local_ctx->flow_hold->pkts[i]);
+                free(nf_local_ctx->flow_hold);
+        }
+
         /* Cleanup context */
         nf_local_ctx->nf = NULL;
         free(nf_local_ctx);
 }
 
+static inline int
+onvm_nflib_nf_is_idle(struct onvm_nf *nf) {
+        return rte_ring_empty(nf->rx_q) && rte_ring_empty(nf->msg_q);
+}
+
+static int
+onvm_nflib_sched_acquire(struct onvm_nf *nf) {
+        struct core_status *core = &cores[nf->thread_info.core];
+        uint16_t owner;
+
+        owner = core->sched_owner;
+        if (likely(owner == nf->instance_id && nf->shared_core.sched_credit > 0))
+                return 1;
+
+        if (owner != nf->instance_id) {
+                /* Announce the wait before the last look at the owner, see onvm_threading_sched_handoff */
+                nf->shared_core.sleep_state = NF_WAITING_TURN;
+                rte_smp_mb();
+                owner = core->sched_owner;
+                if (owner == 0 && __atomic_compare_exchange_n(&core->sched_owner, &owner, nf->instance_id, 0,
+                                                              __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+                        owner = nf->instance_id;
+                if (owner != nf->instance_id) {
+                        syscall(SYS_futex, &nf->shared_core.sleep_state, FUTEX_WAIT, NF_WAITING_TURN, NULL, NULL, 0);
+                        nf->shared_core.sleep_state = NF_AWAKE;
+                        return 0;
+                }
+                nf->shared_core.sleep_state = NF_AWAKE;
+        }
+
+        /* A new turn */
+        nf->shared_core.sched_credit = onvm_threading_sched_quota(core, nf->instance_id);
+        nf->shared_core.sched_last_run = rte_get_tsc_cycles();
+        return 1;
+}
+
+static inline void
+onvm_nflib_sched_account(struct onvm_nf *nf, uint16_t nb_pkts) {
+        struct core_status *core;
+        uint16_t next;
+
+        /* Bursts without packets still count, so message handling can't keep the core forever */
+        nf->shared_core.sched_credit -= RTE_MAX(nb_pkts, 1);
+        if (likely(nf->shared_core.sched_credit > 0))
+                return;
+
+        core = &cores[nf->thread_info.core];
+        next = onvm_threading_sched_pick(core, nf->instance_id);
+        if (next == 0) {
+                /* Nobody else has work, take another turn */
+                nf->shared_core.sched_credit = onvm_threading_sched_quota(core, nf->instance_id);
+                nf->shared_core.sched_last_run = rte_get_tsc_cycles();
+                return;
+        }
+
+        nf->shared_core.sched_credit = 0;
+        onvm_threading_sched_handoff(core, nf->instance_id, next);
+}
+
 static void
-init_shared_core_mode_info(uint16_t instance_id) {
-        key_t key;
-        int shmid;
-        char *shm;
-        struct onvm_nf *nf;
-        const char *sem_name;
+onvm_nflib_sched_release(struct onvm_nf *nf) {
+        struct core_status *core = &cores[nf->thread_info.core];
 
-        nf = &nfs[instance_id];
-        sem_name = get_sem_name(instance_id);
+        nf->shared_core.sched_credit = 0;
+        onvm_threading_sched_handoff(core, nf->instance_id, onvm_threading_sched_pick(core, nf->instance_id));
+}
 
-        nf->shared_core.nf_mutex = sem_open(sem_name, 0, 0666, 0);
-        if (nf->shared_core.nf_mutex == SEM_FAILED)
-                rte_exit(EXIT_FAILURE, "Unable to execute semphore for NF %d\n", instance_id);
+static void
+onvm_nflib_lcore_register(struct onvm_nf *nf) {
+        if (ONVM_CHECK_BIT(nf->flags.init_options, SHARE_CORE_BIT)) {
+                onvm_threading_lcore_register(-1);
+                return;
+        }
 
-        /* Get flag which is shared by server */
-        key = get_rx_shmkey(instance_id);
-        if ((shmid = shmget(key, SHMSZ, 0666)) < 0)
-                rte_exit(EXIT_FAILURE, "Unable to locate the segment for NF %d\n", instance_id);
+        if (onvm_threading_lcore_register(nf->thread_info.core) < 0)
+                RTE_LOG(WARNING, APP, "NF %u: core %u has no lcore id, mbufs are allocated without a cache\n",
+                        nf->instance_id, nf->thread_info.core);
+}
+
+static void
+onvm_nflib_lcore_unregister(void) {
+        struct rte_mempool_cache *cache;
+        struct rte_mempool *mp;
+        unsigned lcore_id, socket_id;
+
+        lcore_id = rte_lcore_id();
+        if (lcore_id == LCORE_ID_ANY)
+                return;
 
-        if ((shm = shmat(shmid, NULL, 0)) == (char *)-1)
-                rte_exit(EXIT_FAILURE, "Can not attach the shared segment to the NF space for NF %d\n", instance_id);
+        mp = rte_mempool_lookup(PKTMBUF_POOL_NAME);
+        if (mp != NULL && (cache = rte_mempool_default_cache(mp, lcore_id)) != NULL)
+                rte_mempool_cache_flush(cache, mp);
+        /* Packets from ports on other sockets go back to the pools of those sockets */
+        for (socket_id = 0; socket_id < RTE_MAX_NUMA_NODES; socket_id++) {
+                mp = rte_mempool_lookup(get_pktmbuf_pool_name(socket_id));
+                if (mp != NULL && (cache = rte_mempool_default_cache(mp, lcore_id)) != NULL)
+                        rte_mempool_cache_flush(cache, mp);
+        }
+        if (nf_msg_pool != NULL && (cache = rte_mempool_default_cache(nf_msg_pool, lcore_id)) != NULL)
+                rte_mempool_cache_flush(cache, nf_msg_pool);
+        onvm_threading_lcore_register(-1);
+}
 
-        nf->shared_core.sleep_state = (rte_atomic16_t *)shm;
+static void
+onvm_nflib_wake_nf(struct onvm_nf *nf) {
+        rte_smp_mb();
+        if (!onvm_nf_wake(nf, NF_SLEEPING))
+                onvm_nf_wake(nf, NF_WAITING_TURN);
 }
 
 void
@@ -1359,16 +2191,16 @@ onvm_nflib_stats_summary_output(uint16_t id) {
             "NF tag, NF instance ID, NF service ID, NF assigned core, RX total,"
             "RX total dropped, TX total, TX total dropped, NF sent out, NF sent to NF,"
             "NF dropped, NF next, NF tx buffered, NF tx buffered, NF tx returned";
-        const uint64_t rx = nfs[id].stats.rx;
-        const uint64_t rx_drop = nfs[id].stats.rx_drop;
+        const uint64_t rx = onvm_nf_stats_rx(nf_rx_stats, id);
+        const uint64_t rx_drop = onvm_nf_stats_rx_drop(nf_rx_stats, id);
         const uint64_t tx = nfs[id].stats.tx;
-        const uint64_t tx_drop = nfs[id].stats.tx_drop;
+        const uint64_t tx_drop = nfs[id].stats.tx_drop + nfs[id].nf_stats.tx_returned_drop;
         const uint64_t act_out = nfs[id].stats.act_out;
         const uint64_t act_tonf = nfs[id].stats.act_tonf;
         const uint64_t act_drop = nfs[id].stats.act_drop;
         const uint64_t act_next = nfs[id].stats.act_next;
-        const uint64_t act_buffer = nfs[id].stats.tx_buffer;
-        const uint64_t act_returned = nfs[id].stats.tx_returned;
+        const uint64_t act_buffer = nfs[id].nf_stats.tx_buffer;
+        const uint64_t act_returned = nfs[id].nf_stats.tx_returned;
         char *nf_tag = nfs[id].tag;
         uint16_t core = nfs[id].thread_info.core;
         uint16_t service_id = nfs[id].service_id;
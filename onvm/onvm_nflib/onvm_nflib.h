@@ -191,6 +191,156 @@ onvm_nflib_handle_msg(struct onvm_nf_msg *msg, struct onvm_nf_local_ctx *nf_loca
 int
 onvm_nflib_send_msg_to_nf(uint16_t dest_nf, void *msg_data);
 
+/**
+ * Sets how often the NF looks for messages, every interval bursts. NFs
+ * exchanging few messages save the look at their message queue in most
+ * iterations, at the cost of handling messages later. Defaults to 1.
+ *
+ * @param nf_local_ctx
+ *    Pointer to a context struct of this NF.
+ * @param interval
+ *    the number of bursts between two looks, at least 1
+ */
+void
+onvm_nflib_set_msg_poll_interval(struct onvm_nf_local_ctx *nf_local_ctx, uint16_t interval);
+
+/**
+ * Allocates typed messages to send to other NFs with onvm_nflib_send_msgs.
+ *
+ * @param msgs
+ *    an array of at least count message pointers to fill
+ * @param count
+ *    the number of messages
+ * @return
+ *    0 on success, a negative value if the message pool can't give all of them
+ */
+int
+onvm_nflib_msg_alloc_bulk(struct onvm_nf_msg **msgs, unsigned count);
+
+/**
+ * Frees messages, releasing their payloads. For the messages
+ * onvm_nflib_send_msgs could not send, received messages are freed by nflib.
+ *
+ * @param msgs
+ *    an array of message pointers
+ * @param count
+ *    the number of messages
+ */
+void
+onvm_nflib_msg_free_bulk(struct onvm_nf_msg **msgs, unsigned count);
+
+/**
+ * Sets the type and payload of a message, copying the payload. Payloads up
+ * to ONVM_NF_MSG_INLINE_SIZE bytes are copied into the message, larger ones
+ * into a new onvm_nf_msg_payload.
+ *
+ * @param msg
+ *    a message from onvm_nflib_msg_alloc_bulk
+ * @param type
+ *    the type of the message, chosen by the NFs
+ * @param data
+ *    the payload
+ * @param len
+ *    the length of the payload in bytes
+ * @return
+ *    0 on success, -ENOMEM if a large payload can't be allocated
+ */
+int
+onvm_nflib_msg_set_data(struct onvm_nf_msg *msg, uint16_t type, const void *data, uint32_t len);
+
+/**
+ * Sets the type and payload of a message without copying the payload. The
+ * message takes a reference on it, the same payload can go in any number
+ * of messages.
+ *
+ * @param msg
+ *    a message from onvm_nflib_msg_alloc_bulk
+ * @param type
+ *    the type of the message, chosen by the NFs
+ * @param payload
+ *    a payload from onvm_nflib_msg_payload_alloc
+ */
+void
+onvm_nflib_msg_set_payload(struct onvm_nf_msg *msg, uint16_t type, struct onvm_nf_msg_payload *payload);
+
+/**
+ * Gets the payload of a received typed message and its length.
+ */
+const void *
+onvm_nflib_msg_data(const struct onvm_nf_msg *msg);
+
+uint32_t
+onvm_nflib_msg_len(const struct onvm_nf_msg *msg);
+
+/**
+ * Allocates a refcounted payload in hugepages, with one reference held by
+ * the caller. The payload is freed when the last reference is put.
+ *
+ * @param len
+ *    the size of the payload data in bytes
+ * @return
+ *    the payload, NULL if it can't be allocated
+ */
+struct onvm_nf_msg_payload *
+onvm_nflib_msg_payload_alloc(uint32_t len);
+
+/**
+ * Takes and releases a reference on a payload, a NF keeps the payload of a
+ * received message past its typed message handler by taking one.
+ */
+void
+onvm_nflib_msg_payload_get(struct onvm_nf_msg_payload *payload);
+
+void
+onvm_nflib_msg_payload_put(struct onvm_nf_msg_payload *payload);
+
+/**
+ * Sends a burst of typed messages to another NF, which gets them in its
+ * typed_msg_handler. Messages that are sent belong to the receiver.
+ *
+ * @param nf_local_ctx
+ *    Pointer to a context struct of this NF.
+ * @param dest
+ *    the instance id of the NF to send to
+ * @param msgs
+ *    the messages, filled with onvm_nflib_msg_set_data or onvm_nflib_msg_set_payload
+ * @param count
+ *    the number of messages
+ * @return
+ *    the number of messages sent, the first ones, the caller frees the others
+ */
+unsigned
+onvm_nflib_send_msgs(struct onvm_nf_local_ctx *nf_local_ctx, uint16_t dest, struct onvm_nf_msg **msgs,
+                     unsigned count);
+
+/**
+ * Attach the exported state of the flows being handed over, from the NF's
+ * flow_export callback. The state is copied, the NF keeps its buffer.
+ *
+ * @param handoff
+ *    the handoff given to flow_export
+ * @param state
+ *    the state of the flows in handoff, in any format the NF's flow_import reads
+ * @param state_len
+ *    the length of state in bytes
+ * @return
+ *    0 on success, -ENOMEM if the state can't be copied
+ */
+int
+onvm_nflib_flow_handoff_set_state(struct onvm_flow_handoff *handoff, const void *state, uint32_t state_len);
+
+/**
+ * Idles a shared core NF until packets or messages arrive for it.
+ * Spins for a while first, then blocks until a producer wakes it. Signals
+ * and shutdown also wake it, so callers recheck their own state on return.
+ * Only for NFs running their own loop (advanced rings) in shared core mode.
+ *
+ * @param nf
+ *   Pointer to the NF that has nothing to do
+ */
+void
+onvm_nflib_wait_for_work(struct onvm_nf *nf);
+
 /**
  * Stop this NF and clean up its memory
  * Sends shutdown message to manager.
@@ -50,8 +50,8 @@
 
 #include "onvm_pkt_common.h"
 
-sem_t *onvm_pkt_mutex[32];
-sem_t *onvm_set_action_mutex[32];
+/* Pool private copies of parallel packets are taken from, looked up on first use */
+static struct rte_mempool *pkt_clone_pool = NULL;
 
 /**********************Internal Functions Prototypes**************************/
 
@@ -71,12 +71,33 @@ onvm_pkt_clear_meta_bit(uint8_t flags, uint8_t n) {
 }
 
 /*
- * Function to enqueue multi NF
+ * Function to enqueue a packet on several NFs processing it in parallel.
  * Check all of NF is available
+ *
+ * Inputs : a pointer to the tx queue responsible
+ *          the destination service ids
+ *          whether each destination writes to the packet
+ *          the number of destinations
+ *          a pointer to the packet
+ *          a pointer to the NF possessing the TX queue.
+ *
  */
 static inline void
-onvm_pkt_enqueue_multi_nf(struct queue_mgr *tx_mgr, uint8_t dst_service, struct rte_mbuf *pkt,
-                          struct onvm_nf *source_nf);
+onvm_pkt_enqueue_multi_nf(struct queue_mgr *tx_mgr, const uint16_t dst_service_id[], const uint8_t dst_write[],
+                          uint16_t dst_counter, struct rte_mbuf *pkt, struct onvm_nf *source_nf);
+
+/*
+ * Function to enqueue a packet on the services set in a PARA bitmask.
+ *
+ * Inputs : a pointer to the tx queue responsible
+ *          the bitmask of destination services
+ *          a pointer to the packet
+ *          a pointer to the NF possessing the TX queue.
+ *
+ */
+static inline void
+onvm_pkt_enqueue_para(struct queue_mgr *tx_mgr, uint8_t dst_service, struct rte_mbuf *pkt,
+                      struct onvm_nf *source_nf);
 
 /*
  * Function to enqueue a packet on one port's queue.
@@ -112,18 +133,60 @@ static int
 onvm_pkt_drop(struct rte_mbuf *pkt);
 
 /*
- * Initialize set action mutex
- * This mutex will helpful for parallelization
+ * Mark one parallel NF as finished with a packet.
+ *
+ * Input  : a pointer to the packet meta
+ * Output : 1 if the caller was the last parallel NF and now owns the packet,
+ *          0 if other parallel NFs are still processing it
+ *
+ */
+static inline int
+onvm_pkt_parallel_done(struct onvm_pkt_meta *meta);
+
+/*
+ * Make the private copy of a parallel packet handed to a writer service.
+ *
+ * Input  : a pointer to the shared packet
+ *          the writer service id
+ * Output : the copy, NULL if no mbuf could be allocated
+ *
  */
-void
-onvm_init_set_action_mutex(void);
+static struct rte_mbuf *
+onvm_pkt_parallel_copy(struct rte_mbuf *pkt, uint8_t service);
 
 /*
- * Initialize pkt mutex
- * This mutex will helpful for parallelization
+ * Finish one branch of a parallel packet. A writer copy is kept for the join,
+ * unless keep is 0, in which case its changes are discarded.
+ *
+ * Input  : a pointer to the shared packet or to a writer copy
+ *          whether a writer copy should be kept
+ * Output : the packet to forward if this was the last branch, NULL otherwise
+ *
  */
-void
-onvm_init_pkt_mutex(void);
+static inline struct rte_mbuf *
+onvm_pkt_parallel_join(struct rte_mbuf *pkt, int keep);
+
+/*
+ * Helper functions to track which NF buffers hold packets.
+ *
+ * Inputs : a pointer to the tx queue responsible
+ *          the instance id owning the buffer
+ *
+ */
+static inline void
+onvm_pkt_mark_nf_pending(struct queue_mgr *tx_mgr, uint16_t nf_id);
+
+static inline void
+onvm_pkt_clear_nf_pending(struct queue_mgr *tx_mgr, uint16_t nf_id);
+
+/*
+ * Helper function returning the row of nf_rx_stats written by the calling thread.
+ *
+ * Input : a pointer to the tx queue of the thread
+ *
+ */
+static inline struct onvm_nf_rx_stats *
+onvm_pkt_rx_stats(struct queue_mgr *tx_mgr);
 
 /*
  * Set packet meta action and destination
@@ -162,28 +225,21 @@ onvm_pkt_process_tx_batch(struct queue_mgr *tx_mgr, struct rte_mbuf *pkts[], uin
 #endif
 
                 if (onvm_pkt_check_meta_bit(meta->flags, PKT_META_GO_PARALLEL)) {
-                        sem_t *pkt_mutex = onvm_pkt_mutex[meta->mutex_id];
-                        sem_wait(pkt_mutex);
-                        if (meta->numNF) {
-                                if (--meta->numNF) {
-                                        sem_post(pkt_mutex);
-
+                        pkts[i] = onvm_pkt_parallel_join(pkts[i], 1);
+                        if (pkts[i] == NULL) {
 #ifdef _measure
-                                        uint64_t end = rte_get_timer_cycles();
-                                        cost += (end - start);
-                                        if ((counter % 1000000) == 0) {
-                                                uint64_t latency = ((cost * 1000) / rte_get_timer_hz());
-                                                printf("process cost = %ld cycles, latency = %ld nanosecond\n", cost,
-                                                       latency);
-                                                cost = 0;
-                                        }
-#endif
-
-                                        continue;
+                                uint64_t end = rte_get_timer_cycles();
+                                cost += (end - start);
+                                if ((counter % 1000000) == 0) {
+                                        uint64_t latency = ((cost * 1000) / rte_get_timer_hz());
+                                        printf("process cost = %ld cycles, latency = %ld nanosecond\n", cost,
+                                               latency);
+                                        cost = 0;
                                 }
+#endif
+                                continue;
                         }
-                        meta->flags = onvm_pkt_clear_meta_bit(meta->flags, PKT_META_GO_PARALLEL);
-                        sem_post(pkt_mutex);
+                        meta = onvm_get_pkt_meta(pkts[i]);
                 }
 
 #ifdef _measure
@@ -196,21 +252,31 @@ onvm_pkt_process_tx_batch(struct queue_mgr *tx_mgr, struct rte_mbuf *pkts[], uin
                 }
 #endif
 
+                /* Only a NEXT verdict resumes the graph after a fork, any other one leaves it */
+                if (meta->action != ONVM_NF_ACTION_NEXT)
+                        meta->flags = onvm_pkt_clear_meta_bit(meta->flags, PKT_META_SG_FORK);
+
                 if (meta->action == ONVM_NF_ACTION_DROP) {
                         // if the packet is drop, then <return value> is 0
                         // and !<return value> is 1.
                         nf->stats.act_drop++;
                         nf->stats.tx += !onvm_pkt_drop(pkts[i]);
                 } else if (meta->action == ONVM_NF_ACTION_NEXT) {
-                        /* TODO: Here we drop the packet : there will be a flow table
-                        in the future to know what to do with the packet next */
                         nf->stats.act_next++;
-                        onvm_pkt_process_next_action(tx_mgr, pkts[i], nf);
+                        if (service_graph != NULL && service_graph->num_nodes != 0)
+                                onvm_pkt_enqueue_sg(tx_mgr, pkts[i], nf);
+                        else
+                                onvm_pkt_process_next_action(tx_mgr, pkts[i], nf);
                 } else if (meta->action == ONVM_NF_ACTION_TONF) {
                         nf->stats.act_tonf++;
                         onvm_pkt_enqueue_nf(tx_mgr, meta->destination, pkts[i], nf);
                 } else if (meta->action == ONVM_NF_ACTION_OUT) {
-                        if (tx_mgr->mgr_type_t != MGR) {
+                        if (tx_mgr->mgr_type_t != MGR && tx_mgr->nic_txq != ONVM_NF_NO_TXQ) {
+                                /* The NF has its own NIC TX queue, skip the TX thread */
+                                nf->stats.act_out++;
+                                nf->stats.tx++;
+                                onvm_pkt_enqueue_port(tx_mgr, meta->destination, pkts[i]);
+                        } else if (tx_mgr->mgr_type_t != MGR) {
                                 nf->stats.act_out++;
                                 out_buf = tx_mgr->to_tx_buf;
                                 out_buf->buffer[out_buf->count++] = pkts[i];
@@ -219,7 +285,7 @@ onvm_pkt_process_tx_batch(struct queue_mgr *tx_mgr, struct rte_mbuf *pkts[], uin
                                 onvm_pkt_enqueue_port(tx_mgr, meta->destination, pkts[i]);
                         }
                 } else if (meta->action == ONVM_NF_ACTION_PARA) {
-                        onvm_pkt_enqueue_multi_nf(tx_mgr, meta->destination, pkts[i], nf);
+                        onvm_pkt_enqueue_para(tx_mgr, meta->destination, pkts[i], nf);
                 } else {
                         printf("ERROR invalid action : this shouldn't happen.\n");
                         onvm_pkt_drop(pkts[i]);
@@ -228,21 +294,112 @@ onvm_pkt_process_tx_batch(struct queue_mgr *tx_mgr, struct rte_mbuf *pkts[], uin
         }
 }
 
+uint16_t
+onvm_pkt_process_direct_rx_batch(struct queue_mgr *tx_mgr, struct rte_mbuf *pkts[], uint16_t rx_count,
+                                 struct onvm_nf *nf) {
+        struct onvm_flow_entry *flow_entries[PACKET_READ_SIZE];
+        struct rte_mbuf *fwd_pkts[PACKET_READ_SIZE];
+        struct onvm_service_chain *sc;
+        struct onvm_pkt_meta *meta;
+        uint16_t i, nb_kept, nb_fwd;
+        uint8_t policy;
+
+        if (tx_mgr == NULL || pkts == NULL || nf == NULL || rx_count > PACKET_READ_SIZE)
+                return 0;
+
+        onvm_flow_dir_get_pkt_bulk(pkts, rx_count, flow_entries);
+
+        nb_kept = 0;
+        nb_fwd = 0;
+        for (i = 0; i < rx_count; i++) {
+                meta = onvm_get_pkt_meta(pkts[i]);
+                meta->src = 0;
+                meta->chain_index = 0;
+                meta->numNF = 0;
+                meta->flags = 0;
+                meta->writers = 0;
+
+                sc = flow_entries[i] != NULL ? onvm_flow_dir_get_sc(flow_entries[i]) : NULL;
+                policy = sc != NULL ? flow_entries[i]->bp_policy : ONVM_BP_POLICY_SHED;
+                if (sc == NULL)
+                        sc = default_chain;
+                meta->action = onvm_sc_next_action(sc, pkts[i]);
+                meta->destination = onvm_sc_next_destination(sc, pkts[i]);
+                /* Flows bound for an overloaded service are shed before any NF works on them */
+                if (unlikely(onvm_pkt_bp_active()) && onvm_pkt_bp_shed(tx_mgr, pkts[i], sc, policy))
+                        continue;
+                (meta->chain_index)++;
+
+                if (meta->action == ONVM_NF_ACTION_TONF && meta->destination == nf->service_id)
+                        pkts[nb_kept++] = pkts[i];
+                else
+                        fwd_pkts[nb_fwd++] = pkts[i];
+        }
+
+        /* Flows steered elsewhere by the flow director go where the manager would have sent them */
+        if (nb_fwd > 0)
+                onvm_pkt_process_tx_batch(tx_mgr, fwd_pkts, nb_fwd, nf);
+
+        return nb_kept;
+}
+
+int
+onvm_pkt_bp_shed(struct queue_mgr *tx_mgr, struct rte_mbuf *pkt, const struct onvm_service_chain *sc,
+                 uint8_t policy) {
+        struct onvm_pkt_meta *meta = onvm_get_pkt_meta(pkt);
+        struct onvm_ft_ipv4_5tuple key;
+        uint16_t admit = ONVM_BP_ADMIT_ALL;
+        uint16_t service_id = 0;
+        uint32_t hash;
+        int i;
+
+        if (policy == ONVM_BP_POLICY_EXEMPT || sc == NULL)
+                return 0;
+
+        /* The most overloaded service the packet still has to go through decides */
+        for (i = meta->chain_index + 1; i <= sc->chain_length; i++) {
+                if (sc->sc[i].action != ONVM_NF_ACTION_TONF || sc->sc[i].destination >= MAX_SERVICES)
+                        continue;
+                if (service_bp->admit[sc->sc[i].destination] < admit) {
+                        admit = service_bp->admit[sc->sc[i].destination];
+                        service_id = sc->sc[i].destination;
+                }
+        }
+        if (admit >= ONVM_BP_ADMIT_ALL)
+                return 0;
+
+        if (policy == ONVM_BP_POLICY_SHED) {
+                /* Whole flows are shed, the high hash bits as the low ones pick the RX queue */
+                if (pkt->ol_flags & PKT_RX_RSS_HASH)
+                        hash = pkt->hash.rss;
+                else if (onvm_ft_fill_key(&key, pkt) == 0)
+                        hash = onvm_softrss(&key);
+                else
+                        hash = 0;
+                if ((hash >> 24) < admit)
+                        return 0;
+        }
+
+        onvm_pkt_rx_stats(tx_mgr)->bp_drop[service_id]++;
+        onvm_pkt_drop(pkt);
+        return 1;
+}
+
 void
 onvm_pkt_flush_port_queue(struct queue_mgr *tx_mgr, uint16_t port) {
         uint16_t i, sent;
         volatile struct tx_stats *tx_stats;
         struct packet_buf *port_buf;
 
-        if (tx_mgr == NULL || tx_mgr->mgr_type_t != MGR)
+        if (tx_mgr == NULL || tx_mgr->port_tx_bufs == NULL)
                 return;
 
-        port_buf = &tx_mgr->tx_thread_info->port_tx_bufs[port];
+        port_buf = &tx_mgr->port_tx_bufs[port];
         if (port_buf->count == 0)
                 return;
 
         tx_stats = &(ports->tx_stats);
-        sent = rte_eth_tx_burst(port, tx_mgr->id, port_buf->buffer, port_buf->count);
+        sent = rte_eth_tx_burst(port, tx_mgr->nic_txq, port_buf->buffer, port_buf->count);
         if (unlikely(sent < port_buf->count)) {
                 for (i = sent; i < port_buf->count; i++) {
                         onvm_pkt_drop(port_buf->buffer[i]);
@@ -254,6 +411,17 @@ onvm_pkt_flush_port_queue(struct queue_mgr *tx_mgr, uint16_t port) {
         port_buf->count = 0;
 }
 
+void
+onvm_pkt_flush_all_ports(struct queue_mgr *tx_mgr) {
+        uint16_t i;
+
+        if (tx_mgr == NULL || tx_mgr->port_tx_bufs == NULL)
+                return;
+
+        for (i = 0; i < ports->num_ports; i++)
+                onvm_pkt_flush_port_queue(tx_mgr, ports->id[i]);
+}
+
 void
 onvm_pkt_enqueue_tx_thread(struct packet_buf *pkt_buf, struct onvm_nf *nf) {
         if (pkt_buf->count == 0)
@@ -277,10 +445,15 @@ inline static void
 onvm_pkt_enqueue_port(struct queue_mgr *tx_mgr, uint16_t port, struct rte_mbuf *buf) {
         struct packet_buf *port_buf;
 
-        if (tx_mgr == NULL || buf == NULL || !ports->init[port])
+        if (tx_mgr == NULL || buf == NULL)
+                return;
+
+        if (unlikely(!ports->init[port] || tx_mgr->port_tx_bufs == NULL)) {
+                onvm_pkt_drop(buf);
                 return;
+        }
 
-        port_buf = &tx_mgr->tx_thread_info->port_tx_bufs[port];
+        port_buf = &tx_mgr->port_tx_bufs[port];
         port_buf->buffer[port_buf->count++] = buf;
         if (port_buf->count == PACKET_READ_SIZE) {
                 onvm_pkt_flush_port_queue(tx_mgr, port);
@@ -297,29 +470,35 @@ onvm_pkt_process_next_action(struct queue_mgr *tx_mgr, struct rte_mbuf *pkt, str
         struct onvm_pkt_meta *meta = onvm_get_pkt_meta(pkt);
         int ret;
 
+#ifdef _experiment
+        if (onvm_pkt_check_meta_bit(meta->flags, PKT_META_GO_PARALLEL)) {
+                pkt = onvm_pkt_parallel_join(pkt, 1);
+                if (pkt == NULL) {
+                        nf->stats.act_cont++;
+                        return;
+                }
+                meta = onvm_get_pkt_meta(pkt);
+        }
+#endif
         ret = onvm_flow_dir_get_pkt(pkt, &flow_entry);
-        if (ret >= 0) {
-                sc = flow_entry->sc;
+        /* Entries still being installed have no chain yet */
+        if (ret >= 0 && (sc = onvm_flow_dir_get_sc(flow_entry)) != NULL) {
+                meta->action = onvm_sc_next_action(sc, pkt);
+                meta->destination = onvm_sc_next_destination(sc, pkt);
+                if (unlikely(onvm_pkt_bp_active()) && meta->action == ONVM_NF_ACTION_TONF &&
+                    onvm_pkt_bp_shed(tx_mgr, pkt, sc, flow_entry->bp_policy))
+                        return;
+        } else if (onvm_pkt_check_meta_bit(meta->flags, PKT_META_CLASSIFIED)) {
+                /* The rest of the chain the manager classifier picked at RX */
+                sc = &onvm_get_pkt_priv(pkt)->chain;
                 meta->action = onvm_sc_next_action(sc, pkt);
                 meta->destination = onvm_sc_next_destination(sc, pkt);
+                if (unlikely(onvm_pkt_bp_active()) && meta->action == ONVM_NF_ACTION_TONF &&
+                    onvm_pkt_bp_shed(tx_mgr, pkt, sc, ONVM_BP_POLICY_SHED))
+                        return;
         } else {
                 meta->action = ONVM_NF_ACTION_DROP;
         }
-#ifdef _experiment
-        if (onvm_pkt_check_meta_bit(meta->flags, PKT_META_GO_PARALLEL)) {
-                sem_t *pkt_mutex = onvm_pkt_mutex[pkt->hash.rss % 16];
-                sem_wait(pkt_mutex);
-                if (meta->numNF) {
-                        if (--meta->numNF) {
-                                sem_post(pkt_mutex);
-                                nf->stats.act_cont++;
-                                return;
-                        }
-                }
-                meta->flags = onvm_pkt_clear_meta_bit(meta->flags, PKT_META_GO_PARALLEL);
-                sem_post(pkt_mutex);
-        }
-#endif
         switch (meta->action) {
                 case ONVM_NF_ACTION_DROP:
                         // if the packet is drop, then <return value> is 0
@@ -358,6 +537,134 @@ onvm_pkt_drop(struct rte_mbuf *pkt) {
         return 0;
 }
 
+static inline int
+onvm_pkt_parallel_done(struct onvm_pkt_meta *meta) {
+        /* The release/acquire pair makes every sibling's writes to the packet
+         * visible to whichever NF ends up forwarding it */
+        if (__atomic_sub_fetch(&meta->numNF, 1, __ATOMIC_ACQ_REL) != 0)
+                return 0;
+
+        meta->flags &= ~((1 << PKT_META_GO_PARALLEL) | (1 << PKT_META_PAYLOAD_READ) |
+                         (1 << PKT_META_PAYLOAD_WRITE) | (1 << PKT_META_HDR_WRITE));
+        meta->writers = 0;
+        return 1;
+}
+
+static struct rte_mbuf *
+onvm_pkt_parallel_copy(struct rte_mbuf *pkt, uint8_t service) {
+        struct rte_mbuf *copy, *payload;
+        struct onvm_pkt_meta *meta;
+        struct onvm_pkt_priv *priv;
+
+        if (unlikely(pkt_clone_pool == NULL)) {
+                pkt_clone_pool = rte_mempool_lookup(PKTMBUF_CLONE_POOL_NAME);
+                if (pkt_clone_pool == NULL)
+                        return NULL;
+        }
+
+        meta = onvm_get_pkt_meta(pkt);
+        if (onvm_pkt_check_meta_bit(meta->flags, PKT_META_HDR_WRITE) && pkt->nb_segs == 1 &&
+            pkt->data_len > ONVM_PKT_HDR_COPY_LEN) {
+                /* Copy the headers only, the payload is shared through an indirect mbuf */
+                copy = rte_pktmbuf_alloc(pkt_clone_pool);
+                payload = rte_pktmbuf_clone(pkt, pkt_clone_pool);
+                if (copy == NULL || payload == NULL) {
+                        rte_pktmbuf_free(copy);
+                        rte_pktmbuf_free(payload);
+                        return NULL;
+                }
+                rte_memcpy(rte_pktmbuf_mtod(copy, char *), rte_pktmbuf_mtod(pkt, char *), ONVM_PKT_HDR_COPY_LEN);
+                copy->data_len = ONVM_PKT_HDR_COPY_LEN;
+                copy->pkt_len = ONVM_PKT_HDR_COPY_LEN;
+                rte_pktmbuf_adj(payload, ONVM_PKT_HDR_COPY_LEN);
+                if (rte_pktmbuf_chain(copy, payload) != 0) {
+                        rte_pktmbuf_free(copy);
+                        rte_pktmbuf_free(payload);
+                        return NULL;
+                }
+        } else {
+                copy = onvm_pkt_pktmbuf_copy(pkt, pkt_clone_pool);
+                if (copy == NULL)
+                        return NULL;
+        }
+
+        copy->port = pkt->port;
+        copy->ol_flags = pkt->ol_flags;
+        copy->packet_type = pkt->packet_type;
+        copy->hash = pkt->hash;
+        copy->udata64 = pkt->udata64;
+
+        meta = onvm_get_pkt_meta(copy);
+        meta->flags = onvm_pkt_clear_meta_bit(meta->flags, PKT_META_PAYLOAD_READ);
+        meta->flags = onvm_pkt_set_meta_bit(meta->flags, PKT_META_PAYLOAD_WRITE);
+        meta->flags = onvm_pkt_set_meta_bit(meta->flags, PKT_META_CLONE);
+
+        priv = onvm_get_pkt_priv(copy);
+        priv->parallel_link = pkt;
+        priv->parallel_service = service;
+
+        return copy;
+}
+
+static inline struct rte_mbuf *
+onvm_pkt_parallel_join(struct rte_mbuf *pkt, int keep) {
+        struct rte_mbuf *parent, *kept, **slot;
+        uint8_t service;
+
+        if (!onvm_pkt_check_meta_bit(onvm_get_pkt_meta(pkt)->flags, PKT_META_CLONE)) {
+                parent = pkt;
+        } else {
+                parent = onvm_get_pkt_priv(pkt)->parallel_link;
+                if (!keep) {
+                        rte_pktmbuf_free(pkt);
+                } else {
+                        /* A fork has a single writer, keep the lowest service should several copies come */
+                        slot = &onvm_get_pkt_priv(parent)->parallel_link;
+                        service = onvm_get_pkt_priv(pkt)->parallel_service;
+                        kept = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+                        do {
+                                if (kept != NULL && onvm_get_pkt_priv(kept)->parallel_service < service) {
+                                        rte_pktmbuf_free(pkt);
+                                        pkt = NULL;
+                                        break;
+                                }
+                        } while (!__atomic_compare_exchange_n(slot, &kept, pkt, 0, __ATOMIC_ACQ_REL,
+                                                              __ATOMIC_ACQUIRE));
+                        if (pkt != NULL && kept != NULL)
+                                rte_pktmbuf_free(kept);
+                }
+        }
+
+        if (!onvm_pkt_parallel_done(onvm_get_pkt_meta(parent)))
+                return NULL;
+
+        /* Every branch is done, a kept writer copy replaces the shared packet */
+        kept = onvm_get_pkt_priv(parent)->parallel_link;
+        if (kept == NULL)
+                return parent;
+
+        kept->udata64 = parent->udata64;
+        rte_pktmbuf_free(parent);
+        return kept;
+}
+
+static inline void
+onvm_pkt_mark_nf_pending(struct queue_mgr *tx_mgr, uint16_t nf_id) {
+        tx_mgr->nf_rx_bufs_pending[nf_id / 64] |= (1ULL << (nf_id % 64));
+}
+
+static inline void
+onvm_pkt_clear_nf_pending(struct queue_mgr *tx_mgr, uint16_t nf_id) {
+        tx_mgr->nf_rx_bufs_pending[nf_id / 64] &= ~(1ULL << (nf_id % 64));
+}
+
+static inline struct onvm_nf_rx_stats *
+onvm_pkt_rx_stats(struct queue_mgr *tx_mgr) {
+        if (tx_mgr->mgr_type_t == NF)
+                return &nf_rx_stats[tx_mgr->id];
+        return &nf_rx_stats[ONVM_MGR_THREAD_ID(rte_lcore_id())];
+}
+
 int
 onvm_pkt_set_action(struct rte_mbuf *pkt, uint8_t action, uint8_t destination) {
 #ifdef _measure
@@ -369,13 +676,19 @@ onvm_pkt_set_action(struct rte_mbuf *pkt, uint8_t action, uint8_t destination) {
 
         struct onvm_pkt_meta *meta = onvm_get_pkt_meta(pkt);
         if (onvm_pkt_check_meta_bit(meta->flags, PKT_META_GO_PARALLEL)) {
-                sem_t *pkt_mutex = onvm_set_action_mutex[meta->mutex_id];
-                sem_wait(pkt_mutex);
-                if (action > meta->action) {
-                        meta->action = action;
-                        meta->destination = destination;
-                }
-                sem_post(pkt_mutex);
+                /* Writer copies vote on the verdict of the shared packet */
+                if (onvm_pkt_check_meta_bit(meta->flags, PKT_META_CLONE))
+                        meta = onvm_get_pkt_meta(onvm_get_pkt_priv(pkt)->parallel_link);
+                /* Keep the highest priority verdict among the parallel NFs */
+                union onvm_pkt_verdict cur, next;
+                next.action = action;
+                next.destination = destination;
+                cur.value = __atomic_load_n(&meta->verdict, __ATOMIC_RELAXED);
+                do {
+                        if (action <= cur.action)
+                                break;
+                } while (!__atomic_compare_exchange_n(&meta->verdict, &cur.value, next.value, 0, __ATOMIC_RELAXED,
+                                                      __ATOMIC_RELAXED));
         } else {
                 meta->action = action;
                 meta->destination = destination;
@@ -394,111 +707,19 @@ onvm_pkt_set_action(struct rte_mbuf *pkt, uint8_t action, uint8_t destination) {
         return 0;
 }
 
-/*******************************Mutex init************************************/
-inline void
-onvm_init_pkt_mutex(void) {
-        onvm_pkt_mutex[0] = sem_open("pkt_mutex0", 0);
-        onvm_pkt_mutex[1] = sem_open("pkt_mutex1", 0);
-        onvm_pkt_mutex[2] = sem_open("pkt_mutex2", 0);
-        onvm_pkt_mutex[3] = sem_open("pkt_mutex3", 0);
-        onvm_pkt_mutex[4] = sem_open("pkt_mutex4", 0);
-        onvm_pkt_mutex[5] = sem_open("pkt_mutex5", 0);
-        onvm_pkt_mutex[6] = sem_open("pkt_mutex6", 0);
-        onvm_pkt_mutex[7] = sem_open("pkt_mutex7", 0);
-        onvm_pkt_mutex[8] = sem_open("pkt_mutex8", 0);
-        onvm_pkt_mutex[9] = sem_open("pkt_mutex9", 0);
-        onvm_pkt_mutex[10] = sem_open("pkt_mutex10", 0);
-        onvm_pkt_mutex[11] = sem_open("pkt_mutex11", 0);
-        onvm_pkt_mutex[12] = sem_open("pkt_mutex12", 0);
-        onvm_pkt_mutex[13] = sem_open("pkt_mutex13", 0);
-        onvm_pkt_mutex[14] = sem_open("pkt_mutex14", 0);
-        onvm_pkt_mutex[15] = sem_open("pkt_mutex15", 0);
-        onvm_pkt_mutex[16] = sem_open("pkt_mutex16", 0);
-        onvm_pkt_mutex[17] = sem_open("pkt_mutex17", 0);
-        onvm_pkt_mutex[18] = sem_open("pkt_mutex18", 0);
-        onvm_pkt_mutex[19] = sem_open("pkt_mutex19", 0);
-        onvm_pkt_mutex[20] = sem_open("pkt_mutex20", 0);
-        onvm_pkt_mutex[21] = sem_open("pkt_mutex21", 0);
-        onvm_pkt_mutex[22] = sem_open("pkt_mutex22", 0);
-        onvm_pkt_mutex[23] = sem_open("pkt_mutex23", 0);
-        onvm_pkt_mutex[24] = sem_open("pkt_mutex24", 0);
-        onvm_pkt_mutex[25] = sem_open("pkt_mutex25", 0);
-        onvm_pkt_mutex[26] = sem_open("pkt_mutex26", 0);
-        onvm_pkt_mutex[27] = sem_open("pkt_mutex27", 0);
-        onvm_pkt_mutex[28] = sem_open("pkt_mutex28", 0);
-        onvm_pkt_mutex[29] = sem_open("pkt_mutex29", 0);
-        onvm_pkt_mutex[30] = sem_open("pkt_mutex30", 0);
-        onvm_pkt_mutex[31] = sem_open("pkt_mutex31", 0);
-
-        for (int i = 0; i < 32; i++) {
-                if (onvm_pkt_mutex[i] == SEM_FAILED) {
-                        printf("onvm_pkt_mutex[%d] open failed\n", i);
-                }
-        }
-}
-
-inline void
-onvm_init_set_action_mutex(void) {
-        onvm_set_action_mutex[0] = sem_open("set_action_mutex0", 0);
-        onvm_set_action_mutex[1] = sem_open("set_action_mutex1", 0);
-        onvm_set_action_mutex[2] = sem_open("set_action_mutex2", 0);
-        onvm_set_action_mutex[3] = sem_open("set_action_mutex3", 0);
-        onvm_set_action_mutex[4] = sem_open("set_action_mutex4", 0);
-        onvm_set_action_mutex[5] = sem_open("set_action_mutex5", 0);
-        onvm_set_action_mutex[6] = sem_open("set_action_mutex6", 0);
-        onvm_set_action_mutex[7] = sem_open("set_action_mutex7", 0);
-        onvm_set_action_mutex[8] = sem_open("set_action_mutex8", 0);
-        onvm_set_action_mutex[9] = sem_open("set_action_mutex9", 0);
-        onvm_set_action_mutex[10] = sem_open("set_action_mutex10", 0);
-        onvm_set_action_mutex[11] = sem_open("set_action_mutex11", 0);
-        onvm_set_action_mutex[12] = sem_open("set_action_mutex12", 0);
-        onvm_set_action_mutex[13] = sem_open("set_action_mutex13", 0);
-        onvm_set_action_mutex[14] = sem_open("set_action_mutex14", 0);
-        onvm_set_action_mutex[15] = sem_open("set_action_mutex15", 0);
-        onvm_set_action_mutex[16] = sem_open("set_action_mutex16", 0);
-        onvm_set_action_mutex[17] = sem_open("set_action_mutex17", 0);
-        onvm_set_action_mutex[18] = sem_open("set_action_mutex18", 0);
-        onvm_set_action_mutex[19] = sem_open("set_action_mutex19", 0);
-        onvm_set_action_mutex[20] = sem_open("set_action_mutex20", 0);
-        onvm_set_action_mutex[21] = sem_open("set_action_mutex21", 0);
-        onvm_set_action_mutex[22] = sem_open("set_action_mutex22", 0);
-        onvm_set_action_mutex[23] = sem_open("set_action_mutex23", 0);
-        onvm_set_action_mutex[24] = sem_open("set_action_mutex24", 0);
-        onvm_set_action_mutex[25] = sem_open("set_action_mutex25", 0);
-        onvm_set_action_mutex[26] = sem_open("set_action_mutex26", 0);
-        onvm_set_action_mutex[27] = sem_open("set_action_mutex27", 0);
-        onvm_set_action_mutex[28] = sem_open("set_action_mutex28", 0);
-        onvm_set_action_mutex[29] = sem_open("set_action_mutex29", 0);
-        onvm_set_action_mutex[30] = sem_open("set_action_mutex30", 0);
-        onvm_set_action_mutex[31] = sem_open("set_action_mutex31", 0);
-
-        for (int i = 0; i < 32; i++) {
-                if (onvm_set_action_mutex[i] == SEM_FAILED) {
-                        printf("onvm_set_action_mutex[%d] open failed\n", i);
-                }
-        }
-}
-
 /*******************************packet enqueue nf*****************************/
 static inline void
-onvm_pkt_enqueue_multi_nf(struct queue_mgr *tx_mgr, uint8_t dst_service, struct rte_mbuf *pkt,
-                          struct onvm_nf *source_nf) {
+onvm_pkt_enqueue_multi_nf(struct queue_mgr *tx_mgr, const uint16_t dst_service_id[], const uint8_t dst_write[],
+                          uint16_t dst_counter, struct rte_mbuf *pkt, struct onvm_nf *source_nf) {
         struct onvm_pkt_meta *meta = (struct onvm_pkt_meta *)&pkt->udata64;
         struct onvm_nf *nf;
-        uint8_t i, j;
-        uint32_t dst_service_id[10];
-        uint16_t dst_instance_id[10];
-        uint16_t dst_counter = 0;
-        static uint32_t counter = 0;
+        uint16_t i, j;
+        uint16_t dst_instance_id[ONVM_MAX_SG_BRANCHES];
+        struct rte_mbuf *branch_pkt[ONVM_MAX_SG_BRANCHES];
 
-        if (tx_mgr == NULL || pkt == NULL)
+        if (tx_mgr == NULL || pkt == NULL || dst_counter > ONVM_MAX_SG_BRANCHES)
                 return;
 
-        for (i = 0; i < 8; i++) {
-                if (((dst_service >> i) & 1)) {
-                        dst_service_id[dst_counter++] = i;
-                }
-        }
         for (i = 0; i < dst_counter; i++) {
                 dst_instance_id[i] = onvm_sc_service_to_nf_map(dst_service_id[i], pkt);
                 if (dst_instance_id[i] == 0) {
@@ -523,21 +744,46 @@ onvm_pkt_enqueue_multi_nf(struct queue_mgr *tx_mgr, uint8_t dst_service, struct
                         if (source_nf != NULL)
                                 source_nf->stats.tx_drop++;
 
-                        for (j = 0; j < dst_counter; j++) {
-                                nf = &nfs[dst_instance_id[j]];
-                                nf->stats.rx_drop++;
-                        }
+                        for (j = 0; j < dst_counter; j++)
+                                onvm_pkt_rx_stats(tx_mgr)->rx_drop[dst_instance_id[j]]++;
                         return;
                 }
         }
 
-        meta->flags = onvm_pkt_set_meta_bit(meta->flags, PKT_META_GO_PARALLEL);
-        meta->mutex_id = (counter++) % 32;
+        /* Parallel NFs merge their verdicts starting from the lowest priority action */
+        meta->action = ONVM_NF_ACTION_NEXT;
+        meta->destination = 0;
         meta->numNF = dst_counter;
+        meta->flags = onvm_pkt_set_meta_bit(meta->flags, PKT_META_GO_PARALLEL);
+        onvm_get_pkt_priv(pkt)->parallel_link = NULL;
+
+        /* Readers share the packet, only writers get a private copy */
+        for (i = 0; i < dst_counter; i++) {
+                if (!dst_write[i]) {
+                        branch_pkt[i] = pkt;
+                        continue;
+                }
+                meta->flags = onvm_pkt_set_meta_bit(meta->flags, PKT_META_PAYLOAD_READ);
+                branch_pkt[i] = onvm_pkt_parallel_copy(pkt, dst_service_id[i]);
+                if (branch_pkt[i] == NULL) {
+                        for (j = 0; j < i; j++) {
+                                if (branch_pkt[j] != pkt)
+                                        rte_pktmbuf_free(branch_pkt[j]);
+                        }
+                        meta->numNF = 0;
+                        meta->flags = onvm_pkt_clear_meta_bit(meta->flags, PKT_META_GO_PARALLEL);
+                        onvm_pkt_drop(pkt);
+                        if (source_nf != NULL)
+                                source_nf->stats.tx_drop++;
+                        return;
+                }
+        }
+
         struct packet_buf *nf_buf;
         for (i = 0; i < dst_counter; i++) {
                 nf_buf = &tx_mgr->nf_rx_bufs[dst_instance_id[i]];
-                nf_buf->buffer[nf_buf->count++] = pkt;
+                nf_buf->buffer[nf_buf->count++] = branch_pkt[i];
+                onvm_pkt_mark_nf_pending(tx_mgr, dst_instance_id[i]);
                 if (nf_buf->count == PACKET_READ_SIZE) {
                         onvm_pkt_flush_nf_queue(tx_mgr, dst_instance_id[i], source_nf);
                 }
@@ -548,6 +794,103 @@ onvm_pkt_enqueue_multi_nf(struct queue_mgr *tx_mgr, uint8_t dst_service, struct
         return;
 }
 
+static inline void
+onvm_pkt_enqueue_para(struct queue_mgr *tx_mgr, uint8_t dst_service, struct rte_mbuf *pkt,
+                      struct onvm_nf *source_nf) {
+        struct onvm_pkt_meta *meta = onvm_get_pkt_meta(pkt);
+        uint16_t dst_service_id[ONVM_MAX_SG_BRANCHES];
+        uint8_t dst_write[ONVM_MAX_SG_BRANCHES];
+        uint16_t dst_counter = 0;
+        uint8_t writers = 0;
+        uint8_t i;
+
+        /* Without an explicit writer list every destination is a writer */
+        if (onvm_pkt_check_meta_bit(meta->flags, PKT_META_PAYLOAD_WRITE))
+                writers = (meta->writers != 0 ? meta->writers : dst_service) & dst_service;
+        /* The join keeps a single writer copy, the changes of any other writer would be lost */
+        if (unlikely(writers & (writers - 1))) {
+                onvm_pkt_drop(pkt);
+                if (source_nf != NULL)
+                        source_nf->stats.tx_drop++;
+                return;
+        }
+
+        for (i = 0; i < 8; i++) {
+                if (((dst_service >> i) & 1)) {
+                        dst_write[dst_counter] = (writers >> i) & 1;
+                        dst_service_id[dst_counter++] = i;
+                }
+        }
+        onvm_pkt_enqueue_multi_nf(tx_mgr, dst_service_id, dst_write, dst_counter, pkt, source_nf);
+}
+
+void
+onvm_pkt_enqueue_sg(struct queue_mgr *tx_mgr, struct rte_mbuf *pkt, struct onvm_nf *source_nf) {
+        struct onvm_pkt_meta *meta = onvm_get_pkt_meta(pkt);
+        struct onvm_sg_node *node, *next;
+        struct packet_buf *out_buf;
+        uint16_t dst_service_id[ONVM_MAX_SG_BRANCHES];
+        uint8_t dst_write[ONVM_MAX_SG_BRANCHES];
+        uint8_t i, hdr_only;
+
+        if (tx_mgr == NULL || pkt == NULL)
+                return;
+
+        node = &service_graph->nodes[meta->chain_index];
+        if (onvm_pkt_check_meta_bit(meta->flags, PKT_META_SG_FORK)) {
+                /* All branches are joined, continue from the node they lead to */
+                meta->flags = onvm_pkt_clear_meta_bit(meta->flags, PKT_META_SG_FORK);
+                node = &service_graph->nodes[node->next[0]];
+        }
+
+        if (node->num_next == 0) {
+                if (node->port < 0) {
+                        if (source_nf != NULL)
+                                source_nf->stats.act_drop++;
+                        onvm_pkt_drop(pkt);
+                        return;
+                }
+                meta->action = ONVM_NF_ACTION_OUT;
+                meta->destination = node->port;
+                if (tx_mgr->mgr_type_t != MGR && tx_mgr->nic_txq != ONVM_NF_NO_TXQ) {
+                        source_nf->stats.act_out++;
+                        source_nf->stats.tx++;
+                        onvm_pkt_enqueue_port(tx_mgr, meta->destination, pkt);
+                } else if (tx_mgr->mgr_type_t != MGR) {
+                        source_nf->stats.act_out++;
+                        out_buf = tx_mgr->to_tx_buf;
+                        out_buf->buffer[out_buf->count++] = pkt;
+                        onvm_pkt_enqueue_tx_thread(out_buf, source_nf);
+                } else {
+                        onvm_pkt_enqueue_port(tx_mgr, meta->destination, pkt);
+                }
+                return;
+        }
+
+        if (node->num_next == 1) {
+                meta->chain_index = node->next[0];
+                meta->action = ONVM_NF_ACTION_TONF;
+                meta->destination = service_graph->nodes[meta->chain_index].service_id;
+                onvm_pkt_enqueue_nf(tx_mgr, meta->destination, pkt, source_nf);
+                return;
+        }
+
+        /* Fork, the packet stays on this node until every branch is done */
+        meta->chain_index = node - service_graph->nodes;
+        meta->flags = onvm_pkt_set_meta_bit(meta->flags, PKT_META_SG_FORK);
+        hdr_only = 1;
+        for (i = 0; i < node->num_next; i++) {
+                next = &service_graph->nodes[node->next[i]];
+                dst_service_id[i] = next->service_id;
+                dst_write[i] = next->write != ONVM_SG_READ;
+                if (next->write == ONVM_SG_WRITE)
+                        hdr_only = 0;
+        }
+        if (hdr_only)
+                meta->flags = onvm_pkt_set_meta_bit(meta->flags, PKT_META_HDR_WRITE);
+        onvm_pkt_enqueue_multi_nf(tx_mgr, dst_service_id, dst_write, node->num_next, pkt, source_nf);
+}
+
 void
 onvm_pkt_enqueue_nf(struct queue_mgr *tx_mgr, uint16_t dst_service_id, struct rte_mbuf *pkt,
                     struct onvm_nf *source_nf) {
@@ -578,6 +921,7 @@ onvm_pkt_enqueue_nf(struct queue_mgr *tx_mgr, uint16_t dst_service_id, struct rt
 
         nf_buf = &tx_mgr->nf_rx_bufs[dst_instance_id];
         nf_buf->buffer[nf_buf->count++] = pkt;
+        onvm_pkt_mark_nf_pending(tx_mgr, dst_instance_id);
         if (nf_buf->count == PACKET_READ_SIZE) {
                 onvm_pkt_flush_nf_queue(tx_mgr, dst_instance_id, source_nf);
         }
@@ -588,12 +932,19 @@ onvm_pkt_enqueue_nf(struct queue_mgr *tx_mgr, uint16_t dst_service_id, struct rt
 void
 onvm_pkt_flush_all_nfs(struct queue_mgr *tx_mgr, struct onvm_nf *source_nf) {
         uint16_t i;
+        uint64_t pending;
 
         if (tx_mgr == NULL)
                 return;
 
-        for (i = 0; i < MAX_NFS; i++)
-                onvm_pkt_flush_nf_queue(tx_mgr, i, source_nf);
+        for (i = 0; i < NF_RX_BUFS_PENDING_WORDS; i++) {
+                /* Work on a snapshot, flushing clears the bits as it goes */
+                pending = tx_mgr->nf_rx_bufs_pending[i];
+                while (pending != 0) {
+                        onvm_pkt_flush_nf_queue(tx_mgr, i * 64 + __builtin_ctzll(pending), source_nf);
+                        pending &= pending - 1;
+                }
+        }
 }
 
 void
@@ -606,8 +957,10 @@ onvm_pkt_flush_nf_queue(struct queue_mgr *tx_mgr, uint16_t nf_id, struct onvm_nf
                 return;
 
         nf_buf = &tx_mgr->nf_rx_bufs[nf_id];
-        if (nf_buf->count == 0)
+        if (nf_buf->count == 0) {
+                onvm_pkt_clear_nf_pending(tx_mgr, nf_id);
                 return;
+        }
 
         nf = &nfs[nf_id];
 
@@ -618,20 +971,25 @@ onvm_pkt_flush_nf_queue(struct queue_mgr *tx_mgr, uint16_t nf_id, struct onvm_nf
 	if (rte_ring_enqueue_bulk(nf->rx_q, (void **)nf_buf->buffer, nf_buf->count, NULL) == 0) {
         //if (rte_ring_mp_enqueue_bulk(nf->rx_q, (void **)nf_buf->buffer, nf_buf->count, NULL) == 0) {
                 for (i = 0; i < nf_buf->count; i++) {
-                        struct onvm_pkt_meta *meta = onvm_get_pkt_meta(nf_buf->buffer[i]);
-                        if (meta->numNF > 1)
-                                meta->numNF--;
-                        else
-                                onvm_pkt_drop(nf_buf->buffer[i]);
+                        struct rte_mbuf *pkt = nf_buf->buffer[i];
+                        /* A parallel packet is only freed once no sibling NF still holds it */
+                        if (onvm_pkt_check_meta_bit(onvm_get_pkt_meta(pkt)->flags, PKT_META_GO_PARALLEL))
+                                pkt = onvm_pkt_parallel_join(pkt, 0);
+                        if (pkt != NULL)
+                                onvm_pkt_drop(pkt);
                 }
 
-                nf->stats.rx_drop += nf_buf->count;
+                onvm_pkt_rx_stats(tx_mgr)->rx_drop[nf_id] += nf_buf->count;
                 if (source_nf != NULL)
                         source_nf->stats.tx_drop += nf_buf->count;
         } else {
-                nf->stats.rx += nf_buf->count;
+                onvm_pkt_rx_stats(tx_mgr)->rx[nf_id] += nf_buf->count;
                 if (source_nf != NULL)
                         source_nf->stats.tx += nf_buf->count;
+                /* A shared core NF may have gone to sleep on the empty ring */
+                if (ONVM_NF_SHARE_CORES)
+                        onvm_nf_wakeup(nf);
         }
         nf_buf->count = 0;
+        onvm_pkt_clear_nf_pending(tx_mgr, nf_id);
 }
@@ -59,6 +59,10 @@
 
 extern struct port_info *ports;
 extern struct onvm_service_chain *default_chain;
+extern struct onvm_service_graph *service_graph;
+extern struct onvm_nf_rx_stats *nf_rx_stats;
+extern struct onvm_service_bp *service_bp;
+extern uint8_t ONVM_NF_SHARE_CORES;
 
 /*********************************My Function**********************************/
 
@@ -71,12 +75,6 @@ onvm_pkt_check_meta_bit(uint8_t flags, uint8_t n);
 uint8_t
 onvm_pkt_clear_meta_bit(uint8_t flags, uint8_t n);
 
-void
-onvm_init_set_action_mutex(void);
-
-void
-onvm_init_pkt_mutex(void);
-
 /*********************************Interfaces**********************************/
 /*
  * Interface to process packets in a given TX queue.
@@ -90,8 +88,52 @@ onvm_init_pkt_mutex(void);
 void
 onvm_pkt_process_tx_batch(struct queue_mgr *tx_mgr, struct rte_mbuf *pkts[], uint16_t tx_count, struct onvm_nf *nf);
 
+/*
+ * Interface for NFs polling a NIC RX queue themselves: gives packets their
+ * first hop like the manager RX threads do, from the flow director or the
+ * default chain. Packets for the NF's own service are compacted to the front
+ * of the array, the others are passed on through the NF's tx path.
+ *
+ * Inputs : a pointer to the NF's tx queue
+ *          an array of packets just received
+ *          the size of the array
+ *          a pointer to the NF that received them.
+ * Output : the number of packets left for the NF
+ *
+ */
+uint16_t
+onvm_pkt_process_direct_rx_batch(struct queue_mgr *tx_mgr, struct rte_mbuf *pkts[], uint16_t rx_count,
+                                 struct onvm_nf *nf);
+
+/*
+ * Check done on the packet path before looking at a packet's chain for
+ * backpressure, it only reads a shared counter while nothing is overloaded.
+ */
+static inline int
+onvm_pkt_bp_active(void) {
+        return service_bp != NULL && service_bp->num_overloaded != 0;
+}
+
+/*
+ * Interface to shed a packet whose next hop was just taken from its chain,
+ * if a service further down the chain is overloaded. A shed packet is
+ * dropped and counted for the overloaded service. Only call it when
+ * onvm_pkt_bp_active is true.
+ *
+ * Inputs : a pointer to the tx queue of the calling thread
+ *          a pointer to the packet, meta->chain_index not yet incremented
+ *          the service chain of the packet
+ *          the backpressure policy of its flow, ONVM_BP_POLICY_SHED without a flow entry
+ * Output : 1 if the packet was shed, 0 if it goes on
+ *
+ */
+int
+onvm_pkt_bp_shed(struct queue_mgr *tx_mgr, struct rte_mbuf *pkt, const struct onvm_service_chain *sc,
+                 uint8_t policy);
+
 /*
  * Interface to send packets to all NFs after processing them.
+ * Only the NF buffers marked as pending in the queue manager are visited.
  *
  * Input : a pointer to the tx queue
  *         a pointer to the NF possessing the TX queue.
@@ -122,6 +164,19 @@ onvm_pkt_flush_nf_queue(struct queue_mgr *tx_mgr, uint16_t nf_id, struct onvm_nf
 void
 onvm_pkt_enqueue_nf(struct queue_mgr *tx_mgr, uint16_t dst_service_id, struct rte_mbuf *pkt, struct onvm_nf *source_nf);
 
+/*
+ * Function to move a packet to the next node of the service graph.
+ * Forks hand the packet to all branches at once, the end of the graph
+ * sends it out or drops it.
+ *
+ * Inputs : a pointer to the tx queue responsible
+ *          a pointer to the packet, meta->chain_index is its current node
+ *          a pointer to the NF possessing the TX queue, NULL for the manager RX.
+ *
+ */
+void
+onvm_pkt_enqueue_sg(struct queue_mgr *tx_mgr, struct rte_mbuf *pkt, struct onvm_nf *source_nf);
+
 /*
  * Function to send packets to one port after processing them.
  *
@@ -132,6 +187,16 @@ onvm_pkt_enqueue_nf(struct queue_mgr *tx_mgr, uint16_t dst_service_id, struct rt
 void
 onvm_pkt_flush_port_queue(struct queue_mgr *tx_mgr, uint16_t port);
 
+/*
+ * Interface to send a burst to every port. Does nothing for queue managers
+ * without a NIC TX queue.
+ *
+ * Input : a pointer to the tx queue
+ *
+ */
+void
+onvm_pkt_flush_all_ports(struct queue_mgr *tx_mgr);
+
 /*
  * Give packets to TX thread so it can do useful work.
  *
@@ -144,7 +209,7 @@ onvm_pkt_enqueue_tx_thread(struct packet_buf *pkt_buf, struct onvm_nf *nf);
 
 /*
  * Set packet meta action and destination
- * This API will check priority when run parallel
+ * When run parallel the highest priority action wins, merged lock-free
  *
  * Inputs : a pointer to packet
  *          a action will to do
@@ -47,19 +47,19 @@
 
 uint16_t
 onvm_sc_service_to_nf_map(uint16_t service_id, struct rte_mbuf *pkt) {
-        if (!nf_per_service_count || !services) {
+        if (!service_lb) {
                 rte_exit(EXIT_FAILURE, "Failed to retrieve service information\n");
         }
-        uint16_t num_nfs_available = nf_per_service_count[service_id];
+        struct onvm_service_lb *lb = &service_lb[service_id];
 
-        if (num_nfs_available == 0)
+        if (lb->num_instances == 0)
                 return 0;
 
         if (pkt == NULL)
                 return 0;
 
-        uint16_t instance_index = pkt->hash.rss % num_nfs_available;
-        uint16_t instance_id = services[service_id][instance_index];
+        /* A flow keeps its instance as long as that instance runs */
+        uint16_t instance_id = lb->table[pkt->hash.rss % ONVM_SERVICE_LB_SIZE];
 
         return instance_id;
 }
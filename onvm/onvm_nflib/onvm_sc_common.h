@@ -49,6 +49,7 @@
 extern struct onvm_nf *nfs;
 extern uint16_t **services;
 extern uint16_t *nf_per_service_count;
+extern struct onvm_service_lb *service_lb;
 
 /********************************Interfaces***********************************/
 
@@ -46,6 +46,8 @@
 #include <rte_launch.h>
 #include <rte_lcore.h>
 #include <rte_per_lcore.h>
+#include <rte_cycles.h>
+#include <limits.h>
 #include <stdio.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
@@ -53,19 +55,81 @@
 
 #include "onvm_threading.h"
 
+#define SYSFS_CPU_DIR "/sys/devices/system/cpu"
+
+/*
+ * Reads the first number of a sysfs file, for a cpu list the lowest cpu as
+ * the lists are sorted.
+ *
+ * Output : the number, -1 if the file can't be read
+ */
+static int
+onvm_threading_read_sysfs_int(const char *path);
+
+/*
+ * Placement cost of a core for a new NF, the lower the better: the NFs on
+ * the core first, then the NFs on its hyperthread siblings, counting the
+ * ones with a dedicated core twice as they never leave it idle, then the
+ * NF's peers sharing its last level cache.
+ */
+static uint64_t
+onvm_threading_core_cost(struct core_status *cores, int core, int max_cores, const uint16_t *peer_count);
+
 /*----------------------------------------------------------------------------*/
 int
 onvm_threading_get_num_cores(void) {
         return sysconf(_SC_NPROCESSORS_ONLN);
 }
 
+void
+onvm_threading_read_topology(struct core_status *cores) {
+        char path[PATH_MAX];
+        int i, j, cpu, level, llc_level, max_cores;
+
+        max_cores = onvm_threading_get_num_cores();
+        for (i = 0; i < max_cores; i++) {
+                snprintf(path, sizeof(path), SYSFS_CPU_DIR "/cpu%d/topology/thread_siblings_list", i);
+                cpu = onvm_threading_read_sysfs_int(path);
+                cores[i].sibling_group = cpu >= 0 ? cpu : i;
+
+                /* The last level cache is the cache index with the highest level */
+                cpu = -1;
+                llc_level = 0;
+                for (j = 0;; j++) {
+                        snprintf(path, sizeof(path), SYSFS_CPU_DIR "/cpu%d/cache/index%d/level", i, j);
+                        level = onvm_threading_read_sysfs_int(path);
+                        if (level < 0)
+                                break;
+                        if (level < llc_level)
+                                continue;
+                        llc_level = level;
+                        snprintf(path, sizeof(path), SYSFS_CPU_DIR "/cpu%d/cache/index%d/shared_cpu_list", i, j);
+                        cpu = onvm_threading_read_sysfs_int(path);
+                }
+                if (cpu < 0) {
+                        cpu = i;
+                        for (j = 0; j < i; j++) {
+                                if (cores[j].socket_id == cores[i].socket_id) {
+                                        cpu = cores[j].llc_group;
+                                        break;
+                                }
+                        }
+                }
+                cores[i].llc_group = cpu;
+        }
+}
+
 int
-onvm_threading_get_core(uint16_t *core_value, uint8_t flags, struct core_status *cores) {
+onvm_threading_get_core(uint16_t *core_value, uint8_t flags, struct core_status *cores, int socket_id,
+                        const uint16_t *peer_count) {
         int i;
         int max_cores;
         int best_core = 0;
+        int best_socket_core = 0;
         int pref_core_id = *core_value;
         uint16_t min_nf_count = (uint16_t)-1;
+        uint16_t min_socket_nf_count = (uint16_t)-1;
+        uint64_t cost, min_cost = UINT64_MAX, min_socket_cost = UINT64_MAX;
 
         max_cores = onvm_threading_get_num_cores();
 
@@ -90,16 +154,30 @@ onvm_threading_get_core(uint16_t *core_value, uint8_t flags, struct core_status
                 return 0;
         }
 
-        /* Find the most optimal core, least NFs running */
+        /* Find the most optimal core, least NFs running, overall and on the preferred socket */
         for (i = 0; i < max_cores; ++i) {
                 if (cores[i].enabled && cores[i].is_dedicated_core == 0) {
-                        if (cores[i].nf_count < min_nf_count) {
+                        cost = onvm_threading_core_cost(cores, i, max_cores, peer_count);
+                        if (cost < min_cost) {
+                                min_cost = cost;
                                 min_nf_count = cores[i].nf_count;
                                 best_core = i;
                         }
+                        if (cores[i].socket_id == socket_id && cost < min_socket_cost) {
+                                min_socket_cost = cost;
+                                min_socket_nf_count = cores[i].nf_count;
+                                best_socket_core = i;
+                        }
                 }
         }
 
+        /* Stay on the preferred socket, unless only another one still has a free core for a dedicated NF */
+        if (min_socket_nf_count != (uint16_t)-1 &&
+            (ONVM_CHECK_BIT(flags, SHARE_CORE_BIT) || min_socket_nf_count == 0)) {
+                min_nf_count = min_socket_nf_count;
+                best_core = best_socket_core;
+        }
+
         /* No cores available, can't launch */
         if (min_nf_count == (uint16_t)-1) {
                 return NF_NO_CORES;
@@ -138,6 +216,19 @@ onvm_threading_core_affinitize(int cpu) {
         return rte_thread_set_affinity(&cpus);
 }
 
+int
+onvm_threading_lcore_register(int core) {
+        if (core < 0) {
+                RTE_PER_LCORE(_lcore_id) = LCORE_ID_ANY;
+                return 0;
+        }
+        if (core >= RTE_MAX_LCORE)
+                return -1;
+
+        RTE_PER_LCORE(_lcore_id) = (unsigned)core;
+        return 0;
+}
+
 int
 onvm_threading_find_nf_to_reassign_core(uint16_t candidate_core, struct core_status *cores) {
         uint16_t candidate_nf_id, most_used_core, max_nfs_per_core;
@@ -174,3 +265,143 @@ onvm_threading_find_nf_to_reassign_core(uint16_t candidate_core, struct core_sta
 
         return candidate_nf_id;
 }
+
+int
+onvm_threading_sched_add(struct core_status *core, uint16_t instance_id, uint16_t quota) {
+        uint16_t num_nfs = core->sched_num_nfs;
+
+        if (num_nfs >= ONVM_SCHED_MAX_NFS)
+                return -1;
+
+        core->sched_nfs[num_nfs] = instance_id;
+        core->sched_quota[num_nfs] = quota;
+        /* Publish the slot only once it is filled in */
+        __atomic_store_n(&core->sched_num_nfs, num_nfs + 1, __ATOMIC_RELEASE);
+        return 0;
+}
+
+void
+onvm_threading_sched_remove(struct core_status *core, uint16_t instance_id) {
+        uint16_t i, last;
+
+        for (i = 0; i < core->sched_num_nfs; i++) {
+                if (core->sched_nfs[i] != instance_id)
+                        continue;
+
+                /* Readers racing with this may see the last NF twice, never a stale one */
+                last = core->sched_num_nfs - 1;
+                core->sched_nfs[i] = core->sched_nfs[last];
+                core->sched_quota[i] = core->sched_quota[last];
+                __atomic_store_n(&core->sched_num_nfs, last, __ATOMIC_RELEASE);
+                break;
+        }
+
+        if (core->sched_owner == instance_id)
+                onvm_threading_sched_handoff(core, instance_id, onvm_threading_sched_pick(core, instance_id));
+}
+
+uint16_t
+onvm_threading_sched_quota(struct core_status *core, uint16_t instance_id) {
+        uint16_t i, num_nfs;
+
+        num_nfs = __atomic_load_n(&core->sched_num_nfs, __ATOMIC_ACQUIRE);
+        for (i = 0; i < num_nfs; i++) {
+                if (core->sched_nfs[i] == instance_id)
+                        return core->sched_quota[i];
+        }
+
+        return ONVM_SCHED_DEFAULT_QUOTA;
+}
+
+uint16_t
+onvm_threading_sched_pick(struct core_status *core, uint16_t instance_id) {
+        uint16_t i, num_nfs, id;
+        uint16_t longest_nf = 0, late_nf = 0;
+        unsigned queued, longest_queued = 0;
+        uint64_t now, waited, late_waited = 0;
+        struct onvm_nf *nf;
+
+        now = rte_get_tsc_cycles();
+        num_nfs = __atomic_load_n(&core->sched_num_nfs, __ATOMIC_ACQUIRE);
+        for (i = 0; i < num_nfs; i++) {
+                id = core->sched_nfs[i];
+                nf = &nfs[id];
+                if (id == instance_id || !onvm_nf_is_valid(nf))
+                        continue;
+
+                queued = rte_ring_count(nf->rx_q) + rte_ring_count(nf->msg_q);
+                if (queued == 0)
+                        continue;
+
+                waited = now - nf->shared_core.sched_last_run;
+                if (waited > core->sched_deadline && waited > late_waited) {
+                        late_nf = id;
+                        late_waited = waited;
+                }
+                if (queued > longest_queued) {
+                        longest_nf = id;
+                        longest_queued = queued;
+                }
+        }
+
+        return late_nf != 0 ? late_nf : longest_nf;
+}
+
+void
+onvm_threading_sched_handoff(struct core_status *core, uint16_t from, uint16_t next) {
+        uint16_t i, num_nfs, id, owner;
+
+        if (!__atomic_compare_exchange_n(&core->sched_owner, &from, next, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+                return;
+
+        /* Pairs with the barrier a NF takes between announcing it waits and checking the owner */
+        rte_smp_mb();
+        if (next != 0) {
+                if (!onvm_nf_wake(&nfs[next], NF_WAITING_TURN))
+                        onvm_nf_wake(&nfs[next], NF_SLEEPING);
+                return;
+        }
+
+        num_nfs = __atomic_load_n(&core->sched_num_nfs, __ATOMIC_ACQUIRE);
+        for (i = 0; i < num_nfs; i++) {
+                id = core->sched_nfs[i];
+                if (nfs[id].shared_core.sleep_state != NF_WAITING_TURN)
+                        continue;
+
+                owner = 0;
+                if (__atomic_compare_exchange_n(&core->sched_owner, &owner, id, 0, __ATOMIC_ACQ_REL,
+                                                __ATOMIC_RELAXED))
+                        onvm_nf_wake(&nfs[id], NF_WAITING_TURN);
+                return;
+        }
+}
+
+static int
+onvm_threading_read_sysfs_int(const char *path) {
+        FILE *fp;
+        int value;
+
+        fp = fopen(path, "r");
+        if (fp == NULL)
+                return -1;
+        if (fscanf(fp, "%d", &value) != 1)
+                value = -1;
+        fclose(fp);
+        return value;
+}
+
+static uint64_t
+onvm_threading_core_cost(struct core_status *cores, int core, int max_cores, const uint16_t *peer_count) {
+        uint64_t sibling_nfs = 0, llc_peers = 0;
+        int i;
+
+        for (i = 0; i < max_cores; i++) {
+                if (i != core && cores[i].sibling_group == cores[core].sibling_group)
+                        sibling_nfs += cores[i].nf_count + cores[i].is_dedicated_core;
+                if (peer_count != NULL && i < RTE_MAX_LCORE && cores[i].llc_group == cores[core].llc_group)
+                        llc_peers += peer_count[i];
+        }
+
+        return ((uint64_t)cores[core].nf_count << 32) | (RTE_MIN(sibling_nfs, 0xFFFFULL) << 16) |
+               (0xFFFF - RTE_MIN(llc_peers, 0xFFFFULL));
+}
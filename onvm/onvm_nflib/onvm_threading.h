@@ -55,9 +55,23 @@ extern struct onvm_nf *nfs;
 int
 onvm_threading_get_num_cores(void);
 
+/**
+ * Reads the hyperthread siblings and the last level cache of every core from
+ * sysfs into the sibling_group and llc_group of the core_status map. Cores
+ * sysfs says nothing about are their own sibling group and share the last
+ * level cache of their socket.
+ *
+ * @param cores
+ *    A pointer to the core_status map, with the socket ids already set
+ */
+void
+onvm_threading_read_topology(struct core_status *cores);
+
 /**
  * Get the core id for a new NF to run on.
  * If no flags are passed finds the core with the least number of NFs running on it,
+ * then the one with the least NFs on its hyperthread siblings, then the one sharing
+ * its last level cache with most of the NF's peers,
  * will reserve the core unless the share core flag is set
  * For manual core assignment: the user picks the core
  * For shared core will allow other NFs to share assigned core
@@ -71,13 +85,20 @@ onvm_threading_get_num_cores(void);
  *    Bit SHARE_CORE_BIT: allow other NFs(also with SHARE_CORE_BIT enabled) to start on assigned core
  * @param cores
  *    A pointer to the core_status map containing core information
+ * @param socket_id
+ *    The socket to pick a core from when it has one, SOCKET_ID_ANY for no preference
+ *    Not used for manual core assignment
+ * @param peer_count
+ *    The number of NFs the new NF exchanges packets with on each core, or NULL
+ *    Not used for manual core assignment
  *
  * @return
  *    0 on success
  *    NF_NO_CORES or NF_NO_DEDICATED_CORES or NF_CORE_OUT_OF_RANGE or NF_CORE_BUSY on error
  */
 int
-onvm_threading_get_core(uint16_t *core_value, uint8_t flags, struct core_status *cores);
+onvm_threading_get_core(uint16_t *core_value, uint8_t flags, struct core_status *cores, int socket_id,
+                        const uint16_t *peer_count);
 
 /**
  * Uses the dpdk function to reaffinitize the calling pthread to another core.
@@ -90,6 +111,19 @@ onvm_threading_get_core(uint16_t *core_value, uint8_t flags, struct core_status
 int
 onvm_threading_core_affinitize(int core);
 
+/**
+ * Makes the calling pthread run as the DPDK lcore of the core it is bound to,
+ * so rte_lcore_id() and the per lcore mempool caches work for threads that
+ * were not launched by the EAL. Only one thread may use a given core this way.
+ *
+ * @param core
+ *    The core the pthread is bound to, or a negative value to drop the lcore id
+ * @return
+ *    0 on success, or a negative value on failure
+ */
+int
+onvm_threading_lcore_register(int core);
+
 /**
  * Based on current core usage decides if any NF should be moved to passed candidate core.
  *
@@ -104,4 +138,77 @@ onvm_threading_core_affinitize(int core);
 int
 onvm_threading_find_nf_to_reassign_core(uint16_t candidate_core, struct core_status *cores);
 
+/**
+ * Adds a NF to the NFs taking turns on a core, only called by the manager.
+ *
+ * @param core
+ *    A pointer to the core_status of the NF's core
+ * @param instance_id
+ *    The instance ID of the NF
+ * @param quota
+ *    How many packets the NF may handle per turn
+ *
+ * @return
+ *    0 on success, -1 if the core already has ONVM_SCHED_MAX_NFS members
+ */
+int
+onvm_threading_sched_add(struct core_status *core, uint16_t instance_id, uint16_t quota);
+
+/**
+ * Removes a NF from the NFs taking turns on a core, only called by the manager.
+ * If the NF still owns the core it is handed to the next NF.
+ *
+ * @param core
+ *    A pointer to the core_status of the NF's core
+ * @param instance_id
+ *    The instance ID of the NF
+ */
+void
+onvm_threading_sched_remove(struct core_status *core, uint16_t instance_id);
+
+/**
+ * Gets the packet quota of one turn of a NF.
+ *
+ * @param core
+ *    A pointer to the core_status of the NF's core
+ * @param instance_id
+ *    The instance ID of the NF
+ *
+ * @return
+ *    The quota set by the manager, ONVM_SCHED_DEFAULT_QUOTA if the NF is not a member
+ */
+uint16_t
+onvm_threading_sched_quota(struct core_status *core, uint16_t instance_id);
+
+/**
+ * Picks the NF to run next on a core. A NF with work that waited past the
+ * core's deadline goes first, the one waiting longest. Otherwise the NF with
+ * the most packets and messages queued is picked.
+ *
+ * @param core
+ *    A pointer to the core_status
+ * @param instance_id
+ *    The instance ID of the NF giving up the core, it is not considered
+ *
+ * @return
+ *    The instance ID of the next NF, 0 if no other NF has work
+ */
+uint16_t
+onvm_threading_sched_pick(struct core_status *core, uint16_t instance_id);
+
+/**
+ * Hands a core from its owner to the next NF and wakes it.
+ * Handing it to 0 frees the core, it then goes to a NF already waiting for it.
+ * Nothing happens if the core is no longer owned by from.
+ *
+ * @param core
+ *    A pointer to the core_status
+ * @param from
+ *    The instance ID of the current owner, 0 if the core is free
+ * @param next
+ *    The instance ID of the next owner, or 0
+ */
+void
+onvm_threading_sched_handoff(struct core_status *core, uint16_t from, uint16_t next);
+
 #endif  // _ONVM_THREADING_H_